@@ -0,0 +1,395 @@
+#include <algorithm>
+#include <cinttypes>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <random>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <llama/cc/ggml.h>
+#include <llama/cc/llama.h>
+#include <llama/cc/utils.h>
+
+struct bench_params {
+    std::string model = "models/llama-7B/ggml-model.bin";
+    std::string output = "csv";
+
+    std::vector<int> n_threads;      // sweep of thread counts
+    std::vector<int> n_batch = {512}; // sweep of prompt batch sizes
+    std::vector<int> n_depth = {0};   // sweep of context fill levels
+
+    int n_gen = 128; // tokens generated one by one per repetition
+    int n_reps = 5;  // timed repetitions of every test
+
+    int n_parts = -1;
+    std::string memory_type = "f16"; // type of memory kv: f32, f16 or q8_0
+    bool huge_pages = false;
+    bool mlock = false;
+    bool numa = false;
+    int repack_rows = 0;
+};
+
+struct bench_result {
+    std::string test; // pp (prompt processing) or tg (text generation)
+    int n_threads;
+    int n_batch;
+    int n_depth;
+    int n_tokens;
+    std::vector<double> samples_us;
+
+    double avg_ts(void) const {
+        double sum = 0.0;
+        for (double t : samples_us) {
+            sum += 1e6*n_tokens/t;
+        }
+        return sum/samples_us.size();
+    }
+
+    double stddev_ts(void) const {
+        if (samples_us.size() < 2) {
+            return 0.0;
+        }
+        const double avg = avg_ts();
+        double sum = 0.0;
+        for (double t : samples_us) {
+            const double d = 1e6*n_tokens/t - avg;
+            sum += d*d;
+        }
+        return std::sqrt(sum/(samples_us.size() - 1));
+    }
+
+    // all weights are streamed once per evaluation, i.e. once per batch
+    double avg_gbs(size_t n_weight_bytes) const {
+        return n_weight_bytes*avg_ts()/n_batch/1e9;
+    }
+};
+
+static bool parse_list(const char * arg, std::vector<int> & values) {
+    values.clear();
+    std::stringstream ss(arg);
+    std::string item;
+    while (std::getline(ss, item, ',')) {
+        char * end = nullptr;
+        const long value = strtol(item.c_str(), &end, 10);
+        if (item.empty() || *end != '\0' || value < 0) {
+            return false;
+        }
+        values.push_back((int) value);
+    }
+    return !values.empty();
+}
+
+static void bench_print_usage(int /*argc*/, char ** argv, const bench_params & params) {
+    fprintf(stderr, "usage: %s [options]\n", argv[0]);
+    fprintf(stderr, "\n");
+    fprintf(stderr, "Load a model once and measure prompt processing (pp) and text generation (tg)\n");
+    fprintf(stderr, "throughput over all combinations of the swept values.\n");
+    fprintf(stderr, "\n");
+    fprintf(stderr, "options:\n");
+    fprintf(stderr, "  -h, --help            show this help message and exit\n");
+    fprintf(stderr, "  -m FNAME, --model FNAME\n");
+    fprintf(stderr, "                        model path (default: %s)\n", params.model.c_str());
+    fprintf(stderr, "  -t N,..., --threads N,...\n");
+    fprintf(stderr, "                        thread counts (default: all cores)\n");
+    fprintf(stderr, "  -b N,..., --batch_size N,...\n");
+    fprintf(stderr, "                        prompt batch sizes, 0 to skip pp (default: 512)\n");
+    fprintf(stderr, "  -d N,..., --depth N,...\n");
+    fprintf(stderr, "                        tokens in context before each test (default: 0)\n");
+    fprintf(stderr, "  -n N, --n_gen N       tokens to generate, 0 to skip tg (default: %d)\n", params.n_gen);
+    fprintf(stderr, "  -r N, --repetitions N timed repetitions of each test (default: %d)\n", params.n_reps);
+    fprintf(stderr, "  -o FMT, --output FMT  output format: csv or json (default: %s)\n", params.output.c_str());
+    fprintf(stderr, "  --n_parts N           number of model parts (default: -1 = determine from dimensions)\n");
+    fprintf(stderr, "  --memory_type T       type of memory key+value: f32, f16 or q8_0 (default: %s)\n", params.memory_type.c_str());
+    fprintf(stderr, "  --memory_f16          same as --memory_type f16\n");
+    fprintf(stderr, "  --huge_pages          back weights and memory key+value with huge pages\n");
+    fprintf(stderr, "  --mlock               lock weights and memory key+value in RAM\n");
+    fprintf(stderr, "  --numa                pin threads to NUMA nodes and place weight rows on them\n");
+    fprintf(stderr, "  --repack N            interleave rows of Q4_0 weights in groups of N (4 or 8)\n");
+    fprintf(stderr, "\n");
+}
+
+static bool bench_params_parse(int argc, char ** argv, bench_params & params) {
+    for (int i = 1; i < argc; i++) {
+        std::string arg = argv[i];
+
+        if (arg == "-h" || arg == "--help") {
+            bench_print_usage(argc, argv, params);
+            exit(0);
+        }
+        if (i + 1 >= argc && arg != "--memory_f16" && arg != "--huge_pages" &&
+            arg != "--mlock" && arg != "--numa") {
+            fprintf(stderr, "error: missing value of argument: %s\n", arg.c_str());
+            return false;
+        }
+
+        bool ok = true;
+        if (arg == "-m" || arg == "--model") {
+            params.model = argv[++i];
+        } else if (arg == "-t" || arg == "--threads") {
+            ok = parse_list(argv[++i], params.n_threads);
+        } else if (arg == "-b" || arg == "--batch_size") {
+            ok = parse_list(argv[++i], params.n_batch);
+        } else if (arg == "-d" || arg == "--depth") {
+            ok = parse_list(argv[++i], params.n_depth);
+        } else if (arg == "-n" || arg == "--n_gen") {
+            params.n_gen = std::stoi(argv[++i]);
+        } else if (arg == "-r" || arg == "--repetitions") {
+            params.n_reps = std::stoi(argv[++i]);
+        } else if (arg == "-o" || arg == "--output") {
+            params.output = argv[++i];
+            ok = params.output == "csv" || params.output == "json";
+        } else if (arg == "--n_parts") {
+            params.n_parts = std::stoi(argv[++i]);
+        } else if (arg == "--memory_type") {
+            params.memory_type = argv[++i];
+        } else if (arg == "--memory_f16") {
+            params.memory_type = "f16";
+        } else if (arg == "--huge_pages") {
+            params.huge_pages = true;
+        } else if (arg == "--mlock") {
+            params.mlock = true;
+        } else if (arg == "--numa") {
+            params.numa = true;
+        } else if (arg == "--repack") {
+            params.repack_rows = std::stoi(argv[++i]);
+        } else {
+            fprintf(stderr, "error: unknown argument: %s\n", arg.c_str());
+            bench_print_usage(argc, argv, params);
+            return false;
+        }
+
+        if (!ok) {
+            fprintf(stderr, "error: invalid value of argument %s: %s\n", arg.c_str(), argv[i]);
+            return false;
+        }
+    }
+
+    if (params.n_threads.empty()) {
+        params.n_threads = {std::max(1, (int32_t) std::thread::hardware_concurrency())};
+    }
+    for (int n : params.n_threads) {
+        if (n < 1) {
+            fprintf(stderr, "error: thread count must be positive\n");
+            return false;
+        }
+    }
+    if (params.n_reps < 1 || params.n_gen < 0) {
+        fprintf(stderr, "error: invalid number of repetitions or generated tokens\n");
+        return false;
+    }
+
+    return true;
+}
+
+// fill the context with n_depth tokens, in batches of at most 512
+static bool bench_fill(llama::LLaMA & model, const std::vector<llama_vocab::id> & tokens,
+                       int n_depth, int n_threads) {
+    std::vector<float> logits;
+    size_t mem_per_token = 0;
+    for (int n_past = 0; n_past < n_depth; ) {
+        const int n = std::min(512, n_depth - n_past);
+        const std::vector<llama_vocab::id> batch(tokens.begin() + n_past, tokens.begin() + n_past + n);
+        if (!model.Apply(batch, n_past, logits, mem_per_token, n_threads)) {
+            return false;
+        }
+        n_past += n;
+    }
+    return true;
+}
+
+// time one evaluation of a batch of n_batch tokens following n_depth tokens
+static bool bench_prompt(llama::LLaMA & model, const std::vector<llama_vocab::id> & tokens,
+                         int n_batch, int n_depth, int n_threads, double & t_us) {
+    std::vector<float> logits;
+    size_t mem_per_token = 0;
+    const std::vector<llama_vocab::id> batch(tokens.begin(), tokens.begin() + n_batch);
+
+    const int64_t t_start_us = ggml_time_us();
+    if (!model.Apply(batch, n_depth, logits, mem_per_token, n_threads)) {
+        return false;
+    }
+    t_us = ggml_time_us() - t_start_us;
+    return true;
+}
+
+// time n_gen evaluations of a single token each following n_depth tokens
+static bool bench_gen(llama::LLaMA & model, const std::vector<llama_vocab::id> & tokens,
+                      int n_gen, int n_depth, int n_threads, double & t_us) {
+    std::vector<float> logits;
+    size_t mem_per_token = 0;
+
+    const int64_t t_start_us = ggml_time_us();
+    for (int i = 0; i < n_gen; i++) {
+        if (!model.Apply({tokens[i]}, n_depth + i, logits, mem_per_token, n_threads)) {
+            return false;
+        }
+    }
+    t_us = ggml_time_us() - t_start_us;
+    return true;
+}
+
+static void bench_print_csv(const bench_params & params, size_t n_weight_bytes,
+                            const std::vector<bench_result> & results) {
+    printf("model,weight_bytes,test,n_threads,n_batch,n_depth,n_tokens,reps,avg_ts,stddev_ts,avg_gbs\n");
+    for (const auto & r : results) {
+        printf("\"%s\",%zu,%s,%d,%d,%d,%d,%zu,%.3f,%.3f,%.3f\n",
+               params.model.c_str(), n_weight_bytes, r.test.c_str(), r.n_threads, r.n_batch,
+               r.n_depth, r.n_tokens, r.samples_us.size(), r.avg_ts(), r.stddev_ts(),
+               r.avg_gbs(n_weight_bytes));
+    }
+}
+
+// a string as the contents of a JSON string literal
+static std::string json_escape(const std::string & s) {
+    std::string res;
+    for (char c : s) {
+        if (c == '"' || c == '\\') {
+            res += '\\';
+        }
+        res += c;
+    }
+    return res;
+}
+
+static void bench_print_json(const bench_params & params, size_t n_weight_bytes,
+                             const std::vector<bench_result> & results) {
+    printf("[\n");
+    for (size_t i = 0; i < results.size(); i++) {
+        const auto & r = results[i];
+        printf("  {\"model\": \"%s\", \"weight_bytes\": %zu, \"test\": \"%s\", "
+               "\"n_threads\": %d, \"n_batch\": %d, \"n_depth\": %d, \"n_tokens\": %d, "
+               "\"avg_ts\": %.3f, \"stddev_ts\": %.3f, \"avg_gbs\": %.3f, \"samples_us\": [",
+               json_escape(params.model).c_str(), n_weight_bytes, r.test.c_str(), r.n_threads, r.n_batch,
+               r.n_depth, r.n_tokens, r.avg_ts(), r.stddev_ts(), r.avg_gbs(n_weight_bytes));
+        for (size_t j = 0; j < r.samples_us.size(); j++) {
+            printf("%s%.0f", j > 0 ? ", " : "", r.samples_us[j]);
+        }
+        printf("]}%s\n", i + 1 < results.size() ? "," : "");
+    }
+    printf("]\n");
+}
+
+int main(int argc, char ** argv) {
+    ggml_time_init();
+
+    bench_params params;
+    if (!bench_params_parse(argc, argv, params)) {
+        return 1;
+    }
+
+    const int max_batch = *std::max_element(params.n_batch.begin(), params.n_batch.end());
+    const int max_depth = *std::max_element(params.n_depth.begin(), params.n_depth.end());
+    const int max_threads = *std::max_element(params.n_threads.begin(), params.n_threads.end());
+    const int n_ctx = max_depth + std::max(max_batch, params.n_gen);
+
+    if (n_ctx > 2048) {
+        fprintf(stderr, "%s: warning: model does not support context sizes greater than 2048 tokens (%d needed); "
+                "expect poor results\n", __func__, n_ctx);
+    }
+
+    // load the model
+    std::shared_ptr<llama::LLaMA> model;
+    {
+        const int64_t t_start_us = ggml_time_us();
+        ggml_type memory_type;
+        if (params.memory_type == "f32") {
+            memory_type = GGML_TYPE_F32;
+        } else if (params.memory_type == "f16") {
+            memory_type = GGML_TYPE_F16;
+        } else if (params.memory_type == "q8_0") {
+            memory_type = GGML_TYPE_Q8_0;
+        } else {
+            fprintf(stderr, "%s: unknown memory type '%s'\n", __func__, params.memory_type.c_str());
+            return 1;
+        }
+        llama_load_params load_params;
+        load_params.n_ctx = std::max(n_ctx, 4);
+        load_params.n_parts = params.n_parts;
+        load_params.memory_type = memory_type;
+        load_params.huge_pages = params.huge_pages;
+        load_params.mlock = params.mlock;
+        load_params.numa = params.numa;
+        load_params.repack_rows = params.repack_rows;
+        model = llama::LLaMA::Load(params.model, load_params);
+        if (!model) {
+            fprintf(stderr, "%s: failed to load model from '%s'\n", __func__, params.model.c_str());
+            return 1;
+        }
+        fprintf(stderr, "%s: load time = %8.2f ms\n", __func__, (ggml_time_us() - t_start_us)/1000.0f);
+    }
+
+    const size_t n_weight_bytes = model->GetWeightSize();
+    const int n_vocab = model->GetHParams().n_vocab;
+
+    fprintf(stderr, "%s: weights = %8.2f MB, n_ctx = %d\n", __func__, n_weight_bytes/1024.0/1024.0, n_ctx);
+    fprintf(stderr, "system_info: n_threads = %d / %d | %s\n",
+            max_threads, std::thread::hardware_concurrency(), llama_print_system_info());
+
+    // the same random tokens for every run; their values do not affect timing
+    std::mt19937 rng(1234);
+    std::uniform_int_distribution<int> dist(1, n_vocab - 1);
+    std::vector<llama_vocab::id> tokens(std::max(n_ctx, 1));
+    for (auto & id : tokens) {
+        id = dist(rng);
+    }
+
+    std::vector<bench_result> results;
+    for (int n_depth : params.n_depth) {
+        if (!bench_fill(*model, tokens, n_depth, max_threads)) {
+            fprintf(stderr, "%s: failed to fill context of %d tokens\n", __func__, n_depth);
+            return 1;
+        }
+
+        for (int n_threads : params.n_threads) {
+            for (int n_batch : params.n_batch) {
+                if (n_batch == 0) {
+                    continue;
+                }
+                bench_result r = {"pp", n_threads, n_batch, n_depth, n_batch, {}};
+                double t_us = 0.0;
+                // warm-up run: plans the graph of the batch and faults in pages
+                bool ok = bench_prompt(*model, tokens, n_batch, n_depth, n_threads, t_us);
+                for (int i = 0; ok && i < params.n_reps; i++) {
+                    ok = bench_prompt(*model, tokens, n_batch, n_depth, n_threads, t_us);
+                    r.samples_us.push_back(t_us);
+                }
+                if (!ok) {
+                    fprintf(stderr, "%s: failed to evaluate prompt\n", __func__);
+                    return 1;
+                }
+                fprintf(stderr, "%s: pp %4d t = %3d d = %4d: %10.2f ± %.2f t/s\n", __func__,
+                        n_batch, n_threads, n_depth, r.avg_ts(), r.stddev_ts());
+                results.push_back(r);
+            }
+
+            if (params.n_gen > 0) {
+                bench_result r = {"tg", n_threads, 1, n_depth, params.n_gen, {}};
+                double t_us = 0.0;
+                bool ok = bench_gen(*model, tokens, 1, n_depth, n_threads, t_us);
+                for (int i = 0; ok && i < params.n_reps; i++) {
+                    ok = bench_gen(*model, tokens, params.n_gen, n_depth, n_threads, t_us);
+                    r.samples_us.push_back(t_us);
+                }
+                if (!ok) {
+                    fprintf(stderr, "%s: failed to generate\n", __func__);
+                    return 1;
+                }
+                fprintf(stderr, "%s: tg %4d t = %3d d = %4d: %10.2f ± %.2f t/s, %.2f GB/s\n", __func__,
+                        params.n_gen, n_threads, n_depth, r.avg_ts(), r.stddev_ts(),
+                        r.avg_gbs(n_weight_bytes));
+                results.push_back(r);
+            }
+        }
+    }
+
+    if (params.output == "json") {
+        bench_print_json(params, n_weight_bytes, results);
+    } else {
+        bench_print_csv(params, n_weight_bytes, results);
+    }
+
+    return 0;
+}
@@ -0,0 +1,1104 @@
+#include "checkpoint.h"
+
+#include <algorithm>
+#include <cinttypes>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <iterator>
+#include <map>
+#include <memory>
+#include <thread>
+#include <vector>
+
+#include <llama/cc/utils.h>
+
+namespace llama {
+
+template <typename T> static T llama_read_le(char const *p) {
+    T value;
+    memcpy(&value, p, sizeof(value));
+    return value;
+}
+
+// entry of a zip archive which is stored without compression as torch.save
+// writes it
+struct llama_zip_entry {
+    uint64_t offset; // of data in archive
+    uint64_t size;
+};
+
+// read the central directory of a zip archive (with zip64 extensions)
+static bool
+llama_zip_read_directory(std::ifstream &fin, std::string const &fname,
+                         std::map<std::string, llama_zip_entry> &entries) {
+    fin.seekg(0, std::ios::end);
+    const uint64_t file_size = fin.tellg();
+
+    // end of central directory record is followed by a comment of at most
+    // 64 KiB
+    const uint64_t tail_size = std::min<uint64_t>(file_size, 22 + 65535);
+    std::vector<char> tail(tail_size);
+    fin.seekg(file_size - tail_size);
+    fin.read(tail.data(), tail_size);
+
+    int64_t eocd = -1;
+    for (int64_t i = (int64_t)tail_size - 22; fin && i >= 0; --i) {
+        if (llama_read_le<uint32_t>(&tail[i]) == 0x06054b50) {
+            eocd = i;
+            break;
+        }
+    }
+    if (eocd < 0) {
+        fprintf(stderr, "%s: '%s' is not a zip archive\n", __func__,
+                fname.c_str());
+        return false;
+    }
+
+    uint64_t n_entries = llama_read_le<uint16_t>(&tail[eocd + 10]);
+    uint64_t cd_size = llama_read_le<uint32_t>(&tail[eocd + 12]);
+    uint64_t cd_offset = llama_read_le<uint32_t>(&tail[eocd + 16]);
+
+    // zip64 end of central directory locator precedes the record
+    if (eocd >= 20 && llama_read_le<uint32_t>(&tail[eocd - 20]) == 0x07064b50) {
+        char eocd64[56];
+        fin.seekg(llama_read_le<uint64_t>(&tail[eocd - 20 + 8]));
+        fin.read(eocd64, sizeof(eocd64));
+        if (!fin || llama_read_le<uint32_t>(eocd64) != 0x06064b50) {
+            fprintf(stderr, "%s: invalid zip64 directory in '%s'\n", __func__,
+                    fname.c_str());
+            return false;
+        }
+        n_entries = llama_read_le<uint64_t>(eocd64 + 32);
+        cd_size = llama_read_le<uint64_t>(eocd64 + 40);
+        cd_offset = llama_read_le<uint64_t>(eocd64 + 48);
+    }
+
+    std::vector<char> cd(cd_size);
+    fin.seekg(cd_offset);
+    fin.read(cd.data(), cd_size);
+    if (!fin) {
+        fprintf(stderr, "%s: truncated zip directory in '%s'\n", __func__,
+                fname.c_str());
+        return false;
+    }
+
+    size_t pos = 0;
+    for (uint64_t i = 0; i < n_entries; ++i) {
+        char const *p = cd.data() + pos;
+        if (pos + 46 > cd.size() || llama_read_le<uint32_t>(p) != 0x02014b50) {
+            fprintf(stderr, "%s: invalid zip directory in '%s'\n", __func__,
+                    fname.c_str());
+            return false;
+        }
+
+        const uint16_t method = llama_read_le<uint16_t>(p + 10);
+        uint64_t csize = llama_read_le<uint32_t>(p + 20);
+        uint64_t usize = llama_read_le<uint32_t>(p + 24);
+        const size_t name_len = llama_read_le<uint16_t>(p + 28);
+        const size_t extra_len = llama_read_le<uint16_t>(p + 30);
+        const size_t comment_len = llama_read_le<uint16_t>(p + 32);
+        uint64_t offset = llama_read_le<uint32_t>(p + 42);
+
+        if (pos + 46 + name_len + extra_len + comment_len > cd.size()) {
+            fprintf(stderr, "%s: invalid zip directory in '%s'\n", __func__,
+                    fname.c_str());
+            return false;
+        }
+
+        // zip64 extended information holds the fields which do not fit
+        char const *extra = p + 46 + name_len;
+        for (size_t j = 0; j + 4 <= extra_len;) {
+            const size_t len = llama_read_le<uint16_t>(extra + j + 2);
+            if (llama_read_le<uint16_t>(extra + j) == 0x0001) {
+                char const *q = extra + j + 4;
+                char const *end = q + std::min(len, extra_len - j - 4);
+                for (uint64_t *field : {&usize, &csize, &offset}) {
+                    if (*field == 0xFFFFFFFF && q + 8 <= end) {
+                        *field = llama_read_le<uint64_t>(q);
+                        q += 8;
+                    }
+                }
+            }
+            j += 4 + len;
+        }
+
+        std::string name(p + 46, name_len);
+        if (method != 0 || csize != usize) {
+            fprintf(stderr, "%s: entry '%s' of '%s' is compressed\n", __func__,
+                    name.c_str(), fname.c_str());
+            return false;
+        }
+
+        entries[name] = {offset, usize};
+        pos += 46 + name_len + extra_len + comment_len;
+    }
+
+    // data follows a local header whose extra field may differ from the one
+    // in the central directory
+    for (auto &it : entries) {
+        char header[30];
+        fin.seekg(it.second.offset);
+        fin.read(header, sizeof(header));
+        if (!fin || llama_read_le<uint32_t>(header) != 0x04034b50) {
+            fprintf(stderr, "%s: invalid header of entry '%s' in '%s'\n",
+                    __func__, it.first.c_str(), fname.c_str());
+            return false;
+        }
+        it.second.offset += sizeof(header) +
+                            llama_read_le<uint16_t>(header + 26) +
+                            llama_read_le<uint16_t>(header + 28);
+    }
+
+    return true;
+}
+
+// value of a pickle; only what torch.save writes for a state dict is
+// represented
+struct llama_pickle_value {
+    enum kind_type {
+        NONE,
+        INT,
+        FLOAT,
+        STRING,
+        TUPLE,
+        LIST,
+        DICT,
+        GLOBAL,
+        STORAGE,
+        TENSOR,
+        OBJECT,
+    };
+
+    kind_type kind = NONE;
+    int64_t i = 0;     // value of int (and bool) or storage offset of tensor
+    double f = 0;      // value of float
+    std::string s;     // string, module.name of global, key of storage
+    std::string dtype; // storage type of storage or tensor
+    // items of tuple and list; keys and values of dict in turn
+    std::vector<std::shared_ptr<llama_pickle_value>> items;
+    std::vector<int64_t> shape;
+    std::vector<int64_t> stride;
+};
+
+using llama_pickle_ptr = std::shared_ptr<llama_pickle_value>;
+
+static llama_pickle_ptr llama_pickle_make(llama_pickle_value::kind_type kind) {
+    auto value = std::make_shared<llama_pickle_value>();
+    value->kind = kind;
+    return value;
+}
+
+// turn the arguments of _rebuild_tensor_v2 (storage, storage_offset, size,
+// stride, ...) into a tensor
+static llama_pickle_ptr llama_pickle_tensor(llama_pickle_ptr const &args) {
+    if (args->kind != llama_pickle_value::TUPLE || args->items.size() < 4 ||
+        args->items[0]->kind != llama_pickle_value::STORAGE ||
+        args->items[1]->kind != llama_pickle_value::INT ||
+        args->items[2]->kind != llama_pickle_value::TUPLE ||
+        args->items[3]->kind != llama_pickle_value::TUPLE ||
+        args->items[2]->items.size() != args->items[3]->items.size()) {
+        return nullptr;
+    }
+
+    auto tensor = llama_pickle_make(llama_pickle_value::TENSOR);
+    tensor->s = args->items[0]->s;
+    tensor->dtype = args->items[0]->dtype;
+    tensor->i = args->items[1]->i;
+    for (size_t k = 0; k < args->items[2]->items.size(); ++k) {
+        auto const &size = args->items[2]->items[k];
+        auto const &stride = args->items[3]->items[k];
+        if (size->kind != llama_pickle_value::INT ||
+            stride->kind != llama_pickle_value::INT) {
+            return nullptr;
+        }
+        tensor->shape.push_back(size->i);
+        tensor->stride.push_back(stride->i);
+    }
+    return tensor;
+}
+
+// evaluate a pickle (up to protocol 5) of a state dict into a dict of tensors
+static bool llama_pickle_load(std::string const &data, std::string const &fname,
+                              llama_pickle_ptr &result) {
+    using kind = llama_pickle_value;
+
+    std::vector<llama_pickle_ptr> stack;
+    std::vector<size_t> marks;
+    std::map<uint32_t, llama_pickle_ptr> memo;
+    size_t pos = 0;
+
+    auto fail = [&](char const *what) {
+        fprintf(stderr, "%s: %s at offset %zu of pickle in '%s'\n", __func__,
+                what, pos, fname.c_str());
+        return false;
+    };
+
+    // read n bytes of argument of an opcode
+    auto read = [&](size_t n, char const *&p) {
+        if (pos + n > data.size()) {
+            return false;
+        }
+        p = data.data() + pos;
+        pos += n;
+        return true;
+    };
+
+    auto read_line = [&](std::string &line) {
+        const size_t end = data.find('\n', pos);
+        if (end == std::string::npos) {
+            return false;
+        }
+        line = data.substr(pos, end - pos);
+        pos = end + 1;
+        return true;
+    };
+
+    auto pop = [&]() {
+        if (stack.empty() || (!marks.empty() && stack.size() == marks.back())) {
+            return llama_pickle_ptr();
+        }
+        auto value = stack.back();
+        stack.pop_back();
+        return value;
+    };
+
+    // pop the items above the topmost mark
+    auto pop_mark = [&](std::vector<llama_pickle_ptr> &items) {
+        if (marks.empty()) {
+            return false;
+        }
+        items.assign(stack.begin() + marks.back(), stack.end());
+        stack.resize(marks.back());
+        marks.pop_back();
+        return true;
+    };
+
+    auto push_string = [&](size_t n) {
+        char const *p;
+        if (!read(n, p)) {
+            return false;
+        }
+        auto value = llama_pickle_make(kind::STRING);
+        value->s.assign(p, n);
+        stack.push_back(value);
+        return true;
+    };
+
+    auto push_int = [&](int64_t i) {
+        auto value = llama_pickle_make(kind::INT);
+        value->i = i;
+        stack.push_back(value);
+    };
+
+    while (true) {
+        char const *p;
+        if (!read(1, p)) {
+            return fail("unexpected end");
+        }
+
+        const uint8_t op = *p;
+        switch (op) {
+        case 0x80: // PROTO
+            if (!read(1, p)) {
+                return fail("unexpected end");
+            }
+            break;
+        case 0x95: // FRAME
+            if (!read(8, p)) {
+                return fail("unexpected end");
+            }
+            break;
+        case 'c': { // GLOBAL
+            std::string module, name;
+            if (!read_line(module) || !read_line(name)) {
+                return fail("unexpected end");
+            }
+            auto value = llama_pickle_make(kind::GLOBAL);
+            value->s = module + "." + name;
+            stack.push_back(value);
+        } break;
+        case 0x93: { // STACK_GLOBAL
+            auto name = pop();
+            auto module = pop();
+            if (!name || !module || name->kind != kind::STRING ||
+                module->kind != kind::STRING) {
+                return fail("invalid global");
+            }
+            auto value = llama_pickle_make(kind::GLOBAL);
+            value->s = module->s + "." + name->s;
+            stack.push_back(value);
+        } break;
+        case '(': // MARK
+            marks.push_back(stack.size());
+            break;
+        case '}': // EMPTY_DICT
+            stack.push_back(llama_pickle_make(kind::DICT));
+            break;
+        case ']': // EMPTY_LIST
+            stack.push_back(llama_pickle_make(kind::LIST));
+            break;
+        case ')': // EMPTY_TUPLE
+            stack.push_back(llama_pickle_make(kind::TUPLE));
+            break;
+        case 't':   // TUPLE
+        case 'l': { // LIST
+            auto value = llama_pickle_make(op == 't' ? kind::TUPLE : kind::LIST);
+            if (!pop_mark(value->items)) {
+                return fail("missing mark");
+            }
+            stack.push_back(value);
+        } break;
+        case 0x85:   // TUPLE1
+        case 0x86:   // TUPLE2
+        case 0x87: { // TUPLE3
+            auto value = llama_pickle_make(kind::TUPLE);
+            value->items.resize(op - 0x84);
+            for (size_t k = value->items.size(); k-- > 0;) {
+                if (!(value->items[k] = pop())) {
+                    return fail("stack underflow");
+                }
+            }
+            stack.push_back(value);
+        } break;
+        case 'X': // BINUNICODE
+        case 'T': // BINSTRING
+        case 'B': // BINBYTES
+            if (!read(4, p) || !push_string(llama_read_le<uint32_t>(p))) {
+                return fail("unexpected end");
+            }
+            break;
+        case 0x8c: // SHORT_BINUNICODE
+        case 'U':  // SHORT_BINSTRING
+        case 'C':  // SHORT_BINBYTES
+            if (!read(1, p) || !push_string(llama_read_le<uint8_t>(p))) {
+                return fail("unexpected end");
+            }
+            break;
+        case 0x8d: // BINUNICODE8
+        case 0x8e: // BINBYTES8
+            if (!read(8, p) || !push_string(llama_read_le<uint64_t>(p))) {
+                return fail("unexpected end");
+            }
+            break;
+        case 'J': // BININT
+            if (!read(4, p)) {
+                return fail("unexpected end");
+            }
+            push_int(llama_read_le<int32_t>(p));
+            break;
+        case 'K': // BININT1
+            if (!read(1, p)) {
+                return fail("unexpected end");
+            }
+            push_int(llama_read_le<uint8_t>(p));
+            break;
+        case 'M': // BININT2
+            if (!read(2, p)) {
+                return fail("unexpected end");
+            }
+            push_int(llama_read_le<uint16_t>(p));
+            break;
+        case 0x8a: { // LONG1
+            if (!read(1, p)) {
+                return fail("unexpected end");
+            }
+            const size_t n = llama_read_le<uint8_t>(p);
+            if (n > 8 || !read(n, p)) {
+                return fail("unsupported long");
+            }
+            // little-endian two's complement
+            uint64_t bits = n > 0 && (p[n - 1] & 0x80) ? ~uint64_t(0) : 0;
+            memcpy(&bits, p, n);
+            push_int(bits);
+        } break;
+        case 'G': { // BINFLOAT
+            if (!read(8, p)) {
+                return fail("unexpected end");
+            }
+            char bytes[8];
+            std::reverse_copy(p, p + 8, bytes); // big-endian
+            auto value = llama_pickle_make(kind::FLOAT);
+            value->f = llama_read_le<double>(bytes);
+            stack.push_back(value);
+        } break;
+        case 'N': // NONE
+            stack.push_back(llama_pickle_make(kind::NONE));
+            break;
+        case 0x88: // NEWTRUE
+        case 0x89: // NEWFALSE
+            push_int(op == 0x88);
+            break;
+        case 'q': // BINPUT
+        case 'r': // LONG_BINPUT
+            if (!read(op == 'q' ? 1 : 4, p) || stack.empty()) {
+                return fail("invalid memo");
+            }
+            memo[op == 'q' ? llama_read_le<uint8_t>(p)
+                           : llama_read_le<uint32_t>(p)] = stack.back();
+            break;
+        case 0x94: // MEMOIZE
+            if (stack.empty()) {
+                return fail("invalid memo");
+            }
+            memo[memo.size()] = stack.back();
+            break;
+        case 'h':   // BINGET
+        case 'j': { // LONG_BINGET
+            if (!read(op == 'h' ? 1 : 4, p)) {
+                return fail("unexpected end");
+            }
+            auto it = memo.find(op == 'h' ? llama_read_le<uint8_t>(p)
+                                          : llama_read_le<uint32_t>(p));
+            if (it == memo.end()) {
+                return fail("invalid memo");
+            }
+            stack.push_back(it->second);
+        } break;
+        case '0': // POP
+            if (!pop()) {
+                return fail("stack underflow");
+            }
+            break;
+        case '2': // DUP
+            if (stack.empty()) {
+                return fail("stack underflow");
+            }
+            stack.push_back(stack.back());
+            break;
+        case 'Q': { // BINPERSID
+            // ('storage', storage_type, key, location, numel)
+            auto pid = pop();
+            if (!pid || pid->kind != kind::TUPLE || pid->items.size() < 3 ||
+                pid->items[0]->kind != kind::STRING ||
+                pid->items[0]->s != "storage" ||
+                pid->items[1]->kind != kind::GLOBAL ||
+                pid->items[2]->kind != kind::STRING) {
+                return fail("unsupported persistent id");
+            }
+            auto value = llama_pickle_make(kind::STORAGE);
+            auto const &type = pid->items[1]->s;
+            value->dtype = type.substr(type.rfind('.') + 1);
+            value->s = pid->items[2]->s;
+            stack.push_back(value);
+        } break;
+        case 'R':    // REDUCE
+        case 0x81: { // NEWOBJ
+            auto args = pop();
+            auto callable = pop();
+            if (!args || !callable) {
+                return fail("stack underflow");
+            }
+            llama_pickle_ptr value;
+            if (callable->s == "torch._utils._rebuild_tensor_v2") {
+                if (!(value = llama_pickle_tensor(args))) {
+                    return fail("invalid tensor");
+                }
+            } else if (callable->s == "torch._utils._rebuild_parameter") {
+                if (args->items.empty() ||
+                    args->items[0]->kind != kind::TENSOR) {
+                    return fail("invalid parameter");
+                }
+                value = args->items[0];
+            } else if (callable->s == "collections.OrderedDict") {
+                value = llama_pickle_make(kind::DICT);
+            } else {
+                value = llama_pickle_make(kind::OBJECT);
+                value->s = callable->s;
+            }
+            stack.push_back(value);
+        } break;
+        case 'b': // BUILD
+            // state of objects (e.g. metadata of OrderedDict) is not needed
+            if (!pop() || stack.empty()) {
+                return fail("stack underflow");
+            }
+            break;
+        case 's': { // SETITEM
+            auto value = pop();
+            auto key = pop();
+            if (!value || !key || stack.empty() ||
+                stack.back()->kind != kind::DICT) {
+                return fail("invalid dict");
+            }
+            stack.back()->items.push_back(key);
+            stack.back()->items.push_back(value);
+        } break;
+        case 'u':   // SETITEMS
+        case 'e': { // APPENDS
+            std::vector<llama_pickle_ptr> items;
+            if (!pop_mark(items) || stack.empty() ||
+                stack.back()->kind != (op == 'u' ? kind::DICT : kind::LIST) ||
+                (op == 'u' && items.size() % 2 != 0)) {
+                return fail(op == 'u' ? "invalid dict" : "invalid list");
+            }
+            auto &dst = stack.back()->items;
+            dst.insert(dst.end(), items.begin(), items.end());
+        } break;
+        case 'a': { // APPEND
+            auto value = pop();
+            if (!value || stack.empty() || stack.back()->kind != kind::LIST) {
+                return fail("invalid list");
+            }
+            stack.back()->items.push_back(value);
+        } break;
+        case '.': // STOP
+            if (stack.size() != 1) {
+                return fail("invalid stack");
+            }
+            result = stack.back();
+            return true;
+        default: {
+            char what[32];
+            snprintf(what, sizeof(what), "unsupported opcode 0x%02x", op);
+            return fail(what);
+        }
+        }
+    }
+}
+
+// read a varint of a protobuf message
+static bool llama_proto_varint(char const *&p, char const *end,
+                               uint64_t &value) {
+    value = 0;
+    for (int shift = 0; p < end && shift < 64; shift += 7) {
+        const uint8_t byte = *p++;
+        value |= uint64_t(byte & 0x7f) << shift;
+        if (!(byte & 0x80)) {
+            return true;
+        }
+    }
+    return false;
+}
+
+// skip a field of wire type wt of a protobuf message
+static bool llama_proto_skip(char const *&p, char const *end, uint64_t wt) {
+    uint64_t n = 0;
+    switch (wt) {
+    case 0:
+        return llama_proto_varint(p, end, n);
+    case 1:
+        n = 8;
+        break;
+    case 2:
+        if (!llama_proto_varint(p, end, n)) {
+            return false;
+        }
+        break;
+    case 5:
+        n = 4;
+        break;
+    default:
+        return false;
+    }
+    if (n > uint64_t(end - p)) {
+        return false;
+    }
+    p += n;
+    return true;
+}
+
+// read the pieces of a sentencepiece model (ModelProto) as tokens of a model
+// file: the unknown piece is " \u2047 ", control pieces are empty, byte pieces
+// <0xXX> are the byte and U+2581 is a space
+static bool llama_tokenizer_load(std::string const &fname,
+                                 std::vector<std::string> &tokens,
+                                 std::vector<float> &scores) {
+    // types of SentencePiece
+    enum { NORMAL = 1, UNKNOWN = 2, CONTROL = 3, BYTE = 6 };
+
+    std::ifstream fin(fname, std::ios::binary);
+    if (!fin) {
+        fprintf(stderr, "%s: failed to open '%s' for reading\n", __func__,
+                fname.c_str());
+        return false;
+    }
+    const std::string data((std::istreambuf_iterator<char>(fin)),
+                           std::istreambuf_iterator<char>());
+
+    char const *p = data.data();
+    char const *end = p + data.size();
+    while (p < end) {
+        uint64_t key, len;
+        if (!llama_proto_varint(p, end, key)) {
+            break;
+        }
+        if (key != (1 << 3 | 2)) { // pieces = 1
+            if (!llama_proto_skip(p, end, key & 7)) {
+                break;
+            }
+            continue;
+        }
+        if (!llama_proto_varint(p, end, len) || len > uint64_t(end - p)) {
+            break;
+        }
+
+        std::string piece;
+        float score = 0;
+        uint64_t type = NORMAL;
+        char const *q = p;
+        p += len;
+        while (q < p) {
+            uint64_t piece_key, value;
+            if (!llama_proto_varint(q, p, piece_key)) {
+                break;
+            }
+            if (piece_key == (1 << 3 | 2) && // piece = 1
+                llama_proto_varint(q, p, value) && value <= uint64_t(p - q)) {
+                piece.assign(q, value);
+                q += value;
+            } else if (piece_key == (2 << 3 | 5) && p - q >= 4) { // score = 2
+                score = llama_read_le<float>(q);
+                q += 4;
+            } else if (piece_key == (3 << 3 | 0)) { // type = 3
+                llama_proto_varint(q, p, type);
+            } else if (!llama_proto_skip(q, p, piece_key & 7)) {
+                break;
+            }
+        }
+
+        std::string text;
+        if (type == UNKNOWN) {
+            text = " \xe2\x81\x87 "; // U+2047
+        } else if (type == CONTROL) {
+            text = "";
+        } else if (type == BYTE) {
+            if (piece.size() != 6) {
+                fprintf(stderr, "%s: invalid token #%zu '%s'\n", __func__,
+                        tokens.size(), piece.c_str());
+                return false;
+            }
+            text = std::string(1, (char)std::stoi(piece.substr(3, 2), 0, 16));
+        } else {
+            static const std::string space = "\xe2\x96\x81"; // U+2581
+            for (size_t i = 0; i < piece.size();) {
+                if (piece.compare(i, space.size(), space) == 0) {
+                    text += ' ';
+                    i += space.size();
+                } else {
+                    text += piece[i++];
+                }
+            }
+        }
+        tokens.push_back(text);
+        scores.push_back(score);
+    }
+
+    if (p != end || tokens.empty()) {
+        fprintf(stderr, "%s: invalid tokenizer model '%s'\n", __func__,
+                fname.c_str());
+        return false;
+    }
+    return true;
+}
+
+// storage types of tensors of a checkpoint
+enum llama_storage_type {
+    LLAMA_STORAGE_F32,
+    LLAMA_STORAGE_F16,
+    LLAMA_STORAGE_BF16,
+};
+
+// read a row of ne0 elements of a storage into floats
+typedef void (*llama_read_row_t)(char const *src, float *row, size_t ne0);
+
+static void llama_read_row_f32(char const *src, float *row, size_t ne0) {
+    memcpy(row, src, ne0 * sizeof(float));
+}
+
+static void llama_read_row_f16(char const *src, float *row, size_t ne0) {
+    for (size_t i = 0; i < ne0; ++i) {
+        row[i] = ggml_fp16_to_fp32(llama_read_le<ggml_fp16_t>(src + 2 * i));
+    }
+}
+
+static void llama_read_row_bf16(char const *src, float *row, size_t ne0) {
+    for (size_t i = 0; i < ne0; ++i) {
+        const uint32_t bits = uint32_t(llama_read_le<uint16_t>(src + 2 * i))
+                              << 16;
+        memcpy(&row[i], &bits, sizeof(bits));
+    }
+}
+
+// convert n rows of ne0 elements of a storage type to the type of a model
+// file; row is a buffer of ne0 floats, hist counts the quantized values
+static void llama_convert_rows(char const *src, llama_storage_type src_type,
+                               char *dst, ggml_type dst_type, size_t n,
+                               size_t ne0, float *row, int64_t *hist) {
+    const size_t src_size = src_type == LLAMA_STORAGE_F32 ? 4 : 2;
+    const size_t dst_size = ggml_type_size(dst_type) * ne0 /
+                            ggml_blck_size(dst_type);
+
+    if (src_type == LLAMA_STORAGE_F16 && dst_type == GGML_TYPE_F16) {
+        memcpy(dst, src, n * dst_size);
+        return;
+    }
+
+    const llama_read_row_t read_row = src_type == LLAMA_STORAGE_F32
+                                          ? llama_read_row_f32
+                                      : src_type == LLAMA_STORAGE_F16
+                                          ? llama_read_row_f16
+                                          : llama_read_row_bf16;
+
+    for (size_t r = 0; r < n; ++r, src += ne0 * src_size, dst += dst_size) {
+        read_row(src, row, ne0);
+
+        switch (dst_type) {
+        case GGML_TYPE_F32:
+            memcpy(dst, row, dst_size);
+            break;
+        case GGML_TYPE_F16:
+            for (size_t i = 0; i < ne0; ++i) {
+                const ggml_fp16_t value = ggml_fp32_to_fp16(row[i]);
+                memcpy(dst + 2 * i, &value, sizeof(value));
+            }
+            break;
+        case GGML_TYPE_Q4_0:
+            ggml_quantize_q4_0(row, dst, ne0, ne0,
+                               ggml_blck_size(GGML_TYPE_Q4_0), hist);
+            break;
+        default:
+            ggml_quantize_q4_1(row, dst, ne0, ne0,
+                               ggml_blck_size(GGML_TYPE_Q4_1), hist);
+            break;
+        }
+    }
+}
+
+// convert a checkpoint part to a model file; header holds hyperparameters
+static bool llama_convert_part(std::string const &fname_inp,
+                               std::string const &fname_out,
+                               std::vector<int32_t> const &header,
+                               std::vector<std::string> const &tokens,
+                               std::vector<float> const &scores,
+                               ggml_type dtype, size_t n_threads) {
+    printf("%s: converting '%s' to '%s'\n", __func__, fname_inp.c_str(),
+           fname_out.c_str());
+
+    std::ifstream fin(fname_inp, std::ios::binary);
+    std::map<std::string, llama_zip_entry> entries;
+    if (!fin || !llama_zip_read_directory(fin, fname_inp, entries)) {
+        fprintf(stderr, "%s: failed to read '%s'\n", __func__,
+                fname_inp.c_str());
+        return false;
+    }
+
+    // the archive holds <prefix>data.pkl and storages <prefix>data/<key>
+    std::string prefix;
+    auto it_pkl = entries.end();
+    for (auto it = entries.begin(); it != entries.end(); ++it) {
+        auto const &name = it->first;
+        if (name.size() >= 8 && name.compare(name.size() - 8, 8, "data.pkl") == 0) {
+            prefix = name.substr(0, name.size() - 8);
+            it_pkl = it;
+            break;
+        }
+    }
+    if (it_pkl == entries.end()) {
+        fprintf(stderr, "%s: no data.pkl in '%s'\n", __func__,
+                fname_inp.c_str());
+        return false;
+    }
+
+    std::string pickle(it_pkl->second.size, 0);
+    fin.seekg(it_pkl->second.offset);
+    fin.read(&pickle[0], pickle.size());
+
+    llama_pickle_ptr state_dict;
+    if (!fin || !llama_pickle_load(pickle, fname_inp, state_dict)) {
+        return false;
+    }
+    if (state_dict->kind != llama_pickle_value::DICT) {
+        fprintf(stderr, "%s: '%s' holds no state dict\n", __func__,
+                fname_inp.c_str());
+        return false;
+    }
+
+    std::ofstream fout(fname_out, std::ios::binary);
+    if (!fout) {
+        fprintf(stderr, "%s: failed to open '%s' for writing\n", __func__,
+                fname_out.c_str());
+        return false;
+    }
+
+    fout.write((char const *)header.data(), header.size() * sizeof(int32_t));
+    for (size_t i = 0; i < tokens.size(); ++i) {
+        const uint32_t len = tokens[i].size();
+        fout.write((char const *)&len, sizeof(len));
+        fout.write(tokens[i].data(), len);
+        fout.write((char const *)&scores[i], sizeof(scores[i]));
+    }
+
+    std::vector<char> buf_inp;
+    std::vector<char> buf_out;
+    std::vector<std::vector<float>> rows(n_threads);
+    std::vector<std::vector<int64_t>> hists(n_threads);
+    std::vector<int64_t> hist_all(1 << 4, 0);
+    size_t total_size = 0;
+
+    auto const &items = state_dict->items;
+    for (size_t k = 0; k + 1 < items.size(); k += 2) {
+        auto const &key = items[k];
+        auto const &tensor = items[k + 1];
+        if (key->kind != llama_pickle_value::STRING ||
+            tensor->kind != llama_pickle_value::TENSOR) {
+            fprintf(stderr, "%s: unsupported item of state dict in '%s'\n",
+                    __func__, fname_inp.c_str());
+            return false;
+        }
+
+        auto const &name = key->s;
+        if (name.size() >= 5 && name.compare(name.size() - 5, 5, "freqs") == 0) {
+            continue;
+        }
+
+        llama_storage_type src_type;
+        size_t src_size = 0;
+        if (tensor->dtype == "FloatStorage") {
+            src_type = LLAMA_STORAGE_F32;
+            src_size = 4;
+        } else if (tensor->dtype == "HalfStorage") {
+            src_type = LLAMA_STORAGE_F16;
+            src_size = 2;
+        } else if (tensor->dtype == "BFloat16Storage") {
+            src_type = LLAMA_STORAGE_BF16;
+            src_size = 2;
+        } else {
+            fprintf(stderr, "%s: unsupported storage type %s of tensor '%s'\n",
+                    __func__, tensor->dtype.c_str(), name.c_str());
+            return false;
+        }
+
+        // only contiguous tensors are stored; dimensions of size 1 are
+        // squeezed and the rest are reversed
+        int64_t numel = 1;
+        std::vector<int32_t> ne;
+        for (size_t d = tensor->shape.size(); d-- > 0;) {
+            if (tensor->shape[d] != 1 && tensor->stride[d] != numel) {
+                fprintf(stderr, "%s: tensor '%s' is not contiguous\n",
+                        __func__, name.c_str());
+                return false;
+            }
+            if (tensor->shape[d] != 1) {
+                ne.push_back(tensor->shape[d]);
+            }
+            numel *= tensor->shape[d];
+        }
+
+        auto it_storage = entries.find(prefix + "data/" + tensor->s);
+        if (ne.empty() || ne.size() > 2 || it_storage == entries.end() ||
+            (tensor->i + numel) * src_size > it_storage->second.size) {
+            fprintf(stderr, "%s: invalid tensor '%s' in '%s'\n", __func__,
+                    name.c_str(), fname_inp.c_str());
+            return false;
+        }
+
+        const ggml_type type = ne.size() == 1 ? GGML_TYPE_F32 : dtype;
+        const bool quantize = type == GGML_TYPE_Q4_0 || type == GGML_TYPE_Q4_1;
+        if (quantize && ne[0] % ggml_blck_size(type) != 0) {
+            fprintf(stderr, "%s: row size %d of tensor '%s' is not a multiple "
+                    "of %d\n", __func__, ne[0], name.c_str(),
+                    ggml_blck_size(type));
+            return false;
+        }
+
+        const int32_t n_dims = ne.size();
+        const int32_t length = name.size();
+        const int32_t ftype = type == GGML_TYPE_F32    ? 0
+                              : type == GGML_TYPE_F16  ? 1
+                              : type == GGML_TYPE_Q4_0 ? 2
+                                                       : 3;
+        fout.write((char const *)&n_dims, sizeof(n_dims));
+        fout.write((char const *)&length, sizeof(length));
+        fout.write((char const *)&ftype, sizeof(ftype));
+        fout.write((char const *)ne.data(), n_dims * sizeof(int32_t));
+        fout.write(name.data(), length);
+
+        // rows are read, converted in parallel and written in batches of at
+        // most 16 MiB of storage
+        const size_t ne0 = ne[0];
+        const size_t n_rows = numel / ne0;
+        const size_t row_inp = ne0 * src_size;
+        const size_t row_out = ggml_type_size(type) * ne0 / ggml_blck_size(type);
+        const size_t n_batch = std::max<size_t>(1, (16 << 20) / row_inp);
+
+        buf_inp.resize(std::min(n_batch, n_rows) * row_inp);
+        buf_out.resize(std::min(n_batch, n_rows) * row_out);
+        for (size_t t = 0; t < n_threads; ++t) {
+            rows[t].resize(ne0);
+            hists[t].assign(1 << 4, 0);
+        }
+
+        fin.seekg(it_storage->second.offset + tensor->i * src_size);
+        for (size_t i1 = 0; i1 < n_rows; i1 += n_batch) {
+            const size_t n = std::min(n_batch, n_rows - i1);
+            fin.read(buf_inp.data(), n * row_inp);
+            if (!fin) {
+                fprintf(stderr, "%s: tensor '%s' is truncated in '%s'\n",
+                        __func__, name.c_str(), fname_inp.c_str());
+                return false;
+            }
+
+            const size_t n_workers = std::min(n_threads, n);
+            auto convert = [&](size_t t) {
+                const size_t r0 = n * t / n_workers;
+                const size_t r1 = n * (t + 1) / n_workers;
+                llama_convert_rows(buf_inp.data() + r0 * row_inp,
+                                   src_type, buf_out.data() + r0 * row_out,
+                                   type, r1 - r0, ne0, rows[t].data(),
+                                   hists[t].data());
+            };
+
+            std::vector<std::thread> workers;
+            for (size_t t = 1; t < n_workers; ++t) {
+                workers.emplace_back(convert, t);
+            }
+            convert(0);
+            for (auto &worker : workers) {
+                worker.join();
+            }
+
+            fout.write(buf_out.data(), n * row_out);
+        }
+
+        printf("%48s - [%5d, %5d], type = %6s, size = %8.2f MB",
+               name.c_str(), ne[0], n_dims == 2 ? ne[1] : 1,
+               ftype == 0 ? "f32" : ftype == 1 ? "f16" : ftype == 2 ? "q4_0" : "q4_1",
+               n_rows * row_out / 1024.0 / 1024.0);
+        if (quantize) {
+            printf(" | hist: ");
+            for (size_t i = 0; i < hist_all.size(); ++i) {
+                int64_t count = 0;
+                for (size_t t = 0; t < n_threads; ++t) {
+                    count += hists[t][i];
+                }
+                hist_all[i] += count;
+                printf("%5.3f ", count / (float)numel);
+            }
+        }
+        printf("\n");
+        total_size += n_rows * row_out;
+    }
+
+    if (!fout) {
+        fprintf(stderr, "%s: failed to write '%s'\n", __func__,
+                fname_out.c_str());
+        return false;
+    }
+
+    printf("%s: model size = %8.2f MB\n", __func__,
+           total_size / 1024.0 / 1024.0);
+
+    if (dtype == GGML_TYPE_Q4_0 || dtype == GGML_TYPE_Q4_1) {
+        int64_t sum_all = 0;
+        for (size_t i = 0; i < hist_all.size(); ++i) {
+            sum_all += hist_all[i];
+        }
+
+        printf("%s: hist: ", __func__);
+        for (size_t i = 0; i < hist_all.size(); ++i) {
+            printf("%5.3f ", hist_all[i] / (float)sum_all);
+        }
+        printf("\n");
+    }
+
+    return true;
+}
+
+bool ConvertCheckpoint(std::string const &model_dir, ggml_type dtype,
+                       size_t nothreads) {
+    static char const *type_names[] = {"f32", "f16", "q4_0", "q4_1"};
+    int32_t ftype;
+    switch (dtype) {
+    case GGML_TYPE_F32:
+        ftype = 0;
+        break;
+    case GGML_TYPE_F16:
+        ftype = 1;
+        break;
+    case GGML_TYPE_Q4_0:
+        ftype = 2;
+        break;
+    case GGML_TYPE_Q4_1:
+        ftype = 3;
+        break;
+    default:
+        fprintf(stderr, "%s: invalid type %d\n", __func__, dtype);
+        return false;
+    }
+
+    if (nothreads == 0) {
+        nothreads = std::max(1u, std::thread::hardware_concurrency());
+    }
+
+    // needed to initialize f16 tables
+    {
+        struct ggml_init_params params = {0, NULL};
+        struct ggml_context *ctx = ggml_init(params);
+        ggml_free(ctx);
+    }
+
+    const std::string fname_params = model_dir + "/params.json";
+    if (!std::ifstream(fname_params)) {
+        fprintf(stderr, "%s: failed to open '%s' for reading\n", __func__,
+                fname_params.c_str());
+        return false;
+    }
+
+    auto params = json_parse(fname_params);
+    for (char const *key : {"dim", "multiple_of", "n_heads", "n_layers"}) {
+        if (params.count(key) == 0 || params[key] <= 0) {
+            fprintf(stderr, "%s: missing '%s' in '%s'\n", __func__, key,
+                    fname_params.c_str());
+            return false;
+        }
+    }
+
+    std::vector<std::string> tokens;
+    std::vector<float> scores;
+    if (!llama_tokenizer_load(model_dir + "/../tokenizer.model", tokens,
+                              scores)) {
+        return false;
+    }
+
+    const std::vector<int32_t> header = {
+        FILE_MAGIC,
+        FILE_VERSION,
+        (int32_t)tokens.size(),
+        params["dim"],
+        params["multiple_of"],
+        params["n_heads"],
+        params["n_layers"],
+        params["dim"] / params["n_heads"], // n_rot
+        ftype,
+    };
+
+    for (int part = 0;; ++part) {
+        char name[32];
+        snprintf(name, sizeof(name), "consolidated.%02d.pth", part);
+        const std::string fname_inp = model_dir + "/" + name;
+        if (!std::ifstream(fname_inp)) {
+            if (part == 0) {
+                fprintf(stderr, "%s: no checkpoint '%s'\n", __func__,
+                        fname_inp.c_str());
+                return false;
+            }
+            break;
+        }
+
+        std::string fname_out =
+            model_dir + "/ggml-model-" + type_names[ftype] + ".bin";
+        if (part > 0) {
+            fname_out += "." + std::to_string(part);
+        }
+
+        if (!llama_convert_part(fname_inp, fname_out, header, tokens, scores,
+                                dtype, nothreads)) {
+            return false;
+        }
+    }
+
+    return true;
+}
+
+} // namespace llama
@@ -0,0 +1,27 @@
+#pragma once
+
+#include <llama/cc/ggml.h>
+#include <string>
+
+namespace llama {
+
+/**
+ * Convert a PyTorch checkpoint of LLaMA to model files (FILE_VERSION) in a
+ * single pass: model_dir holds params.json and consolidated.XX.pth and its
+ * parent directory holds tokenizer.model. Part XX is written to
+ * model_dir/ggml-model-<type>.bin (with suffix .XX for XX > 0).
+ *
+ * Tensor storage is read directly from the zip archive of a checkpoint and
+ * converted row by row with a bounded buffer, so that no tensor is ever held
+ * in memory in full.
+ *
+ * @param[in] model_dir Directory of checkpoint.
+ * @param[in] dtype     Type of 2-d tensors: GGML_TYPE_F32, GGML_TYPE_F16,
+ *                      GGML_TYPE_Q4_0 or GGML_TYPE_Q4_1; 1-d tensors are
+ *                      always of GGML_TYPE_F32.
+ * @param[in] nothreads Number of conversion threads (all cores if 0).
+ */
+bool ConvertCheckpoint(std::string const &model_dir,
+                       ggml_type dtype = GGML_TYPE_F16, size_t nothreads = 0);
+
+} // namespace llama
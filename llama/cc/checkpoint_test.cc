@@ -0,0 +1,186 @@
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <string>
+#include <vector>
+
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <llama/cc/checkpoint.h>
+#include <llama/cc/utils.h>
+
+// the checkpoint of models/tiny-pth (see make_fixture.py there)
+static const int k_dim = 32;
+static const int k_n_ff = 96;
+
+static const std::vector<std::string> k_tokens = {
+    " \xe2\x81\x87 ", "", "\n", " a", "b",
+};
+
+static const std::vector<std::pair<std::string, std::vector<int>>> k_tensors = {
+    { "tok_embeddings.weight",                 { k_dim, 5,      }, },
+    { "norm.weight",                           { k_dim,         }, },
+    { "output.weight",                         { k_dim, 5,      }, },
+    { "layers.0.attention.wq.weight",          { k_dim, k_dim,  }, },
+    { "layers.0.attention.wk.weight",          { k_dim, k_dim,  }, },
+    { "layers.0.attention.wv.weight",          { k_dim, k_dim,  }, },
+    { "layers.0.attention.wo.weight",          { k_dim, k_dim,  }, },
+    { "layers.0.feed_forward.w1.weight",       { k_dim, k_n_ff, }, },
+    { "layers.0.feed_forward.w2.weight",       { k_n_ff, k_dim, }, },
+    { "layers.0.feed_forward.w3.weight",       { k_dim, k_n_ff, }, },
+    { "layers.0.attention_norm.weight",        { k_dim,         }, },
+    { "layers.0.ffn_norm.weight",              { k_dim,         }, },
+};
+
+// element i of tensor t as make_fixture.py writes it
+static float fixture_value(int t, int i) {
+    return ((i * 7 + t) % 31 - 15) / 16.0f;
+}
+
+static bool copy_file(const std::string & src, const std::string & dst) {
+    std::ifstream fin(src, std::ios::binary);
+    std::ofstream fout(dst, std::ios::binary);
+    fout << fin.rdbuf();
+    return fin && fout;
+}
+
+template <typename T> static bool read_value(std::ifstream & fin, T & value) {
+    return (bool) fin.read((char *) &value, sizeof(value));
+}
+
+// compare a converted model file with the fixture; ftype is 0 (f32) or 1 (f16)
+static bool check_model(const std::string & fname, int ftype) {
+    std::ifstream fin(fname, std::ios::binary);
+
+    int32_t header[9];
+    if (!fin.read((char *) header, sizeof(header))) {
+        fprintf(stderr, "%s : failed to read header of '%s'\n", __func__, fname.c_str());
+        return false;
+    }
+
+    const int32_t expected[9] = { FILE_MAGIC, FILE_VERSION, (int32_t) k_tokens.size(), k_dim, 32, 2, 1, k_dim / 2, ftype, };
+    if (memcmp(header, expected, sizeof(header)) != 0) {
+        fprintf(stderr, "%s : unexpected header of '%s'\n", __func__, fname.c_str());
+        return false;
+    }
+
+    for (const auto & token : k_tokens) {
+        uint32_t len;
+        float score;
+        std::string text;
+        if (read_value(fin, len)) {
+            text.resize(len);
+            fin.read(&text[0], len);
+        }
+        if (!read_value(fin, score) || text != token) {
+            fprintf(stderr, "%s : expected token '%s', got '%s'\n", __func__, token.c_str(), text.c_str());
+            return false;
+        }
+    }
+
+    for (int t = 0; t < (int) k_tensors.size(); ++t) {
+        const auto & name = k_tensors[t].first;
+        const auto & ne   = k_tensors[t].second;
+
+        int32_t n_dims, length, type;
+        read_value(fin, n_dims);
+        read_value(fin, length);
+        read_value(fin, type);
+
+        std::vector<int32_t> dims(n_dims > 0 && n_dims <= 2 ? n_dims : 0);
+        std::string tensor_name(length > 0 && length < 256 ? length : 0, 0);
+        fin.read((char *) dims.data(), dims.size()*sizeof(int32_t));
+        fin.read(&tensor_name[0], tensor_name.size());
+
+        const int expected_type = ne.size() == 1 ? 0 : ftype;
+        if (!fin || tensor_name != name || type != expected_type || std::vector<int>(dims.begin(), dims.end()) != ne) {
+            fprintf(stderr, "%s : unexpected tensor '%s' (expected '%s')\n", __func__, tensor_name.c_str(), name.c_str());
+            return false;
+        }
+
+        const int n = ne.size() == 1 ? ne[0] : ne[0]*ne[1];
+        for (int i = 0; i < n; ++i) {
+            float value = 0.0f;
+            if (type == 0) {
+                read_value(fin, value);
+            } else {
+                ggml_fp16_t half = 0;
+                read_value(fin, half);
+                value = ggml_fp16_to_fp32(half);
+            }
+
+            if (!fin || value != fixture_value(t, i)) {
+                fprintf(stderr, "%s : element %d of '%s' is %f, expected %f\n", __func__, i, name.c_str(), value, fixture_value(t, i));
+                return false;
+            }
+        }
+    }
+
+    if (fin.peek() != EOF) {
+        fprintf(stderr, "%s : unexpected data after the tensors of '%s'\n", __func__, fname.c_str());
+        return false;
+    }
+
+    return true;
+}
+
+int main(int argc, char **argv) {
+    if (argc < 2) {
+        fprintf(stderr, "Usage: %s <fixture-dir>\n", argv[0]);
+        return 1;
+    }
+
+    const std::string fixture = argv[1];
+
+    // the converter writes next to the checkpoint, so it works on a copy
+    char tmpl[] = "/tmp/checkpoint_test.XXXXXX";
+    if (mkdtemp(tmpl) == NULL) {
+        fprintf(stderr, "%s : failed to create a temporary directory\n", __func__);
+        return 1;
+    }
+
+    const std::string root = tmpl;
+    const std::string model_dir = root + "/1L";
+
+    fprintf(stderr, "%s : copying '%s' to '%s'\n", __func__, fixture.c_str(), root.c_str());
+
+    if (mkdir(model_dir.c_str(), 0700) != 0 ||
+        !copy_file(fixture + "/tokenizer.model", root + "/tokenizer.model") ||
+        !copy_file(fixture + "/1L/params.json", model_dir + "/params.json") ||
+        !copy_file(fixture + "/1L/consolidated.00.pth", model_dir + "/consolidated.00.pth")) {
+        fprintf(stderr, "%s : failed to copy the fixture\n", __func__);
+        return 1;
+    }
+
+    int result = 0;
+
+    const struct { ggml_type type; int ftype; const char * fname; } k_types[] = {
+        { GGML_TYPE_F32, 0, "ggml-model-f32.bin" },
+        { GGML_TYPE_F16, 1, "ggml-model-f16.bin" },
+    };
+
+    for (const auto & t : k_types) {
+        if (!llama::ConvertCheckpoint(model_dir, t.type, 2)) {
+            fprintf(stderr, "%s : failed to convert to %s\n", __func__, t.fname);
+            result = 2;
+            continue;
+        }
+
+        if (!check_model(model_dir + "/" + t.fname, t.ftype)) {
+            fprintf(stderr, "%s : failed test: %s\n", __func__, t.fname);
+            result = 3;
+        }
+    }
+
+    for (const auto & t : k_types) {
+        std::remove((model_dir + "/" + t.fname).c_str());
+    }
+    std::remove((model_dir + "/consolidated.00.pth").c_str());
+    std::remove((model_dir + "/params.json").c_str());
+    std::remove((root + "/tokenizer.model").c_str());
+    rmdir(model_dir.c_str());
+    rmdir(root.c_str());
+
+    return result;
+}
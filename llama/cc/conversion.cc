@@ -0,0 +1,365 @@
+#include "conversion.h"
+
+#include <algorithm>
+#include <cinttypes>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <vector>
+
+#include <llama/cc/ggml.h>
+#include <llama/cc/utils.h>
+
+namespace llama {
+
+// tensor record of a model file; for a model of several parts shape and size
+// are the ones of the whole tensor
+struct llama_tensor_info {
+    std::string name;
+    int32_t n_dims;
+    int32_t ftype;
+    int32_t ne[2];
+    int32_t split_type;           // see llama_tensor_split_type
+    uint64_t size;                // bytes of data
+    std::vector<uint64_t> offset; // of data in each part
+};
+
+// bytes of data of a tensor record or 0 for an unknown type
+static uint64_t llama_tensor_size(int32_t ftype, int32_t const ne[2]) {
+    static const ggml_type types[] = {
+        GGML_TYPE_F32,
+        GGML_TYPE_F16,
+        GGML_TYPE_Q4_0,
+        GGML_TYPE_Q4_1,
+    };
+    if (ftype < 0 || ftype > 3) {
+        return 0;
+    }
+    const ggml_type type = types[ftype];
+    return (uint64_t)ne[0] * ne[1] / ggml_blck_size(type) *
+           ggml_type_size(type);
+}
+
+// copy n bytes between streams through a bounded buffer
+static bool llama_copy_bytes(std::ifstream &fin, std::ofstream &fout,
+                             uint64_t n, std::vector<char> &buf) {
+    while (n > 0) {
+        const size_t chunk = std::min<uint64_t>(n, buf.size());
+        fin.read(buf.data(), chunk);
+        if (!fin) {
+            return false;
+        }
+        fout.write(buf.data(), chunk);
+        n -= chunk;
+    }
+    return true;
+}
+
+// read the tensor records of a part following its vocab
+static bool llama_read_records(std::ifstream &fin, std::string const &fname,
+                               std::vector<llama_tensor_info> &tensors) {
+    while (true) {
+        llama_tensor_info info = {};
+        int32_t length;
+
+        fin.read(reinterpret_cast<char *>(&info.n_dims), sizeof(info.n_dims));
+        fin.read(reinterpret_cast<char *>(&length), sizeof(length));
+        fin.read(reinterpret_cast<char *>(&info.ftype), sizeof(info.ftype));
+
+        if (fin.eof()) {
+            return true;
+        }
+
+        if (info.n_dims < 1 || info.n_dims > 2 || length < 0) {
+            fprintf(stderr, "%s: invalid tensor record in '%s'\n", __func__,
+                    fname.c_str());
+            return false;
+        }
+
+        info.ne[0] = info.ne[1] = 1;
+        for (int i = 0; i < info.n_dims; ++i) {
+            fin.read(reinterpret_cast<char *>(&info.ne[i]),
+                     sizeof(info.ne[i]));
+        }
+
+        info.name.resize(length);
+        fin.read(&info.name[0], length);
+
+        info.size = llama_tensor_size(info.ftype, info.ne);
+        if (info.size == 0) {
+            fprintf(stderr, "%s: unknown ftype %d of tensor '%s'\n", __func__,
+                    info.ftype, info.name.c_str());
+            return false;
+        }
+
+        for (auto const &other : tensors) {
+            if (other.name == info.name) {
+                fprintf(stderr, "%s: tensor '%s' occurs twice in '%s'\n",
+                        __func__, info.name.c_str(), fname.c_str());
+                return false;
+            }
+        }
+
+        info.split_type = llama_tensor_split_type(info.name);
+        info.offset.push_back(fin.tellg());
+        fin.seekg(info.size, std::ios::cur);
+        tensors.push_back(std::move(info));
+    }
+}
+
+// write the data of a tensor of the parts: 1-d tensors are the same in every
+// part, tensors split by rows are concatenated and tensors split by columns
+// are interleaved row by row in batches of rows which fit the buffer
+static bool llama_write_tensor(std::vector<std::ifstream> &fins,
+                               std::ofstream &fout,
+                               llama_tensor_info const &info,
+                               std::vector<char> &buf) {
+    const size_t n_parts = fins.size();
+    if (n_parts == 1 || info.n_dims == 1 || info.split_type == 1) {
+        const size_t n_copy = info.n_dims == 1 ? 1 : n_parts;
+        for (size_t k = 0; k < n_copy; ++k) {
+            fins[k].clear();
+            fins[k].seekg(info.offset[k]);
+            if (!llama_copy_bytes(fins[k], fout, info.size / n_copy, buf)) {
+                return false;
+            }
+        }
+        return true;
+    }
+
+    const size_t row_size = info.size / info.ne[1];
+    const size_t part_row_size = row_size / n_parts;
+    const size_t n_batch = std::max<size_t>(1, buf.size() / row_size);
+    buf.resize(std::max(buf.size(), row_size));
+
+    for (size_t k = 0; k < n_parts; ++k) {
+        fins[k].clear();
+        fins[k].seekg(info.offset[k]);
+    }
+
+    std::vector<char> part_buf(n_batch * part_row_size);
+    for (size_t i1 = 0; i1 < (size_t)info.ne[1]; i1 += n_batch) {
+        const size_t n_rows = std::min<size_t>(n_batch, info.ne[1] - i1);
+        for (size_t k = 0; k < n_parts; ++k) {
+            fins[k].read(part_buf.data(), n_rows * part_row_size);
+            if (!fins[k]) {
+                return false;
+            }
+            for (size_t r = 0; r < n_rows; ++r) {
+                memcpy(buf.data() + r * row_size + k * part_row_size,
+                       part_buf.data() + r * part_row_size, part_row_size);
+            }
+        }
+        fout.write(buf.data(), n_rows * row_size);
+    }
+    return true;
+}
+
+bool MergeModel(std::string const &fname_inp, std::string const &fname_out,
+                bool indexed) {
+    printf("%s: reading model from '%s'\n", __func__, fname_inp.c_str());
+
+    // parts are the file and the existing fname_inp.1, fname_inp.2, ...
+    std::vector<std::string> fnames = {fname_inp};
+    while (std::ifstream(fname_inp + "." + std::to_string(fnames.size()))) {
+        fnames.push_back(fname_inp + "." + std::to_string(fnames.size()));
+    }
+    const size_t n_parts = fnames.size();
+
+    std::vector<std::ifstream> fins;
+    for (auto const &fname : fnames) {
+        fins.emplace_back(fname, std::ios::binary);
+        if (!fins.back()) {
+            fprintf(stderr, "%s: failed to open '%s' for reading\n", __func__,
+                    fname.c_str());
+            return false;
+        }
+    }
+
+    auto &finp = fins[0];
+
+    // verify magic
+    {
+        uint32_t magic;
+        finp.read((char *)&magic, sizeof(magic));
+        if (magic != FILE_MAGIC) {
+            fprintf(stderr, "%s: invalid model file '%s' (bad magic)\n",
+                    __func__, fname_inp.c_str());
+            return false;
+        }
+
+        uint32_t format_version;
+        finp.read((char *)&format_version, sizeof(format_version));
+        if (format_version != FILE_VERSION) {
+            fprintf(stderr,
+                    "%s: invalid model file '%s' (unsupported format version "
+                    "%" PRIu32 ", expected %d)\n",
+                    __func__, fname_inp.c_str(), format_version, FILE_VERSION);
+            return false;
+        }
+    }
+
+    // hyperparameters and vocab are copied as they are
+    std::vector<char> head;
+    {
+        int32_t hparams[7]; // n_vocab, n_embd, n_mult, n_head, n_layer, n_rot,
+                            // f16
+        finp.read((char *)hparams, sizeof(hparams));
+
+        const char *p = (const char *)hparams;
+        head.insert(head.end(), p, p + sizeof(hparams));
+
+        for (int i = 0; i < hparams[0] && finp; i++) {
+            uint32_t len;
+            finp.read((char *)&len, sizeof(len));
+
+            const size_t pos = head.size();
+            head.resize(pos + sizeof(len) + len + sizeof(float));
+            memcpy(head.data() + pos, &len, sizeof(len));
+            finp.read(head.data() + pos + sizeof(len), len + sizeof(float));
+        }
+
+        if (!finp) {
+            fprintf(stderr, "%s: invalid model file '%s' (truncated vocab)\n",
+                    __func__, fname_inp.c_str());
+            return false;
+        }
+    }
+
+    // the first pass collects the tensor records of all parts, which share
+    // the head and hold equal slices of the same tensors in the same order
+    std::vector<llama_tensor_info> tensors;
+    for (size_t k = 0; k < n_parts; ++k) {
+        fins[k].seekg(2 * sizeof(uint32_t) + head.size());
+
+        std::vector<llama_tensor_info> part;
+        if (!llama_read_records(fins[k], fnames[k], part)) {
+            return false;
+        }
+
+        if (k == 0) {
+            tensors = std::move(part);
+            continue;
+        }
+
+        bool same = part.size() == tensors.size();
+        for (size_t i = 0; same && i < part.size(); ++i) {
+            same = part[i].name == tensors[i].name &&
+                   part[i].ftype == tensors[i].ftype &&
+                   part[i].n_dims == tensors[i].n_dims &&
+                   part[i].ne[0] == tensors[i].ne[0] &&
+                   part[i].ne[1] == tensors[i].ne[1];
+            if (same) {
+                tensors[i].offset.push_back(part[i].offset[0]);
+            }
+        }
+        if (!same) {
+            fprintf(stderr, "%s: tensors of part '%s' differ from '%s'\n",
+                    __func__, fnames[k].c_str(), fname_inp.c_str());
+            return false;
+        }
+    }
+
+    // shapes of whole tensors
+    for (auto &info : tensors) {
+        if (info.n_dims == 2) {
+            info.ne[info.split_type == 0 ? 0 : 1] *= n_parts;
+            info.size *= n_parts;
+        }
+    }
+
+    const uint32_t n_tensors = tensors.size();
+    const uint32_t alignment = FILE_ALIGNMENT;
+
+    // lay out the directory and the aligned data after the head
+    std::vector<uint64_t> offsets(n_tensors);
+    if (indexed) {
+        uint64_t offset = 2 * sizeof(uint32_t) + head.size() +
+                          2 * sizeof(uint32_t);
+        for (auto const &info : tensors) {
+            offset += 3 * sizeof(int32_t) + info.n_dims * sizeof(int32_t) +
+                      info.name.size() + sizeof(uint64_t);
+        }
+        for (uint32_t i = 0; i < n_tensors; ++i) {
+            offset = (offset + alignment - 1) / alignment * alignment;
+            offsets[i] = offset;
+            offset += tensors[i].size;
+        }
+    }
+
+    auto fout = std::ofstream(fname_out, std::ios::binary);
+    if (!fout) {
+        fprintf(stderr, "%s: failed to open '%s' for writing\n", __func__,
+                fname_out.c_str());
+        return false;
+    }
+
+    const uint32_t magic = FILE_MAGIC;
+    const uint32_t format_version =
+        indexed ? FILE_VERSION_INDEXED : FILE_VERSION;
+    fout.write((const char *)&magic, sizeof(magic));
+    fout.write((const char *)&format_version, sizeof(format_version));
+    fout.write(head.data(), head.size());
+
+    // a record of an indexed file is a directory entry with the offset of its
+    // data, otherwise the data follows it
+    auto write_record = [&](llama_tensor_info const &info) {
+        const int32_t length = info.name.size();
+        fout.write((const char *)&info.n_dims, sizeof(info.n_dims));
+        fout.write((const char *)&length, sizeof(length));
+        fout.write((const char *)&info.ftype, sizeof(info.ftype));
+        fout.write((const char *)info.ne, info.n_dims * sizeof(int32_t));
+        fout.write(info.name.data(), length);
+    };
+
+    if (indexed) {
+        fout.write((const char *)&n_tensors, sizeof(n_tensors));
+        fout.write((const char *)&alignment, sizeof(alignment));
+        for (uint32_t i = 0; i < n_tensors; ++i) {
+            write_record(tensors[i]);
+            fout.write((const char *)&offsets[i], sizeof(offsets[i]));
+        }
+    }
+
+    // the second pass copies the data with a bounded buffer
+    std::vector<char> buf(4 * 1024 * 1024);
+    uint64_t total_size = 0;
+    for (uint32_t i = 0; i < n_tensors; ++i) {
+        auto const &info = tensors[i];
+
+        if (indexed) {
+            const uint64_t pos = fout.tellp();
+            std::fill(buf.begin(), buf.begin() + (offsets[i] - pos), 0);
+            fout.write(buf.data(), offsets[i] - pos);
+        } else {
+            write_record(info);
+        }
+
+        if (!llama_write_tensor(fins, fout, info, buf)) {
+            fprintf(stderr, "%s: tensor '%s' is truncated in '%s'\n", __func__,
+                    info.name.c_str(), fname_inp.c_str());
+            return false;
+        }
+
+        printf("%48s - [%5d, %5d], split = %d\n", info.name.c_str(),
+               info.ne[0], info.ne[1], info.split_type);
+        total_size += info.size;
+    }
+
+    if (!fout) {
+        fprintf(stderr, "%s: failed to write '%s'\n", __func__,
+                fname_out.c_str());
+        return false;
+    }
+
+    printf("%s: %zu parts, %u tensors, %8.2f MB\n", __func__, n_parts,
+           n_tensors, total_size / 1024.0 / 1024.0);
+
+    return true;
+}
+
+bool ConvertModel(std::string const &fname_inp, std::string const &fname_out) {
+    return MergeModel(fname_inp, fname_out, true);
+}
+
+} // namespace llama
@@ -0,0 +1,29 @@
+#pragma once
+
+#include <string>
+
+namespace llama {
+
+/**
+ * Merge the parts of a model file (FILE_VERSION) into a single-part file:
+ * parts are the file itself and the existing fname_inp.1, fname_inp.2, ...
+ * Tensors split by columns or rows are reassembled once, streaming with a
+ * bounded buffer, so that loading the result needs no reassembly.
+ *
+ * @param[in] fname_inp Path to the first part.
+ * @param[in] fname_out Path to the merged file.
+ * @param[in] indexed   Write an indexed file (FILE_VERSION_INDEXED) instead
+ *                      of a sequence of tensor records.
+ */
+bool MergeModel(std::string const &fname_inp, std::string const &fname_out,
+                bool indexed = false);
+
+/**
+ * Convert a model file (FILE_VERSION) to an indexed one
+ * (FILE_VERSION_INDEXED): hyperparameters and vocab are copied, followed by a
+ * directory of the tensors and their data at aligned offsets. Parts are
+ * merged as by MergeModel.
+ */
+bool ConvertModel(std::string const &fname_inp, std::string const &fname_out);
+
+} // namespace llama
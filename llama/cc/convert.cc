@@ -0,0 +1,29 @@
+#include <cstdio>
+#include <string>
+
+#include <llama/cc/conversion.h>
+#include <llama/cc/ggml.h>
+
+int main(int argc, char ** argv) {
+    ggml_time_init();
+    if (argc != 3) {
+        fprintf(stderr, "usage: %s model.bin model-indexed.bin\n", argv[0]);
+        fprintf(stderr, "  converts a single-part model file to the indexed format\n");
+        return 1;
+    }
+
+    const std::string fname_inp = argv[1];
+    const std::string fname_out = argv[2];
+
+    const int64_t t_start_us = ggml_time_us();
+
+    if (!llama::ConvertModel(fname_inp, fname_out)) {
+        fprintf(stderr, "%s: failed to convert model from '%s'\n", __func__, fname_inp.c_str());
+        return 1;
+    }
+
+    printf("\n");
+    printf("%s: convert time = %8.2f ms\n", __func__, (ggml_time_us() - t_start_us)/1000.0f);
+
+    return 0;
+}
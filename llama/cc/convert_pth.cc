@@ -0,0 +1,44 @@
+#include <cstdio>
+#include <cstdlib>
+#include <string>
+
+#include <llama/cc/checkpoint.h>
+#include <llama/cc/ggml.h>
+
+int main(int argc, char ** argv) {
+    ggml_time_init();
+    if (argc < 2 || argc > 4) {
+        fprintf(stderr, "usage: %s model_dir [type] [n_threads]\n", argv[0]);
+        fprintf(stderr, "  converts model_dir/consolidated.XX.pth to model_dir/ggml-model-<type>.bin\n");
+        fprintf(stderr, "  type = f32, f16 (default), q4_0, q4_1\n");
+        return 1;
+    }
+
+    const std::string model_dir = argv[1];
+    const std::string type = argc > 2 ? argv[2] : "f16";
+    const int n_threads = argc > 3 ? atoi(argv[3]) : 0;
+
+    ggml_type dtype = GGML_TYPE_F16;
+    if (type == "f32") {
+        dtype = GGML_TYPE_F32;
+    } else if (type == "q4_0") {
+        dtype = GGML_TYPE_Q4_0;
+    } else if (type == "q4_1") {
+        dtype = GGML_TYPE_Q4_1;
+    } else if (type != "f16") {
+        fprintf(stderr, "%s: invalid type '%s'\n", __func__, type.c_str());
+        return 1;
+    }
+
+    const int64_t t_start_us = ggml_time_us();
+
+    if (!llama::ConvertCheckpoint(model_dir, dtype, n_threads)) {
+        fprintf(stderr, "%s: failed to convert checkpoint in '%s'\n", __func__, model_dir.c_str());
+        return 1;
+    }
+
+    printf("\n");
+    printf("%s: convert time = %8.2f ms\n", __func__, (ggml_time_us() - t_start_us)/1000.0f);
+
+    return 0;
+}
@@ -1,3 +1,7 @@
+#if defined(__linux__)
+#define _GNU_SOURCE // pthread_setaffinity_np
+#endif
+
 #include "ggml.h"
 
 #if defined(_MSC_VER) || defined(__MINGW32__)
@@ -72,6 +76,11 @@ static int sched_yield (void) {
 #else
 #include <pthread.h>
 #include <stdatomic.h>
+#if defined(__linux__)
+#include <sched.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
 
 typedef void* thread_ret_t;
 #endif
@@ -720,6 +729,62 @@ void dequantize_row_q4_1(const void * restrict x, float * restrict y, int k) {
     }
 }
 
+// method 6
+// blocks of QK elements
+// represented with a single float (delta) and QK 8-bit signed integer factors
+// used for the KV cache, where 4 bits lose too much of the attention signal
+void quantize_row_q8_0(const float * restrict x, void * restrict y, int k) {
+    assert(k % QK == 0);
+
+    const int nb = k / QK;
+    const size_t bs = sizeof(float) + QK;
+
+    uint8_t * restrict pd = ((uint8_t *)y + 0*bs);
+    int8_t  * restrict pb = ((int8_t  *)y + 0*bs + sizeof(float));
+
+    for (int i = 0; i < nb; i++) {
+        float amax = 0.0f; // absolute max
+
+        for (int l = 0; l < QK; l++) {
+            const float v = x[i*QK + l];
+            amax = MAX(amax, fabsf(v));
+        }
+
+        const float d = amax / ((1 << 7) - 1);
+        const float id = d ? 1.0f/d : 0.0f;
+
+        *(float *)pd = d;
+        pd += bs;
+
+        for (int l = 0; l < QK; l++) {
+            const float v = x[i*QK + l]*id;
+            pb[l] = roundf(v);
+        }
+
+        pb += bs;
+    }
+}
+
+void dequantize_row_q8_0(const void * restrict x, float * restrict y, int k) {
+    assert(k % QK == 0);
+
+    const int nb = k / QK;
+    const size_t bs = sizeof(float) + QK;
+
+    const uint8_t * restrict pd = ((const uint8_t *)x + 0*bs);
+    const int8_t  * restrict pb = ((const int8_t  *)x + 0*bs + sizeof(float));
+
+    for (int i = 0; i < nb; i++) {
+        const float d = *(const float *) (pd + i*bs);
+
+        const int8_t * restrict pp = pb + i*bs;
+
+        for (int l = 0; l < QK; l++) {
+            y[i*QK + l] = pp[l]*d;
+        }
+    }
+}
+
 //
 // simd mappings
 //
@@ -1785,6 +1850,174 @@ inline static void ggml_vec_dot_q4_1(const int n, float * restrict s, const void
     *s = sumf;
 }
 
+inline static void ggml_vec_dot_q8_0(const int n, float * restrict s, const void * restrict x, const void * restrict y) {
+    const int nb = n / QK;
+
+    assert(n % QK == 0);
+
+    const size_t bs = sizeof(float) + QK;
+
+    const uint8_t * restrict pd0 = ((const uint8_t *)x + 0*bs);
+    const uint8_t * restrict pd1 = ((const uint8_t *)y + 0*bs);
+
+    const int8_t * restrict pb0 = ((const int8_t *)x + 0*bs + sizeof(float));
+    const int8_t * restrict pb1 = ((const int8_t *)y + 0*bs + sizeof(float));
+
+    float sumf = 0.0;
+
+#if defined(__AVX2__)
+#if QK == 32
+    // Initialize accumulator with zeros
+    __m256 acc = _mm256_setzero_ps();
+
+    for (int i = 0; i < nb; ++i) {
+        const float * d0 = (const float *) (pd0 + i*bs);
+        const float * d1 = (const float *) (pd1 + i*bs);
+
+        // Compute combined scale for the block
+        const __m256 scale = _mm256_mul_ps( _mm256_broadcast_ss( d0 ), _mm256_broadcast_ss( d1 ) );
+
+        const __m256i bx = _mm256_loadu_si256( (const __m256i *) (pb0 + i*bs) );
+        const __m256i by = _mm256_loadu_si256( (const __m256i *) (pb1 + i*bs) );
+
+        // maddubs wants unsigned x signed: move the sign of x onto y
+        // the factors are in [ -127 .. +127 ], so the int16_t pair sums cannot saturate
+        const __m256i ax = _mm256_sign_epi8( bx, bx );
+        const __m256i sy = _mm256_sign_epi8( by, bx );
+
+        const __m256i i16 = _mm256_maddubs_epi16( ax, sy );
+        const __m256i i32 = _mm256_madd_epi16( i16, _mm256_set1_epi16( 1 ) );
+
+        // Convert int32_t to float, apply the scale, and accumulate
+        acc = _mm256_fmadd_ps( scale, _mm256_cvtepi32_ps( i32 ), acc );
+    }
+
+    // Return horizontal sum of the acc vector
+    __m128 res = _mm256_extractf128_ps( acc, 1 );
+    res = _mm_add_ps( res, _mm256_castps256_ps128( acc ) );
+    res = _mm_add_ps( res, _mm_movehl_ps( res, res ) );
+    res = _mm_add_ss( res, _mm_movehdup_ps( res ) );
+
+    sumf = _mm_cvtss_f32( res );
+#else
+#error "not implemented for QK"
+#endif
+#else
+    // scalar
+    for (int i = 0; i < nb; i++) {
+        const float d0 = *(const float *) (pd0 + i*bs);
+        const float d1 = *(const float *) (pd1 + i*bs);
+
+        const int8_t * restrict p0 = pb0 + i*bs;
+        const int8_t * restrict p1 = pb1 + i*bs;
+
+        int sumi = 0;
+        for (int j = 0; j < QK; j++) {
+            sumi += p0[j]*p1[j];
+        }
+
+        sumf += d0*d1*sumi;
+    }
+#endif
+
+    *s = sumf;
+}
+
+// dot products of nr (4 or 8) rows of Q4_0 with the blocks interleaved (GGML_TYPE_Q4_0_R4/R8) with a Q4_0
+// row y: block i of the group holds the nr deltas followed by the nr nibble arrays, so each block of y
+// is unpacked once for all rows; each row is summed in the same order as by ggml_vec_dot_q4_0 on AVX2 or
+// scalar builds (AVX-512 builds of ggml_vec_dot_q4_0 accumulate in another order, so the last bits differ)
+inline static void ggml_vec_dot_q4_0_r(const int n, const int nr, float * restrict s, const void * restrict x, const void * restrict y) {
+    const int nb = n / QK;
+
+    assert(n % QK == 0);
+    assert(nr <= 8);
+
+    const size_t bs = sizeof(float) + QK/2;
+
+    const uint8_t * restrict pg0 = (const uint8_t *) x;
+    const uint8_t * restrict pd1 = ((const uint8_t *)y + 0*bs);
+    const uint8_t * restrict pb1 = ((const uint8_t *)y + 0*bs + sizeof(float));
+
+#if defined(__AVX2__)
+#if QK == 32
+    // Initialize accumulators with zeros
+    __m256 acc[8];
+    for (int r = 0; r < nr; ++r) {
+        acc[r] = _mm256_setzero_ps();
+    }
+
+    const __m256i off = _mm256_set1_epi8( 8 );
+
+    for (int i = 0; i < nb; ++i) {
+        const float   * restrict d0 = (const float *) (pg0 + i*nr*bs);
+        const uint8_t * restrict p0 = pg0 + i*nr*bs + nr*sizeof(float);
+
+        const float * d1 = (const float *) (pd1 + i*bs);
+
+        // Unpack the block of y into int16_t once for all rows
+        const __m256i by = _mm256_sub_epi8( bytesFromNibbles( pb1 + i*bs ), off );
+
+        const __m256i y16_0 = _mm256_cvtepi8_epi16( _mm256_castsi256_si128( by ) );
+        const __m256i y16_1 = _mm256_cvtepi8_epi16( _mm256_extracti128_si256( by, 1 ) );
+
+        const __m256 dy = _mm256_broadcast_ss( d1 );
+
+        for (int r = 0; r < nr; ++r) {
+            const __m256i bx = _mm256_sub_epi8( bytesFromNibbles( p0 + r*QK/2 ), off );
+
+            __m256i i32 = _mm256_madd_epi16( _mm256_cvtepi8_epi16( _mm256_castsi256_si128( bx ) ), y16_0 );
+            i32 = _mm256_add_epi32( i32, _mm256_madd_epi16( _mm256_cvtepi8_epi16( _mm256_extracti128_si256( bx, 1 ) ), y16_1 ) );
+
+            const __m256 scale = _mm256_mul_ps( _mm256_broadcast_ss( d0 + r ), dy );
+
+            acc[r] = _mm256_fmadd_ps( scale, _mm256_cvtepi32_ps( i32 ), acc[r] );
+        }
+    }
+
+    // Return horizontal sums of the acc vectors
+    for (int r = 0; r < nr; ++r) {
+        __m128 res = _mm256_extractf128_ps( acc[r], 1 );
+        res = _mm_add_ps( res, _mm256_castps256_ps128( acc[r] ) );
+        res = _mm_add_ps( res, _mm_movehl_ps( res, res ) );
+        res = _mm_add_ss( res, _mm_movehdup_ps( res ) );
+
+        s[r] = _mm_cvtss_f32( res );
+    }
+#else
+#error "not implemented for QK"
+#endif
+#else
+    // scalar
+    for (int r = 0; r < nr; ++r) {
+        float sumf = 0.0;
+
+        for (int i = 0; i < nb; i++) {
+            const float d0 = ((const float *) (pg0 + i*nr*bs))[r];
+            const float d1 = *(const float *) (pd1 + i*bs);
+
+            const uint8_t * restrict p0 = pg0 + i*nr*bs + nr*sizeof(float) + r*QK/2;
+            const uint8_t * restrict p1 = pb1 + i*bs;
+
+            for (int j = 0; j < QK/2; j++) {
+                const uint8_t v0 = p0[j];
+                const uint8_t v1 = p1[j];
+
+                const float f0 = d0*((int8_t) (v0 & 0xf) - 8);
+                const float f1 = d0*((int8_t) (v0 >> 4)  - 8);
+
+                const float f2 = d1*((int8_t) (v1 & 0xf) - 8);
+                const float f3 = d1*((int8_t) (v1 >> 4)  - 8);
+
+                sumf += f0*f2 + f1*f3;
+            }
+        }
+
+        s[r] = sumf;
+    }
+#endif
+}
+
 // compute GGML_VEC_DOT_UNROLL dot products at once
 // xs - x row stride in bytes
 inline static void ggml_vec_dot_f16_unroll(const int n, const int xs, float * restrict s, void * restrict xv, ggml_fp16_t * restrict y) {
@@ -2032,6 +2265,47 @@ inline static void ggml_vec_mad_q4_1(const int n, float * restrict y, void * res
     }
 }
 
+inline static void ggml_vec_mad_q8_0(const int n, float * restrict y, void * restrict x, const float v) {
+    assert(n % QK == 0);
+
+    const int nb = n / QK;
+    const size_t bs = sizeof(float) + QK;
+
+    const uint8_t * restrict pd = ((const uint8_t *)x + 0*bs);
+    const int8_t  * restrict pb = ((const int8_t  *)x + 0*bs + sizeof(float));
+
+#if defined(__AVX2__)
+#if QK == 32
+    for (int i = 0; i < nb; i++) {
+        const __m256 vd = _mm256_set1_ps( v*(*(const float *) (pd + i*bs)) );
+
+        const int8_t * restrict pp = pb + i*bs;
+
+        for (int j = 0; j < QK; j += 8) {
+            // Sign-extend 8 bytes into int32_t and convert to float
+            const __m256i vi = _mm256_cvtepi8_epi32( _mm_loadl_epi64( (const __m128i *) (pp + j) ) );
+            const __m256  vx = _mm256_cvtepi32_ps( vi );
+
+            _mm256_storeu_ps( y + i*QK + j, _mm256_fmadd_ps( vx, vd, _mm256_loadu_ps( y + i*QK + j ) ) );
+        }
+    }
+#else
+#error "not implemented for QK"
+#endif
+#else
+    // scalar
+    for (int i = 0; i < nb; i++) {
+        const float d = v*(*(const float *) (pd + i*bs));
+
+        const int8_t * restrict pp = pb + i*bs;
+
+        for (int l = 0; l < QK; l++) {
+            y[i*QK + l] += pp[l]*d;
+        }
+    }
+#endif
+}
+
 //inline static void ggml_vec_scale_f32(const int n, float * y, const float   v) { for (int i = 0; i < n; ++i) y[i] *= v;          }
 inline static void ggml_vec_scale_f32(const int n, float * y, const float   v) {
 #if defined(GGML_SIMD)
@@ -2192,9 +2466,12 @@ static const int GGML_BLCK_SIZE[GGML_TYPE_COUNT] = {
     1,
     1,
     1,
+    QK,
+    QK,
+    QK,
 };
 
-static_assert(GGML_TYPE_COUNT == 7, "GGML_TYPE_COUNT != 5");
+static_assert(GGML_TYPE_COUNT == 10, "GGML_TYPE_COUNT != 10");
 
 static const size_t GGML_TYPE_SIZE[GGML_TYPE_COUNT] = {
     sizeof(float  )   + QK/2,
@@ -2204,10 +2481,13 @@ static const size_t GGML_TYPE_SIZE[GGML_TYPE_COUNT] = {
     sizeof(int32_t),
     sizeof(ggml_fp16_t),
     sizeof(float  ),
+    sizeof(float  )   + QK,
+    sizeof(float  )   + QK/2,
+    sizeof(float  )   + QK/2,
 };
 
 // don't forget to update the array above when adding new types
-static_assert(GGML_TYPE_COUNT == 7, "GGML_TYPE_COUNT != 5");
+static_assert(GGML_TYPE_COUNT == 10, "GGML_TYPE_COUNT != 10");
 
 static const char * GGML_OP_LABEL[GGML_OP_COUNT] = {
     "NONE",
@@ -2233,6 +2513,7 @@ static const char * GGML_OP_LABEL[GGML_OP_COUNT] = {
     "RMS_NORM",
 
     "MUL_MAT",
+    "SWIGLU",
 
     "SCALE",
     "CPY",
@@ -2241,6 +2522,7 @@ static const char * GGML_OP_LABEL[GGML_OP_COUNT] = {
     "PERMUTE",
     "TRANSPOSE",
     "GET_ROWS",
+    "SET_ROWS",
     "DIAG_MASK_INF",
     "SOFT_MAX",
     "ROPE",
@@ -2251,7 +2533,7 @@ static const char * GGML_OP_LABEL[GGML_OP_COUNT] = {
     "FLASH_FF",
 };
 
-static_assert(GGML_OP_COUNT == 35, "GGML_OP_COUNT != 35");
+static_assert(GGML_OP_COUNT == 37, "GGML_OP_COUNT != 37");
 
 static const char * GGML_OP_SYMBOL[GGML_OP_COUNT] = {
     "none",
@@ -2277,6 +2559,7 @@ static const char * GGML_OP_SYMBOL[GGML_OP_COUNT] = {
     "rms_norm(x)",
 
     "X*Y",
+    "swiglu(X,Y)",
 
     "x*v",
     "x-\\>y",
@@ -2285,6 +2568,7 @@ static const char * GGML_OP_SYMBOL[GGML_OP_COUNT] = {
     "permute(x)",
     "transpose(x)",
     "get_rows(x)",
+    "set_rows(x)",
     "diag_mask_inf(x)",
     "soft_max(x)",
     "rope(x)",
@@ -2295,7 +2579,7 @@ static const char * GGML_OP_SYMBOL[GGML_OP_COUNT] = {
     "flash_ff(x)",
 };
 
-static_assert(GGML_OP_COUNT == 35, "GGML_OP_COUNT != 35");
+static_assert(GGML_OP_COUNT == 37, "GGML_OP_COUNT != 37");
 
 //
 // ggml object
@@ -2389,88 +2673,505 @@ inline static void ggml_critical_section_end(void) {
     atomic_fetch_sub(&g_state_barrier, 1);
 }
 
-////////////////////////////////////////////////////////////////////////////////
+//
+// NUMA
+//
 
-void ggml_print_object(const struct ggml_object * obj) {
-    GGML_PRINT(" - ggml_object: offset = %zu, size = %zu, next = %p\n",
-            obj->offs, obj->size, (const void *) obj->next);
-}
+#define GGML_NUMA_MAX_NODES   16
+#define GGML_NUMA_MAX_NODE_ID 256
+#define GGML_NUMA_MAX_CPUS    512
 
-void ggml_print_objects(const struct ggml_context * ctx) {
-    struct ggml_object * obj = ctx->objects_begin;
+// memory policy of mbind(2)
+#define GGML_MPOL_PREFERRED 1
+#define GGML_MPOL_MF_MOVE   (1 << 1)
 
-    GGML_PRINT("%s: objects in context %p:\n", __func__, (const void *) ctx);
+struct ggml_numa_node {
+    int id; // node number of the system
+    int n_cpus;
+    int cpus[GGML_NUMA_MAX_CPUS];
+};
 
-    while (obj != NULL) {
-        ggml_print_object(obj);
-        obj = obj->next;
+struct ggml_numa_state {
+    int n_nodes; // 0 unless the host has more than one node with cpus
+    struct ggml_numa_node nodes[GGML_NUMA_MAX_NODES];
+};
+
+static struct ggml_numa_state g_numa;
+
+bool ggml_numa_init(void) {
+#if defined(__linux__)
+    if (g_numa.n_nodes > 0) {
+        return true;
     }
 
-    GGML_PRINT("%s: --- end ---\n", __func__);
-}
+    int n_nodes = 0;
+    for (int id = 0; id < GGML_NUMA_MAX_NODE_ID && n_nodes < GGML_NUMA_MAX_NODES; id++) {
+        char path[64];
+        snprintf(path, sizeof(path), "/sys/devices/system/node/node%d/cpulist", id);
 
-int ggml_nelements(const struct ggml_tensor * tensor) {
-    static_assert(GGML_MAX_DIMS == 4, "GGML_MAX_DIMS is not 4 - update this function");
+        FILE * f = fopen(path, "r");
+        if (!f) {
+            continue;
+        }
 
-    return tensor->ne[0]*tensor->ne[1]*tensor->ne[2]*tensor->ne[3];
-}
+        struct ggml_numa_node * node = &g_numa.nodes[n_nodes];
+        node->id = id;
+        node->n_cpus = 0;
 
-int ggml_nrows(const struct ggml_tensor * tensor) {
-    static_assert(GGML_MAX_DIMS == 4, "GGML_MAX_DIMS is not 4 - update this function");
+        // ranges of cpus, e.g. 0-15,32-47
+        int cpu0;
+        while (fscanf(f, "%d", &cpu0) == 1) {
+            int cpu1 = cpu0;
+            int c = fgetc(f);
+            if (c == '-') {
+                if (fscanf(f, "%d", &cpu1) != 1) {
+                    break;
+                }
+                c = fgetc(f);
+            }
+            for (int cpu = cpu0; cpu <= cpu1 && node->n_cpus < GGML_NUMA_MAX_CPUS; cpu++) {
+                node->cpus[node->n_cpus++] = cpu;
+            }
+            if (c != ',') {
+                break;
+            }
+        }
+        fclose(f);
 
-    return tensor->ne[1]*tensor->ne[2]*tensor->ne[3];
-}
+        // nodes of memory only do not get threads
+        if (node->n_cpus > 0) {
+            n_nodes++;
+        }
+    }
 
-size_t ggml_nbytes(const struct ggml_tensor * tensor) {
-    static_assert(GGML_MAX_DIMS == 4, "GGML_MAX_DIMS is not 4 - update this function");
+    g_numa.n_nodes = n_nodes > 1 ? n_nodes : 0;
+#endif
 
-    return (ggml_nelements(tensor)*GGML_TYPE_SIZE[tensor->type])/GGML_BLCK_SIZE[tensor->type];
+    return g_numa.n_nodes > 1;
 }
 
-int ggml_blck_size(enum ggml_type type) {
-    return GGML_BLCK_SIZE[type];
+int ggml_numa_n_nodes(void) {
+    return g_numa.n_nodes;
 }
 
-size_t ggml_type_size(enum ggml_type type) {
-    return GGML_TYPE_SIZE[type];
+// threads are split across the nodes when there are enough of them
+inline static bool ggml_numa_active(int nth) {
+    return g_numa.n_nodes > 1 && nth >= g_numa.n_nodes;
 }
 
-float ggml_type_sizef(enum ggml_type type) {
-    return ((float)(GGML_TYPE_SIZE[type]))/GGML_BLCK_SIZE[type];
-}
+// node of thread ith of nth: node k runs threads [nth*k/n_nodes, nth*(k + 1)/n_nodes)
+static int ggml_numa_node_of_thread(int ith, int nth) {
+    const int n_nodes = g_numa.n_nodes;
 
-size_t ggml_element_size(const struct ggml_tensor * tensor) {
-    return GGML_TYPE_SIZE[tensor->type];
+    int k = 0;
+    while (k < n_nodes - 1 && (nth*(k + 1))/n_nodes <= ith) {
+        k++;
+    }
+
+    return k;
 }
 
-static inline bool ggml_is_scalar(const struct ggml_tensor * tensor) {
-    static_assert(GGML_MAX_DIMS == 4, "GGML_MAX_DIMS is not 4 - update this function");
+// rows [ir0, ir1) of nr computed by thread ith of nth: with NUMA the rows are
+// split across the nodes in proportion first (see ggml_numa_place_rows) and
+// then across the threads of each node
+static void ggml_thread_rows(int nr, int ith, int nth, int * ir0, int * ir1) {
+    int r0 = 0;
+    int r1 = nr;
+    int t0 = 0;
+    int t1 = nth;
 
-    return tensor->ne[0] == 1 && tensor->ne[1] == 1 && tensor->ne[2] == 1 && tensor->ne[3] == 1;
-}
+    if (ggml_numa_active(nth)) {
+        const int n_nodes = g_numa.n_nodes;
+        const int k = ggml_numa_node_of_thread(ith, nth);
 
-static inline bool ggml_is_vector(const struct ggml_tensor * tensor) {
-    static_assert(GGML_MAX_DIMS == 4, "GGML_MAX_DIMS is not 4 - update this function");
+        r0 = (int) (((int64_t) nr*k)/n_nodes);
+        r1 = (int) (((int64_t) nr*(k + 1))/n_nodes);
+        t0 = (nth*k)/n_nodes;
+        t1 = (nth*(k + 1))/n_nodes;
+    }
 
-    return tensor->ne[1] == 1 && tensor->ne[2] == 1 && tensor->ne[3] == 1;
+    // rows per thread
+    const int dr = (r1 - r0 + (t1 - t0) - 1)/(t1 - t0);
+
+    *ir0 = MIN(r0 + dr*(ith - t0), r1);
+    *ir1 = MIN(*ir0 + dr, r1);
 }
 
-static inline bool ggml_is_matrix(const struct ggml_tensor * tensor) {
-    static_assert(GGML_MAX_DIMS == 4, "GGML_MAX_DIMS is not 4 - update this function");
+#if defined(__linux__)
+typedef cpu_set_t ggml_cpu_set_t;
+#else
+typedef int ggml_cpu_set_t;
+#endif
 
-    return tensor->ne[2] == 1 && tensor->ne[3] == 1;
-}
+// pin the calling thread to a core of the node of thread ith of nth, among the
+// cores it is allowed to run on; the affinity it had is stored in prev (if not
+// NULL) when it is pinned. returns false if the thread is not pinned
+static bool ggml_numa_pin_thread(int ith, int nth, ggml_cpu_set_t * prev) {
+#if defined(__linux__)
+    if (!ggml_numa_active(nth)) {
+        return false;
+    }
 
-static inline bool ggml_can_mul_mat(const struct ggml_tensor * t0, const struct ggml_tensor * t1) {
-    static_assert(GGML_MAX_DIMS == 4, "GGML_MAX_DIMS is not 4 - update this function");
+    static atomic_int warned = 0;
 
-    return
-        (t0->ne[0]  == t1->ne[0])  &&
-        (t0->ne[2]  == t1->ne[2])  &&
-        (t0->ne[3]  == t1->ne[3]);
-}
+    const int n_nodes = g_numa.n_nodes;
+    const int k = ggml_numa_node_of_thread(ith, nth);
+    const struct ggml_numa_node * node = &g_numa.nodes[k];
 
-static inline bool ggml_is_contiguous(const struct ggml_tensor * tensor) {
+    cpu_set_t allowed;
+    if (pthread_getaffinity_np(pthread_self(), sizeof(allowed), &allowed) != 0) {
+        return false;
+    }
+
+    int cpus[GGML_NUMA_MAX_CPUS];
+    int n_cpus = 0;
+    for (int i = 0; i < node->n_cpus; i++) {
+        if (node->cpus[i] < CPU_SETSIZE && CPU_ISSET(node->cpus[i], &allowed)) {
+            cpus[n_cpus++] = node->cpus[i];
+        }
+    }
+
+    if (n_cpus == 0) {
+        if (atomic_fetch_add(&warned, 1) == 0) {
+            fprintf(stderr, "%s: no allowed cpu on node %d, threads are not pinned\n", __func__, node->id);
+        }
+        return false;
+    }
+
+    cpu_set_t cpus_thread;
+    CPU_ZERO(&cpus_thread);
+    CPU_SET(cpus[(ith - (nth*k)/n_nodes) % n_cpus], &cpus_thread);
+
+    const int rc = pthread_setaffinity_np(pthread_self(), sizeof(cpus_thread), &cpus_thread);
+    if (rc != 0) {
+        if (atomic_fetch_add(&warned, 1) == 0) {
+            fprintf(stderr, "%s: failed to pin thread %d to node %d: %s\n", __func__, ith, node->id, strerror(rc));
+        }
+        return false;
+    }
+
+    if (prev) {
+        *prev = allowed;
+    }
+
+    return true;
+#else
+    UNUSED(ith);
+    UNUSED(nth);
+    UNUSED(prev);
+
+    return false;
+#endif
+}
+
+// give the calling thread back the affinity stored by ggml_numa_pin_thread
+static void ggml_numa_unpin_thread(const ggml_cpu_set_t * prev) {
+#if defined(__linux__)
+    pthread_setaffinity_np(pthread_self(), sizeof(*prev), prev);
+#else
+    UNUSED(prev);
+#endif
+}
+
+bool ggml_numa_place_rows(struct ggml_tensor * tensor, size_t page_size) {
+    if (g_numa.n_nodes < 2) {
+        return false;
+    }
+
+#if defined(__linux__)
+    const int64_t nr = tensor->ne[1]*tensor->ne[2]*tensor->ne[3];
+    const size_t row_size = ggml_nbytes(tensor)/nr;
+    const int n_nodes = g_numa.n_nodes;
+
+    // a page straddling two nodes goes to the latter one
+    uintptr_t begin = ((uintptr_t) tensor->data + page_size - 1)/page_size*page_size;
+    for (int k = 0; k < n_nodes; k++) {
+        const uintptr_t end_row = (uintptr_t) tensor->data + row_size*((nr*(k + 1))/n_nodes);
+        const uintptr_t end = (end_row + page_size - 1)/page_size*page_size;
+        if (begin >= end) {
+            continue;
+        }
+
+        unsigned long mask[GGML_NUMA_MAX_NODE_ID/(8*sizeof(unsigned long))] = { 0 };
+        const int id = g_numa.nodes[k].id;
+        mask[id/(8*sizeof(unsigned long))] |= 1UL << (id%(8*sizeof(unsigned long)));
+
+        if (syscall(SYS_mbind, (void *) begin, end - begin, GGML_MPOL_PREFERRED,
+                    mask, GGML_NUMA_MAX_NODE_ID + 1, GGML_MPOL_MF_MOVE) != 0) {
+            return false;
+        }
+
+        begin = end;
+    }
+
+    return true;
+#else
+    UNUSED(tensor);
+    UNUSED(page_size);
+    return false;
+#endif
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+void ggml_print_object(const struct ggml_object * obj) {
+    GGML_PRINT(" - ggml_object: offset = %zu, size = %zu, next = %p\n",
+            obj->offs, obj->size, (const void *) obj->next);
+}
+
+void ggml_print_objects(const struct ggml_context * ctx) {
+    struct ggml_object * obj = ctx->objects_begin;
+
+    GGML_PRINT("%s: objects in context %p:\n", __func__, (const void *) ctx);
+
+    while (obj != NULL) {
+        ggml_print_object(obj);
+        obj = obj->next;
+    }
+
+    GGML_PRINT("%s: --- end ---\n", __func__);
+}
+
+int ggml_nelements(const struct ggml_tensor * tensor) {
+    static_assert(GGML_MAX_DIMS == 4, "GGML_MAX_DIMS is not 4 - update this function");
+
+    return tensor->ne[0]*tensor->ne[1]*tensor->ne[2]*tensor->ne[3];
+}
+
+int ggml_nrows(const struct ggml_tensor * tensor) {
+    static_assert(GGML_MAX_DIMS == 4, "GGML_MAX_DIMS is not 4 - update this function");
+
+    return tensor->ne[1]*tensor->ne[2]*tensor->ne[3];
+}
+
+size_t ggml_nbytes(const struct ggml_tensor * tensor) {
+    static_assert(GGML_MAX_DIMS == 4, "GGML_MAX_DIMS is not 4 - update this function");
+
+    return (ggml_nelements(tensor)*GGML_TYPE_SIZE[tensor->type])/GGML_BLCK_SIZE[tensor->type];
+}
+
+int ggml_blck_size(enum ggml_type type) {
+    return GGML_BLCK_SIZE[type];
+}
+
+size_t ggml_type_size(enum ggml_type type) {
+    return GGML_TYPE_SIZE[type];
+}
+
+float ggml_type_sizef(enum ggml_type type) {
+    return ((float)(GGML_TYPE_SIZE[type]))/GGML_BLCK_SIZE[type];
+}
+
+void ggml_row_to_f32(enum ggml_type type, const void * x, float * y, int k) {
+    assert(k % GGML_BLCK_SIZE[type] == 0);
+
+    switch (type) {
+        case GGML_TYPE_Q4_0: dequantize_row_q4_0(x, y, k); break;
+        case GGML_TYPE_Q4_1: dequantize_row_q4_1(x, y, k); break;
+        case GGML_TYPE_Q8_0: dequantize_row_q8_0(x, y, k); break;
+        case GGML_TYPE_F16:
+            {
+                for (int i = 0; i < k; ++i) {
+                    y[i] = GGML_FP16_TO_FP32(((const ggml_fp16_t *) x)[i]);
+                }
+            } break;
+        case GGML_TYPE_F32:
+            {
+                memcpy(y, x, k*sizeof(float));
+            } break;
+        case GGML_TYPE_I8:
+        case GGML_TYPE_I16:
+        case GGML_TYPE_I32:
+        case GGML_TYPE_Q4_0_R4:
+        case GGML_TYPE_Q4_0_R8:
+        case GGML_TYPE_COUNT:
+            {
+                GGML_ASSERT(false);
+            } break;
+    }
+}
+
+void ggml_row_from_f32(enum ggml_type type, const float * x, void * y, int k) {
+    assert(k % GGML_BLCK_SIZE[type] == 0);
+
+    switch (type) {
+        case GGML_TYPE_Q4_0: quantize_row_q4_0(x, y, k); break;
+        case GGML_TYPE_Q4_1: quantize_row_q4_1(x, y, k); break;
+        case GGML_TYPE_Q8_0: quantize_row_q8_0(x, y, k); break;
+        case GGML_TYPE_F16:
+            {
+                for (int i = 0; i < k; ++i) {
+                    ((ggml_fp16_t *) y)[i] = GGML_FP32_TO_FP16(x[i]);
+                }
+            } break;
+        case GGML_TYPE_F32:
+            {
+                memcpy(y, x, k*sizeof(float));
+            } break;
+        case GGML_TYPE_I8:
+        case GGML_TYPE_I16:
+        case GGML_TYPE_I32:
+        case GGML_TYPE_Q4_0_R4:
+        case GGML_TYPE_Q4_0_R8:
+        case GGML_TYPE_COUNT:
+            {
+                GGML_ASSERT(false);
+            } break;
+    }
+}
+
+// the vector kernels behind a common signature, for ggml_get_type_kernels
+
+static void ggml_kernel_dot_f32(const int n, float * s, void * x, void * y) {
+    ggml_vec_dot_f32(n, s, (const float *) x, (const float *) y);
+}
+
+static void ggml_kernel_dot_f16(const int n, float * s, void * x, void * y) {
+    ggml_vec_dot_f16(n, s, (ggml_fp16_t *) x, (ggml_fp16_t *) y);
+}
+
+static void ggml_kernel_dot_q4_0(const int n, float * s, void * x, void * y) { ggml_vec_dot_q4_0(n, s, x, y); }
+static void ggml_kernel_dot_q4_1(const int n, float * s, void * x, void * y) { ggml_vec_dot_q4_1(n, s, x, y); }
+static void ggml_kernel_dot_q8_0(const int n, float * s, void * x, void * y) { ggml_vec_dot_q8_0(n, s, x, y); }
+
+static void ggml_kernel_mad_f32(const int n, void * y, void * x, const float v) {
+    ggml_vec_mad_f32(n, (float *) y, (const float *) x, v);
+}
+
+static void ggml_kernel_mad_f16(const int n, void * y, void * x, const float v) {
+    ggml_vec_mad_f16(n, (ggml_fp16_t *) y, (ggml_fp16_t *) x, v);
+}
+
+static void ggml_kernel_mad_q4_0(const int n, void * y, void * x, const float v) { ggml_vec_mad_q4_0(n, (float *) y, x, v); }
+static void ggml_kernel_mad_q4_1(const int n, void * y, void * x, const float v) { ggml_vec_mad_q4_1(n, (float *) y, x, v); }
+static void ggml_kernel_mad_q8_0(const int n, void * y, void * x, const float v) { ggml_vec_mad_q8_0(n, (float *) y, x, v); }
+
+struct ggml_type_kernels ggml_get_type_kernels(enum ggml_type type) {
+    struct ggml_type_kernels kernels = { type, NULL, NULL };
+
+    switch (type) {
+        case GGML_TYPE_F32:
+            {
+                kernels.vec_dot = ggml_kernel_dot_f32;
+                kernels.vec_mad = ggml_kernel_mad_f32;
+            } break;
+        case GGML_TYPE_F16:
+            {
+                kernels.vec_dot = ggml_kernel_dot_f16;
+                kernels.vec_mad = ggml_kernel_mad_f16;
+            } break;
+        case GGML_TYPE_Q4_0:
+            {
+                kernels.vec_dot = ggml_kernel_dot_q4_0;
+                kernels.vec_mad = ggml_kernel_mad_q4_0;
+            } break;
+        case GGML_TYPE_Q4_1:
+            {
+                kernels.vec_dot = ggml_kernel_dot_q4_1;
+                kernels.vec_mad = ggml_kernel_mad_q4_1;
+            } break;
+        case GGML_TYPE_Q8_0:
+            {
+                kernels.vec_dot = ggml_kernel_dot_q8_0;
+                kernels.vec_mad = ggml_kernel_mad_q8_0;
+            } break;
+        case GGML_TYPE_Q4_0_R4:
+        case GGML_TYPE_Q4_0_R8:
+            {
+                // rows are interleaved in groups, only mul_mat and swiglu compute them
+                kernels.vec_dot_type = GGML_TYPE_Q4_0;
+            } break;
+        case GGML_TYPE_I8:
+        case GGML_TYPE_I16:
+        case GGML_TYPE_I32:
+        case GGML_TYPE_COUNT:
+            {
+            } break;
+    }
+
+    return kernels;
+}
+
+// rows in a group of an interleaved Q4_0 type, 0 for other types
+static int ggml_q4_0_group_rows(enum ggml_type type) {
+    switch (type) {
+        case GGML_TYPE_Q4_0_R4: return 4;
+        case GGML_TYPE_Q4_0_R8: return 8;
+        default:                return 0;
+    }
+}
+
+bool ggml_repack_q4_0(struct ggml_tensor * tensor, enum ggml_type type) {
+    const int nr = ggml_q4_0_group_rows(type);
+
+    const int nb = tensor->ne[0]/QK;
+    const size_t bs = sizeof(float) + QK/2;
+    const size_t row_size = nb*bs;
+
+    if (tensor->type != GGML_TYPE_Q4_0 || nr == 0 || tensor->n_dims != 2 ||
+        tensor->nb[1] != row_size || tensor->ne[1] % nr != 0) {
+        return false;
+    }
+
+    uint8_t * tmp = malloc(nr*row_size);
+
+    for (int ig = 0; ig < tensor->ne[1]/nr; ig++) {
+        uint8_t * group = (uint8_t *) tensor->data + ig*nr*row_size;
+
+        memcpy(tmp, group, nr*row_size);
+
+        for (int i = 0; i < nb; i++) {
+            uint8_t * pd = group + i*nr*bs;
+            uint8_t * pb = pd + nr*sizeof(float);
+
+            for (int r = 0; r < nr; r++) {
+                const uint8_t * src = tmp + r*row_size + i*bs;
+
+                memcpy(pd + r*sizeof(float), src, sizeof(float));
+                memcpy(pb + r*QK/2, src + sizeof(float), QK/2);
+            }
+        }
+    }
+
+    free(tmp);
+
+    tensor->type = type;
+
+    return true;
+}
+
+size_t ggml_element_size(const struct ggml_tensor * tensor) {
+    return GGML_TYPE_SIZE[tensor->type];
+}
+
+static inline bool ggml_is_scalar(const struct ggml_tensor * tensor) {
+    static_assert(GGML_MAX_DIMS == 4, "GGML_MAX_DIMS is not 4 - update this function");
+
+    return tensor->ne[0] == 1 && tensor->ne[1] == 1 && tensor->ne[2] == 1 && tensor->ne[3] == 1;
+}
+
+static inline bool ggml_is_vector(const struct ggml_tensor * tensor) {
+    static_assert(GGML_MAX_DIMS == 4, "GGML_MAX_DIMS is not 4 - update this function");
+
+    return tensor->ne[1] == 1 && tensor->ne[2] == 1 && tensor->ne[3] == 1;
+}
+
+static inline bool ggml_is_matrix(const struct ggml_tensor * tensor) {
+    static_assert(GGML_MAX_DIMS == 4, "GGML_MAX_DIMS is not 4 - update this function");
+
+    return tensor->ne[2] == 1 && tensor->ne[3] == 1;
+}
+
+static inline bool ggml_can_mul_mat(const struct ggml_tensor * t0, const struct ggml_tensor * t1) {
+    static_assert(GGML_MAX_DIMS == 4, "GGML_MAX_DIMS is not 4 - update this function");
+
+    return
+        (t0->ne[0]  == t1->ne[0])  &&
+        (t0->ne[2]  == t1->ne[2])  &&
+        (t0->ne[3]  == t1->ne[3]);
+}
+
+static inline bool ggml_is_contiguous(const struct ggml_tensor * tensor) {
     static_assert(GGML_MAX_DIMS == 4, "GGML_MAX_DIMS is not 4 - update this function");
 
     return
@@ -2687,6 +3388,8 @@ struct ggml_tensor * ggml_new_tensor_impl(
     char * const mem_buffer = ctx->mem_buffer;
     struct ggml_object * const obj_new = (struct ggml_object *)(mem_buffer + cur_end);
 
+    bool is_scratch = false;
+
     if (ctx->scratch.data == NULL || data != NULL) {
         size_needed += sizeof(struct ggml_tensor);
 
@@ -2717,6 +3420,7 @@ struct ggml_tensor * ggml_new_tensor_impl(
         }
 
         data = (char * const) ctx->scratch.data + ctx->scratch.offs;
+        is_scratch = true;
 
         *obj_new = (struct ggml_object) {
             .offs = cur_end + GGML_OBJECT_SIZE,
@@ -2751,6 +3455,7 @@ struct ggml_tensor * ggml_new_tensor_impl(
         /*.nb           =*/ { 0, 0, 0, 0 },
         /*.op           =*/ GGML_OP_NONE,
         /*.is_param     =*/ false,
+        /*.is_scratch   =*/ is_scratch,
         /*.grad         =*/ NULL,
         /*.src0         =*/ NULL,
         /*.src1         =*/ NULL,
@@ -2873,6 +3578,7 @@ struct ggml_tensor * ggml_set_i32 (struct ggml_tensor * tensor, int32_t value) {
                 GGML_ASSERT(false);
             } break;
         case GGML_TYPE_Q4_1:
+        case GGML_TYPE_Q8_0:
             {
                 GGML_ASSERT(false);
             } break;
@@ -2911,6 +3617,8 @@ struct ggml_tensor * ggml_set_i32 (struct ggml_tensor * tensor, int32_t value) {
                     ggml_vec_set_f32(nc, (float *)(data + i*n1), value);
                 }
             } break;
+        case GGML_TYPE_Q4_0_R4:
+        case GGML_TYPE_Q4_0_R8:
         case GGML_TYPE_COUNT:
             {
                 GGML_ASSERT(false);
@@ -2933,6 +3641,7 @@ struct ggml_tensor * ggml_set_f32(struct ggml_tensor * tensor, float value) {
                 GGML_ASSERT(false);
             } break;
         case GGML_TYPE_Q4_1:
+        case GGML_TYPE_Q8_0:
             {
                 GGML_ASSERT(false);
             } break;
@@ -2971,6 +3680,8 @@ struct ggml_tensor * ggml_set_f32(struct ggml_tensor * tensor, float value) {
                     ggml_vec_set_f32(nc, (float *)(data + i*n1), value);
                 }
             } break;
+        case GGML_TYPE_Q4_0_R4:
+        case GGML_TYPE_Q4_0_R8:
         case GGML_TYPE_COUNT:
             {
                 GGML_ASSERT(false);
@@ -2987,6 +3698,7 @@ int32_t ggml_get_i32_1d(const struct ggml_tensor * tensor, int i) {
                 GGML_ASSERT(false);
             } break;
         case GGML_TYPE_Q4_1:
+        case GGML_TYPE_Q8_0:
             {
                 GGML_ASSERT(false);
             } break;
@@ -3015,6 +3727,8 @@ int32_t ggml_get_i32_1d(const struct ggml_tensor * tensor, int i) {
                 GGML_ASSERT(tensor->nb[0] == sizeof(float));
                 return ((float *)(tensor->data))[i];
             } break;
+        case GGML_TYPE_Q4_0_R4:
+        case GGML_TYPE_Q4_0_R8:
         case GGML_TYPE_COUNT:
             {
                 GGML_ASSERT(false);
@@ -3031,6 +3745,7 @@ void ggml_set_i32_1d(const struct ggml_tensor * tensor, int i, int32_t value) {
                 GGML_ASSERT(false);
             } break;
         case GGML_TYPE_Q4_1:
+        case GGML_TYPE_Q8_0:
             {
                 GGML_ASSERT(false);
             } break;
@@ -3059,6 +3774,8 @@ void ggml_set_i32_1d(const struct ggml_tensor * tensor, int i, int32_t value) {
                 GGML_ASSERT(tensor->nb[0] == sizeof(float));
                 ((float *)(tensor->data))[i] = value;
             } break;
+        case GGML_TYPE_Q4_0_R4:
+        case GGML_TYPE_Q4_0_R8:
         case GGML_TYPE_COUNT:
             {
                 GGML_ASSERT(false);
@@ -3073,6 +3790,7 @@ float ggml_get_f32_1d(const struct ggml_tensor * tensor, int i) {
                 GGML_ASSERT(false);
             } break;
         case GGML_TYPE_Q4_1:
+        case GGML_TYPE_Q8_0:
             {
                 GGML_ASSERT(false);
             } break;
@@ -3101,6 +3819,8 @@ float ggml_get_f32_1d(const struct ggml_tensor * tensor, int i) {
                 GGML_ASSERT(tensor->nb[0] == sizeof(float));
                 return ((float *)(tensor->data))[i];
             } break;
+        case GGML_TYPE_Q4_0_R4:
+        case GGML_TYPE_Q4_0_R8:
         case GGML_TYPE_COUNT:
             {
                 GGML_ASSERT(false);
@@ -3117,6 +3837,7 @@ void ggml_set_f32_1d(const struct ggml_tensor * tensor, int i, float value) {
                 GGML_ASSERT(false);
             } break;
         case GGML_TYPE_Q4_1:
+        case GGML_TYPE_Q8_0:
             {
                 GGML_ASSERT(false);
             } break;
@@ -3145,6 +3866,8 @@ void ggml_set_f32_1d(const struct ggml_tensor * tensor, int i, float value) {
                 GGML_ASSERT(tensor->nb[0] == sizeof(float));
                 ((float *)(tensor->data))[i] = value;
             } break;
+        case GGML_TYPE_Q4_0_R4:
+        case GGML_TYPE_Q4_0_R8:
         case GGML_TYPE_COUNT:
             {
                 GGML_ASSERT(false);
@@ -3164,7 +3887,10 @@ float * ggml_get_data_f32(const struct ggml_tensor * tensor) {
 struct ggml_tensor * ggml_view_tensor(
         struct ggml_context * ctx,
         const struct ggml_tensor * src) {
-    return ggml_new_tensor_impl(ctx, src->type, src->n_dims, src->ne, src->data);
+    struct ggml_tensor * result = ggml_new_tensor_impl(ctx, src->type, src->n_dims, src->ne, src->data);
+    result->is_scratch = src->is_scratch;
+
+    return result;
 }
 
 ////////////////////////////////////////////////////////////////////////////////
@@ -3210,11 +3936,13 @@ struct ggml_tensor * ggml_add_impl(
         struct ggml_tensor * a,
         struct ggml_tensor * b,
         bool inplace) {
-    GGML_ASSERT(ggml_are_same_shape(a, b));
+    // b is broadcast over the rows of a
+    GGML_ASSERT(ggml_can_repeat(b, a) && b->ne[0] == a->ne[0]);
 
     bool is_node = false;
 
     if (!inplace && (a->grad || b->grad)) {
+        GGML_ASSERT(ggml_are_same_shape(a, b)); // TODO: implement backward of a broadcast
         is_node = true;
     }
 
@@ -3839,6 +4567,33 @@ struct ggml_tensor * ggml_mul_mat(
     return result;
 }
 
+// ggml_swiglu
+
+struct ggml_tensor * ggml_swiglu(
+        struct ggml_context * ctx,
+        struct ggml_tensor  * a,
+        struct ggml_tensor  * b) {
+    GGML_ASSERT(ggml_can_mul_mat(a, b));
+    GGML_ASSERT(ggml_is_matrix(a) && ggml_is_matrix(b));
+    GGML_ASSERT(a->ne[1] % 2 == 0);
+
+    bool is_node = false;
+
+    if (a->grad || b->grad) {
+        GGML_ASSERT(false); // TODO: implement backward
+        is_node = true;
+    }
+
+    struct ggml_tensor * result = ggml_new_tensor_2d(ctx, GGML_TYPE_F32, a->ne[1]/2, b->ne[1]);
+
+    result->op   = GGML_OP_SWIGLU;
+    result->grad = is_node ? ggml_dup_tensor(ctx, result) : NULL;
+    result->src0 = a;
+    result->src1 = b;
+
+    return result;
+}
+
 // ggml_scale
 
 struct ggml_tensor * ggml_scale_impl(
@@ -3941,6 +4696,7 @@ struct ggml_tensor * ggml_reshape(
     }
 
     struct ggml_tensor * result = ggml_new_tensor_impl(ctx, a->type, b->n_dims, b->ne, a->data);
+    result->is_scratch = a->is_scratch;
 
     result->op   = GGML_OP_RESHAPE;
     result->grad = is_node ? ggml_dup_tensor(ctx, result) : NULL;
@@ -3967,6 +4723,7 @@ struct ggml_tensor * ggml_reshape_2d(
 
     const int ne[2] = { ne0, ne1 };
     struct ggml_tensor * result = ggml_new_tensor_impl(ctx, a->type, 2, ne, a->data);
+    result->is_scratch = a->is_scratch;
 
     result->op   = GGML_OP_RESHAPE;
     result->grad = is_node ? ggml_dup_tensor(ctx, result) : NULL;
@@ -3994,6 +4751,7 @@ struct ggml_tensor * ggml_reshape_3d(
 
     const int ne[3] = { ne0, ne1, ne2 };
     struct ggml_tensor * result = ggml_new_tensor_impl(ctx, a->type, 3, ne, a->data);
+    result->is_scratch = a->is_scratch;
 
     result->op   = GGML_OP_RESHAPE;
     result->grad = is_node ? ggml_dup_tensor(ctx, result) : NULL;
@@ -4015,6 +4773,7 @@ struct ggml_tensor * ggml_view_1d(
     }
 
     struct ggml_tensor * result = ggml_new_tensor_impl(ctx, a->type, 1, &ne0, (char *) a->data + offset);
+    result->is_scratch = a->is_scratch;
 
     result->op   = GGML_OP_VIEW;
     result->grad = NULL;
@@ -4040,6 +4799,7 @@ struct ggml_tensor * ggml_view_2d(
     const int ne[GGML_MAX_DIMS] = { ne0, ne1, 1, 1 };
 
     struct ggml_tensor * result = ggml_new_tensor_impl(ctx, a->type, 2, ne, (char *) a->data + offset);
+    result->is_scratch = a->is_scratch;
 
     result->nb[1] = nb1;
     result->nb[2] = result->nb[1]*ne1;
@@ -4169,21 +4929,51 @@ struct ggml_tensor * ggml_get_rows(
     return result;
 }
 
-// ggml_diag_mask_inf
+// ggml_set_rows
 
-struct ggml_tensor * ggml_diag_mask_inf(
+struct ggml_tensor * ggml_set_rows(
         struct ggml_context * ctx,
         struct ggml_tensor  * a,
-        int                   n_past) {
+        struct ggml_tensor  * b,
+        struct ggml_tensor  * c) {
+    GGML_ASSERT(ggml_is_matrix(a) && ggml_is_matrix(b) && b->type == GGML_TYPE_F32);
+    GGML_ASSERT(ggml_is_vector(c) && c->type == GGML_TYPE_I32);
+    GGML_ASSERT(a->ne[0] == b->ne[0] && b->ne[1] == c->ne[0]);
+
     bool is_node = false;
 
-    if (a->grad) {
+    if (a->grad || b->grad) {
         GGML_ASSERT(false); // TODO: implement backward
         is_node = true;
     }
 
-    // TODO: when implement backward, fix this:
-    //struct ggml_tensor * result = inplace ? ggml_view_tensor(ctx, a) : ggml_dup_tensor(ctx, a);
+    // make a view of the destination
+    struct ggml_tensor * result = ggml_view_tensor(ctx, a);
+
+    result->op     = GGML_OP_SET_ROWS;
+    result->grad   = is_node ? ggml_dup_tensor(ctx, result) : NULL;
+    result->src0   = b;
+    result->src1   = c;
+    result->opt[0] = a;
+
+    return result;
+}
+
+// ggml_diag_mask_inf
+
+struct ggml_tensor * ggml_diag_mask_inf(
+        struct ggml_context * ctx,
+        struct ggml_tensor  * a,
+        int                   n_past) {
+    bool is_node = false;
+
+    if (a->grad) {
+        GGML_ASSERT(false); // TODO: implement backward
+        is_node = true;
+    }
+
+    // TODO: when implement backward, fix this:
+    //struct ggml_tensor * result = inplace ? ggml_view_tensor(ctx, a) : ggml_dup_tensor(ctx, a);
     struct ggml_tensor * result = ggml_view_tensor(ctx, a);
     struct ggml_tensor * b = ggml_new_i32(ctx, n_past);
 
@@ -4239,7 +5029,13 @@ struct ggml_tensor * ggml_rope(
     //struct ggml_tensor * result = inplace ? ggml_view_tensor(ctx, a) : ggml_dup_tensor(ctx, a);
     struct ggml_tensor * result = ggml_view_tensor(ctx, a);
 
+    ctx->scratch_save = ctx->scratch;
+    ctx->scratch.data = NULL;
+
     struct ggml_tensor * b = ggml_new_tensor_1d(ctx, GGML_TYPE_I32, 3);
+
+    ctx->scratch = ctx->scratch_save;
+
     ((int32_t *) b->data)[0] = n_past;
     ((int32_t *) b->data)[1] = n_dims;
     ((int32_t *) b->data)[2] = mode;
@@ -4252,6 +5048,21 @@ struct ggml_tensor * ggml_rope(
     return result;
 }
 
+struct ggml_tensor * ggml_rope_pos(
+        struct ggml_context * ctx,
+        struct ggml_tensor  * a,
+        struct ggml_tensor  * b,
+        int                   n_dims) {
+    GGML_ASSERT(ggml_is_vector(b) && b->type == GGML_TYPE_I32);
+    GGML_ASSERT(b->ne[0] == a->ne[2]);
+
+    struct ggml_tensor * result = ggml_rope(ctx, a, 0, n_dims, 0);
+
+    result->opt[0] = b;
+
+    return result;
+}
+
 // ggml_conv_1d_1s
 
 struct ggml_tensor * ggml_conv_1d_1s(
@@ -4547,6 +5358,25 @@ static void ggml_compute_forward_dup_f32(
                     }
                 }
             }
+        } else if (dst->type == GGML_TYPE_Q8_0) {
+            // quantize row by row - rows have to consist of whole blocks
+            GGML_ASSERT(ne00 % GGML_BLCK_SIZE[GGML_TYPE_Q8_0] == 0);
+
+            int id = 0;
+            const size_t rs = (ne00*GGML_TYPE_SIZE[GGML_TYPE_Q8_0])/GGML_BLCK_SIZE[GGML_TYPE_Q8_0];
+
+            for (int i03 = 0; i03 < ne03; i03++) {
+                for (int i02 = 0; i02 < ne02; i02++) {
+                    for (int i01 = 0; i01 < ne01; i01++) {
+                        const float * src0_ptr = (float *) ((char *) src0->data + i01*nb01 + i02*nb02 + i03*nb03);
+                        char * dst_ptr = (char *) dst->data + id*rs;
+
+                        quantize_row_q8_0(src0_ptr, dst_ptr, ne00);
+
+                        id++;
+                    }
+                }
+            }
         } else {
             GGML_ASSERT(false); // TODO: implement
         }
@@ -4606,9 +5436,12 @@ static void ggml_compute_forward_dup(
             } break;
         case GGML_TYPE_Q4_0:
         case GGML_TYPE_Q4_1:
+        case GGML_TYPE_Q8_0:
         case GGML_TYPE_I8:
         case GGML_TYPE_I16:
         case GGML_TYPE_I32:
+        case GGML_TYPE_Q4_0_R4:
+        case GGML_TYPE_Q4_0_R8:
         case GGML_TYPE_COUNT:
             {
                 GGML_ASSERT(false);
@@ -4623,7 +5456,7 @@ static void ggml_compute_forward_add_f32(
         const struct ggml_tensor * src0,
         const struct ggml_tensor * src1,
         struct ggml_tensor * dst) {
-    GGML_ASSERT(ggml_are_same_shape(src0, src1) && ggml_are_same_shape(src0, dst));
+    GGML_ASSERT(ggml_can_repeat(src1, src0) && ggml_are_same_shape(src0, dst));
 
     if (params->type == GGML_TASK_INIT || params->type == GGML_TASK_FINALIZE) {
         return;
@@ -4647,7 +5480,27 @@ static void ggml_compute_forward_add_f32(
     GGML_ASSERT( nb0 == sizeof(float));
     GGML_ASSERT(nb00 == sizeof(float));
 
-    if (nb10 == sizeof(float)) {
+    if (!ggml_are_same_shape(src0, src1)) {
+        // src1 is broadcast: row (i1, i2, i3) adds row (i1 % ne11, i2 % ne12, i3 % ne13)
+        GGML_ASSERT(nb10 == sizeof(float) && src1->ne[0] == nc);
+
+        const int ne01 = src0->ne[1];
+        const int ne02 = src0->ne[2];
+
+        const int j0 = (n/nth)*ith;
+        const int j1 = ith == nth - 1 ? n : (n/nth)*(ith + 1);
+
+        for (int j = j0; j < j1; j++) {
+            const int i3 = j/(ne02*ne01);
+            const int i2 = (j - i3*ne02*ne01)/ne01;
+            const int i1 = j - i3*ne02*ne01 - i2*ne01;
+
+            ggml_vec_add_f32(nc,
+                    (float *) ((char *) dst->data  + j*nb1),
+                    (float *) ((char *) src0->data + j*nb01),
+                    (float *) ((char *) src1->data + (i1%src1->ne[1])*nb11 + (i2%src1->ne[2])*src1->nb[2] + (i3%src1->ne[3])*src1->nb[3]));
+        }
+    } else if (nb10 == sizeof(float)) {
         const int j0 = (n/nth)*ith;
         const int j1 = ith == nth - 1 ? n : (n/nth)*(ith + 1);
 
@@ -4683,10 +5536,13 @@ static void ggml_compute_forward_add(
             } break;
         case GGML_TYPE_Q4_0:
         case GGML_TYPE_Q4_1:
+        case GGML_TYPE_Q8_0:
         case GGML_TYPE_I8:
         case GGML_TYPE_I16:
         case GGML_TYPE_I32:
         case GGML_TYPE_F16:
+        case GGML_TYPE_Q4_0_R4:
+        case GGML_TYPE_Q4_0_R8:
         case GGML_TYPE_COUNT:
             {
                 GGML_ASSERT(false);
@@ -4735,10 +5591,13 @@ static void ggml_compute_forward_sub(
             } break;
         case GGML_TYPE_Q4_0:
         case GGML_TYPE_Q4_1:
+        case GGML_TYPE_Q8_0:
         case GGML_TYPE_I8:
         case GGML_TYPE_I16:
         case GGML_TYPE_I32:
         case GGML_TYPE_F16:
+        case GGML_TYPE_Q4_0_R4:
+        case GGML_TYPE_Q4_0_R8:
         case GGML_TYPE_COUNT:
             {
                 GGML_ASSERT(false);
@@ -4787,10 +5646,13 @@ static void ggml_compute_forward_mul(
             } break;
         case GGML_TYPE_Q4_0:
         case GGML_TYPE_Q4_1:
+        case GGML_TYPE_Q8_0:
         case GGML_TYPE_I8:
         case GGML_TYPE_I16:
         case GGML_TYPE_I32:
         case GGML_TYPE_F16:
+        case GGML_TYPE_Q4_0_R4:
+        case GGML_TYPE_Q4_0_R8:
         case GGML_TYPE_COUNT:
             {
                 GGML_ASSERT(false);
@@ -4839,10 +5701,13 @@ static void ggml_compute_forward_div(
             } break;
         case GGML_TYPE_Q4_0:
         case GGML_TYPE_Q4_1:
+        case GGML_TYPE_Q8_0:
         case GGML_TYPE_I8:
         case GGML_TYPE_I16:
         case GGML_TYPE_I32:
         case GGML_TYPE_F16:
+        case GGML_TYPE_Q4_0_R4:
+        case GGML_TYPE_Q4_0_R8:
         case GGML_TYPE_COUNT:
             {
                 GGML_ASSERT(false);
@@ -4887,10 +5752,13 @@ static void ggml_compute_forward_sqr(
             } break;
         case GGML_TYPE_Q4_0:
         case GGML_TYPE_Q4_1:
+        case GGML_TYPE_Q8_0:
         case GGML_TYPE_I8:
         case GGML_TYPE_I16:
         case GGML_TYPE_I32:
         case GGML_TYPE_F16:
+        case GGML_TYPE_Q4_0_R4:
+        case GGML_TYPE_Q4_0_R8:
         case GGML_TYPE_COUNT:
             {
                 GGML_ASSERT(false);
@@ -4935,10 +5803,13 @@ static void ggml_compute_forward_sqrt(
             } break;
         case GGML_TYPE_Q4_0:
         case GGML_TYPE_Q4_1:
+        case GGML_TYPE_Q8_0:
         case GGML_TYPE_I8:
         case GGML_TYPE_I16:
         case GGML_TYPE_I32:
         case GGML_TYPE_F16:
+        case GGML_TYPE_Q4_0_R4:
+        case GGML_TYPE_Q4_0_R8:
         case GGML_TYPE_COUNT:
             {
                 GGML_ASSERT(false);
@@ -4993,10 +5864,13 @@ static void ggml_compute_forward_sum(
             } break;
         case GGML_TYPE_Q4_0:
         case GGML_TYPE_Q4_1:
+        case GGML_TYPE_Q8_0:
         case GGML_TYPE_I8:
         case GGML_TYPE_I16:
         case GGML_TYPE_I32:
         case GGML_TYPE_F16:
+        case GGML_TYPE_Q4_0_R4:
+        case GGML_TYPE_Q4_0_R8:
         case GGML_TYPE_COUNT:
             {
                 GGML_ASSERT(false);
@@ -5070,10 +5944,13 @@ static void ggml_compute_forward_mean(
             } break;
         case GGML_TYPE_Q4_0:
         case GGML_TYPE_Q4_1:
+        case GGML_TYPE_Q8_0:
         case GGML_TYPE_I8:
         case GGML_TYPE_I16:
         case GGML_TYPE_I32:
         case GGML_TYPE_F16:
+        case GGML_TYPE_Q4_0_R4:
+        case GGML_TYPE_Q4_0_R8:
         case GGML_TYPE_COUNT:
             {
                 GGML_ASSERT(false);
@@ -5094,30 +5971,27 @@ static void ggml_compute_forward_repeat_f32(
         return;
     }
 
-    // TODO: implement support for rank > 2 tensors
-    assert(src0->ne[2] == 1);
-    assert(src0->ne[3] == 1);
-    assert( dst->ne[2] == 1);
-    assert( dst->ne[3] == 1);
-
     const int nc  = dst->ne[0];
-    const int nr  = dst->ne[1];
     const int nc0 = src0->ne[0];
-    const int nr0 = src0->ne[1];
     const int ncr = nc/nc0; // guaranteed to be an integer due to the check in ggml_can_repeat
-    const int nrr = nr/nr0; // guaranteed to be an integer due to the check in ggml_can_repeat
 
     // TODO: support for transposed / permuted tensors
     assert( dst->nb[0] == sizeof(float));
     assert(src0->nb[0] == sizeof(float));
 
     // TODO: maybe this is not optimal?
-    for (int i = 0; i < nrr; i++) {
-        for (int j = 0; j < ncr; j++) {
-            for (int k = 0; k < nr0; k++) {
-                ggml_vec_cpy_f32(nc0,
-                        (float *) ((char *)  dst->data + (i*nr0 + k)*( dst->nb[1]) + j*nc0*( dst->nb[0])),
-                        (float *) ((char *) src0->data + (        k)*(src0->nb[1])));
+    for (int i3 = 0; i3 < dst->ne[3]; i3++) {
+        for (int i2 = 0; i2 < dst->ne[2]; i2++) {
+            for (int i1 = 0; i1 < dst->ne[1]; i1++) {
+                const int k3 = i3 % src0->ne[3];
+                const int k2 = i2 % src0->ne[2];
+                const int k1 = i1 % src0->ne[1];
+
+                for (int j = 0; j < ncr; j++) {
+                    ggml_vec_cpy_f32(nc0,
+                            (float *) ((char *)  dst->data + i3*dst->nb[3]  + i2*dst->nb[2]  + i1*dst->nb[1] + j*nc0*dst->nb[0]),
+                            (float *) ((char *) src0->data + k3*src0->nb[3] + k2*src0->nb[2] + k1*src0->nb[1]));
+                }
             }
         }
     }
@@ -5134,10 +6008,13 @@ static void ggml_compute_forward_repeat(
             } break;
         case GGML_TYPE_Q4_0:
         case GGML_TYPE_Q4_1:
+        case GGML_TYPE_Q8_0:
         case GGML_TYPE_I8:
         case GGML_TYPE_I16:
         case GGML_TYPE_I32:
         case GGML_TYPE_F16:
+        case GGML_TYPE_Q4_0_R4:
+        case GGML_TYPE_Q4_0_R8:
         case GGML_TYPE_COUNT:
             {
                 GGML_ASSERT(false);
@@ -5182,10 +6059,13 @@ static void ggml_compute_forward_abs(
             } break;
         case GGML_TYPE_Q4_0:
         case GGML_TYPE_Q4_1:
+        case GGML_TYPE_Q8_0:
         case GGML_TYPE_I8:
         case GGML_TYPE_I16:
         case GGML_TYPE_I32:
         case GGML_TYPE_F16:
+        case GGML_TYPE_Q4_0_R4:
+        case GGML_TYPE_Q4_0_R8:
         case GGML_TYPE_COUNT:
             {
                 GGML_ASSERT(false);
@@ -5230,10 +6110,13 @@ static void ggml_compute_forward_sgn(
             } break;
         case GGML_TYPE_Q4_0:
         case GGML_TYPE_Q4_1:
+        case GGML_TYPE_Q8_0:
         case GGML_TYPE_I8:
         case GGML_TYPE_I16:
         case GGML_TYPE_I32:
         case GGML_TYPE_F16:
+        case GGML_TYPE_Q4_0_R4:
+        case GGML_TYPE_Q4_0_R8:
         case GGML_TYPE_COUNT:
             {
                 GGML_ASSERT(false);
@@ -5278,10 +6161,13 @@ static void ggml_compute_forward_neg(
             } break;
         case GGML_TYPE_Q4_0:
         case GGML_TYPE_Q4_1:
+        case GGML_TYPE_Q8_0:
         case GGML_TYPE_I8:
         case GGML_TYPE_I16:
         case GGML_TYPE_I32:
         case GGML_TYPE_F16:
+        case GGML_TYPE_Q4_0_R4:
+        case GGML_TYPE_Q4_0_R8:
         case GGML_TYPE_COUNT:
             {
                 GGML_ASSERT(false);
@@ -5326,10 +6212,13 @@ static void ggml_compute_forward_step(
             } break;
         case GGML_TYPE_Q4_0:
         case GGML_TYPE_Q4_1:
+        case GGML_TYPE_Q8_0:
         case GGML_TYPE_I8:
         case GGML_TYPE_I16:
         case GGML_TYPE_I32:
         case GGML_TYPE_F16:
+        case GGML_TYPE_Q4_0_R4:
+        case GGML_TYPE_Q4_0_R8:
         case GGML_TYPE_COUNT:
             {
                 GGML_ASSERT(false);
@@ -5374,10 +6263,13 @@ static void ggml_compute_forward_relu(
             } break;
         case GGML_TYPE_Q4_0:
         case GGML_TYPE_Q4_1:
+        case GGML_TYPE_Q8_0:
         case GGML_TYPE_I8:
         case GGML_TYPE_I16:
         case GGML_TYPE_I32:
         case GGML_TYPE_F16:
+        case GGML_TYPE_Q4_0_R4:
+        case GGML_TYPE_Q4_0_R8:
         case GGML_TYPE_COUNT:
             {
                 GGML_ASSERT(false);
@@ -5439,10 +6331,13 @@ static void ggml_compute_forward_gelu(
             } break;
         case GGML_TYPE_Q4_0:
         case GGML_TYPE_Q4_1:
+        case GGML_TYPE_Q8_0:
         case GGML_TYPE_I8:
         case GGML_TYPE_I16:
         case GGML_TYPE_I32:
         case GGML_TYPE_F16:
+        case GGML_TYPE_Q4_0_R4:
+        case GGML_TYPE_Q4_0_R8:
         case GGML_TYPE_COUNT:
             {
                 GGML_ASSERT(false);
@@ -5506,10 +6401,13 @@ static void ggml_compute_forward_silu(
             } break;
         case GGML_TYPE_Q4_0:
         case GGML_TYPE_Q4_1:
+        case GGML_TYPE_Q8_0:
         case GGML_TYPE_I8:
         case GGML_TYPE_I16:
         case GGML_TYPE_I32:
         case GGML_TYPE_F16:
+        case GGML_TYPE_Q4_0_R4:
+        case GGML_TYPE_Q4_0_R8:
         case GGML_TYPE_COUNT:
             {
                 GGML_ASSERT(false);
@@ -5591,10 +6489,13 @@ static void ggml_compute_forward_norm(
             } break;
         case GGML_TYPE_Q4_0:
         case GGML_TYPE_Q4_1:
+        case GGML_TYPE_Q8_0:
         case GGML_TYPE_I8:
         case GGML_TYPE_I16:
         case GGML_TYPE_I32:
         case GGML_TYPE_F16:
+        case GGML_TYPE_Q4_0_R4:
+        case GGML_TYPE_Q4_0_R8:
         case GGML_TYPE_COUNT:
             {
                 GGML_ASSERT(false);
@@ -5671,10 +6572,13 @@ static void ggml_compute_forward_rms_norm(
             } break;
         case GGML_TYPE_Q4_0:
         case GGML_TYPE_Q4_1:
+        case GGML_TYPE_Q8_0:
         case GGML_TYPE_I8:
         case GGML_TYPE_I16:
         case GGML_TYPE_I32:
         case GGML_TYPE_F16:
+        case GGML_TYPE_Q4_0_R4:
+        case GGML_TYPE_Q4_0_R8:
         case GGML_TYPE_COUNT:
             {
                 GGML_ASSERT(false);
@@ -5862,12 +6766,10 @@ static void ggml_compute_forward_mul_mat_f32(
         // total rows in src0
         const int nr = ne01*ne02*ne03;
 
-        // rows per thread
-        const int dr = (nr + nth - 1)/nth;
-
         // row range for this thread
-        const int ir0 = dr*ith;
-        const int ir1 = MIN(ir0 + dr, nr);
+        int ir0;
+        int ir1;
+        ggml_thread_rows(nr, ith, nth, &ir0, &ir1);
 
         for (int ir = ir0; ir < ir1; ++ir) {
             // src0 indices
@@ -6165,12 +7067,10 @@ static void ggml_compute_forward_mul_mat_f16_f32(
         // total rows in src0
         const int nr = ne01*ne02*ne03;
 
-        // rows per thread
-        const int dr = (nr + nth - 1)/nth;
-
         // row range for this thread
-        const int ir0 = dr*ith;
-        const int ir1 = MIN(ir0 + dr, nr);
+        int ir0;
+        int ir1;
+        ggml_thread_rows(nr, ith, nth, &ir0, &ir1);
 
         ggml_fp16_t * wdata = params->wdata;
 
@@ -6464,12 +7364,10 @@ static void ggml_compute_forward_mul_mat_q4_0_f32(
         // total rows in src0
         const int nr = ne01*ne02*ne03;
 
-        // rows per thread
-        const int dr = (nr + nth - 1)/nth;
-
         // row range for this thread
-        const int ir0 = dr*ith;
-        const int ir1 = MIN(ir0 + dr, nr);
+        int ir0;
+        int ir1;
+        ggml_thread_rows(nr, ith, nth, &ir0, &ir1);
 
         void * wdata = params->wdata;
 
@@ -6764,12 +7662,10 @@ static void ggml_compute_forward_mul_mat_q4_1_f32(
         // total rows in src0
         const int nr = ne01*ne02*ne03;
 
-        // rows per thread
-        const int dr = (nr + nth - 1)/nth;
-
         // row range for this thread
-        const int ir0 = dr*ith;
-        const int ir1 = MIN(ir0 + dr, nr);
+        int ir0;
+        int ir1;
+        ggml_thread_rows(nr, ith, nth, &ir0, &ir1);
 
         void * wdata = params->wdata;
 
@@ -6861,160 +7757,719 @@ static void ggml_compute_forward_mul_mat_q4_1_f32(
     //}
 }
 
-static void ggml_compute_forward_mul_mat(
+static void ggml_compute_forward_mul_mat_q8_0_f32(
         const struct ggml_compute_params * params,
         const struct ggml_tensor * src0,
         const struct ggml_tensor * src1,
-        struct ggml_tensor * dst) {
-    switch (src0->type) {
-        case GGML_TYPE_Q4_0:
-            {
-                ggml_compute_forward_mul_mat_q4_0_f32(params, src0, src1, dst);
-            } break;
-        case GGML_TYPE_Q4_1:
-            {
-                ggml_compute_forward_mul_mat_q4_1_f32(params, src0, src1, dst);
-            } break;
-        case GGML_TYPE_F16:
-            {
-                ggml_compute_forward_mul_mat_f16_f32(params, src0, src1, dst);
-            } break;
-        case GGML_TYPE_F32:
-            {
-                ggml_compute_forward_mul_mat_f32(params, src0, src1, dst);
-            } break;
-        case GGML_TYPE_I8:
-        case GGML_TYPE_I16:
-        case GGML_TYPE_I32:
-        case GGML_TYPE_COUNT:
-            {
-                GGML_ASSERT(false);
-            } break;
-    }
+              struct ggml_tensor * dst) {
+    const int ne00 = src0->ne[0];
+    const int ne01 = src0->ne[1];
+    const int ne02 = src0->ne[2];
+    const int ne03 = src0->ne[3];
 
-#if 0
-    if (src0->type == GGML_TYPE_F16 || src0->type == GGML_TYPE_Q4_1) {
-        static int first = 8;
-        printf("src0: ne0 = %5d, ne1 = %5d, ne2 = %5d\n", src0->ne[0], src0->ne[1], src0->ne[2]);
-        printf("src1: ne0 = %5d, ne1 = %5d, ne2 = %5d\n", src1->ne[0], src1->ne[1], src1->ne[2]);
-        printf("dst:  ne0 = %5d, ne1 = %5d, ne2 = %5d\n", dst->ne[0], dst->ne[1], dst->ne[2]);
-        if (first) {
-            --first;
-        } else {
-            for (int k = 0; k < dst->ne[1]; ++k) {
-                for (int j = 0; j < dst->ne[0]/16; ++j) {
-                    for (int i = 0; i < 16; ++i) {
-                        printf("%8.4f ", ((float *) dst->data)[k*dst->ne[0] + j*16 + i]);
-                    }
-                    printf("\n");
-                }
-                printf("\n");
-            }
-            printf("\n");
-            exit(0);
-        }
-    } else {
-        printf("aaaa src0: ne0 = %5d, ne1 = %5d, ne2 = %5d\n", src0->ne[0], src0->ne[1], src0->ne[2]);
-        printf("aaaa src1: ne0 = %5d, ne1 = %5d, ne2 = %5d\n", src1->ne[0], src1->ne[1], src1->ne[2]);
-        printf("aaaa dst:  ne0 = %5d, ne1 = %5d, ne2 = %5d\n", dst->ne[0], dst->ne[1], dst->ne[2]);
-    }
-#endif
-}
+    const int ne10 = src1->ne[0];
+    const int ne11 = src1->ne[1];
+    const int ne12 = src1->ne[2];
+    const int ne13 = src1->ne[3];
 
-// ggml_compute_forward_scale
+    const int ne0  = dst->ne[0];
+    const int ne1  = dst->ne[1];
+    const int ne2  = dst->ne[2];
+    const int ne3  = dst->ne[3];
+    const int ne   = ne0*ne1*ne2*ne3;
 
-static void ggml_compute_forward_scale_f32(
-        const struct ggml_compute_params * params,
-        const struct ggml_tensor * src0,
-        const struct ggml_tensor * src1,
-        struct ggml_tensor * dst) {
-    GGML_ASSERT(ggml_is_contiguous(src0));
-    GGML_ASSERT(ggml_is_contiguous(dst));
-    GGML_ASSERT(ggml_are_same_shape(src0, dst));
-    GGML_ASSERT(ggml_is_scalar(src1));
+    const int nb00 = src0->nb[0];
+    const int nb01 = src0->nb[1];
+    const int nb02 = src0->nb[2];
+    const int nb03 = src0->nb[3];
 
-    if (params->type == GGML_TASK_INIT || params->type == GGML_TASK_FINALIZE) {
-        return;
-    }
+    const int nb10 = src1->nb[0];
+    const int nb11 = src1->nb[1];
+    const int nb12 = src1->nb[2];
+    const int nb13 = src1->nb[3];
 
-    // scale factor
-    const float v = *(float *) src1->data;
+    const int nb0  = dst->nb[0];
+    const int nb1  = dst->nb[1];
+    const int nb2  = dst->nb[2];
+    const int nb3  = dst->nb[3];
 
     const int ith = params->ith;
     const int nth = params->nth;
 
-    const int nc = src0->ne[0];
-    const int nr = ggml_nrows(src0);
-
-    // rows per thread
-    const int dr = (nr + nth - 1)/nth;
-
-    // row range for this thread
-    const int ir0 = dr*ith;
-    const int ir1 = MIN(ir0 + dr, nr);
+    GGML_ASSERT(ne02 == ne12);
+    GGML_ASSERT(ne03 == ne13);
+    GGML_ASSERT(ne2  == ne12);
+    GGML_ASSERT(ne3  == ne13);
 
-    for (int i1 = ir0; i1 < ir1; i1++) {
-        ggml_vec_scale_f32(nc, (float *) ((char *) dst->data + i1*(dst->nb[1])), v);
-    }
-}
+    // TODO: we don't support permuted src0
+    GGML_ASSERT(nb00 == (int) GGML_TYPE_SIZE[GGML_TYPE_Q8_0] || nb01 == (int) GGML_TYPE_SIZE[GGML_TYPE_Q8_0]);
 
-static void ggml_compute_forward_scale(
-        const struct ggml_compute_params * params,
-        const struct ggml_tensor * src0,
-        const struct ggml_tensor * src1,
-        struct ggml_tensor * dst) {
-    switch (src0->type) {
-        case GGML_TYPE_F32:
-            {
-                ggml_compute_forward_scale_f32(params, src0, src1, dst);
-            } break;
-        case GGML_TYPE_Q4_0:
-        case GGML_TYPE_Q4_1:
-        case GGML_TYPE_I8:
-        case GGML_TYPE_I16:
-        case GGML_TYPE_I32:
-        case GGML_TYPE_F16:
-        case GGML_TYPE_COUNT:
-            {
-                GGML_ASSERT(false);
-            } break;
-    }
-}
+    // dst cannot be transposed or permuted
+    GGML_ASSERT(nb0 == sizeof(float));
+    GGML_ASSERT(nb0 <= nb1);
+    GGML_ASSERT(nb1 <= nb2);
+    GGML_ASSERT(nb2 <= nb3);
 
-// ggml_compute_forward_cpy
+    GGML_ASSERT(ne0 == ne01);
+    GGML_ASSERT(ne1 == ne11);
+    GGML_ASSERT(ne2 == ne02);
+    GGML_ASSERT(ne3 == ne03);
 
-static void ggml_compute_forward_cpy(
-        const struct ggml_compute_params * params,
-        const struct ggml_tensor * src0,
-        struct ggml_tensor * dst) {
-    ggml_compute_forward_dup(params, src0, dst);
-}
+    // nb01 >= nb00 - src0 is not transposed
+    //   compute by src0 rows
+    //
+    // nb00 <  nb01 - src0 is transposed
+    //   compute by src0 columns
 
-// ggml_compute_forward_reshape
+#if defined(GGML_USE_ACCELERATE) || defined(GGML_USE_OPENBLAS)
+    if (ggml_compute_forward_mul_mat_use_blas(src0, src1, dst)) {
+        GGML_ASSERT(nb10 == sizeof(float));
 
-static void ggml_compute_forward_reshape(
-        const struct ggml_compute_params * params,
-        const struct ggml_tensor * src0,
-        struct ggml_tensor * dst) {
-    // NOP
-    UNUSED(params);
-    UNUSED(src0);
-    UNUSED(dst);
-}
+        if (params->ith != 0) {
+            return;
+        }
 
-// ggml_compute_forward_view
+        if (params->type == GGML_TASK_INIT) {
+            return;
+        }
 
-static void ggml_compute_forward_view(
-        const struct ggml_compute_params * params,
-        const struct ggml_tensor * src0) {
-    // NOP
-    UNUSED(params);
-    UNUSED(src0);
-}
+        if (params->type == GGML_TASK_FINALIZE) {
+            return;
+        }
 
-// ggml_compute_forward_permute
+        float * const wdata = params->wdata;
 
-static void ggml_compute_forward_permute(
+        for (int i03 = 0; i03 < ne03; i03++) {
+            for (int i02 = 0; i02 < ne02; i02++) {
+                {
+                    int id = 0;
+                    for (int i01 = 0; i01 < ne01; ++i01) {
+                        //for (int i00 = 0; i00 < ne00; ++i00) {
+                        //    wdata[id++] = GGML_FP16_TO_FP32(*(ggml_fp16_t *) ((char *) src0->data + i03*nb03 + i02*nb02 + i01*nb01 + i00*nb00));
+                        //}
+                        dequantize_row_q8_0((char *) src0->data + i03*nb03 + i02*nb02 + i01*nb01, wdata + id, ne00);
+                        id += ne00;
+                    }
+                }
+
+                const float * x = wdata;
+                const float * y = (float *) ((char *) src1->data + i02*nb12 + i03*nb13);
+
+                //      float * z =                          wdata + ne00*ne01;
+
+                // z = x * yT
+                //{
+                //    cblas_sgemm(CblasRowMajor, CblasNoTrans, CblasTrans,
+                //            ne01, ne11, ne00,
+                //            1.0f, x, ne00,
+                //                  y, ne00,
+                //            0.0f, z, ne11);
+                //}
+
+                float * d = (float *) ((char *) dst->data + i02*nb2 + i03*nb3);
+
+                // transpose z
+                //for (int j = 0; j < ne11; ++j) {
+                //    for (int i = 0; i < ne01; ++i) {
+                //        d[j*ne01 + i] = z[i*ne11 + j];
+                //    }
+                //}
+
+                {
+#if 1
+                    // zT = y * xT
+                    cblas_sgemm(CblasRowMajor, CblasNoTrans, CblasTrans,
+                            ne11, ne01, ne10,
+                            1.0f,    y, ne00,
+                                     x, ne00,
+                            0.0f,    d, ne01);
+#else
+                    // zT = (xT * y)T
+                    cblas_sgemm(CblasColMajor, CblasTrans, CblasNoTrans,
+                            ne01, ne11, ne10,
+                            1.0f,    x, ne00,
+                                     y, ne00,
+                            0.0f,    d, ne01);
+#endif
+                }
+            }
+        }
+
+        return;
+    }
+#endif
+
+    if (params->type == GGML_TASK_INIT) {
+        if (nb01 >= nb00) {
+            char * wdata = params->wdata;
+
+            for (int i13 = 0; i13 < ne13; ++i13) {
+                for (int i12 = 0; i12 < ne12; ++i12) {
+                    for (int i11 = 0; i11 < ne11; ++i11) {
+                        //for (int i10 = 0; i10 < ne10; ++i10) {
+                        //    wdata[id++] = GGML_FP32_TO_FP16(*(float *)((char *) src1->data + i13*nb13 + i12*nb12 + i11*nb11 + i10*nb10));
+                        //}
+                        quantize_row_q8_0((float *)((char *) src1->data + i13*nb13 + i12*nb12 + i11*nb11), (void *) wdata, ne10);
+                        wdata += (ne10*GGML_TYPE_SIZE[GGML_TYPE_Q8_0])/GGML_BLCK_SIZE[GGML_TYPE_Q8_0];
+                    }
+                }
+            }
+
+            return;
+        }
+
+        // TODO: fix this memset (wsize is overestimated)
+        memset(params->wdata, 0, params->wsize);
+        return;
+    }
+
+    if (params->type == GGML_TASK_FINALIZE) {
+        if (nb01 >= nb00) {
+            return;
+        }
+
+        float * const wdata = params->wdata;
+
+        // cols per thread
+        const int dc = (ne + nth - 1)/nth;
+
+        // col range for this thread
+        const int ic0 = dc*ith;
+        const int ic1 = MIN(ic0 + dc, ne);
+
+        ggml_vec_cpy_f32(ic1 - ic0, (float *) dst->data + ic0, wdata + ic0);
+
+        for (int k = 1; k < nth; k++) {
+            ggml_vec_acc_f32(ic1 - ic0, (float *) dst->data + ic0, wdata + (ne + CACHE_LINE_SIZE_F32)*k + ic0);
+        }
+
+        return;
+    }
+
+    if (nb01 >= nb00) {
+        // TODO: do not support transposed src1
+
+        // parallelize by src0 rows using ggml_vec_dot_q8_0
+
+        // total rows in src0
+        const int nr = ne01*ne02*ne03;
+
+        // row range for this thread
+        int ir0;
+        int ir1;
+        ggml_thread_rows(nr, ith, nth, &ir0, &ir1);
+
+        void * wdata = params->wdata;
+
+        for (int ir = ir0; ir < ir1; ++ir) {
+            // src0 indices
+            const int i03 = ir/(ne02*ne01);
+            const int i02 = (ir - i03*ne02*ne01)/ne01;
+            const int i01 = (ir - i03*ne02*ne01 - i02*ne01);
+
+            const int i13 = i03;
+            const int i12 = i02;
+
+            const int i0 = i01;
+            const int i2 = i02;
+            const int i3 = i03;
+
+            void * src0_row = (void *) ((char *) src0->data + (i01*nb01 + i02*nb02 + i03*nb03));
+            char * src1_col =          ((char *)      wdata + (      (0 + i12*ne11 + i13*ne12*ne11)*ne00*GGML_TYPE_SIZE[GGML_TYPE_Q8_0])/GGML_BLCK_SIZE[GGML_TYPE_Q8_0]);
+
+            float * dst_col = (float *) ((char *) dst->data + (i0*nb0 + 0*nb1 + i2*nb2 + i3*nb3));
+
+            assert(ne00 % 32 == 0);
+
+            for (int ic = 0; ic < ne11; ++ic) {
+                ggml_vec_dot_q8_0(ne00, &dst_col[ic*ne0], src0_row, ((void *) (src1_col + (ic*ne00*GGML_TYPE_SIZE[GGML_TYPE_Q8_0])/GGML_BLCK_SIZE[GGML_TYPE_Q8_0])));
+            }
+        }
+    } else {
+        // parallelize by src1 columns using ggml_vec_mad_q8_0
+        // each thread has its own work data
+        // during FINALIZE we accumulate all work data into dst
+
+        // total columns in src1
+        const int nc = ne10;
+
+        // columns per thread
+        const int dc = (nc + nth - 1)/nth;
+
+        // column range for this thread
+        const int ic0 = dc*ith;
+        const int ic1 = MIN(ic0 + dc, nc);
+
+        // work data for thread
+        const int wo = (ne + CACHE_LINE_SIZE_F32)*ith;
+        float * const wdata = params->wdata;
+
+        for (int i13 = 0; i13 < ne13; ++i13) {
+            for (int i12 = 0; i12 < ne12; ++i12) {
+                for (int i11 = 0; i11 < ne11; ++i11) {
+                    // dst indices
+                    const int i1 = i11;
+                    const int i2 = i12;
+                    const int i3 = i13;
+
+                    float * dst_row = wdata + wo + i3*ne2*ne1*ne0 + i2*ne1*ne0 + i1*ne0;
+
+                    for (int ic = ic0; ic < ic1; ++ic) {
+                        // src1 indices
+                        const int i10 = ic;
+
+                        // src0 indices
+                        const int i03 = i13;
+                        const int i02 = i12;
+                        const int i00 = ic;
+
+                        assert(sizeof(float)*(wo + i3*ne2*ne1*ne0 + i2*ne1*ne0 + i1*ne0 + ne01) <= params->wsize);
+
+                        void * src0_col =   (void *) ((char *) src0->data + (i00*nb00 + i02*nb02 + i03*nb03));
+                        float  src1_val = *(float *) ((char *) src1->data + (i10*nb10 + i11*nb11 + i12*nb12 + i13*nb13));
+
+                        ggml_vec_mad_q8_0(ne01, dst_row, src0_col, src1_val);
+                    }
+                }
+            }
+        }
+    }
+}
+
+static void ggml_compute_forward_mul_mat_q4_0_r_f32(
+        const struct ggml_compute_params * params,
+        const struct ggml_tensor * src0,
+        const struct ggml_tensor * src1,
+              struct ggml_tensor * dst) {
+    const int ne00 = src0->ne[0];
+    const int ne01 = src0->ne[1];
+
+    const int ne10 = src1->ne[0];
+    const int ne11 = src1->ne[1];
+
+    const int nb01 = src0->nb[1];
+
+    const int nb10 = src1->nb[0];
+    const int nb11 = src1->nb[1];
+
+    const int nb0  = dst->nb[0];
+    const int nb1  = dst->nb[1];
+
+    const int ith = params->ith;
+    const int nth = params->nth;
+
+    // rows per group of src0
+    const int nr = ggml_q4_0_group_rows(src0->type);
+
+    // src0 is a weight matrix, src1 and dst are not transposed
+    GGML_ASSERT(src0->ne[2] == 1 && src0->ne[3] == 1);
+    GGML_ASSERT(src1->ne[2] == 1 && src1->ne[3] == 1);
+    GGML_ASSERT(ne00 == ne10);
+    GGML_ASSERT(ne01 % nr == 0);
+    GGML_ASSERT(dst->ne[0] == ne01);
+    GGML_ASSERT(dst->ne[1] == ne11);
+    GGML_ASSERT(nb10 == sizeof(float));
+    GGML_ASSERT(nb0  == sizeof(float));
+
+    // row size of src1 after conversion to Q4_0
+    const size_t row_size = (ne10*GGML_TYPE_SIZE[GGML_TYPE_Q4_0])/GGML_BLCK_SIZE[GGML_TYPE_Q4_0];
+
+    if (params->type == GGML_TASK_INIT) {
+        char * wdata = params->wdata;
+
+        for (int i11 = 0; i11 < ne11; ++i11) {
+            quantize_row_q4_0((float *) ((char *) src1->data + i11*nb11), (void *) wdata, ne10);
+            wdata += row_size;
+        }
+
+        return;
+    }
+
+    if (params->type == GGML_TASK_FINALIZE) {
+        return;
+    }
+
+    // parallelize by groups of src0 rows using ggml_vec_dot_q4_0_r: every
+    // block of src1 is unpacked once for the nr rows of a group
+
+    // group range for this thread
+    int ig0;
+    int ig1;
+    ggml_thread_rows(ne01/nr, ith, nth, &ig0, &ig1);
+
+    for (int ig = ig0; ig < ig1; ++ig) {
+        const void * src0_group = (const char *) src0->data + ig*nr*nb01;
+
+        for (int ic = 0; ic < ne11; ++ic) {
+            float * dst_col = (float *) ((char *) dst->data + ic*nb1) + ig*nr;
+
+            ggml_vec_dot_q4_0_r(ne00, nr, dst_col, src0_group, (char *) params->wdata + ic*row_size);
+        }
+    }
+}
+
+static void ggml_compute_forward_mul_mat(
+        const struct ggml_compute_params * params,
+        const struct ggml_tensor * src0,
+        const struct ggml_tensor * src1,
+        struct ggml_tensor * dst) {
+    switch (src0->type) {
+        case GGML_TYPE_Q4_0:
+            {
+                ggml_compute_forward_mul_mat_q4_0_f32(params, src0, src1, dst);
+            } break;
+        case GGML_TYPE_Q4_1:
+            {
+                ggml_compute_forward_mul_mat_q4_1_f32(params, src0, src1, dst);
+            } break;
+        case GGML_TYPE_Q8_0:
+            {
+                ggml_compute_forward_mul_mat_q8_0_f32(params, src0, src1, dst);
+            } break;
+        case GGML_TYPE_Q4_0_R4:
+        case GGML_TYPE_Q4_0_R8:
+            {
+                ggml_compute_forward_mul_mat_q4_0_r_f32(params, src0, src1, dst);
+            } break;
+        case GGML_TYPE_F16:
+            {
+                ggml_compute_forward_mul_mat_f16_f32(params, src0, src1, dst);
+            } break;
+        case GGML_TYPE_F32:
+            {
+                ggml_compute_forward_mul_mat_f32(params, src0, src1, dst);
+            } break;
+        case GGML_TYPE_I8:
+        case GGML_TYPE_I16:
+        case GGML_TYPE_I32:
+        case GGML_TYPE_COUNT:
+            {
+                GGML_ASSERT(false);
+            } break;
+    }
+
+#if 0
+    if (src0->type == GGML_TYPE_F16 || src0->type == GGML_TYPE_Q4_1) {
+        static int first = 8;
+        printf("src0: ne0 = %5d, ne1 = %5d, ne2 = %5d\n", src0->ne[0], src0->ne[1], src0->ne[2]);
+        printf("src1: ne0 = %5d, ne1 = %5d, ne2 = %5d\n", src1->ne[0], src1->ne[1], src1->ne[2]);
+        printf("dst:  ne0 = %5d, ne1 = %5d, ne2 = %5d\n", dst->ne[0], dst->ne[1], dst->ne[2]);
+        if (first) {
+            --first;
+        } else {
+            for (int k = 0; k < dst->ne[1]; ++k) {
+                for (int j = 0; j < dst->ne[0]/16; ++j) {
+                    for (int i = 0; i < 16; ++i) {
+                        printf("%8.4f ", ((float *) dst->data)[k*dst->ne[0] + j*16 + i]);
+                    }
+                    printf("\n");
+                }
+                printf("\n");
+            }
+            printf("\n");
+            exit(0);
+        }
+    } else {
+        printf("aaaa src0: ne0 = %5d, ne1 = %5d, ne2 = %5d\n", src0->ne[0], src0->ne[1], src0->ne[2]);
+        printf("aaaa src1: ne0 = %5d, ne1 = %5d, ne2 = %5d\n", src1->ne[0], src1->ne[1], src1->ne[2]);
+        printf("aaaa dst:  ne0 = %5d, ne1 = %5d, ne2 = %5d\n", dst->ne[0], dst->ne[1], dst->ne[2]);
+    }
+#endif
+}
+
+// ggml_compute_forward_swiglu
+
+// size of the work buffer needed to convert src1 to the vec_dot type of src0
+static size_t ggml_swiglu_wsize(const struct ggml_tensor * src0, const struct ggml_tensor * src1) {
+    switch (src0->type) {
+        case GGML_TYPE_Q4_0:
+        case GGML_TYPE_Q4_1:
+        case GGML_TYPE_Q8_0:
+        case GGML_TYPE_Q4_0_R4:
+        case GGML_TYPE_Q4_0_R8:
+        case GGML_TYPE_F16:
+            return (GGML_TYPE_SIZE[src0->type]*ggml_nelements(src1))/GGML_BLCK_SIZE[src0->type];
+        case GGML_TYPE_F32:
+            return 0;
+        case GGML_TYPE_I8:
+        case GGML_TYPE_I16:
+        case GGML_TYPE_I32:
+        case GGML_TYPE_COUNT:
+            {
+                GGML_ASSERT(false);
+            } break;
+    }
+
+    return 0;
+}
+
+inline static void ggml_vec_dot_swiglu(enum ggml_type type, const int n, float * restrict s, void * restrict x, void * restrict y) {
+    switch (type) {
+        case GGML_TYPE_Q4_0: ggml_vec_dot_q4_0(n, s, x, y); break;
+        case GGML_TYPE_Q4_1: ggml_vec_dot_q4_1(n, s, x, y); break;
+        case GGML_TYPE_Q8_0: ggml_vec_dot_q8_0(n, s, x, y); break;
+        case GGML_TYPE_F16:  ggml_vec_dot_f16 (n, s, x, y); break;
+        case GGML_TYPE_F32:  ggml_vec_dot_f32 (n, s, x, y); break;
+        default: GGML_ASSERT(false);
+    }
+}
+
+static void ggml_compute_forward_swiglu(
+        const struct ggml_compute_params * params,
+        const struct ggml_tensor * src0,
+        const struct ggml_tensor * src1,
+              struct ggml_tensor * dst) {
+    const int ne00 = src0->ne[0];
+    const int ne01 = src0->ne[1];
+
+    const int ne10 = src1->ne[0];
+    const int ne11 = src1->ne[1];
+
+    const int nb00 = src0->nb[0];
+    const int nb01 = src0->nb[1];
+
+    const int nb10 = src1->nb[0];
+    const int nb11 = src1->nb[1];
+
+    const int nb0  = dst->nb[0];
+    const int nb1  = dst->nb[1];
+
+    const int ith = params->ith;
+    const int nth = params->nth;
+
+    const enum ggml_type type = src0->type;
+
+    GGML_ASSERT(ne00 == ne10);
+    GGML_ASSERT(dst->ne[0] == ne01/2);
+    GGML_ASSERT(dst->ne[1] == ne11);
+
+    // src0 rows must be contiguous, src1 and dst rows must be contiguous
+    GGML_ASSERT(nb00 == (int) GGML_TYPE_SIZE[type]);
+    GGML_ASSERT(nb10 == sizeof(float));
+    GGML_ASSERT(nb0  == sizeof(float));
+
+    // row size of src1 after conversion to the vec_dot type of src0
+    const size_t row_size = (ne10*GGML_TYPE_SIZE[type])/GGML_BLCK_SIZE[type];
+
+    if (params->type == GGML_TASK_INIT) {
+        char * wdata = params->wdata;
+
+        for (int i11 = 0; i11 < ne11; ++i11) {
+            const float * x = (float *) ((char *) src1->data + i11*nb11);
+
+            switch (type) {
+                case GGML_TYPE_Q4_0:
+                case GGML_TYPE_Q4_0_R4:
+                case GGML_TYPE_Q4_0_R8:
+                    {
+                        quantize_row_q4_0(x, wdata, ne10);
+                    } break;
+                case GGML_TYPE_Q4_1:
+                    {
+                        quantize_row_q4_1(x, wdata, ne10);
+                    } break;
+                case GGML_TYPE_Q8_0:
+                    {
+                        quantize_row_q8_0(x, wdata, ne10);
+                    } break;
+                case GGML_TYPE_F16:
+                    {
+                        for (int i10 = 0; i10 < ne10; ++i10) {
+                            ((ggml_fp16_t *) wdata)[i10] = GGML_FP32_TO_FP16(x[i10]);
+                        }
+                    } break;
+                case GGML_TYPE_F32:
+                    {
+                        return;
+                    }
+                default:
+                    {
+                        GGML_ASSERT(false);
+                    } break;
+            }
+
+            wdata += row_size;
+        }
+
+        return;
+    }
+
+    if (params->type == GGML_TASK_FINALIZE) {
+        return;
+    }
+
+    // rows per group of src0 if its blocks are interleaved
+    const int ng = ggml_q4_0_group_rows(type);
+
+    if (ng > 0) {
+        // parallelize by groups of src0 rows using ggml_vec_dot_q4_0_r: a
+        // group holds the W1 and W3 rows of ng/2 gated activations
+
+        GGML_ASSERT(ne01 % ng == 0);
+
+        // group range for this thread
+        int ig0;
+        int ig1;
+        ggml_thread_rows(ne01/ng, ith, nth, &ig0, &ig1);
+
+        float s[8];
+
+        for (int ig = ig0; ig < ig1; ++ig) {
+            char * src0_group = (char *) src0->data + ig*ng*nb01;
+
+            for (int ic = 0; ic < ne11; ++ic) {
+                ggml_vec_dot_q4_0_r(ne00, ng, s, src0_group, (char *) params->wdata + ic*row_size);
+
+                float * dst_row = (float *) ((char *) dst->data + ic*nb1);
+
+                for (int k = 0; k < ng/2; ++k) {
+                    float g = s[2*k + 0];
+                    float u = s[2*k + 1];
+
+                    // same SiLU approximation as ggml_silu()
+                    ggml_vec_silu_f32(1, &g, &g);
+
+                    dst_row[ig*ng/2 + k] = g*u;
+                }
+            }
+        }
+
+        return;
+    }
+
+    // parallelize by gate rows: each task computes the W1 and W3 rows which
+    // are adjacent in src0 and writes only the gated activation
+
+    // total rows in dst
+    const int nr = ne01/2;
+
+    // row range for this thread
+    int ir0;
+    int ir1;
+    ggml_thread_rows(nr, ith, nth, &ir0, &ir1);
+
+    for (int ir = ir0; ir < ir1; ++ir) {
+        char * src0_w1 = (char *) src0->data + (2*ir + 0)*nb01;
+        char * src0_w3 = (char *) src0->data + (2*ir + 1)*nb01;
+
+        for (int ic = 0; ic < ne11; ++ic) {
+            void * src1_col = type == GGML_TYPE_F32
+                ? (void *) ((char *) src1->data   + ic*nb11)
+                : (void *) ((char *) params->wdata + ic*row_size);
+
+            float g = 0.0f;
+            float u = 0.0f;
+
+            ggml_vec_dot_swiglu(type, ne00, &g, src0_w1, src1_col);
+            ggml_vec_dot_swiglu(type, ne00, &u, src0_w3, src1_col);
+
+            float * dst_row = (float *) ((char *) dst->data + ic*nb1);
+
+            // same SiLU approximation as ggml_silu()
+            ggml_vec_silu_f32(1, &g, &g);
+
+            dst_row[ir] = g*u;
+        }
+    }
+}
+
+// ggml_compute_forward_scale
+
+static void ggml_compute_forward_scale_f32(
+        const struct ggml_compute_params * params,
+        const struct ggml_tensor * src0,
+        const struct ggml_tensor * src1,
+        struct ggml_tensor * dst) {
+    GGML_ASSERT(ggml_is_contiguous(src0));
+    GGML_ASSERT(ggml_is_contiguous(dst));
+    GGML_ASSERT(ggml_are_same_shape(src0, dst));
+    GGML_ASSERT(ggml_is_scalar(src1));
+
+    if (params->type == GGML_TASK_INIT || params->type == GGML_TASK_FINALIZE) {
+        return;
+    }
+
+    // scale factor
+    const float v = *(float *) src1->data;
+
+    const int ith = params->ith;
+    const int nth = params->nth;
+
+    const int nc = src0->ne[0];
+    const int nr = ggml_nrows(src0);
+
+    // rows per thread
+    const int dr = (nr + nth - 1)/nth;
+
+    // row range for this thread
+    const int ir0 = dr*ith;
+    const int ir1 = MIN(ir0 + dr, nr);
+
+    for (int i1 = ir0; i1 < ir1; i1++) {
+        ggml_vec_scale_f32(nc, (float *) ((char *) dst->data + i1*(dst->nb[1])), v);
+    }
+}
+
+static void ggml_compute_forward_scale(
+        const struct ggml_compute_params * params,
+        const struct ggml_tensor * src0,
+        const struct ggml_tensor * src1,
+        struct ggml_tensor * dst) {
+    switch (src0->type) {
+        case GGML_TYPE_F32:
+            {
+                ggml_compute_forward_scale_f32(params, src0, src1, dst);
+            } break;
+        case GGML_TYPE_Q4_0:
+        case GGML_TYPE_Q4_1:
+        case GGML_TYPE_Q8_0:
+        case GGML_TYPE_I8:
+        case GGML_TYPE_I16:
+        case GGML_TYPE_I32:
+        case GGML_TYPE_F16:
+        case GGML_TYPE_Q4_0_R4:
+        case GGML_TYPE_Q4_0_R8:
+        case GGML_TYPE_COUNT:
+            {
+                GGML_ASSERT(false);
+            } break;
+    }
+}
+
+// ggml_compute_forward_cpy
+
+static void ggml_compute_forward_cpy(
+        const struct ggml_compute_params * params,
+        const struct ggml_tensor * src0,
+        struct ggml_tensor * dst) {
+    ggml_compute_forward_dup(params, src0, dst);
+}
+
+// ggml_compute_forward_reshape
+
+static void ggml_compute_forward_reshape(
+        const struct ggml_compute_params * params,
+        const struct ggml_tensor * src0,
+        struct ggml_tensor * dst) {
+    // NOP
+    UNUSED(params);
+    UNUSED(src0);
+    UNUSED(dst);
+}
+
+// ggml_compute_forward_view
+
+static void ggml_compute_forward_view(
+        const struct ggml_compute_params * params,
+        const struct ggml_tensor * src0) {
+    // NOP
+    UNUSED(params);
+    UNUSED(src0);
+}
+
+// ggml_compute_forward_permute
+
+static void ggml_compute_forward_permute(
         const struct ggml_compute_params * params,
         const struct ggml_tensor * src0) {
     // NOP
@@ -7032,9 +8487,36 @@ static void ggml_compute_forward_transpose(
     UNUSED(src0);
 }
 
-// ggml_compute_forward_get_rows
-
-static void ggml_compute_forward_get_rows_q4_0(
+// ggml_compute_forward_get_rows
+
+static void ggml_compute_forward_get_rows_q4_0(
+        const struct ggml_compute_params * params,
+        const struct ggml_tensor * src0,
+        const struct ggml_tensor * src1,
+              struct ggml_tensor * dst) {
+    assert(params->ith == 0);
+
+    if (params->type == GGML_TASK_INIT || params->type == GGML_TASK_FINALIZE) {
+        return;
+    }
+
+    const int nc = src0->ne[0];
+    const int nr = ggml_nelements(src1);
+
+    assert( dst->ne[0] == nc);
+    assert( dst->ne[1] == nr);
+    assert(src0->nb[0] == GGML_TYPE_SIZE[GGML_TYPE_Q4_0]);
+
+    for (int i = 0; i < nr; ++i) {
+        const int r = ((int32_t *) src1->data)[i];
+
+        dequantize_row_q4_0(
+                (const void *) ((char *) src0->data + r*src0->nb[1]),
+                     (float *) ((char *)  dst->data + i*dst->nb[1]), nc);
+    }
+}
+
+static void ggml_compute_forward_get_rows_q4_1(
         const struct ggml_compute_params * params,
         const struct ggml_tensor * src0,
         const struct ggml_tensor * src1,
@@ -7050,18 +8532,18 @@ static void ggml_compute_forward_get_rows_q4_0(
 
     assert( dst->ne[0] == nc);
     assert( dst->ne[1] == nr);
-    assert(src0->nb[0] == GGML_TYPE_SIZE[GGML_TYPE_Q4_0]);
+    assert(src0->nb[0] == GGML_TYPE_SIZE[GGML_TYPE_Q4_1]);
 
     for (int i = 0; i < nr; ++i) {
         const int r = ((int32_t *) src1->data)[i];
 
-        dequantize_row_q4_0(
+        dequantize_row_q4_1(
                 (const void *) ((char *) src0->data + r*src0->nb[1]),
                      (float *) ((char *)  dst->data + i*dst->nb[1]), nc);
     }
 }
 
-static void ggml_compute_forward_get_rows_q4_1(
+static void ggml_compute_forward_get_rows_q8_0(
         const struct ggml_compute_params * params,
         const struct ggml_tensor * src0,
         const struct ggml_tensor * src1,
@@ -7077,12 +8559,12 @@ static void ggml_compute_forward_get_rows_q4_1(
 
     assert( dst->ne[0] == nc);
     assert( dst->ne[1] == nr);
-    assert(src0->nb[0] == GGML_TYPE_SIZE[GGML_TYPE_Q4_1]);
+    assert(src0->nb[0] == GGML_TYPE_SIZE[GGML_TYPE_Q8_0]);
 
     for (int i = 0; i < nr; ++i) {
         const int r = ((int32_t *) src1->data)[i];
 
-        dequantize_row_q4_1(
+        dequantize_row_q8_0(
                 (const void *) ((char *) src0->data + r*src0->nb[1]),
                      (float *) ((char *)  dst->data + i*dst->nb[1]), nc);
     }
@@ -7165,9 +8647,15 @@ static void ggml_compute_forward_get_rows(
             {
                 ggml_compute_forward_get_rows_f32(params, src0, src1, dst);
             } break;
+        case GGML_TYPE_Q8_0:
+            {
+                ggml_compute_forward_get_rows_q8_0(params, src0, src1, dst);
+            } break;
         case GGML_TYPE_I8:
         case GGML_TYPE_I16:
         case GGML_TYPE_I32:
+        case GGML_TYPE_Q4_0_R4:
+        case GGML_TYPE_Q4_0_R8:
         case GGML_TYPE_COUNT:
             {
                 GGML_ASSERT(false);
@@ -7193,6 +8681,37 @@ static void ggml_compute_forward_get_rows(
     //}
 }
 
+// ggml_compute_forward_set_rows
+
+static void ggml_compute_forward_set_rows(
+        const struct ggml_compute_params * params,
+        const struct ggml_tensor * src0,
+        const struct ggml_tensor * src1,
+              struct ggml_tensor * dst) {
+    assert(params->ith == 0);
+
+    if (params->type == GGML_TASK_INIT || params->type == GGML_TASK_FINALIZE) {
+        return;
+    }
+
+    const int nc = src0->ne[0];
+    const int nr = ggml_nelements(src1);
+
+    assert( dst->ne[0] == nc);
+    assert(src0->ne[1] == nr);
+    assert(src0->nb[0] == sizeof(float));
+
+    for (int i = 0; i < nr; ++i) {
+        const int r = ((int32_t *) src1->data)[i];
+
+        assert(r >= 0 && r < dst->ne[1]);
+
+        ggml_row_from_f32(dst->type,
+                (const float *) ((char *) src0->data + i*src0->nb[1]),
+                       (void *) ((char *)  dst->data + r*dst->nb[1]), nc);
+    }
+}
+
 // ggml_compute_forward_diag_mask_inf
 
 static void ggml_compute_forward_diag_mask_inf_f32(
@@ -7243,10 +8762,13 @@ static void ggml_compute_forward_diag_mask_inf(
             } break;
         case GGML_TYPE_Q4_0:
         case GGML_TYPE_Q4_1:
+        case GGML_TYPE_Q8_0:
         case GGML_TYPE_I8:
         case GGML_TYPE_I16:
         case GGML_TYPE_I32:
         case GGML_TYPE_F16:
+        case GGML_TYPE_Q4_0_R4:
+        case GGML_TYPE_Q4_0_R8:
         case GGML_TYPE_COUNT:
             {
                 GGML_ASSERT(false);
@@ -7337,10 +8859,13 @@ static void ggml_compute_forward_soft_max(
             } break;
         case GGML_TYPE_Q4_0:
         case GGML_TYPE_Q4_1:
+        case GGML_TYPE_Q8_0:
         case GGML_TYPE_I8:
         case GGML_TYPE_I16:
         case GGML_TYPE_I32:
         case GGML_TYPE_F16:
+        case GGML_TYPE_Q4_0_R4:
+        case GGML_TYPE_Q4_0_R8:
         case GGML_TYPE_COUNT:
             {
                 GGML_ASSERT(false);
@@ -7367,6 +8892,9 @@ static void ggml_compute_forward_rope_f32(
     const int n_dims = ((int32_t *) src1->data)[1];
     const int mode   = ((int32_t *) src1->data)[2];
 
+    // positions given by ggml_rope_pos
+    const int32_t * pos = dst->opt[0] ? (const int32_t *) dst->opt[0]->data : NULL;
+
     //const int ne0 = src0->ne[0];
     const int ne1 = src0->ne[1];
     const int ne2 = src0->ne[2];
@@ -7385,7 +8913,7 @@ static void ggml_compute_forward_rope_f32(
     // TODO: optimize
     for (int i3 = 0; i3 < ne3; i3++) {
         for (int i2 = (mode == 0 ? 0 : n_past); i2 < ne2; i2++) {
-            const int p = (mode == 0 ? n_past + i2 : i2);
+            const int p = pos ? pos[i2] : (mode == 0 ? n_past + i2 : i2);
             for (int i1 = 0; i1 < ne1; i1++) {
                 for (int i0 = 0; i0 < n_dims; i0 += 2) {
                     const double theta = pow(10000.0, ((double)-i0)/n_dims);
@@ -7424,6 +8952,9 @@ static void ggml_compute_forward_rope_f16(
     const int n_dims = ((int32_t *) src1->data)[1];
     const int mode   = ((int32_t *) src1->data)[2];
 
+    // positions given by ggml_rope_pos
+    const int32_t * pos = dst->opt[0] ? (const int32_t *) dst->opt[0]->data : NULL;
+
     //const int ne0 = src0->ne[0];
     const int ne1 = src0->ne[1];
     const int ne2 = src0->ne[2];
@@ -7441,7 +8972,7 @@ static void ggml_compute_forward_rope_f16(
 
     for (int i3 = 0; i3 < ne3; i3++) {
         for (int i2 = (mode == 0 ? 0 : n_past); i2 < ne2; i2++) {
-            const int p = (mode == 0 ? n_past + i2 : i2);
+            const int p = pos ? pos[i2] : (mode == 0 ? n_past + i2 : i2);
             for (int i1 = 0; i1 < ne1; i1++) {
                 for (int i0 = 0; i0 < n_dims; i0 += 2) {
                     const double theta = pow(10000.0, ((double)-i0)/n_dims);
@@ -7479,9 +9010,12 @@ static void ggml_compute_forward_rope(
             } break;
         case GGML_TYPE_Q4_0:
         case GGML_TYPE_Q4_1:
+        case GGML_TYPE_Q8_0:
         case GGML_TYPE_I8:
         case GGML_TYPE_I16:
         case GGML_TYPE_I32:
+        case GGML_TYPE_Q4_0_R4:
+        case GGML_TYPE_Q4_0_R8:
         case GGML_TYPE_COUNT:
             {
                 GGML_ASSERT(false);
@@ -7747,9 +9281,12 @@ static void ggml_compute_forward_conv_1d_1s(
             } break;
         case GGML_TYPE_Q4_0:
         case GGML_TYPE_Q4_1:
+        case GGML_TYPE_Q8_0:
         case GGML_TYPE_I8:
         case GGML_TYPE_I16:
         case GGML_TYPE_I32:
+        case GGML_TYPE_Q4_0_R4:
+        case GGML_TYPE_Q4_0_R8:
         case GGML_TYPE_COUNT:
             {
                 GGML_ASSERT(false);
@@ -8015,9 +9552,12 @@ static void ggml_compute_forward_conv_1d_2s(
             } break;
         case GGML_TYPE_Q4_0:
         case GGML_TYPE_Q4_1:
+        case GGML_TYPE_Q8_0:
         case GGML_TYPE_I8:
         case GGML_TYPE_I16:
         case GGML_TYPE_I32:
+        case GGML_TYPE_Q4_0_R4:
+        case GGML_TYPE_Q4_0_R8:
         case GGML_TYPE_COUNT:
             {
                 GGML_ASSERT(false);
@@ -8500,9 +10040,12 @@ static void ggml_compute_forward_flash_attn(
             } break;
         case GGML_TYPE_Q4_0:
         case GGML_TYPE_Q4_1:
+        case GGML_TYPE_Q8_0:
         case GGML_TYPE_I8:
         case GGML_TYPE_I16:
         case GGML_TYPE_I32:
+        case GGML_TYPE_Q4_0_R4:
+        case GGML_TYPE_Q4_0_R8:
         case GGML_TYPE_COUNT:
             {
                 GGML_ASSERT(false);
@@ -8711,9 +10254,12 @@ static void ggml_compute_forward_flash_ff(
             } break;
         case GGML_TYPE_Q4_0:
         case GGML_TYPE_Q4_1:
+        case GGML_TYPE_Q8_0:
         case GGML_TYPE_I8:
         case GGML_TYPE_I16:
         case GGML_TYPE_I32:
+        case GGML_TYPE_Q4_0_R4:
+        case GGML_TYPE_Q4_0_R8:
         case GGML_TYPE_COUNT:
             {
                 GGML_ASSERT(false);
@@ -8807,6 +10353,10 @@ static void ggml_compute_forward(struct ggml_compute_params * params, struct ggm
             {
                 ggml_compute_forward_mul_mat(params, tensor->src0, tensor->src1, tensor);
             } break;
+        case GGML_OP_SWIGLU:
+            {
+                ggml_compute_forward_swiglu(params, tensor->src0, tensor->src1, tensor);
+            } break;
         case GGML_OP_SCALE:
             {
                 ggml_compute_forward_scale(params, tensor->src0, tensor->src1, tensor);
@@ -8835,6 +10385,10 @@ static void ggml_compute_forward(struct ggml_compute_params * params, struct ggm
             {
                 ggml_compute_forward_get_rows(params, tensor->src0, tensor->src1, tensor);
             } break;
+        case GGML_OP_SET_ROWS:
+            {
+                ggml_compute_forward_set_rows(params, tensor->src0, tensor->src1, tensor);
+            } break;
         case GGML_OP_DIAG_MASK_INF:
             {
                 ggml_compute_forward_diag_mask_inf(params, tensor->src0, tensor->src1, tensor);
@@ -9064,6 +10618,10 @@ static void ggml_compute_backward(struct ggml_context * ctx, struct ggml_tensor
                                 inplace);
                 }
             } break;
+        case GGML_OP_SWIGLU:
+            {
+                GGML_ASSERT(false); // TODO: not implemented
+            } break;
         case GGML_OP_SCALE:
             {
                 GGML_ASSERT(false); // TODO: not implemented
@@ -9092,6 +10650,10 @@ static void ggml_compute_backward(struct ggml_context * ctx, struct ggml_tensor
             {
                 GGML_ASSERT(false); // TODO: not implemented
             } break;
+        case GGML_OP_SET_ROWS:
+            {
+                GGML_ASSERT(false); // TODO: not implemented
+            } break;
         case GGML_OP_DIAG_MASK_INF:
             {
                 GGML_ASSERT(false); // TODO: not implemented
@@ -9199,6 +10761,8 @@ static void ggml_build_forward_impl(struct ggml_cgraph * cgraph, struct ggml_ten
     if (n_new > 0) {
         // the last added node should always be starting point
         GGML_ASSERT(cgraph->nodes[cgraph->n_nodes - 1] == tensor);
+
+        cgraph->planned = false;
     }
 }
 
@@ -9213,6 +10777,7 @@ struct ggml_cgraph ggml_build_forward(struct ggml_tensor * tensor) {
         /*.n_threads    =*/ 0,
         /*.work_size    =*/ 0,
         /*.work         =*/ NULL,
+        /*.planned      =*/ false,
         /*.nodes        =*/ { NULL },
         /*.grads        =*/ { NULL },
         /*.leafs        =*/ { NULL },
@@ -9273,125 +10838,645 @@ struct ggml_cgraph ggml_build_backward(struct ggml_context * ctx, struct ggml_cg
 
 #ifdef __APPLE__
 
-//#include <os/lock.h>
-//
-//typedef os_unfair_lock ggml_lock_t;
-//
-//#define ggml_lock_init(x)    UNUSED(x)
-//#define ggml_lock_destroy(x) UNUSED(x)
-//#define ggml_lock_lock       os_unfair_lock_lock
-//#define ggml_lock_unlock     os_unfair_lock_unlock
-//
-//#define GGML_LOCK_INITIALIZER OS_UNFAIR_LOCK_INIT
+//#include <os/lock.h>
+//
+//typedef os_unfair_lock ggml_lock_t;
+//
+//#define ggml_lock_init(x)    UNUSED(x)
+//#define ggml_lock_destroy(x) UNUSED(x)
+//#define ggml_lock_lock       os_unfair_lock_lock
+//#define ggml_lock_unlock     os_unfair_lock_unlock
+//
+//#define GGML_LOCK_INITIALIZER OS_UNFAIR_LOCK_INIT
+
+typedef int ggml_lock_t;
+
+#define ggml_lock_init(x)    UNUSED(x)
+#define ggml_lock_destroy(x) UNUSED(x)
+#define ggml_lock_lock(x)    UNUSED(x)
+#define ggml_lock_unlock(x)  UNUSED(x)
+
+#define GGML_LOCK_INITIALIZER 0
+
+typedef pthread_t ggml_thread_t;
+
+#define ggml_thread_create pthread_create
+#define ggml_thread_join   pthread_join
+
+#else
+
+//typedef pthread_spinlock_t ggml_lock_t;
+
+//#define ggml_lock_init(x) pthread_spin_init(x, PTHREAD_PROCESS_PRIVATE)
+//#define ggml_lock_destroy pthread_spin_destroy
+//#define ggml_lock_lock    pthread_spin_lock
+//#define ggml_lock_unlock  pthread_spin_unlock
+
+typedef int ggml_lock_t;
+
+#define ggml_lock_init(x)    UNUSED(x)
+#define ggml_lock_destroy(x) UNUSED(x)
+#define ggml_lock_lock(x)    UNUSED(x)
+#define ggml_lock_unlock(x)  UNUSED(x)
+
+#define GGML_LOCK_INITIALIZER 0
+
+typedef pthread_t ggml_thread_t;
+
+#define ggml_thread_create pthread_create
+#define ggml_thread_join   pthread_join
+
+#endif
+
+struct ggml_compute_state_shared {
+    ggml_lock_t spin;
+
+    int n_threads;
+
+    // synchronization primitives
+    atomic_int  n_ready;
+    atomic_bool has_work;
+    atomic_bool stop; // stop all threads
+};
+
+struct ggml_compute_state {
+    ggml_thread_t thrd;
+
+    struct ggml_compute_params params;
+    struct ggml_tensor * node;
+
+    struct ggml_compute_state_shared * shared;
+};
+
+static thread_ret_t ggml_graph_compute_thread(void * data) {
+    struct ggml_compute_state * state = (struct ggml_compute_state *) data;
+
+    const int n_threads = state->shared->n_threads;
+
+    ggml_numa_pin_thread(state->params.ith, n_threads, NULL);
+
+    while (true) {
+        if (atomic_fetch_add(&state->shared->n_ready, 1) == n_threads - 1) {
+            atomic_store(&state->shared->has_work, false);
+        } else {
+            while (atomic_load(&state->shared->has_work)) {
+                if (atomic_load(&state->shared->stop)) {
+                    return 0;
+                }
+                ggml_lock_lock  (&state->shared->spin);
+                ggml_lock_unlock(&state->shared->spin);
+            }
+        }
+
+        atomic_fetch_sub(&state->shared->n_ready, 1);
+
+        // wait for work
+        while (!atomic_load(&state->shared->has_work)) {
+            if (atomic_load(&state->shared->stop)) {
+                return 0;
+            }
+            ggml_lock_lock  (&state->shared->spin);
+            ggml_lock_unlock(&state->shared->spin);
+        }
+
+        // check if we should stop
+        if (atomic_load(&state->shared->stop)) {
+            break;
+        }
+
+        if (state->node) {
+            if (state->params.ith < state->params.nth) {
+                ggml_compute_forward(&state->params, state->node);
+            }
+
+            state->node = NULL;
+        } else {
+            break;
+        }
+    }
+
+    return 0;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+// memory planning of intermediate results
+
+struct ggml_alloc_block {
+    size_t offs;
+    size_t size;
+};
+
+// free regions of the scratch memory, sorted by offset
+struct ggml_alloc_state {
+    struct ggml_alloc_block * blocks;
+    int n_blocks;
+
+    size_t top;  // end of the used part of the memory
+    size_t peak;
+};
+
+static size_t ggml_alloc_block_take(struct ggml_alloc_state * state, size_t size) {
+    // best fit among the free blocks
+    int best = -1;
+    for (int i = 0; i < state->n_blocks; i++) {
+        if (state->blocks[i].size >= size && (best < 0 || state->blocks[i].size < state->blocks[best].size)) {
+            best = i;
+        }
+    }
+
+    if (best >= 0) {
+        const size_t offs = state->blocks[best].offs;
+
+        state->blocks[best].offs += size;
+        state->blocks[best].size -= size;
+
+        if (state->blocks[best].size == 0) {
+            memmove(&state->blocks[best], &state->blocks[best + 1], (state->n_blocks - best - 1)*sizeof(struct ggml_alloc_block));
+            state->n_blocks--;
+        }
+
+        return offs;
+    }
+
+    // grow the memory; a free block at its end becomes part of the new region
+    size_t offs = state->top;
+    if (state->n_blocks > 0) {
+        struct ggml_alloc_block * last = &state->blocks[state->n_blocks - 1];
+        if (last->offs + last->size == state->top) {
+            offs = last->offs;
+            state->n_blocks--;
+        }
+    }
+
+    state->top  = offs + size;
+    state->peak = MAX(state->peak, state->top);
+
+    return offs;
+}
+
+static void ggml_alloc_block_free(struct ggml_alloc_state * state, size_t offs, size_t size) {
+    int i = 0;
+    while (i < state->n_blocks && state->blocks[i].offs < offs) {
+        i++;
+    }
+
+    memmove(&state->blocks[i + 1], &state->blocks[i], (state->n_blocks - i)*sizeof(struct ggml_alloc_block));
+    state->blocks[i] = (struct ggml_alloc_block) { offs, size };
+    state->n_blocks++;
+
+    // merge with the neighbours
+    if (i + 1 < state->n_blocks && state->blocks[i].offs + state->blocks[i].size == state->blocks[i + 1].offs) {
+        state->blocks[i].size += state->blocks[i + 1].size;
+        memmove(&state->blocks[i + 1], &state->blocks[i + 2], (state->n_blocks - i - 2)*sizeof(struct ggml_alloc_block));
+        state->n_blocks--;
+    }
+
+    if (i > 0 && state->blocks[i - 1].offs + state->blocks[i - 1].size == state->blocks[i].offs) {
+        state->blocks[i - 1].size += state->blocks[i].size;
+        memmove(&state->blocks[i], &state->blocks[i + 1], (state->n_blocks - i - 1)*sizeof(struct ggml_alloc_block));
+        state->n_blocks--;
+        i--;
+    }
+
+    // give the free end back
+    if (state->blocks[i].offs + state->blocks[i].size == state->top) {
+        state->top = state->blocks[i].offs;
+        state->n_blocks--;
+    }
+}
+
+static int ggml_alloc_cmp_tensor(const void * a, const void * b) {
+    const uintptr_t pa = (uintptr_t) *(struct ggml_tensor * const *) a;
+    const uintptr_t pb = (uintptr_t) *(struct ggml_tensor * const *) b;
+
+    return (pa > pb) - (pa < pb);
+}
+
+static int ggml_alloc_find(struct ggml_tensor ** tensors, int n, const struct ggml_tensor * tensor) {
+    struct ggml_tensor ** found = bsearch(&tensor, tensors, n, sizeof(struct ggml_tensor *), ggml_alloc_cmp_tensor);
+
+    return found ? (int) (found - tensors) : -1;
+}
+
+size_t ggml_graph_alloc(struct ggml_cgraph * cgraph, void * data) {
+    const int n_max = cgraph->n_nodes + cgraph->n_leafs;
+
+    struct ggml_tensor ** tensors = malloc(n_max*sizeof(struct ggml_tensor *));
+
+    int n = 0;
+
+    for (int i = 0; i < cgraph->n_nodes + cgraph->n_leafs; i++) {
+        struct ggml_tensor * t = i < cgraph->n_nodes ? cgraph->nodes[i] : cgraph->leafs[i - cgraph->n_nodes];
+
+        if (t->is_scratch) {
+            tensors[n++] = t;
+        }
+    }
+
+    // objects are appended to the context, so this is the order of creation
+    qsort(tensors, n, sizeof(struct ggml_tensor *), ggml_alloc_cmp_tensor);
+
+    int    * owner    = malloc(n*sizeof(int));    // tensor -> index of the tensor owning its memory
+    char  ** data_old = malloc(n*sizeof(char *));
+    size_t * size     = malloc(n*sizeof(size_t)); // of owners
+    size_t * offs     = malloc(n*sizeof(size_t)); // of owners
+    int    * first    = malloc(n*sizeof(int));    // of owners
+    int    * last     = malloc(n*sizeof(int));    // of owners
+    int    * owners   = malloc(n*sizeof(int));
+
+    int n_owners = 0;
+
+    // the scratch memory is handed out in increasing order, so a tensor either starts a new
+    // region or is a view into the region of the last owner that starts at or below its data
+    for (int i = 0; i < n; i++) {
+        struct ggml_tensor * t = tensors[i];
+
+        data_old[i] = t->data;
+        owner[i] = i;
+
+        int l = 0;
+        int r = n_owners;
+        while (l < r) {
+            const int m = (l + r)/2;
+            if (data_old[owners[m]] <= (char *) t->data) {
+                l = m + 1;
+            } else {
+                r = m;
+            }
+        }
+
+        if (l > 0) {
+            const int o = owners[l - 1];
+            if ((char *) t->data < data_old[o] + size[o]) {
+                owner[i] = o;
+                continue;
+            }
+        }
+
+        GGML_ASSERT(l == n_owners);
+
+        size[i]  = ((ggml_nbytes(t) + GGML_MEM_ALIGN - 1)/GGML_MEM_ALIGN)*GGML_MEM_ALIGN;
+        offs[i]  = 0;
+        first[i] = cgraph->n_nodes + 1;
+        last[i]  = -1;
+
+        owners[n_owners++] = i;
+    }
+
+    // lifetimes: from the first to the last node that reads or writes the memory
+    for (int i = 0; i < cgraph->n_nodes; i++) {
+        struct ggml_tensor * node = cgraph->nodes[i];
+
+        struct ggml_tensor * used[3 + GGML_MAX_OPT] = { node, node->src0, node->src1 };
+        for (int j = 0; j < GGML_MAX_OPT; j++) {
+            used[3 + j] = node->opt[j];
+        }
+
+        for (int j = 0; j < 3 + GGML_MAX_OPT; j++) {
+            if (used[j] == NULL) {
+                continue;
+            }
+
+            const int k = ggml_alloc_find(tensors, n, used[j]);
+            if (k < 0) {
+                continue;
+            }
+
+            const int o = owner[k];
+
+            first[o] = MIN(first[o], i);
+            last[o]  = MAX(last[o],  i);
+        }
+    }
+
+    // the result of the graph is read after the computation
+    if (cgraph->n_nodes > 0) {
+        const int k = ggml_alloc_find(tensors, n, cgraph->nodes[cgraph->n_nodes - 1]);
+        if (k >= 0) {
+            last[owner[k]] = cgraph->n_nodes;
+        }
+    }
+
+    struct ggml_alloc_state state = {
+        /*.blocks   =*/ malloc((n_owners + 1)*sizeof(struct ggml_alloc_block)),
+        /*.n_blocks =*/ 0,
+        /*.top      =*/ 0,
+        /*.peak     =*/ 0,
+    };
+
+    // walk the nodes in order; the memory of the inputs of a node is released only after its
+    // result has been placed, so the two never overlap
+    {
+        int * by_last = malloc(n_owners*sizeof(int));
+        int n_live = 0;
+
+        for (int i = 0; i <= cgraph->n_nodes; i++) {
+            for (int j = 0; j < n_owners; j++) {
+                const int o = owners[j];
+                if (first[o] == i) {
+                    offs[o] = ggml_alloc_block_take(&state, size[o]);
+                    by_last[n_live++] = o;
+                }
+            }
+
+            for (int j = 0; j < n_live; ) {
+                const int o = by_last[j];
+                if (last[o] == i) {
+                    ggml_alloc_block_free(&state, offs[o], size[o]);
+                    by_last[j] = by_last[--n_live];
+                } else {
+                    j++;
+                }
+            }
+        }
 
-typedef int ggml_lock_t;
+        free(by_last);
+    }
 
-#define ggml_lock_init(x)    UNUSED(x)
-#define ggml_lock_destroy(x) UNUSED(x)
-#define ggml_lock_lock(x)    UNUSED(x)
-#define ggml_lock_unlock(x)  UNUSED(x)
+    if (data != NULL) {
+        for (int i = 0; i < n; i++) {
+            const int o = owner[i];
 
-#define GGML_LOCK_INITIALIZER 0
+            tensors[i]->data = (char *) data + offs[o] + (data_old[i] - data_old[o]);
+        }
+    }
 
-typedef pthread_t ggml_thread_t;
+    const size_t result = state.peak;
 
-#define ggml_thread_create pthread_create
-#define ggml_thread_join   pthread_join
+    free(state.blocks);
+    free(owners);
+    free(last);
+    free(first);
+    free(offs);
+    free(size);
+    free(data_old);
+    free(owner);
+    free(tensors);
 
-#else
+    return result;
+}
 
-//typedef pthread_spinlock_t ggml_lock_t;
+void ggml_graph_plan(struct ggml_context * ctx, struct ggml_cgraph * cgraph) {
+    const int n_threads = cgraph->n_threads;
 
-//#define ggml_lock_init(x) pthread_spin_init(x, PTHREAD_PROCESS_PRIVATE)
-//#define ggml_lock_destroy pthread_spin_destroy
-//#define ggml_lock_lock    pthread_spin_lock
-//#define ggml_lock_unlock  pthread_spin_unlock
+    size_t work_size = 0;
 
-typedef int ggml_lock_t;
+    // thread scheduling for the different operations
+    for (int i = 0; i < cgraph->n_nodes; i++) {
+        struct ggml_tensor * node = cgraph->nodes[i];
 
-#define ggml_lock_init(x)    UNUSED(x)
-#define ggml_lock_destroy(x) UNUSED(x)
-#define ggml_lock_lock(x)    UNUSED(x)
-#define ggml_lock_unlock(x)  UNUSED(x)
+        switch (node->op) {
+            case GGML_OP_DUP:
+                {
+                    node->n_tasks = 1;
+                } break;
+            case GGML_OP_ADD:
+                {
+                    node->n_tasks = n_threads;
+                } break;
+            case GGML_OP_SUB:
+            case GGML_OP_MUL:
+            case GGML_OP_DIV:
+            case GGML_OP_SQR:
+            case GGML_OP_SQRT:
+            case GGML_OP_SUM:
+            case GGML_OP_MEAN:
+            case GGML_OP_REPEAT:
+            case GGML_OP_ABS:
+            case GGML_OP_SGN:
+            case GGML_OP_NEG:
+            case GGML_OP_STEP:
+            case GGML_OP_RELU:
+                {
+                    node->n_tasks = 1;
+                } break;
+            case GGML_OP_GELU:
+                {
+                    node->n_tasks = n_threads;
+                } break;
+            case GGML_OP_SILU:
+                {
+                    node->n_tasks = n_threads;
+                } break;
+            case GGML_OP_NORM:
+            case GGML_OP_RMS_NORM:
+                {
+                    node->n_tasks = n_threads;
+                } break;
+            case GGML_OP_MUL_MAT:
+                {
+                    node->n_tasks = n_threads;
 
-#define GGML_LOCK_INITIALIZER 0
+                    // TODO: use different scheduling for different matrix sizes
+                    //const int nr0 = ggml_nrows(node->src0);
+                    //const int nr1 = ggml_nrows(node->src1);
 
-typedef pthread_t ggml_thread_t;
+                    //node->n_tasks = MIN(n_threads, MAX(1, nr0/128));
+                    //printf("nr0 = %8d, nr1 = %8d, nr0*nr1 = %8d, n_tasks = %d\n", nr0, nr1, nr0*nr1, node->n_tasks);
 
-#define ggml_thread_create pthread_create
-#define ggml_thread_join   pthread_join
+                    size_t cur = 0;
 
+                    // TODO: better way to determine if the matrix is transposed
+                    if (node->src0->nb[1] < node->src0->nb[0]) {
+                        cur = ggml_nbytes(node)*node->n_tasks; // TODO: this can become (n_tasks-1)
+                                                               // TODO: overestimated by factor of x2 for FP16
+                    } else {
+                        if (node->src0->type == GGML_TYPE_F16 &&
+                            node->src1->type == GGML_TYPE_F32) {
+#if defined(GGML_USE_ACCELERATE) || defined(GGML_USE_OPENBLAS)
+                            if (ggml_compute_forward_mul_mat_use_blas(node->src0, node->src1, node)) {
+                                node->n_tasks = 1; // TODO: this actually is doing nothing
+                                                   //       the threads are still spinning
+                                cur = GGML_TYPE_SIZE[GGML_TYPE_F32]*(node->src0->ne[0]*node->src0->ne[1]);
+                                //printf("src0: ne0 = %d, ne1 = %d, ne = %d\n", node->src0->ne[0], node->src0->ne[1], node->src0->ne[0]*node->src0->ne[1]);
+                                //printf("src1: ne0 = %d, ne1 = %d, ne = %d\n", node->src1->ne[0], node->src1->ne[1], node->src1->ne[0]*node->src1->ne[1]);
+                                //printf("cur = %zu\n", cur);
+                            } else {
+                                cur = GGML_TYPE_SIZE[GGML_TYPE_F16]*ggml_nelements(node->src1);
+                            }
+#else
+                            cur = GGML_TYPE_SIZE[GGML_TYPE_F16]*ggml_nelements(node->src1);
+#endif
+                        } else if (node->src0->type == GGML_TYPE_F32 &&
+                                   node->src1->type == GGML_TYPE_F32) {
+                            cur = 0;
+                        } else if (node->src0->type == GGML_TYPE_Q4_0 &&
+                                   node->src1->type == GGML_TYPE_F32) {
+#if defined(GGML_USE_ACCELERATE) || defined(GGML_USE_OPENBLAS)
+                            if (ggml_compute_forward_mul_mat_use_blas(node->src0, node->src1, node)) {
+                                node->n_tasks = 1;
+                                cur = GGML_TYPE_SIZE[GGML_TYPE_F32]*(node->src0->ne[0]*node->src0->ne[1]);
+                            } else {
+                                cur = (GGML_TYPE_SIZE[GGML_TYPE_Q4_0]*ggml_nelements(node->src1))/GGML_BLCK_SIZE[GGML_TYPE_Q4_0];
+                            }
+#else
+                            cur = (GGML_TYPE_SIZE[GGML_TYPE_Q4_0]*ggml_nelements(node->src1))/GGML_BLCK_SIZE[GGML_TYPE_Q4_0];
+#endif
+                        } else if (node->src0->type == GGML_TYPE_Q4_1 &&
+                                   node->src1->type == GGML_TYPE_F32) {
+#if defined(GGML_USE_ACCELERATE) || defined(GGML_USE_OPENBLAS)
+                            if (ggml_compute_forward_mul_mat_use_blas(node->src0, node->src1, node)) {
+                                node->n_tasks = 1;
+                                cur = GGML_TYPE_SIZE[GGML_TYPE_F32]*(node->src0->ne[0]*node->src0->ne[1]);
+                            } else {
+                                cur = (GGML_TYPE_SIZE[GGML_TYPE_Q4_1]*ggml_nelements(node->src1))/GGML_BLCK_SIZE[GGML_TYPE_Q4_1];
+                            }
+#else
+                            cur = (GGML_TYPE_SIZE[GGML_TYPE_Q4_1]*ggml_nelements(node->src1))/GGML_BLCK_SIZE[GGML_TYPE_Q4_1];
+#endif
+                        } else if (node->src0->type == GGML_TYPE_Q8_0 &&
+                                   node->src1->type == GGML_TYPE_F32) {
+#if defined(GGML_USE_ACCELERATE) || defined(GGML_USE_OPENBLAS)
+                            if (ggml_compute_forward_mul_mat_use_blas(node->src0, node->src1, node)) {
+                                node->n_tasks = 1;
+                                cur = GGML_TYPE_SIZE[GGML_TYPE_F32]*(node->src0->ne[0]*node->src0->ne[1]);
+                            } else {
+                                cur = (GGML_TYPE_SIZE[GGML_TYPE_Q8_0]*ggml_nelements(node->src1))/GGML_BLCK_SIZE[GGML_TYPE_Q8_0];
+                            }
+#else
+                            cur = (GGML_TYPE_SIZE[GGML_TYPE_Q8_0]*ggml_nelements(node->src1))/GGML_BLCK_SIZE[GGML_TYPE_Q8_0];
 #endif
+                        } else if (ggml_q4_0_group_rows(node->src0->type) > 0 &&
+                                   node->src1->type == GGML_TYPE_F32) {
+                            cur = (GGML_TYPE_SIZE[GGML_TYPE_Q4_0]*ggml_nelements(node->src1))/GGML_BLCK_SIZE[GGML_TYPE_Q4_0];
+                        } else {
+                            GGML_ASSERT(false);
+                        }
+                    }
 
-struct ggml_compute_state_shared {
-    ggml_lock_t spin;
+                    work_size = MAX(work_size, cur);
+                } break;
+            case GGML_OP_SWIGLU:
+                {
+                    node->n_tasks = n_threads;
 
-    int n_threads;
+                    work_size = MAX(work_size, ggml_swiglu_wsize(node->src0, node->src1));
+                } break;
+            case GGML_OP_SCALE:
+                {
+                    node->n_tasks = n_threads;
+                } break;
+            case GGML_OP_CPY:
+            case GGML_OP_RESHAPE:
+            case GGML_OP_VIEW:
+            case GGML_OP_PERMUTE:
+            case GGML_OP_TRANSPOSE:
+            case GGML_OP_GET_ROWS:
+            case GGML_OP_SET_ROWS:
+            case GGML_OP_DIAG_MASK_INF:
+                {
+                    node->n_tasks = 1;
+                } break;
+            case GGML_OP_SOFT_MAX:
+                {
+                    node->n_tasks = n_threads;
+                } break;
+            case GGML_OP_ROPE:
+                {
+                    node->n_tasks = 1;
+                } break;
+            case GGML_OP_CONV_1D_1S:
+            case GGML_OP_CONV_1D_2S:
+                {
+                    node->n_tasks = n_threads;
+
+                    GGML_ASSERT(node->src0->ne[3] == 1);
+                    GGML_ASSERT(node->src1->ne[2] == 1);
+                    GGML_ASSERT(node->src1->ne[3] == 1);
+
+                    size_t cur = 0;
+                    const int nk = node->src0->ne[0];
+
+                    if (node->src0->type == GGML_TYPE_F16 &&
+                        node->src1->type == GGML_TYPE_F32) {
+                        cur = sizeof(ggml_fp16_t)*(
+                                nk*ggml_up32(node->src0->ne[1])*node->src0->ne[2] +
+                                ( 2*(nk/2) + node->src1->ne[0])*node->src1->ne[1]
+                                );
+                    } else if (node->src0->type == GGML_TYPE_F32 &&
+                               node->src1->type == GGML_TYPE_F32) {
+                        cur = sizeof(float)*(
+                                nk*ggml_up32(node->src0->ne[1])*node->src0->ne[2] +
+                                ( 2*(nk/2) + node->src1->ne[0])*node->src1->ne[1]
+                                );
+                    } else {
+                        GGML_ASSERT(false);
+                    }
 
-    // synchronization primitives
-    atomic_int  n_ready;
-    atomic_bool has_work;
-    atomic_bool stop; // stop all threads
-};
+                    work_size = MAX(work_size, cur);
+                } break;
+            case GGML_OP_FLASH_ATTN:
+                {
+                    node->n_tasks = n_threads;
 
-struct ggml_compute_state {
-    ggml_thread_t thrd;
+                    size_t cur = 0;
 
-    struct ggml_compute_params params;
-    struct ggml_tensor * node;
+                    const int ne11 = ggml_up(node->src1->ne[1], GGML_SOFT_MAX_UNROLL);
 
-    struct ggml_compute_state_shared * shared;
-};
+                    if (node->src1->type == GGML_TYPE_F32) {
+                        cur  = sizeof(float)*ne11*node->n_tasks; // TODO: this can become (n_tasks-1)
+                        cur += sizeof(float)*ne11*node->n_tasks; // this is overestimated by x2
+                    }
 
-static thread_ret_t ggml_graph_compute_thread(void * data) {
-    struct ggml_compute_state * state = (struct ggml_compute_state *) data;
+                    if (node->src1->type == GGML_TYPE_F16) {
+                        cur  = sizeof(float)*ne11*node->n_tasks; // TODO: this can become (n_tasks-1)
+                        cur += sizeof(float)*ne11*node->n_tasks; // this is overestimated by x2
+                    }
 
-    const int n_threads = state->shared->n_threads;
+                    work_size = MAX(work_size, cur);
+                } break;
+            case GGML_OP_FLASH_FF:
+                {
+                    node->n_tasks = n_threads;
 
-    while (true) {
-        if (atomic_fetch_add(&state->shared->n_ready, 1) == n_threads - 1) {
-            atomic_store(&state->shared->has_work, false);
-        } else {
-            while (atomic_load(&state->shared->has_work)) {
-                if (atomic_load(&state->shared->stop)) {
-                    return 0;
-                }
-                ggml_lock_lock  (&state->shared->spin);
-                ggml_lock_unlock(&state->shared->spin);
-            }
-        }
+                    size_t cur = 0;
 
-        atomic_fetch_sub(&state->shared->n_ready, 1);
+                    if (node->src1->type == GGML_TYPE_F32) {
+                        cur  = sizeof(float)*node->src1->ne[1]*node->n_tasks; // TODO: this can become (n_tasks-1)
+                        cur += sizeof(float)*node->src1->ne[1]*node->n_tasks; // this is overestimated by x2
+                    }
 
-        // wait for work
-        while (!atomic_load(&state->shared->has_work)) {
-            if (atomic_load(&state->shared->stop)) {
-                return 0;
-            }
-            ggml_lock_lock  (&state->shared->spin);
-            ggml_lock_unlock(&state->shared->spin);
-        }
+                    if (node->src1->type == GGML_TYPE_F16) {
+                        cur  = sizeof(float)*node->src1->ne[1]*node->n_tasks; // TODO: this can become (n_tasks-1)
+                        cur += sizeof(float)*node->src1->ne[1]*node->n_tasks; // this is overestimated by x2
+                    }
 
-        // check if we should stop
-        if (atomic_load(&state->shared->stop)) {
-            break;
+                    work_size = MAX(work_size, cur);
+                } break;
+            case GGML_OP_NONE:
+                {
+                    node->n_tasks = 1;
+                } break;
+            case GGML_OP_COUNT:
+                {
+                    GGML_ASSERT(false);
+                } break;
         }
+    }
 
-        if (state->node) {
-            if (state->params.ith < state->params.nth) {
-                ggml_compute_forward(&state->params, state->node);
-            }
+    if (cgraph->work != NULL && work_size > cgraph->work_size) {
+        GGML_ASSERT(false); // TODO: better handling
+    }
 
-            state->node = NULL;
-        } else {
-            break;
+    if (work_size > 0 && cgraph->work == NULL) {
+        cgraph->work_size = work_size + CACHE_LINE_SIZE*(n_threads - 1);
+
+        // without a context the caller provides the work buffer
+        if (ctx != NULL) {
+            GGML_PRINT_DEBUG("%s: allocating work buffer for graph (%zu bytes)\n", __func__, cgraph->work_size);
+            cgraph->work = ggml_new_tensor_1d(ctx, GGML_TYPE_I8, cgraph->work_size);
         }
     }
 
-    return 0;
+    cgraph->planned = true;
 }
 
 void ggml_graph_compute(struct ggml_context * ctx, struct ggml_cgraph * cgraph) {
+    ggml_graph_compute_range(ctx, cgraph, 0, cgraph->n_nodes);
+}
+
+void ggml_graph_compute_range(struct ggml_context * ctx, struct ggml_cgraph * cgraph, int i0, int i1) {
     const int n_threads = cgraph->n_threads;
 
     struct ggml_compute_state_shared state_shared = {
@@ -9430,236 +11515,18 @@ void ggml_graph_compute(struct ggml_context * ctx, struct ggml_cgraph * cgraph)
     }
 
     // initialize tasks + work buffer
-    {
-        size_t work_size = 0;
-
-        // thread scheduling for the different operations
-        for (int i = 0; i < cgraph->n_nodes; i++) {
-            struct ggml_tensor * node = cgraph->nodes[i];
-
-            switch (node->op) {
-                case GGML_OP_DUP:
-                    {
-                        node->n_tasks = 1;
-                    } break;
-                case GGML_OP_ADD:
-                    {
-                        node->n_tasks = n_threads;
-                    } break;
-                case GGML_OP_SUB:
-                case GGML_OP_MUL:
-                case GGML_OP_DIV:
-                case GGML_OP_SQR:
-                case GGML_OP_SQRT:
-                case GGML_OP_SUM:
-                case GGML_OP_MEAN:
-                case GGML_OP_REPEAT:
-                case GGML_OP_ABS:
-                case GGML_OP_SGN:
-                case GGML_OP_NEG:
-                case GGML_OP_STEP:
-                case GGML_OP_RELU:
-                    {
-                        node->n_tasks = 1;
-                    } break;
-                case GGML_OP_GELU:
-                    {
-                        node->n_tasks = n_threads;
-                    } break;
-                case GGML_OP_SILU:
-                    {
-                        node->n_tasks = n_threads;
-                    } break;
-                case GGML_OP_NORM:
-                case GGML_OP_RMS_NORM:
-                    {
-                        node->n_tasks = n_threads;
-                    } break;
-                case GGML_OP_MUL_MAT:
-                    {
-                        node->n_tasks = n_threads;
-
-                        // TODO: use different scheduling for different matrix sizes
-                        //const int nr0 = ggml_nrows(node->src0);
-                        //const int nr1 = ggml_nrows(node->src1);
-
-                        //node->n_tasks = MIN(n_threads, MAX(1, nr0/128));
-                        //printf("nr0 = %8d, nr1 = %8d, nr0*nr1 = %8d, n_tasks = %d\n", nr0, nr1, nr0*nr1, node->n_tasks);
-
-                        size_t cur = 0;
-
-                        // TODO: better way to determine if the matrix is transposed
-                        if (node->src0->nb[1] < node->src0->nb[0]) {
-                            cur = ggml_nbytes(node)*node->n_tasks; // TODO: this can become (n_tasks-1)
-                                                                   // TODO: overestimated by factor of x2 for FP16
-                        } else {
-                            if (node->src0->type == GGML_TYPE_F16 &&
-                                node->src1->type == GGML_TYPE_F32) {
-#if defined(GGML_USE_ACCELERATE) || defined(GGML_USE_OPENBLAS)
-                                if (ggml_compute_forward_mul_mat_use_blas(node->src0, node->src1, node)) {
-                                    node->n_tasks = 1; // TODO: this actually is doing nothing
-                                                       //       the threads are still spinning
-                                    cur = GGML_TYPE_SIZE[GGML_TYPE_F32]*(node->src0->ne[0]*node->src0->ne[1]);
-                                    //printf("src0: ne0 = %d, ne1 = %d, ne = %d\n", node->src0->ne[0], node->src0->ne[1], node->src0->ne[0]*node->src0->ne[1]);
-                                    //printf("src1: ne0 = %d, ne1 = %d, ne = %d\n", node->src1->ne[0], node->src1->ne[1], node->src1->ne[0]*node->src1->ne[1]);
-                                    //printf("cur = %zu\n", cur);
-                                } else {
-                                    cur = GGML_TYPE_SIZE[GGML_TYPE_F16]*ggml_nelements(node->src1);
-                                }
-#else
-                                cur = GGML_TYPE_SIZE[GGML_TYPE_F16]*ggml_nelements(node->src1);
-#endif
-                            } else if (node->src0->type == GGML_TYPE_F32 &&
-                                       node->src1->type == GGML_TYPE_F32) {
-                                cur = 0;
-                            } else if (node->src0->type == GGML_TYPE_Q4_0 &&
-                                       node->src1->type == GGML_TYPE_F32) {
-#if defined(GGML_USE_ACCELERATE) || defined(GGML_USE_OPENBLAS)
-                                if (ggml_compute_forward_mul_mat_use_blas(node->src0, node->src1, node)) {
-                                    node->n_tasks = 1;
-                                    cur = GGML_TYPE_SIZE[GGML_TYPE_F32]*(node->src0->ne[0]*node->src0->ne[1]);
-                                } else {
-                                    cur = (GGML_TYPE_SIZE[GGML_TYPE_Q4_0]*ggml_nelements(node->src1))/GGML_BLCK_SIZE[GGML_TYPE_Q4_0];
-                                }
-#else
-                                cur = (GGML_TYPE_SIZE[GGML_TYPE_Q4_0]*ggml_nelements(node->src1))/GGML_BLCK_SIZE[GGML_TYPE_Q4_0];
-#endif
-                            } else if (node->src0->type == GGML_TYPE_Q4_1 &&
-                                       node->src1->type == GGML_TYPE_F32) {
-#if defined(GGML_USE_ACCELERATE) || defined(GGML_USE_OPENBLAS)
-                                if (ggml_compute_forward_mul_mat_use_blas(node->src0, node->src1, node)) {
-                                    node->n_tasks = 1;
-                                    cur = GGML_TYPE_SIZE[GGML_TYPE_F32]*(node->src0->ne[0]*node->src0->ne[1]);
-                                } else {
-                                    cur = (GGML_TYPE_SIZE[GGML_TYPE_Q4_1]*ggml_nelements(node->src1))/GGML_BLCK_SIZE[GGML_TYPE_Q4_1];
-                                }
-#else
-                                cur = (GGML_TYPE_SIZE[GGML_TYPE_Q4_1]*ggml_nelements(node->src1))/GGML_BLCK_SIZE[GGML_TYPE_Q4_1];
-#endif
-                            } else {
-                                GGML_ASSERT(false);
-                            }
-                        }
-
-                        work_size = MAX(work_size, cur);
-                    } break;
-                case GGML_OP_SCALE:
-                    {
-                        node->n_tasks = n_threads;
-                    } break;
-                case GGML_OP_CPY:
-                case GGML_OP_RESHAPE:
-                case GGML_OP_VIEW:
-                case GGML_OP_PERMUTE:
-                case GGML_OP_TRANSPOSE:
-                case GGML_OP_GET_ROWS:
-                case GGML_OP_DIAG_MASK_INF:
-                    {
-                        node->n_tasks = 1;
-                    } break;
-                case GGML_OP_SOFT_MAX:
-                    {
-                        node->n_tasks = n_threads;
-                    } break;
-                case GGML_OP_ROPE:
-                    {
-                        node->n_tasks = 1;
-                    } break;
-                case GGML_OP_CONV_1D_1S:
-                case GGML_OP_CONV_1D_2S:
-                    {
-                        node->n_tasks = n_threads;
-
-                        GGML_ASSERT(node->src0->ne[3] == 1);
-                        GGML_ASSERT(node->src1->ne[2] == 1);
-                        GGML_ASSERT(node->src1->ne[3] == 1);
-
-                        size_t cur = 0;
-                        const int nk = node->src0->ne[0];
-
-                        if (node->src0->type == GGML_TYPE_F16 &&
-                            node->src1->type == GGML_TYPE_F32) {
-                            cur = sizeof(ggml_fp16_t)*(
-                                    nk*ggml_up32(node->src0->ne[1])*node->src0->ne[2] +
-                                    ( 2*(nk/2) + node->src1->ne[0])*node->src1->ne[1]
-                                    );
-                        } else if (node->src0->type == GGML_TYPE_F32 &&
-                                   node->src1->type == GGML_TYPE_F32) {
-                            cur = sizeof(float)*(
-                                    nk*ggml_up32(node->src0->ne[1])*node->src0->ne[2] +
-                                    ( 2*(nk/2) + node->src1->ne[0])*node->src1->ne[1]
-                                    );
-                        } else {
-                            GGML_ASSERT(false);
-                        }
-
-                        work_size = MAX(work_size, cur);
-                    } break;
-                case GGML_OP_FLASH_ATTN:
-                    {
-                        node->n_tasks = n_threads;
-
-                        size_t cur = 0;
-
-                        const int ne11 = ggml_up(node->src1->ne[1], GGML_SOFT_MAX_UNROLL);
-
-                        if (node->src1->type == GGML_TYPE_F32) {
-                            cur  = sizeof(float)*ne11*node->n_tasks; // TODO: this can become (n_tasks-1)
-                            cur += sizeof(float)*ne11*node->n_tasks; // this is overestimated by x2
-                        }
-
-                        if (node->src1->type == GGML_TYPE_F16) {
-                            cur  = sizeof(float)*ne11*node->n_tasks; // TODO: this can become (n_tasks-1)
-                            cur += sizeof(float)*ne11*node->n_tasks; // this is overestimated by x2
-                        }
-
-                        work_size = MAX(work_size, cur);
-                    } break;
-                case GGML_OP_FLASH_FF:
-                    {
-                        node->n_tasks = n_threads;
-
-                        size_t cur = 0;
-
-                        if (node->src1->type == GGML_TYPE_F32) {
-                            cur  = sizeof(float)*node->src1->ne[1]*node->n_tasks; // TODO: this can become (n_tasks-1)
-                            cur += sizeof(float)*node->src1->ne[1]*node->n_tasks; // this is overestimated by x2
-                        }
-
-                        if (node->src1->type == GGML_TYPE_F16) {
-                            cur  = sizeof(float)*node->src1->ne[1]*node->n_tasks; // TODO: this can become (n_tasks-1)
-                            cur += sizeof(float)*node->src1->ne[1]*node->n_tasks; // this is overestimated by x2
-                        }
-
-                        work_size = MAX(work_size, cur);
-                    } break;
-                case GGML_OP_NONE:
-                    {
-                        node->n_tasks = 1;
-                    } break;
-                case GGML_OP_COUNT:
-                    {
-                        GGML_ASSERT(false);
-                    } break;
-            }
-        }
-
-        if (cgraph->work != NULL && work_size > cgraph->work_size) {
-            GGML_ASSERT(false); // TODO: better handling
-        }
-
-        if (work_size > 0 && cgraph->work == NULL) {
-            cgraph->work_size = work_size + CACHE_LINE_SIZE*(n_threads - 1);
-
-            GGML_PRINT_DEBUG("%s: allocating work buffer for graph (%zu bytes)\n", __func__, cgraph->work_size);
-            cgraph->work = ggml_new_tensor_1d(ctx, GGML_TYPE_I8, cgraph->work_size);
-        }
+    if (!cgraph->planned) {
+        ggml_graph_plan(ctx, cgraph);
     }
 
+    // the calling thread computes as thread 0, its own affinity is restored afterwards
+    ggml_cpu_set_t cpus_caller;
+    const bool pinned = ggml_numa_pin_thread(0, n_threads, &cpus_caller);
+
     const int64_t perf_start_cycles  = ggml_perf_cycles();
     const int64_t perf_start_time_us = ggml_perf_time_us();
 
-    for (int i = 0; i < cgraph->n_nodes; i++) {
+    for (int i = i0; i < i1; i++) {
         GGML_PRINT_DEBUG_5("%s: %d/%d\n", __func__, i, cgraph->n_nodes);
 
         struct ggml_tensor * node = cgraph->nodes[i];
@@ -9818,6 +11685,10 @@ void ggml_graph_compute(struct ggml_context * ctx, struct ggml_cgraph * cgraph)
         ggml_lock_destroy(&state_shared.spin);
     }
 
+    if (pinned) {
+        ggml_numa_unpin_thread(&cpus_caller);
+    }
+
     // performance stats (graph)
     {
         int64_t perf_cycles_cur  = ggml_perf_cycles()  - perf_start_cycles;
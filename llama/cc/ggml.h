@@ -205,6 +205,9 @@ enum ggml_type {
     GGML_TYPE_I32,
     GGML_TYPE_F16,
     GGML_TYPE_F32,
+    GGML_TYPE_Q8_0,
+    GGML_TYPE_Q4_0_R4, // Q4_0 with the blocks of 4 consecutive rows interleaved (see ggml_repack_q4_0)
+    GGML_TYPE_Q4_0_R8, // Q4_0 with the blocks of 8 consecutive rows interleaved
     GGML_TYPE_COUNT,
 };
 
@@ -233,6 +236,7 @@ enum ggml_op {
     GGML_OP_RMS_NORM,
 
     GGML_OP_MUL_MAT,
+    GGML_OP_SWIGLU,
 
     GGML_OP_SCALE,
     GGML_OP_CPY,
@@ -241,6 +245,7 @@ enum ggml_op {
     GGML_OP_PERMUTE,
     GGML_OP_TRANSPOSE,
     GGML_OP_GET_ROWS,
+    GGML_OP_SET_ROWS,
     GGML_OP_DIAG_MASK_INF,
     GGML_OP_SOFT_MAX,
     GGML_OP_ROPE,
@@ -268,6 +273,7 @@ struct ggml_tensor {
     enum ggml_op op;
 
     bool is_param;
+    bool is_scratch; // data is in the scratch buffer (or is a view of such data)
 
     struct ggml_tensor * grad;
     struct ggml_tensor * src0;
@@ -295,6 +301,9 @@ struct ggml_cgraph {
     size_t work_size;
     struct ggml_tensor * work;
 
+    // n_tasks of the nodes and the work buffer are up to date (see ggml_graph_plan)
+    bool planned;
+
     struct ggml_tensor * nodes[GGML_MAX_NODES];
     struct ggml_tensor * grads[GGML_MAX_NODES];
     struct ggml_tensor * leafs[GGML_MAX_NODES];
@@ -334,6 +343,31 @@ int    ggml_blck_size (enum ggml_type type);
 size_t ggml_type_size (enum ggml_type type); // size in bytes for all elements in a block
 float  ggml_type_sizef(enum ggml_type type); // ggml_type_size()/ggml_blck_size() as float
 
+// convert a row of k elements (a multiple of the block size) of a float or
+// quantized type to f32 and back
+void ggml_row_to_f32  (enum ggml_type type, const void  * x, float * y, int k);
+void ggml_row_from_f32(enum ggml_type type, const float * x, void  * y, int k);
+
+// the vector kernels of a type used by mul_mat, exposed for tests and benchmarks (NULL if there are none):
+// vec_dot computes *s = x.y of a row x of the type and a row y of vec_dot_type, to which mul_mat converts the
+// rows of src1 with ggml_row_from_f32; vec_mad computes y += x*v of a row x of the type and a row y of F16 for
+// GGML_TYPE_F16 and of F32 otherwise
+typedef void (*ggml_vec_dot_t)(const int n, float * s, void * x, void * y);
+typedef void (*ggml_vec_mad_t)(const int n, void * y, void * x, const float v);
+
+struct ggml_type_kernels {
+    enum ggml_type vec_dot_type;
+    ggml_vec_dot_t vec_dot;
+    ggml_vec_mad_t vec_mad;
+};
+
+struct ggml_type_kernels ggml_get_type_kernels(enum ggml_type type);
+
+// interleave the blocks of each group of 4 (GGML_TYPE_Q4_0_R4) or 8 (GGML_TYPE_Q4_0_R8) consecutive
+// rows of a contiguous 2-d Q4_0 tensor in place, so that mul_mat and swiglu compute a group of rows per
+// pass over a row of src1; false (and the tensor unchanged) if the tensor does not qualify
+bool ggml_repack_q4_0(struct ggml_tensor * tensor, enum ggml_type type);
+
 size_t ggml_element_size(const struct ggml_tensor * tensor);
 
 struct ggml_context * ggml_init(struct ggml_init_params params);
@@ -402,6 +436,7 @@ struct ggml_tensor * ggml_dup(
         struct ggml_context * ctx,
         struct ggml_tensor  * a);
 
+// b can have fewer rows than a if they repeat into a (see ggml_repeat), it is then broadcast
 struct ggml_tensor * ggml_add(
         struct ggml_context * ctx,
         struct ggml_tensor  * a,
@@ -495,6 +530,14 @@ struct ggml_tensor * ggml_mul_mat(
         struct ggml_tensor  * a,
         struct ggml_tensor  * b);
 
+// fused SwiGLU gate: silu(W1*b) * (W3*b)
+// a holds the rows of W1 and W3 interleaved: a[2*i] = W1[i], a[2*i + 1] = W3[i]
+// result is a->ne[1]/2 columns, b->ne[1] rows
+struct ggml_tensor * ggml_swiglu(
+        struct ggml_context * ctx,
+        struct ggml_tensor  * a,
+        struct ggml_tensor  * b);
+
 //
 // operations on tensors without backpropagation
 //
@@ -568,6 +611,14 @@ struct ggml_tensor * ggml_get_rows(
         struct ggml_tensor  * a,
         struct ggml_tensor  * b);
 
+// store the F32 rows of b into rows c[i] of a (converted to the type of a)
+// returns view(a)
+struct ggml_tensor * ggml_set_rows(
+        struct ggml_context * ctx,
+        struct ggml_tensor  * a,
+        struct ggml_tensor  * b,
+        struct ggml_tensor  * c);
+
 // set elements above the diagonal to -INF
 // in-place, returns view(a)
 struct ggml_tensor * ggml_diag_mask_inf(
@@ -591,6 +642,15 @@ struct ggml_tensor * ggml_rope(
         int                   n_dims,
         int                   mode);
 
+// rotary position embedding with the position of a[:, :, i2] given by b[i2]
+// (I32) instead of n_past + i2
+// in-place, returns view(a)
+struct ggml_tensor * ggml_rope_pos(
+        struct ggml_context * ctx,
+        struct ggml_tensor  * a,
+        struct ggml_tensor  * b,
+        int                   n_dims);
+
 // padding = 1
 // TODO: we don't support extra parameters for now
 //       that's why we are hard-coding the stride, padding, and dilation
@@ -633,9 +693,42 @@ void ggml_build_forward_expand(struct ggml_cgraph * cgraph, struct ggml_tensor *
 struct ggml_cgraph ggml_build_forward (struct ggml_tensor * tensor);
 struct ggml_cgraph ggml_build_backward(struct ggml_context * ctx, struct ggml_cgraph * gf, bool keep);
 
+// assign n_tasks to the nodes and allocate the work buffer in ctx
+// ggml_graph_compute() does this on the first call; a planned graph can be computed repeatedly
+// as long as its nodes, n_threads and the shapes that determine the work size stay the same
+// if ctx is NULL, only cgraph->work_size is set and the caller has to provide cgraph->work
+void ggml_graph_plan   (struct ggml_context * ctx, struct ggml_cgraph * cgraph);
+
+// memory planning of intermediate results
+//
+// build the graph with a scratch buffer set (see ggml_set_scratch) - the tensors created in it are
+// the intermediate results. ggml_graph_alloc() then gives each of them an offset based on the first
+// and the last node that uses it, so that results with disjoint lifetimes share memory, and moves
+// the tensors and the views of them to data. only the result of the last node is kept until the end
+//
+// the scratch memory is not accessed before that, so the origin of the offsets while building
+// (scratch.data) does not have to be real memory of that size - it is never dereferenced and
+// may overlap other buffers. the tensors are recognized by is_scratch, not by their address
+// if data is NULL, the tensors are not moved
+// returns the size of the memory needed at data
+size_t ggml_graph_alloc(struct ggml_cgraph * cgraph, void * data);
 void ggml_graph_compute(struct ggml_context * ctx, struct ggml_cgraph * cgraph);
 void ggml_graph_reset  (struct ggml_cgraph * cgraph);
 
+// compute nodes [i0, i1) of a graph, the ones before i0 have to be computed already; the caller may
+// wait in between, e.g. for the weights used by the following nodes
+void ggml_graph_compute_range(struct ggml_context * ctx, struct ggml_cgraph * cgraph, int i0, int i1);
+
+// NUMA: on a host with more than one node, the compute threads are split into one contiguous range per
+// node and pinned to its cores, and the src0 rows of mul_mat and swiglu are split across the nodes in
+// the same proportion, so that each node reads the rows placed in its memory by ggml_numa_place_rows
+bool ggml_numa_init(void); // false if the host is not NUMA
+int  ggml_numa_n_nodes(void);
+
+// bind the rows of a tensor whose data is not yet faulted in to the nodes which compute them, with
+// boundaries rounded to page_size
+bool ggml_numa_place_rows(struct ggml_tensor * tensor, size_t page_size);
+
 // print info and performance information for the graph
 void ggml_graph_print(const struct ggml_cgraph * cgraph);
 
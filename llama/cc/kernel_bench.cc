@@ -0,0 +1,708 @@
+#include <algorithm>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <memory>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <llama/cc/ggml.h>
+
+static const struct {
+    const char * name;
+    ggml_type type;
+} k_types[] = {
+    { "f32",     GGML_TYPE_F32     },
+    { "f16",     GGML_TYPE_F16     },
+    { "q4_0",    GGML_TYPE_Q4_0    },
+    { "q4_1",    GGML_TYPE_Q4_1    },
+    { "q8_0",    GGML_TYPE_Q8_0    },
+    { "q4_0_r4", GGML_TYPE_Q4_0_R4 },
+    { "q4_0_r8", GGML_TYPE_Q4_0_R8 },
+};
+
+static const char * type_name(ggml_type type) {
+    for (const auto & t : k_types) {
+        if (t.type == type) {
+            return t.name;
+        }
+    }
+    return "?";
+}
+
+struct kbench_params {
+    std::vector<int> n_embd = {4096, 5120, 6656, 8192}; // LLaMA 7B, 13B, 30B, 65B
+    std::vector<int> n_threads;
+    std::vector<int> n_batch = {1, 32};
+    std::vector<ggml_type> types = {
+        GGML_TYPE_F32, GGML_TYPE_F16, GGML_TYPE_Q4_0, GGML_TYPE_Q4_1,
+        GGML_TYPE_Q8_0, GGML_TYPE_Q4_0_R4, GGML_TYPE_Q4_0_R8,
+    };
+
+    int n_reps = 10; // timed repetitions of each mul_mat
+
+    bool kernels = true;
+    bool mul_mat = true;
+};
+
+struct kbench_result {
+    std::string kernel;
+    std::string type;
+    int n;         // row length
+    int m;         // rows
+    int n_batch;   // columns of src1 (mul_mat)
+    int n_threads;
+    double t_us;   // mean time per call
+    double gflops;
+    double gbs;    // bytes read and written per call over time
+    double err;    // deviation from the scalar reference, < 0 if unchecked
+    double tol;
+};
+
+static std::vector<kbench_result> g_results;
+static int g_n_failed = 0;
+
+static void kbench_report(const kbench_result & r) {
+    const bool checked = r.err >= 0.0;
+    const bool ok = !checked || r.err <= r.tol;
+    if (!ok) {
+        g_n_failed++;
+    }
+    fprintf(stderr, "%-10s %-8s n = %5d m = %5d b = %3d t = %2d: %10.2f us %8.2f GFLOP/s %7.2f GB/s",
+            r.kernel.c_str(), r.type.c_str(), r.n, r.m, r.n_batch, r.n_threads, r.t_us, r.gflops, r.gbs);
+    if (checked) {
+        fprintf(stderr, "  err = %.2e (tol %.0e)%s", r.err, r.tol, ok ? "" : "  FAILED");
+    }
+    fprintf(stderr, "\n");
+    g_results.push_back(r);
+}
+
+// uniform in [-1, 1), the same sequence on every run
+static float kbench_rand(void) {
+    static uint64_t state = 0x853c49e6748fea9bULL;
+    state = state*6364136223846793005ULL + 1442695040888963407ULL;
+    return (int32_t) (state >> 32) / 2147483648.0f;
+}
+
+static std::vector<float> kbench_rand_row(int n) {
+    std::vector<float> x(n);
+    for (auto & v : x) {
+        v = kbench_rand();
+    }
+    return x;
+}
+
+// mean time of a call in us, over as many calls as fit in 20 ms (at least n_min)
+template <typename F>
+static double kbench_time(F && fn, int n_min = 10) {
+    fn(); // warm-up
+
+    int n = 0;
+    int64_t t_us = 0;
+    const int64_t t_start_us = ggml_time_us();
+    do {
+        fn();
+        n++;
+        t_us = ggml_time_us() - t_start_us;
+    } while (n < n_min || t_us < 20000);
+
+    return (double) t_us/n;
+}
+
+// row of n elements of a type from floats
+static std::vector<uint8_t> kbench_row(ggml_type type, const std::vector<float> & x) {
+    std::vector<uint8_t> row(ggml_type_size(type)*x.size()/ggml_blck_size(type));
+    ggml_row_from_f32(type, x.data(), row.data(), (int) x.size());
+    return row;
+}
+
+static std::vector<float> kbench_to_f32(ggml_type type, const void * x, int n) {
+    std::vector<float> y(n);
+    ggml_row_to_f32(type, x, y.data(), n);
+    return y;
+}
+
+//
+// scalar references
+//
+
+// quantize_row_q4_0, quantize_row_q4_1 and quantize_row_q8_0 as plain loops
+static void ref_quantize_row(ggml_type type, const float * x, uint8_t * y, int n) {
+    const int qk = ggml_blck_size(type);
+    const size_t bs = ggml_type_size(type);
+
+    for (int i = 0; i < n/qk; i++) {
+        const float * xb = x + i*qk;
+        uint8_t * yb = y + i*bs;
+
+        float amax = 0.0f;
+        float min = xb[0];
+        float max = xb[0];
+        for (int l = 0; l < qk; l++) {
+            amax = std::max(amax, fabsf(xb[l]));
+            min = std::min(min, xb[l]);
+            max = std::max(max, xb[l]);
+        }
+
+        switch (type) {
+            case GGML_TYPE_Q4_0:
+                {
+                    const float d = amax/7;
+                    const float id = d ? 1.0f/d : 0.0f;
+                    memcpy(yb, &d, sizeof(d));
+                    for (int l = 0; l < qk; l += 2) {
+                        const uint8_t vi0 = (int8_t) round(xb[l + 0]*id) + 8;
+                        const uint8_t vi1 = (int8_t) round(xb[l + 1]*id) + 8;
+                        yb[sizeof(float) + l/2] = vi0 | (vi1 << 4);
+                    }
+                } break;
+            case GGML_TYPE_Q4_1:
+                {
+                    const float d = (max - min)/15;
+                    const float id = d ? 1.0f/d : 0.0f;
+                    memcpy(yb, &d, sizeof(d));
+                    memcpy(yb + sizeof(float), &min, sizeof(min));
+                    for (int l = 0; l < qk; l += 2) {
+                        const uint8_t vi0 = round((xb[l + 0] - min)*id);
+                        const uint8_t vi1 = round((xb[l + 1] - min)*id);
+                        yb[2*sizeof(float) + l/2] = vi0 | (vi1 << 4);
+                    }
+                } break;
+            case GGML_TYPE_Q8_0:
+                {
+                    const float d = amax/127;
+                    const float id = d ? 1.0f/d : 0.0f;
+                    memcpy(yb, &d, sizeof(d));
+                    for (int l = 0; l < qk; l++) {
+                        yb[sizeof(float) + l] = (int8_t) roundf(xb[l]*id);
+                    }
+                } break;
+            default:
+                {
+                    fprintf(stderr, "%s: no reference for %s\n", __func__, type_name(type));
+                    abort();
+                }
+        }
+    }
+}
+
+// deviation of a dot product from its value in double precision, relative to the sum of the absolute
+// values of the products, so that cancellation does not inflate it
+static double ref_dot_err(const float * x, const float * y, int n, float s) {
+    double sum = 0.0;
+    double sum_abs = 0.0;
+    for (int i = 0; i < n; i++) {
+        sum += (double) x[i]*y[i];
+        sum_abs += fabs((double) x[i]*y[i]);
+    }
+    return sum_abs > 0.0 ? fabs(s - sum)/sum_abs : fabs(s - sum);
+}
+
+//
+// kernels on rows of n elements, single-threaded
+//
+
+static void bench_quantize(ggml_type type, int n) {
+    const auto x = kbench_rand_row(n);
+    const int qk = ggml_blck_size(type);
+    const size_t row_size = ggml_type_size(type)*n/qk;
+
+    std::vector<uint8_t> y(row_size);
+    std::vector<uint8_t> y_ref(row_size);
+    ggml_row_from_f32(type, x.data(), y.data(), n);
+    ref_quantize_row(type, x.data(), y_ref.data(), n);
+
+    // rounding of ties may differ, hence the deviation is in quantization steps of the reference
+    const auto v = kbench_to_f32(type, y.data(), n);
+    const auto v_ref = kbench_to_f32(type, y_ref.data(), n);
+    double err = 0.0;
+    for (int i = 0; i < n; i++) {
+        float d;
+        memcpy(&d, y_ref.data() + (i/qk)*ggml_type_size(type), sizeof(d));
+        err = std::max(err, d > 0.0f ? fabs(v[i] - v_ref[i])/d : fabs(v[i] - v_ref[i]));
+    }
+
+    const double t_us = kbench_time([&] { ggml_row_from_f32(type, x.data(), y.data(), n); });
+    kbench_report({"quantize", type_name(type), n, 1, 1, 1, t_us, n/t_us/1e3,
+                   (n*sizeof(float) + row_size)/t_us/1e3, err, 1.0});
+
+    // dequantization is the reference of the other kernels, it is timed only
+    std::vector<float> z(n);
+    const double t_deq_us = kbench_time([&] { ggml_row_to_f32(type, y.data(), z.data(), n); });
+    kbench_report({"dequantize", type_name(type), n, 1, 1, 1, t_deq_us, n/t_deq_us/1e3,
+                   (n*sizeof(float) + row_size)/t_deq_us/1e3, -1.0, 0.0});
+}
+
+static void bench_vec_dot(ggml_type type, int n) {
+    const auto kernels = ggml_get_type_kernels(type);
+    if (kernels.vec_dot == NULL) {
+        return;
+    }
+
+    auto x = kbench_row(type, kbench_rand_row(n));
+    auto y = kbench_row(kernels.vec_dot_type, kbench_rand_row(n));
+
+    float s = 0.0f;
+    kernels.vec_dot(n, &s, x.data(), y.data());
+    const auto xf = kbench_to_f32(type, x.data(), n);
+    const auto yf = kbench_to_f32(kernels.vec_dot_type, y.data(), n);
+    const double err = ref_dot_err(xf.data(), yf.data(), n, s);
+
+    const double t_us = kbench_time([&] { kernels.vec_dot(n, &s, x.data(), y.data()); });
+    kbench_report({"vec_dot", type_name(type), n, 1, 1, 1, t_us, 2.0*n/t_us/1e3,
+                   (x.size() + y.size())/t_us/1e3, err, 1e-4});
+}
+
+static void bench_vec_mad(ggml_type type, int n) {
+    const auto kernels = ggml_get_type_kernels(type);
+    if (kernels.vec_mad == NULL) {
+        return;
+    }
+
+    // y is of F16 for F16 rows, of F32 otherwise
+    const ggml_type type_y = type == GGML_TYPE_F16 ? GGML_TYPE_F16 : GGML_TYPE_F32;
+
+    auto x = kbench_row(type, kbench_rand_row(n));
+    auto y = kbench_row(type_y, kbench_rand_row(n));
+    const auto y0 = kbench_to_f32(type_y, y.data(), n);
+    const auto xf = kbench_to_f32(type, x.data(), n);
+
+    const float v = 0.5f;
+    kernels.vec_mad(n, y.data(), x.data(), v);
+    const auto yf = kbench_to_f32(type_y, y.data(), n);
+    double err = 0.0;
+    for (int i = 0; i < n; i++) {
+        const double ref = y0[i] + (double) xf[i]*v;
+        const double scale = fabs(y0[i]) + fabs(xf[i]*v);
+        err = std::max(err, scale > 0.0 ? fabs(yf[i] - ref)/scale : fabs(yf[i] - ref));
+    }
+
+    // small steps so that repeated accumulation stays in range of f16
+    const double t_us = kbench_time([&] { kernels.vec_mad(n, y.data(), x.data(), 1e-4f); });
+    kbench_report({"vec_mad", type_name(type), n, 1, 1, 1, t_us, 2.0*n/t_us/1e3,
+                   (x.size() + 2*y.size())/t_us/1e3, err, type_y == GGML_TYPE_F16 ? 1e-3 : 1e-5});
+}
+
+//
+// operators on the shapes of attention, computed by graphs
+//
+
+// soft_max of the attention scores of 32 tokens over a context of 2048 tokens with heads of 128
+static void bench_soft_max(int n_embd, const std::vector<int> & n_threads) {
+    const int n_ctx = 2048;
+    const int n_rows = n_embd/128*32;
+
+    struct ggml_init_params params = { sizeof(float)*n_ctx*n_rows + 16*1024*1024, NULL };
+    struct ggml_context * ctx = ggml_init(params);
+
+    struct ggml_tensor * a = ggml_new_tensor_2d(ctx, GGML_TYPE_F32, n_ctx, n_rows);
+    struct ggml_tensor * p = ggml_soft_max(ctx, a);
+
+    // scores of a scaled dot product attention are mostly within a few units
+    std::vector<float> x(n_ctx*n_rows);
+    for (auto & v : x) {
+        v = 4.0f*kbench_rand();
+    }
+
+    std::vector<double> ref(x.size());
+    for (int r = 0; r < n_rows; r++) {
+        const float * xr = x.data() + r*n_ctx;
+        const double max = *std::max_element(xr, xr + n_ctx);
+        double sum = 0.0;
+        for (int i = 0; i < n_ctx; i++) {
+            ref[r*n_ctx + i] = exp(xr[i] - max);
+            sum += ref[r*n_ctx + i];
+        }
+        for (int i = 0; i < n_ctx; i++) {
+            ref[r*n_ctx + i] /= sum;
+        }
+    }
+
+    for (int nt : n_threads) {
+        auto gf = std::make_unique<struct ggml_cgraph>(ggml_build_forward(p));
+        gf->n_threads = nt;
+
+        memcpy(a->data, x.data(), ggml_nbytes(a));
+        ggml_graph_compute(ctx, gf.get());
+
+        // deviation relative to the largest probability of a row
+        double err = 0.0;
+        const float * pd = (const float *) p->data;
+        for (int r = 0; r < n_rows; r++) {
+            const double max = *std::max_element(ref.begin() + r*n_ctx, ref.begin() + (r + 1)*n_ctx);
+            for (int i = 0; i < n_ctx; i++) {
+                err = std::max(err, fabs(pd[r*n_ctx + i] - ref[r*n_ctx + i])/max);
+            }
+        }
+
+        // soft_max works in place, later runs see probabilities instead of scores
+        const double t_us = kbench_time([&] { ggml_graph_compute(ctx, gf.get()); });
+        kbench_report({"soft_max", "f32", n_ctx, n_rows, 1, nt, t_us, 4.0*n_ctx*n_rows/t_us/1e3,
+                       2.0*ggml_nbytes(a)/t_us/1e3, err, 2e-3});
+    }
+
+    ggml_free(ctx);
+}
+
+// rope of the queries of 32 tokens following 512 tokens with heads of 128
+static void bench_rope(int n_embd, const std::vector<int> & n_threads) {
+    const int n_rot = 128;
+    const int n_head = n_embd/n_rot;
+    const int n_tokens = 32;
+    const int n_past = 512;
+
+    struct ggml_init_params params = { sizeof(float)*n_embd*n_tokens + 16*1024*1024, NULL };
+    struct ggml_context * ctx = ggml_init(params);
+
+    struct ggml_tensor * a = ggml_new_tensor_3d(ctx, GGML_TYPE_F32, n_rot, n_head, n_tokens);
+    struct ggml_tensor * q = ggml_rope(ctx, a, n_past, n_rot, 0);
+
+    const auto x = kbench_rand_row(n_embd*n_tokens);
+
+    std::vector<double> ref(x.size());
+    for (int i2 = 0; i2 < n_tokens; i2++) {
+        const int pos = n_past + i2;
+        for (int i1 = 0; i1 < n_head; i1++) {
+            for (int i0 = 0; i0 < n_rot; i0 += 2) {
+                const double theta = pos*pow(10000.0, -(double) i0/n_rot);
+                const int i = (i2*n_head + i1)*n_rot + i0;
+                ref[i + 0] = x[i]*cos(theta) - x[i + 1]*sin(theta);
+                ref[i + 1] = x[i]*sin(theta) + x[i + 1]*cos(theta);
+            }
+        }
+    }
+
+    for (int nt : n_threads) {
+        auto gf = std::make_unique<struct ggml_cgraph>(ggml_build_forward(q));
+        gf->n_threads = nt;
+
+        memcpy(a->data, x.data(), ggml_nbytes(a));
+        ggml_graph_compute(ctx, gf.get());
+
+        double err = 0.0;
+        const float * qd = (const float *) q->data;
+        for (size_t i = 0; i < x.size(); i += 2) {
+            const double scale = fabs(x[i]) + fabs(x[i + 1]);
+            err = std::max(err, std::max(fabs(qd[i] - ref[i]), fabs(qd[i + 1] - ref[i + 1]))/scale);
+        }
+
+        // rope works in place, later runs rotate further
+        const double t_us = kbench_time([&] { ggml_graph_compute(ctx, gf.get()); });
+        kbench_report({"rope", "f32", n_rot, n_head*n_tokens, 1, nt, t_us, 6.0*n_embd*n_tokens/2/t_us/1e3,
+                       2.0*ggml_nbytes(a)/t_us/1e3, err, 1e-5});
+    }
+
+    ggml_free(ctx);
+}
+
+//
+// mul_mat of the feed-forward weights
+//
+
+// n_ff of a model with hidden size n_embd, as in llama_model_load
+static int kbench_n_ff(int n_embd) {
+    const int n_mult = 256;
+    return ((2*(4*n_embd)/3 + n_mult - 1)/n_mult)*n_mult;
+}
+
+// mul_mat of an n_ff x n_embd weight (i.e. w1 or w3 of a layer) and n_batch columns of f32, and swiglu
+// of the same rows taken as interleaved W1/W3 rows (i.e. w13 of n_ff/2 outputs) against the unfused
+// silu(mul_mat(w1))*mul_mat(w3) of strided views of them
+static void bench_mul_mat(ggml_type type, int n_embd, const kbench_params & params) {
+    const int n = n_embd;
+    const int m = kbench_n_ff(n_embd);
+    const int max_batch = *std::max_element(params.n_batch.begin(), params.n_batch.end());
+
+    // interleaved types are repacked from Q4_0 after filling in the rows
+    const auto kernels = ggml_get_type_kernels(type);
+    const ggml_type type_rows = kernels.vec_dot == NULL ? GGML_TYPE_Q4_0 : type;
+    const size_t row_size = ggml_type_size(type_rows)*n/ggml_blck_size(type_rows);
+
+    const size_t ctx_size = (type != type_rows ? 2 : 1)*row_size*m +
+        4*sizeof(float)*(n + m)*params.n_batch.size()*max_batch + 64*1024*1024;
+    struct ggml_init_params init_params = { ctx_size, NULL };
+    struct ggml_context * ctx = ggml_init(init_params);
+    if (ctx == NULL) {
+        fprintf(stderr, "%s: failed to allocate %zu MB\n", __func__, ctx_size/1024/1024);
+        g_n_failed++;
+        return;
+    }
+
+    struct ggml_tensor * w = ggml_new_tensor_2d(ctx, type_rows, n, m);
+
+    // the reference uses a sample of the rows
+    const int row_stride = std::max(1, m/16);
+    std::vector<int> rows;
+    std::vector<std::vector<float>> rows_f32;
+    for (int r = 0; r < m; r++) {
+        const auto x = kbench_rand_row(n);
+        char * row = (char *) w->data + r*w->nb[1];
+        ggml_row_from_f32(type_rows, x.data(), row, n);
+        if (r % row_stride == 0 || r == m - 1) {
+            rows.push_back(r);
+            rows_f32.push_back(kbench_to_f32(type_rows, row, n));
+        }
+    }
+    // the unfused path reads the rows before repacking
+    struct ggml_tensor * w_rows = w;
+    if (type != type_rows) {
+        w_rows = ggml_new_tensor_2d(ctx, type_rows, n, m);
+        memcpy(w_rows->data, w->data, ggml_nbytes(w));
+    }
+    if (type != type_rows && !ggml_repack_q4_0(w, type)) {
+        fprintf(stderr, "%s: failed to repack %d x %d rows to %s\n", __func__, n, m, type_name(type));
+        g_n_failed++;
+        ggml_free(ctx);
+        return;
+    }
+
+    for (int n_batch : params.n_batch) {
+        struct ggml_tensor * x = ggml_new_tensor_2d(ctx, GGML_TYPE_F32, n, n_batch);
+        struct ggml_tensor * y = ggml_mul_mat(ctx, w, x);
+
+        struct ggml_tensor * w1 = ggml_view_2d(ctx, w_rows, n, m/2, 2*w_rows->nb[1], 0);
+        struct ggml_tensor * w3 = ggml_view_2d(ctx, w_rows, n, m/2, 2*w_rows->nb[1], w_rows->nb[1]);
+        struct ggml_tensor * g = ggml_swiglu(ctx, w, x);
+        struct ggml_tensor * g_ref = ggml_mul(ctx, ggml_silu(ctx, ggml_mul_mat(ctx, w1, x)), ggml_mul_mat(ctx, w3, x));
+
+        // columns of x as mul_mat sees them, after conversion to the type of vec_dot
+        std::vector<std::vector<float>> cols_f32;
+        for (int c = 0; c < n_batch; c++) {
+            const auto col = kbench_rand_row(n);
+            memcpy((char *) x->data + c*x->nb[1], col.data(), n*sizeof(float));
+            cols_f32.push_back(kbench_to_f32(kernels.vec_dot_type, kbench_row(kernels.vec_dot_type, col).data(), n));
+        }
+
+        for (int nt : params.n_threads) {
+            auto gf = std::make_unique<struct ggml_cgraph>(ggml_build_forward(y));
+            gf->n_threads = nt;
+
+            ggml_graph_compute(ctx, gf.get());
+
+            double err = 0.0;
+            for (size_t i = 0; i < rows.size(); i++) {
+                for (int c = 0; c < n_batch; c++) {
+                    const float s = ((const float *) y->data)[c*m + rows[i]];
+                    err = std::max(err, ref_dot_err(rows_f32[i].data(), cols_f32[c].data(), n, s));
+                }
+            }
+
+            const int64_t t_start_us = ggml_time_us();
+            for (int i = 0; i < params.n_reps; i++) {
+                ggml_graph_compute(ctx, gf.get());
+            }
+            const double t_us = (double) (ggml_time_us() - t_start_us)/params.n_reps;
+
+            kbench_report({"mul_mat", type_name(type), n, m, n_batch, nt, t_us, 2.0*n*m*n_batch/t_us/1e3,
+                           (ggml_nbytes(w) + ggml_nbytes(x) + ggml_nbytes(y))/t_us/1e3, err, 1e-4});
+
+            // both paths use the same vec_dot per row, so they agree exactly unless the repacked kernel
+            // accumulates in another order than the plain one (AVX-512 builds)
+            auto gf_fused = std::make_unique<struct ggml_cgraph>(ggml_build_forward(g));
+            auto gf_ref = std::make_unique<struct ggml_cgraph>(ggml_build_forward(g_ref));
+            gf_fused->n_threads = nt;
+            gf_ref->n_threads = nt;
+
+            ggml_graph_compute(ctx, gf_fused.get());
+            ggml_graph_compute(ctx, gf_ref.get());
+
+            double err_g = 0.0;
+            double max_g = 0.0;
+            for (int i = 0; i < ggml_nelements(g); i++) {
+                const float v = ((const float *) g->data)[i];
+                const float v_ref = ((const float *) g_ref->data)[i];
+                err_g = std::max(err_g, (double) fabsf(v - v_ref));
+                max_g = std::max(max_g, (double) fabsf(v_ref));
+            }
+            err_g = max_g > 0.0 ? err_g/max_g : err_g;
+
+            const int64_t t_start_g_us = ggml_time_us();
+            for (int i = 0; i < params.n_reps; i++) {
+                ggml_graph_compute(ctx, gf_fused.get());
+            }
+            const double t_g_us = (double) (ggml_time_us() - t_start_g_us)/params.n_reps;
+
+            kbench_report({"swiglu", type_name(type), n, m, n_batch, nt, t_g_us, 2.0*n*m*n_batch/t_g_us/1e3,
+                           (ggml_nbytes(w) + ggml_nbytes(x) + ggml_nbytes(g))/t_g_us/1e3, err_g, 1e-6});
+        }
+    }
+
+    ggml_free(ctx);
+}
+
+//
+// command line
+//
+
+static bool parse_list(const char * arg, std::vector<int> & values) {
+    values.clear();
+    std::stringstream ss(arg);
+    std::string item;
+    while (std::getline(ss, item, ',')) {
+        char * end = nullptr;
+        const long value = strtol(item.c_str(), &end, 10);
+        if (item.empty() || *end != '\0' || value <= 0) {
+            return false;
+        }
+        values.push_back((int) value);
+    }
+    return !values.empty();
+}
+
+static bool parse_types(const char * arg, std::vector<ggml_type> & types) {
+    types.clear();
+    std::stringstream ss(arg);
+    std::string item;
+    while (std::getline(ss, item, ',')) {
+        bool found = false;
+        for (const auto & t : k_types) {
+            if (item == t.name) {
+                types.push_back(t.type);
+                found = true;
+            }
+        }
+        if (!found) {
+            return false;
+        }
+    }
+    return !types.empty();
+}
+
+static void kbench_print_usage(int /*argc*/, char ** argv, const kbench_params & params) {
+    fprintf(stderr, "usage: %s [options]\n", argv[0]);
+    fprintf(stderr, "\n");
+    fprintf(stderr, "Time the vector kernels, mul_mat and swiglu of ggml at the shapes of LLaMA and check them\n");
+    fprintf(stderr, "against scalar references (swiglu against the unfused mul_mat/silu/mul). Exits with 1 if any\n");
+    fprintf(stderr, "result deviates more than its tolerance.\n");
+    fprintf(stderr, "\n");
+    fprintf(stderr, "options:\n");
+    fprintf(stderr, "  -h, --help            show this help message and exit\n");
+    fprintf(stderr, "  -s N,..., --n_embd N,...\n");
+    fprintf(stderr, "                        hidden sizes, multiples of 128 (default: 4096,5120,6656,8192)\n");
+    fprintf(stderr, "  -t N,..., --threads N,...\n");
+    fprintf(stderr, "                        thread counts of graphs (default: 1 and all cores)\n");
+    fprintf(stderr, "  -b N,..., --batch_size N,...\n");
+    fprintf(stderr, "                        columns of src1 of mul_mat (default: 1,32)\n");
+    fprintf(stderr, "  --types T,...         types of mul_mat weights and kernels (default: all of\n");
+    fprintf(stderr, "                        f32,f16,q4_0,q4_1,q8_0,q4_0_r4,q4_0_r8)\n");
+    fprintf(stderr, "  -r N, --repetitions N timed repetitions of each mul_mat (default: %d)\n", params.n_reps);
+    fprintf(stderr, "  --no_kernels          skip the vector kernels, soft_max and rope\n");
+    fprintf(stderr, "  --no_mul_mat          skip mul_mat and swiglu\n");
+    fprintf(stderr, "\n");
+}
+
+static bool kbench_params_parse(int argc, char ** argv, kbench_params & params) {
+    for (int i = 1; i < argc; i++) {
+        std::string arg = argv[i];
+
+        if (arg == "-h" || arg == "--help") {
+            kbench_print_usage(argc, argv, params);
+            exit(0);
+        }
+        if (arg == "--no_kernels") {
+            params.kernels = false;
+            continue;
+        }
+        if (arg == "--no_mul_mat") {
+            params.mul_mat = false;
+            continue;
+        }
+        if (i + 1 >= argc) {
+            fprintf(stderr, "error: missing value of argument: %s\n", arg.c_str());
+            return false;
+        }
+
+        bool ok = true;
+        if (arg == "-s" || arg == "--n_embd") {
+            ok = parse_list(argv[++i], params.n_embd);
+            for (int n : params.n_embd) {
+                ok = ok && n % 128 == 0;
+            }
+        } else if (arg == "-t" || arg == "--threads") {
+            ok = parse_list(argv[++i], params.n_threads);
+        } else if (arg == "-b" || arg == "--batch_size") {
+            ok = parse_list(argv[++i], params.n_batch);
+        } else if (arg == "--types") {
+            ok = parse_types(argv[++i], params.types);
+        } else if (arg == "-r" || arg == "--repetitions") {
+            params.n_reps = std::stoi(argv[++i]);
+            ok = params.n_reps > 0;
+        } else {
+            fprintf(stderr, "error: unknown argument: %s\n", arg.c_str());
+            kbench_print_usage(argc, argv, params);
+            return false;
+        }
+
+        if (!ok) {
+            fprintf(stderr, "error: invalid value of argument %s: %s\n", arg.c_str(), argv[i]);
+            return false;
+        }
+    }
+
+    if (params.n_threads.empty()) {
+        params.n_threads = {1};
+        const int n_cores = (int) std::thread::hardware_concurrency();
+        if (n_cores > 1) {
+            params.n_threads.push_back(n_cores);
+        }
+    }
+
+    return true;
+}
+
+int main(int argc, char ** argv) {
+    ggml_time_init();
+
+    kbench_params params;
+    if (!kbench_params_parse(argc, argv, params)) {
+        return 1;
+    }
+
+    // needed to initialize f16 tables
+    {
+        struct ggml_init_params init_params = { 0, NULL };
+        struct ggml_context * ctx = ggml_init(init_params);
+        ggml_free(ctx);
+    }
+
+    for (int n_embd : params.n_embd) {
+        if (params.kernels) {
+            for (ggml_type type : params.types) {
+                if (type == GGML_TYPE_Q4_0 || type == GGML_TYPE_Q4_1 || type == GGML_TYPE_Q8_0) {
+                    bench_quantize(type, n_embd);
+                }
+                bench_vec_dot(type, n_embd);
+                bench_vec_mad(type, n_embd);
+            }
+            bench_soft_max(n_embd, params.n_threads);
+            bench_rope(n_embd, params.n_threads);
+        }
+        if (params.mul_mat) {
+            for (ggml_type type : params.types) {
+                bench_mul_mat(type, n_embd, params);
+            }
+        }
+    }
+
+    printf("kernel,type,n,m,n_batch,n_threads,t_us,gflops,gbs,err,tol\n");
+    for (const auto & r : g_results) {
+        printf("%s,%s,%d,%d,%d,%d,%.3f,%.3f,%.3f,", r.kernel.c_str(), r.type.c_str(), r.n, r.m,
+               r.n_batch, r.n_threads, r.t_us, r.gflops, r.gbs);
+        if (r.err >= 0.0) {
+            printf("%.3e,%.0e\n", r.err, r.tol);
+        } else {
+            printf(",\n");
+        }
+    }
+
+    if (g_n_failed > 0) {
+        fprintf(stderr, "%s: %d checks failed\n", __func__, g_n_failed);
+        return 1;
+    }
+
+    fprintf(stderr, "%s: all results agree with the reference\n", __func__);
+    return 0;
+}
@@ -1,15 +1,27 @@
 #include "llama.h"
 
+#include <algorithm>
+#include <atomic>
 #include <cassert>
+#include <cerrno>
 #include <cinttypes>
 #include <cmath>
 #include <cstdio>
 #include <cstring>
 #include <fstream>
 #include <iostream>
+#include <sstream>
 #include <string>
+#include <thread>
 #include <vector>
 
+#if defined(__unix__) || (defined(__APPLE__) && defined(__MACH__))
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
 static const int EOS_TOKEN_ID = 2;
 
 // determine number of model parts based on the dimension
@@ -20,958 +32,3667 @@ static const std::unordered_map<int, int> LLAMA_N_PARTS = {
     {8192, 8},
 };
 
-bool llama_model_load(const std::string &fname, llama_model &model,
-                      llama_vocab &vocab, int n_ctx, int n_parts,
-                      ggml_type memory_type = GGML_TYPE_F32) {
-    fprintf(stderr, "%s: loading model from '%s' - please wait ...\n", __func__,
-            fname.c_str());
-
-    std::vector<char> f_buf(1024 * 1024);
-
-    auto fin = std::ifstream(fname, std::ios::binary);
-    fin.rdbuf()->pubsetbuf(f_buf.data(), f_buf.size());
-    if (!fin) {
-        fprintf(stderr, "%s: failed to open '%s'\n", __func__, fname.c_str());
+// type of tensor data of a model file
+static bool llama_ftype_to_type(int32_t ftype, ggml_type &type) {
+    switch (ftype) {
+    case 0:
+        type = GGML_TYPE_F32;
+        return true;
+    case 1:
+        type = GGML_TYPE_F16;
+        return true;
+    case 2:
+        type = GGML_TYPE_Q4_0;
+        return true;
+    case 3:
+        type = GGML_TYPE_Q4_1;
+        return true;
+    default:
         return false;
     }
+}
 
-    // verify magic
-    {
-        uint32_t magic;
-        fin.read((char *)&magic, sizeof(magic));
-        if (magic == FILE_MAGIC_UNVERSIONED) {
-            fprintf(stderr,
-                    "%s: invalid model file '%s' (too old, regenerate your "
-                    "model files!)\n",
-                    __func__, fname.c_str());
-            return false;
-        }
-        if (magic != FILE_MAGIC) {
-            fprintf(stderr, "%s: invalid model file '%s' (bad magic)\n",
-                    __func__, fname.c_str());
-            return false;
-        }
-
-        uint32_t format_version;
-        fin.read((char *)&format_version, sizeof(format_version));
-
-        if (format_version != FILE_VERSION) {
-            fprintf(stderr,
-                    "%s: invalid model file '%s' (unsupported format version "
-                    "%" PRIu32 ", expected %d)\n",
-                    __func__, fname.c_str(), format_version, FILE_VERSION);
-            return false;
-        }
+// copy packed rows of tensor data into a tensor, which may be a strided view
+// into a fused one
+static void llama_tensor_copy_rows(struct ggml_tensor *tensor,
+                                   const char *src) {
+    const size_t row_size = (tensor->ne[0] / ggml_blck_size(tensor->type)) *
+                            ggml_type_size(tensor->type);
+    const int n_rows = ggml_nelements(tensor) / tensor->ne[0];
+    if (n_rows == 1 || tensor->nb[1] == row_size) {
+        memcpy(tensor->data, src, n_rows * row_size);
+        return;
     }
+    for (int i1 = 0; i1 < n_rows; ++i1) {
+        memcpy((char *)tensor->data + i1 * tensor->nb[1], src + i1 * row_size,
+               row_size);
+    }
+}
 
-    int n_ff = 0;
+// weights of a layer which are multiplied by mul_mat or swiglu, the fused ones
+// rather than their views
+static std::vector<struct ggml_tensor *>
+llama_layer_weights(const llama_layer &layer) {
+    std::vector<struct ggml_tensor *> weights;
+    if (layer.wqkv) {
+        weights.push_back(layer.wqkv);
+    } else {
+        weights.insert(weights.end(), {layer.wq, layer.wk, layer.wv});
+    }
+    weights.push_back(layer.wo);
+    if (layer.w13) {
+        weights.push_back(layer.w13);
+    } else {
+        weights.insert(weights.end(), {layer.w1, layer.w3});
+    }
+    weights.push_back(layer.w2);
+    return weights;
+}
 
-    // load hparams
-    {
-        auto &hparams = model.hparams;
+// weights of all layers and the output
+static std::vector<struct ggml_tensor *>
+llama_model_weights(const llama_model &model) {
+    std::vector<struct ggml_tensor *> weights = {model.output};
+    for (const auto &layer : model.layers) {
+        const auto layer_weights = llama_layer_weights(layer);
+        weights.insert(weights.end(), layer_weights.begin(),
+                       layer_weights.end());
+    }
+    return weights;
+}
 
-        fin.read((char *)&hparams.n_vocab, sizeof(hparams.n_vocab));
-        // fin.read((char *) &hparams.n_ctx,   sizeof(hparams.n_ctx));
-        fin.read((char *)&hparams.n_embd, sizeof(hparams.n_embd));
-        fin.read((char *)&hparams.n_mult, sizeof(hparams.n_mult));
-        fin.read((char *)&hparams.n_head, sizeof(hparams.n_head));
-        fin.read((char *)&hparams.n_layer, sizeof(hparams.n_layer));
-        fin.read((char *)&hparams.n_rot, sizeof(hparams.n_rot));
-        fin.read((char *)&hparams.f16, sizeof(hparams.f16));
+// interleave the rows of Q4_0 weights in groups of n_rows (4 or 8) for the
+// multi-row kernels (see ggml_repack_q4_0); others, and Q4_0 weights of a
+// shape that does not qualify, are left as they are. Returns the number of
+// repacked weights.
+static int llama_repack_weights(
+    const std::vector<struct ggml_tensor *> &weights, const int n_rows) {
+    const ggml_type type =
+        n_rows == 8 ? GGML_TYPE_Q4_0_R8 : GGML_TYPE_Q4_0_R4;
+    int n_repacked = 0;
+    for (auto *w : weights) {
+        if (w->type == GGML_TYPE_Q4_0 && ggml_repack_q4_0(w, type)) {
+            ++n_repacked;
+        }
+    }
+    return n_repacked;
+}
 
-        hparams.n_ctx = n_ctx;
+// set up reading the tensors of a model in the background: weights are mapped
+// to their units and every unit waits for its tensors, the 2-d ones of which
+// are split into n_parts slices
+static void llama_load_state_init(llama_model &model, const int n_parts,
+                                  const int repack_rows) {
+    auto state = std::make_unique<llama_load_state>();
 
-        n_ff = ((2 * (4 * hparams.n_embd) / 3 + hparams.n_mult - 1) /
-                hparams.n_mult) *
-               hparams.n_mult;
+    const int n_layer = model.hparams.n_layer;
 
-        if (n_parts < 1) {
-            n_parts = LLAMA_N_PARTS.at(hparams.n_embd);
+    state->units[model.tok_embeddings] = 0;
+    for (int il = 0; il < n_layer; ++il) {
+        const auto &layer = model.layers[il];
+        for (const struct ggml_tensor *tensor :
+             {layer.attention_norm, layer.wq, layer.wk, layer.wv, layer.wo,
+              layer.wqkv, layer.ffn_norm, layer.w1, layer.w2, layer.w3,
+              layer.w13}) {
+            if (tensor) {
+                state->units[tensor] = 1 + il;
+            }
         }
-
-        // temp warning to tell the user to use "--n_parts"
-        if (hparams.f16 == 4 && n_parts != 1) {
-            fprintf(stderr,
-                    "%s: GPTQ model detected - are you sure n_parts should be "
-                    "%d? we normally expect it to be 1\n",
-                    __func__, n_parts);
-            fprintf(stderr, "%s: use '--n_parts 1' if necessary\n", __func__);
+    }
+    state->units[model.norm] = n_layer + 1;
+    state->units[model.output] = n_layer + 1;
+
+    if (repack_rows > 0) {
+        state->repack_rows = repack_rows;
+        state->weights.resize(n_layer + 2);
+        for (int il = 0; il < n_layer; ++il) {
+            state->weights[1 + il] = llama_layer_weights(model.layers[il]);
         }
+        state->weights[n_layer + 1] = {model.output};
+    }
 
-        fprintf(stderr, "%s: n_vocab = %d\n", __func__, hparams.n_vocab);
-        fprintf(stderr, "%s: n_ctx   = %d\n", __func__, hparams.n_ctx);
-        fprintf(stderr, "%s: n_embd  = %d\n", __func__, hparams.n_embd);
-        fprintf(stderr, "%s: n_mult  = %d\n", __func__, hparams.n_mult);
-        fprintf(stderr, "%s: n_head  = %d\n", __func__, hparams.n_head);
-        fprintf(stderr, "%s: n_layer = %d\n", __func__, hparams.n_layer);
-        fprintf(stderr, "%s: n_rot   = %d\n", __func__, hparams.n_rot);
-        fprintf(stderr, "%s: f16     = %d\n", __func__, hparams.f16);
-        fprintf(stderr, "%s: n_ff    = %d\n", __func__, n_ff);
-        fprintf(stderr, "%s: n_parts = %d\n", __func__, n_parts);
+    state->n_pending.assign(n_layer + 2, 0);
+    for (const auto &it : model.tensors) {
+        state->n_pending[state->units.at(it.second)] +=
+            it.second->n_dims == 1 ? 1 : n_parts;
+        state->n_bytes_total += ggml_nbytes(it.second);
     }
 
-    // load vocab
+    model.loading = std::move(state);
+}
+
+// mark a tensor (or its slice of a part) of n_bytes as read in the background
+static void llama_load_mark(llama_load_state *state,
+                            const struct ggml_tensor *tensor,
+                            const size_t n_bytes) {
+    if (state == nullptr) {
+        return;
+    }
+
+    int unit = -1; // all of whose tensors are read
     {
-        std::string word;
-        vocab.id_to_token.resize(model.hparams.n_vocab);
-        std::vector<char> tmp(64);
+        std::lock_guard<std::mutex> lock(state->mutex);
+        state->n_bytes += n_bytes;
 
-        for (int i = 0; i < model.hparams.n_vocab; i++) {
-            uint32_t len;
-            fin.read((char *)&len, sizeof(len));
+        auto it = state->units.find(tensor);
+        if (it != state->units.end() && --state->n_pending[it->second] == 0) {
+            unit = it->second;
+        }
+    }
+    if (unit < 0) {
+        return;
+    }
 
-            word.resize(len);
-            if (len > 0) {
-                tmp.resize(len);
-                fin.read(tmp.data(), len);
-                word.assign(tmp.data(), len);
-            } else {
-                word.clear();
-            }
+    // the weights of a unit are repacked before evaluation may use them
+    if (state->repack_rows > 0) {
+        llama_repack_weights(state->weights[unit], state->repack_rows);
+    }
 
-            float score;
-            fin.read((char *)&score, sizeof(score));
+    std::lock_guard<std::mutex> lock(state->mutex);
+    state->n_pending[unit] = -1;
 
-            vocab.token_to_id[word] = i;
+    const int n_units = state->n_pending.size();
+    while (state->n_ready < n_units && state->n_pending[state->n_ready] < 0) {
+        ++state->n_ready;
+    }
+    state->cond.notify_all();
+}
 
-            auto &tok_score = vocab.id_to_token[i];
-            tok_score.tok = word;
-            tok_score.score = score;
-        }
+// finish reading in the background; all units are ready then (as after
+// loading in the foreground, a tensor missing in the file is not an error)
+static void llama_load_finish(llama_load_state &state, const bool ok) {
+    std::lock_guard<std::mutex> lock(state.mutex);
+    state.done = true;
+    state.failed = !ok;
+    state.n_ready = state.n_pending.size();
+    state.cond.notify_all();
+}
+
+// wait until the units up to unit of a model read in the background are
+// ready; false if loading failed
+static bool llama_load_wait(const llama_model &model, const int unit) {
+    llama_load_state *state = model.loading.get();
+    if (state == nullptr) {
+        return true;
     }
 
-    // for the big tensors, we have the option to store the data in 16-bit
-    // floats or quantized in order to save memory and also to speed up the
-    // computation wtype is for per-layer weights, while vtype is for other
-    // weights
-    ggml_type wtype, vtype;
-    switch (model.hparams.f16) {
-    case 0:
-        wtype = vtype = GGML_TYPE_F32;
-        break;
-    case 1:
-        wtype = vtype = GGML_TYPE_F16;
-        break;
-    case 2:
-        wtype = vtype = GGML_TYPE_Q4_0;
-        break;
-    case 3:
-        wtype = vtype = GGML_TYPE_Q4_1;
-        break;
-    case 4:
-        wtype = GGML_TYPE_Q4_1;
-        vtype = GGML_TYPE_F16;
-        break;
-    default: {
-        fprintf(stderr, "%s: invalid model file '%s' (bad f16 value %d)\n",
-                __func__, fname.c_str(), model.hparams.f16);
+    std::unique_lock<std::mutex> lock(state->mutex);
+    state->cond.wait(lock, [&]() { return state->n_ready > unit; });
+    if (state->failed) {
+        fprintf(stderr, "%s: failed to load model tensors\n", __func__);
         return false;
     }
-    }
+    return true;
+}
 
-    auto &ctx = model.ctx;
+// load part part_id of n_parts of a model file (FILE_VERSION) from its
+// tensor records, which start at file_offset; the size of the data read is
+// returned in part_size
+//
+// A tensor of a part is read with one large read: rows of a tensor split by
+// columns and rows of strided views are scattered from a buffer.
+static bool llama_model_load_part(const std::string &fname_part,
+                                  const int part_id, const int n_parts,
+                                  const size_t file_offset,
+                                  const llama_model &model,
+                                  size_t &part_size) {
+    llama_load_state *state = model.loading.get();
 
-    size_t ctx_size = 0;
+    std::vector<char> f_buf(1024 * 1024);
 
-    {
-        const auto &hparams = model.hparams;
+    auto fin = std::ifstream(fname_part, std::ios::binary);
+    fin.rdbuf()->pubsetbuf(f_buf.data(), f_buf.size());
+    if (!fin) {
+        fprintf(stderr, "%s: failed to open '%s'\n", __func__,
+                fname_part.c_str());
+        return false;
+    }
+    fin.seekg(file_offset);
 
-        const int n_embd = hparams.n_embd;
-        const int n_layer = hparams.n_layer;
-        const int n_ctx = hparams.n_ctx;
-        const int n_vocab = hparams.n_vocab;
+    // data of a tensor which is scattered
+    std::vector<char> buf;
 
-        ctx_size += n_embd * n_vocab * ggml_type_sizef(vtype); // tok_embeddings
+    int n_tensors = 0;
+    size_t total_size = 0;
 
-        ctx_size += n_embd * ggml_type_sizef(GGML_TYPE_F32); // norm
+    while (true) {
+        int32_t n_dims;
+        int32_t length;
+        int32_t ftype;
 
-        ctx_size += n_embd * n_vocab * ggml_type_sizef(vtype); // output
+        fin.read(reinterpret_cast<char *>(&n_dims), sizeof(n_dims));
+        fin.read(reinterpret_cast<char *>(&length), sizeof(length));
+        fin.read(reinterpret_cast<char *>(&ftype), sizeof(ftype));
 
-        ctx_size += n_layer *
-                    (n_embd * ggml_type_sizef(GGML_TYPE_F32)); // attention_norm
+        if (fin.eof()) {
+            break;
+        }
 
-        ctx_size += n_layer * (n_embd * n_embd * ggml_type_sizef(wtype)); // wq
-        ctx_size += n_layer * (n_embd * n_embd * ggml_type_sizef(wtype)); // wk
-        ctx_size += n_layer * (n_embd * n_embd * ggml_type_sizef(wtype)); // wv
-        ctx_size += n_layer * (n_embd * n_embd * ggml_type_sizef(wtype)); // wo
+        int32_t nelements = 1;
+        int32_t ne[2] = {1, 1};
+        for (int i = 0; i < n_dims; ++i) {
+            fin.read(reinterpret_cast<char *>(&ne[i]), sizeof(ne[i]));
+            nelements *= ne[i];
+        }
 
-        ctx_size +=
-            n_layer * (n_embd * ggml_type_sizef(GGML_TYPE_F32)); // ffn_norm
+        std::string name(length, 0);
+        fin.read(&name[0], length);
 
-        ctx_size += n_layer * (n_ff * n_embd * ggml_type_sizef(wtype)); // w1
-        ctx_size += n_layer * (n_ff * n_embd * ggml_type_sizef(wtype)); // w2
-        ctx_size += n_layer * (n_ff * n_embd * ggml_type_sizef(wtype)); // w3
+        auto it = model.tensors.find(name);
+        if (it == model.tensors.end()) {
+            fprintf(stderr, "%s: unknown tensor '%s' in model file\n",
+                    __func__, name.data());
+            return false;
+        }
 
-        ctx_size +=
-            n_ctx * n_layer * n_embd * ggml_type_sizef(memory_type); // memory_k
-        ctx_size +=
-            n_ctx * n_layer * n_embd * ggml_type_sizef(memory_type); // memory_v
+        // split_type = 0: split by columns
+        // split_type = 1: split by rows
+        const int split_type = llama_tensor_split_type(name);
 
-        ctx_size += (5 + 10 * n_layer) * 256; // object overhead
+        auto tensor = it->second;
 
-        fprintf(stderr, "%s: ggml ctx size = %6.2f MB\n", __func__,
-                ctx_size / (1024.0 * 1024.0));
-    }
+        if (n_dims == 1) {
+            if (ggml_nelements(tensor) != nelements) {
+                fprintf(stderr,
+                        "%s: tensor '%s' has wrong size in model file\n",
+                        __func__, name.data());
+                return false;
+            }
+        } else {
+            if (ggml_nelements(tensor) / n_parts != nelements) {
+                fprintf(stderr,
+                        "%s: tensor '%s' has wrong size in model file\n",
+                        __func__, name.data());
+                return false;
+            }
+        }
 
-    // create the ggml context
-    {
-        struct ggml_init_params params = {
-            /*.mem_size   =*/ctx_size,
-            /*.mem_buffer =*/NULL,
-        };
+        if (n_dims == 1) {
+            if (tensor->ne[0] != ne[0] || tensor->ne[1] != ne[1]) {
+                fprintf(stderr,
+                        "%s: tensor '%s' has wrong shape in model "
+                        "file: got [%d, %d], expected [%d, %d]\n",
+                        __func__, name.data(), tensor->ne[0],
+                        tensor->ne[1], ne[0], ne[1]);
+                return false;
+            }
+        } else {
+            if (split_type == 0) {
+                if (tensor->ne[0] / n_parts != ne[0] ||
+                    tensor->ne[1] != ne[1]) {
+                    fprintf(stderr,
+                            "%s: tensor '%s' has wrong shape in model "
+                            "file: got [%d, %d], expected [%d, %d]\n",
+                            __func__, name.data(),
+                            tensor->ne[0] / n_parts, tensor->ne[1],
+                            ne[0], ne[1]);
+                    return false;
+                }
+            } else {
+                if (tensor->ne[0] != ne[0] ||
+                    tensor->ne[1] / n_parts != ne[1]) {
+                    fprintf(stderr,
+                            "%s: tensor '%s' has wrong shape in model "
+                            "file: got [%d, %d], expected [%d, %d]\n",
+                            __func__, name.data(), tensor->ne[0],
+                            tensor->ne[1] / n_parts, ne[0], ne[1]);
+                    return false;
+                }
+            }
+        }
 
-        model.ctx = ggml_init(params);
-        if (!model.ctx) {
-            fprintf(stderr, "%s: ggml_init() failed\n", __func__);
-            return false;
+        if (0) {
+            static const char *ftype_str[] = {
+                "f32",
+                "f16",
+                "q4_0",
+                "q4_1",
+            };
+            fprintf(stderr,
+                    "%24s - [%5d, %5d], type = %6s, split = %d\n",
+                    name.data(), ne[0], ne[1], ftype_str[ftype],
+                    split_type);
         }
-    }
 
-    // prepare memory for the weights
-    {
-        const auto &hparams = model.hparams;
+        size_t bpe = 0;
+        size_t n_read = 0;
+
+        switch (ftype) {
+        case 0:
+            bpe = ggml_type_size(GGML_TYPE_F32);
+            break;
+        case 1:
+            bpe = ggml_type_size(GGML_TYPE_F16);
+            break;
+        case 2:
+            bpe = ggml_type_size(GGML_TYPE_Q4_0);
+            assert(ne[0] % 64 == 0);
+            break;
+        case 3:
+            bpe = ggml_type_size(GGML_TYPE_Q4_1);
+            assert(ne[0] % 64 == 0);
+            break;
+        default: {
+            fprintf(stderr, "%s: unknown ftype %d in model file\n",
+                    __func__, ftype);
+            return false;
+        }
+        };
 
-        const int n_embd = hparams.n_embd;
-        const int n_layer = hparams.n_layer;
-        const int n_vocab = hparams.n_vocab;
+        const size_t row_size =
+            (tensor->ne[0] / ggml_blck_size(tensor->type)) *
+            ggml_type_size(tensor->type);
+
+        if (n_dims == 1 || n_parts == 1) {
+            if ((nelements * bpe) / ggml_blck_size(tensor->type) !=
+                ggml_nbytes(tensor)) {
+                fprintf(stderr,
+                        "%s: tensor '%s' has wrong size in model file: "
+                        "got %zu, expected %zu\n",
+                        __func__, name.data(), ggml_nbytes(tensor),
+                        nelements * bpe);
+                return false;
+            }
 
-        model.layers.resize(n_layer);
+            // a 1-d tensor is the same in every part
+            n_read = part_id == 0 ? ggml_nbytes(tensor) : 0;
 
-        model.tok_embeddings = ggml_new_tensor_2d(ctx, vtype, n_embd, n_vocab);
+            if (part_id != 0) {
+                fin.seekg(ggml_nbytes(tensor), std::ios::cur);
+            } else if (n_dims == 1 || tensor->nb[1] == row_size) {
+                fin.read(reinterpret_cast<char *>(tensor->data),
+                         ggml_nbytes(tensor));
+            } else {
+                // strided view into a packed tensor
+                buf.resize(ggml_nbytes(tensor));
+                fin.read(buf.data(), buf.size());
+                llama_tensor_copy_rows(tensor, buf.data());
+            }
 
-        model.norm = ggml_new_tensor_1d(ctx, GGML_TYPE_F32, n_embd);
-        model.output = ggml_new_tensor_2d(ctx, vtype, n_embd, n_vocab);
+            total_size += ggml_nbytes(tensor);
+        } else {
+            const size_t part_bytes = ggml_nbytes(tensor) / n_parts;
+            if ((nelements * bpe) / ggml_blck_size(tensor->type) !=
+                part_bytes) {
+                fprintf(stderr,
+                        "%s: tensor '%s' has wrong size in model file: "
+                        "got %zu, expected %zu\n",
+                        __func__, name.data(), part_bytes, nelements * bpe);
+                return false;
+            }
 
-        // map by name
-        model.tensors["tok_embeddings.weight"] = model.tok_embeddings;
+            if (split_type == 0) {
+                // the part holds columns np0 * part_id... of every row
+                const int np0 = ne[0];
+                const size_t part_row_size = row_size / n_parts;
+                const size_t offset =
+                    ((part_id * np0) / ggml_blck_size(tensor->type)) *
+                    ggml_type_size(tensor->type);
+
+                assert(row_size == tensor->nb[1]);
+
+                buf.resize(part_bytes);
+                fin.read(buf.data(), buf.size());
+                for (int i1 = 0; i1 < ne[1]; ++i1) {
+                    memcpy(reinterpret_cast<char *>(tensor->data) +
+                               i1 * row_size + offset,
+                           buf.data() + i1 * part_row_size, part_row_size);
+                }
+            } else {
+                // the part holds rows np1 * part_id...
+                const int np1 = ne[1];
+                char *dst = reinterpret_cast<char *>(tensor->data) +
+                            part_id * np1 * tensor->nb[1];
 
-        model.tensors["norm.weight"] = model.norm;
-        model.tensors["output.weight"] = model.output;
+                if (tensor->nb[1] == row_size) {
+                    fin.read(dst, part_bytes);
+                } else {
+                    buf.resize(part_bytes);
+                    fin.read(buf.data(), buf.size());
+                    for (int i1 = 0; i1 < np1; ++i1) {
+                        memcpy(dst + i1 * tensor->nb[1],
+                               buf.data() + i1 * row_size, row_size);
+                    }
+                }
+            }
 
-        for (int i = 0; i < n_layer; ++i) {
-            auto &layer = model.layers[i];
+            n_read = part_bytes;
+            total_size += part_bytes;
+        }
 
-            layer.attention_norm =
-                ggml_new_tensor_1d(ctx, GGML_TYPE_F32, n_embd);
+        if (!fin) {
+            fprintf(stderr, "%s: tensor '%s' is truncated in '%s'\n",
+                    __func__, name.data(), fname_part.c_str());
+            return false;
+        }
 
-            layer.wq = ggml_new_tensor_2d(ctx, wtype, n_embd, n_embd);
-            layer.wk = ggml_new_tensor_2d(ctx, wtype, n_embd, n_embd);
-            layer.wv = ggml_new_tensor_2d(ctx, wtype, n_embd, n_embd);
-            layer.wo = ggml_new_tensor_2d(ctx, wtype, n_embd, n_embd);
+        if (n_read > 0) {
+            llama_load_mark(state, tensor, n_read);
+        }
 
-            layer.ffn_norm = ggml_new_tensor_1d(ctx, GGML_TYPE_F32, n_embd);
+        ++n_tensors;
+    }
 
-            layer.w1 = ggml_new_tensor_2d(ctx, wtype, n_embd, n_ff);
-            layer.w2 = ggml_new_tensor_2d(ctx, wtype, n_ff, n_embd);
-            layer.w3 = ggml_new_tensor_2d(ctx, wtype, n_embd, n_ff);
+    fprintf(stderr, "%s: loaded part %d/%d from '%s': %8.2f MB / %d tensors\n",
+            __func__, part_id + 1, n_parts, fname_part.c_str(),
+            total_size / 1024.0 / 1024.0, n_tensors);
 
-            // map by name
-            model.tensors["layers." + std::to_string(i) +
-                          ".attention_norm.weight"] = layer.attention_norm;
+    part_size = total_size;
+    return true;
+}
 
-            model.tensors["layers." + std::to_string(i) +
-                          ".attention.wq.weight"] = layer.wq;
-            model.tensors["layers." + std::to_string(i) +
-                          ".attention.wk.weight"] = layer.wk;
-            model.tensors["layers." + std::to_string(i) +
-                          ".attention.wv.weight"] = layer.wv;
-            model.tensors["layers." + std::to_string(i) +
-                          ".attention.wo.weight"] = layer.wo;
+// threads reading a model file of n_units parts or tensors
+static int llama_load_threads(const llama_load_params &params, int n_units) {
+    int n_threads = params.n_load_threads;
+    if (n_threads < 1) {
+        n_threads = std::max(1u, std::thread::hardware_concurrency());
+    }
+    return std::max(1, std::min(n_threads, n_units));
+}
 
-            model.tensors["layers." + std::to_string(i) + ".ffn_norm.weight"] =
-                layer.ffn_norm;
+// repack the weights of a loaded model (see llama_repack_weights) on the
+// loading threads
+static void llama_repack_model(const llama_model &model, const int n_rows,
+                               const llama_load_params &params) {
+    const auto weights = llama_model_weights(model);
 
-            model.tensors["layers." + std::to_string(i) +
-                          ".feed_forward.w1.weight"] = layer.w1;
-            model.tensors["layers." + std::to_string(i) +
-                          ".feed_forward.w2.weight"] = layer.w2;
-            model.tensors["layers." + std::to_string(i) +
-                          ".feed_forward.w3.weight"] = layer.w3;
+    int n_q4_0 = 0;
+    for (const auto *w : weights) {
+        n_q4_0 += w->type == GGML_TYPE_Q4_0;
+    }
+    if (n_q4_0 == 0) {
+        return;
+    }
+
+    std::atomic<size_t> next_weight(0);
+    std::atomic<int> n_repacked(0);
+    std::atomic<size_t> n_bytes(0);
+    auto repack = [&]() {
+        for (size_t i; (i = next_weight++) < weights.size();) {
+            if (llama_repack_weights({weights[i]}, n_rows) > 0) {
+                ++n_repacked;
+                n_bytes += ggml_nbytes(weights[i]);
+            }
         }
+    };
+
+    std::vector<std::thread> workers;
+    for (int i = 1; i < llama_load_threads(params, weights.size()); ++i) {
+        workers.emplace_back(repack);
+    }
+    repack();
+    for (auto &worker : workers) {
+        worker.join();
     }
 
-    // key + value memory
-    {
-        const auto &hparams = model.hparams;
+    fprintf(stderr,
+            "%s: repacked %d of %d Q4_0 weights (%8.2f MB) by %d rows\n",
+            __func__, n_repacked.load(), n_q4_0,
+            n_bytes.load() / 1024.0 / 1024.0, n_rows);
+}
 
-        const int n_embd = hparams.n_embd;
-        const int n_layer = hparams.n_layer;
-        const int n_ctx = hparams.n_ctx;
+// load the tensors of an indexed model file (FILE_VERSION_INDEXED) following
+// the vocab at file_offset: a directory of all tensors (name, type, shape,
+// offset) is followed by their data at aligned offsets, so they are copied by
+// offset out of a mapping of the file (or read by seeking)
+static bool llama_model_load_indexed(const std::string &fname,
+                                     const size_t file_offset,
+                                     const llama_model &model,
+                                     const llama_load_params &params) {
+    struct entry {
+        struct ggml_tensor *tensor;
+        uint64_t offset;
+    };
 
-        const int n_mem = n_layer * n_ctx;
-        const int n_elements = n_embd * n_mem;
+    llama_load_state *state = model.loading.get();
 
-        model.memory_k = ggml_new_tensor_1d(ctx, memory_type, n_elements);
-        model.memory_v = ggml_new_tensor_1d(ctx, memory_type, n_elements);
+    auto fin = std::ifstream(fname, std::ios::binary);
+    if (!fin) {
+        fprintf(stderr, "%s: failed to open '%s'\n", __func__, fname.c_str());
+        return false;
+    }
+    fin.seekg(file_offset);
+
+    uint32_t n_tensors = 0;
+    uint32_t alignment = 0;
+    fin.read((char *)&n_tensors, sizeof(n_tensors));
+    fin.read((char *)&alignment, sizeof(alignment));
+
+    std::vector<entry> entries;
+    size_t total_size = 0;
+    for (uint32_t i = 0; i < n_tensors; ++i) {
+        int32_t n_dims;
+        int32_t length;
+        int32_t ftype;
+
+        fin.read(reinterpret_cast<char *>(&n_dims), sizeof(n_dims));
+        fin.read(reinterpret_cast<char *>(&length), sizeof(length));
+        fin.read(reinterpret_cast<char *>(&ftype), sizeof(ftype));
+        if (!fin || n_dims < 1 || n_dims > 2 || length < 0) {
+            fprintf(stderr, "%s: invalid tensor directory in '%s'\n",
+                    __func__, fname.c_str());
+            return false;
+        }
 
-        const size_t memory_size =
-            ggml_nbytes(model.memory_k) + ggml_nbytes(model.memory_v);
+        int32_t ne[2] = {1, 1};
+        for (int j = 0; j < n_dims; ++j) {
+            fin.read(reinterpret_cast<char *>(&ne[j]), sizeof(ne[j]));
+        }
 
-        fprintf(stderr, "%s: memory_size = %8.2f MB, n_mem = %d\n", __func__,
-                memory_size / 1024.0 / 1024.0, n_mem);
+        std::string name(length, 0);
+        fin.read(&name[0], length);
+
+        uint64_t offset;
+        fin.read(reinterpret_cast<char *>(&offset), sizeof(offset));
+
+        auto it = model.tensors.find(name);
+        if (it == model.tensors.end()) {
+            fprintf(stderr, "%s: unknown tensor '%s' in model file\n",
+                    __func__, name.c_str());
+            return false;
+        }
+
+        auto tensor = it->second;
+        ggml_type type;
+        if (!llama_ftype_to_type(ftype, type) || type != tensor->type) {
+            fprintf(stderr, "%s: tensor '%s' has wrong type %d in model file\n",
+                    __func__, name.c_str(), ftype);
+            return false;
+        }
+        if (tensor->ne[0] != ne[0] || tensor->ne[1] != ne[1]) {
+            fprintf(stderr,
+                    "%s: tensor '%s' has wrong shape in model file: got [%d, "
+                    "%d], expected [%d, %d]\n",
+                    __func__, name.c_str(), ne[0], ne[1], tensor->ne[0],
+                    tensor->ne[1]);
+            return false;
+        }
+        if (alignment > 0 && offset % alignment != 0) {
+            fprintf(stderr, "%s: tensor '%s' is not aligned in model file\n",
+                    __func__, name.c_str());
+            return false;
+        }
+
+        entries.push_back({tensor, offset});
+        total_size += ggml_nbytes(tensor);
     }
 
-    const size_t file_offset = fin.tellg();
+    if (!fin) {
+        fprintf(stderr, "%s: invalid tensor directory in '%s'\n", __func__,
+                fname.c_str());
+        return false;
+    }
+    if (entries.size() != model.tensors.size()) {
+        fprintf(stderr, "%s: model file has %zu tensors, expected %zu\n",
+                __func__, entries.size(), model.tensors.size());
+        return false;
+    }
+
+    // tensors read in the background are read in the order of evaluation
+    if (state != nullptr) {
+        std::stable_sort(entries.begin(), entries.end(),
+                         [&](const entry &a, const entry &b) {
+                             return state->units.at(a.tensor) <
+                                    state->units.at(b.tensor);
+                         });
+    }
+
+    const int n_threads = llama_load_threads(params, n_tensors);
 
+    fprintf(stderr, "%s: loading %u tensors from '%s' with %d threads\n",
+            __func__, n_tensors, fname.c_str(), n_threads);
+
+#if defined(__unix__) || (defined(__APPLE__) && defined(__MACH__))
     fin.close();
 
-    std::vector<uint8_t> tmp;
+    int fd = open(fname.c_str(), O_RDONLY);
+    if (fd == -1) {
+        fprintf(stderr, "%s: failed to open '%s'\n", __func__, fname.c_str());
+        return false;
+    }
+
+    struct stat st;
+    void *addr = MAP_FAILED;
+    if (fstat(fd, &st) == 0 && st.st_size > 0) {
+        addr = mmap(nullptr, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    }
+    close(fd);
 
-    for (int i = 0; i < n_parts; ++i) {
-        const int part_id = i;
-        // const int part_id = n_parts - i - 1;
+    if (addr == MAP_FAILED) {
+        fprintf(stderr, "%s: failed to map '%s'\n", __func__, fname.c_str());
+        return false;
+    }
 
-        std::string fname_part = fname;
-        if (i > 0) {
-            fname_part += "." + std::to_string(i);
+    for (const auto &e : entries) {
+        if (e.offset + ggml_nbytes(e.tensor) > (uint64_t)st.st_size) {
+            fprintf(stderr, "%s: tensor data beyond the end of '%s'\n",
+                    __func__, fname.c_str());
+            munmap(addr, st.st_size);
+            return false;
         }
+    }
 
-        fprintf(stderr, "%s: loading model part %d/%d from '%s'\n", __func__,
-                i + 1, n_parts, fname_part.c_str());
+    // tensors are independent, the threads fault in their pages of the
+    // mapping concurrently
+    std::atomic<size_t> next_entry(0);
+    auto copy_entries = [&]() {
+        for (size_t i; (i = next_entry++) < entries.size();) {
+            llama_tensor_copy_rows(entries[i].tensor,
+                                   (const char *)addr + entries[i].offset);
+            llama_load_mark(state, entries[i].tensor,
+                            ggml_nbytes(entries[i].tensor));
+        }
+    };
 
-        fin = std::ifstream(fname_part, std::ios::binary);
-        fin.rdbuf()->pubsetbuf(f_buf.data(), f_buf.size());
-        fin.seekg(file_offset);
+    std::vector<std::thread> workers;
+    for (int i = 1; i < n_threads; ++i) {
+        workers.emplace_back(copy_entries);
+    }
+    copy_entries();
+    for (auto &worker : workers) {
+        worker.join();
+    }
 
-        // load weights
-        {
-            int n_tensors = 0;
-            size_t total_size = 0;
+    munmap(addr, st.st_size);
+#else
+    std::vector<char> buf;
+    for (const auto &e : entries) {
+        buf.resize(ggml_nbytes(e.tensor));
+        fin.seekg(e.offset);
+        fin.read(buf.data(), buf.size());
+        if (!fin) {
+            fprintf(stderr, "%s: tensor data beyond the end of '%s'\n",
+                    __func__, fname.c_str());
+            return false;
+        }
+        llama_tensor_copy_rows(e.tensor, buf.data());
+        llama_load_mark(state, e.tensor, ggml_nbytes(e.tensor));
+    }
+#endif
 
-            fprintf(stderr, "%s: ", __func__);
+    fprintf(stderr, "%s: model size = %8.2f MB / num tensors = %u\n",
+            __func__, total_size / 1024.0 / 1024.0, n_tensors);
 
-            while (true) {
-                int32_t n_dims;
-                int32_t length;
-                int32_t ftype;
+    return true;
+}
 
-                fin.read(reinterpret_cast<char *>(&n_dims), sizeof(n_dims));
-                fin.read(reinterpret_cast<char *>(&length), sizeof(length));
-                fin.read(reinterpret_cast<char *>(&ftype), sizeof(ftype));
+// load the tensors of a model file (FILE_VERSION) of n_parts following the
+// vocab at file_offset
+static bool llama_model_load_parts(const std::string &fname,
+                                   const size_t file_offset, const int n_parts,
+                                   const llama_model &model,
+                                   const llama_load_params &params) {
+    // parts hold disjoint slices of the tensors, so they are read
+    // concurrently
+    const int n_threads = llama_load_threads(params, n_parts);
+
+    std::atomic<int> next_part(0);
+    std::vector<size_t> part_sizes(n_parts, 0);
+    std::vector<char> part_ok(n_parts, 0);
+    auto load_parts = [&]() {
+        for (int i; (i = next_part++) < n_parts;) {
+            std::string fname_part = fname;
+            if (i > 0) {
+                fname_part += "." + std::to_string(i);
+            }
+            part_ok[i] = llama_model_load_part(fname_part, i, n_parts,
+                                               file_offset, model,
+                                               part_sizes[i]);
+        }
+    };
 
-                if (fin.eof()) {
-                    break;
-                }
+    fprintf(stderr, "%s: loading %d model parts with %d threads\n", __func__,
+            n_parts, n_threads);
 
-                int32_t nelements = 1;
-                int32_t ne[2] = {1, 1};
-                for (int i = 0; i < n_dims; ++i) {
-                    fin.read(reinterpret_cast<char *>(&ne[i]), sizeof(ne[i]));
-                    nelements *= ne[i];
-                }
+    std::vector<std::thread> workers;
+    for (int i = 1; i < n_threads; ++i) {
+        workers.emplace_back(load_parts);
+    }
+    load_parts();
+    for (auto &worker : workers) {
+        worker.join();
+    }
 
-                std::string name(length, 0);
-                fin.read(&name[0], length);
+    size_t total_size = 0;
+    for (int i = 0; i < n_parts; ++i) {
+        if (!part_ok[i]) {
+            return false;
+        }
+        total_size += part_sizes[i];
+    }
 
-                if (model.tensors.find(name.data()) == model.tensors.end()) {
-                    fprintf(stderr, "%s: unknown tensor '%s' in model file\n",
-                            __func__, name.data());
-                    return false;
-                }
+    fprintf(stderr, "%s: model size = %8.2f MB\n", __func__,
+            total_size / 1024.0 / 1024.0);
 
-                // split_type = 0: split by columns
-                // split_type = 1: split by rows
-                int split_type = 0;
-
-                // split_type = 0:
-                // regex:
-                //   - tok_embeddings.*
-                //   - layers.*.attention.wo.weight
-                //   - layers.*.feed_forward.w2.weight
-
-                // split_type = 1:
-                // regex:
-                //   - output.*
-                //   - layers.*.attention.wq.weight
-                //   - layers.*.attention.wk.weight
-                //   - layers.*.attention.wv.weight
-                //   - layers.*.feed_forward.w1.weight
-                //   - layers.*.feed_forward.w3.weight
-                if (name.find("tok_embeddings") != std::string::npos) {
-                    split_type = 0;
-                } else if (name.find("layers") != std::string::npos) {
-                    if (name.find("attention.wo.weight") != std::string::npos) {
-                        split_type = 0;
-                    } else if (name.find("feed_forward.w2.weight") !=
-                               std::string::npos) {
-                        split_type = 0;
-                    } else {
-                        split_type = 1;
-                    }
-                } else if (name.find("output") != std::string::npos) {
-                    split_type = 1;
-                }
+    return true;
+}
 
-                auto tensor = model.tensors[name.data()];
+#if defined(__unix__) || (defined(__APPLE__) && defined(__MACH__))
+// size of huge pages (the default one of MAP_HUGETLB on Linux)
+static size_t llama_huge_page_size(void) {
+    size_t size = 2 * 1024 * 1024;
+#if defined(__linux__)
+    FILE *f = fopen("/proc/meminfo", "r");
+    if (f) {
+        char line[256];
+        unsigned long kb;
+        while (fgets(line, sizeof(line), f)) {
+            if (sscanf(line, "Hugepagesize: %lu kB", &kb) == 1) {
+                size = kb * 1024;
+                break;
+            }
+        }
+        fclose(f);
+    }
+#endif
+    return size;
+}
 
-                if (n_dims == 1) {
-                    if (ggml_nelements(tensor) != nelements) {
-                        fprintf(
-                            stderr,
-                            "%s: tensor '%s' has wrong size in model file\n",
-                            __func__, name.data());
-                        return false;
-                    }
-                } else {
-                    if (ggml_nelements(tensor) / n_parts != nelements) {
-                        fprintf(
-                            stderr,
-                            "%s: tensor '%s' has wrong size in model file\n",
-                            __func__, name.data());
-                        return false;
-                    }
-                }
+// bytes of [addr, addr + size) which are backed by transparent huge pages
+static size_t llama_huge_page_bytes(const void *addr, const size_t size) {
+    size_t n_bytes = 0;
+#if defined(__linux__)
+    FILE *f = fopen("/proc/self/smaps", "r");
+    if (!f) {
+        return 0;
+    }
+    const uintptr_t begin = (uintptr_t)addr;
+    const uintptr_t end = begin + size;
+    bool inside = false; // current mapping overlaps the range
+    char line[512];
+    while (fgets(line, sizeof(line), f)) {
+        uintptr_t vm_begin, vm_end;
+        unsigned long kb;
+        if (sscanf(line, "%" SCNxPTR "-%" SCNxPTR " ", &vm_begin, &vm_end) ==
+            2) {
+            inside = vm_begin < end && begin < vm_end;
+        } else if (inside &&
+                   sscanf(line, "AnonHugePages: %lu kB", &kb) == 1) {
+            n_bytes += kb * 1024;
+        }
+    }
+    fclose(f);
+#else
+    (void)addr;
+    (void)size;
+#endif
+    return n_bytes;
+}
+#endif
 
-                if (n_dims == 1) {
-                    if (tensor->ne[0] != ne[0] || tensor->ne[1] != ne[1]) {
-                        fprintf(stderr,
-                                "%s: tensor '%s' has wrong shape in model "
-                                "file: got [%d, %d], expected [%d, %d]\n",
-                                __func__, name.data(), tensor->ne[0],
-                                tensor->ne[1], ne[0], ne[1]);
-                        return false;
-                    }
-                } else {
-                    if (split_type == 0) {
-                        if (tensor->ne[0] / n_parts != ne[0] ||
-                            tensor->ne[1] != ne[1]) {
-                            fprintf(stderr,
-                                    "%s: tensor '%s' has wrong shape in model "
-                                    "file: got [%d, %d], expected [%d, %d]\n",
-                                    __func__, name.data(),
-                                    tensor->ne[0] / n_parts, tensor->ne[1],
-                                    ne[0], ne[1]);
-                            return false;
-                        }
-                    } else {
-                        if (tensor->ne[0] != ne[0] ||
-                            tensor->ne[1] / n_parts != ne[1]) {
-                            fprintf(stderr,
-                                    "%s: tensor '%s' has wrong shape in model "
-                                    "file: got [%d, %d], expected [%d, %d]\n",
-                                    __func__, name.data(), tensor->ne[0],
-                                    tensor->ne[1] / n_parts, ne[0], ne[1]);
-                            return false;
-                        }
-                    }
-                }
+llama_buffer::~llama_buffer(void) {
+#if defined(__unix__) || (defined(__APPLE__) && defined(__MACH__))
+    if (addr) {
+        munmap(addr, size); // unlocks as well
+    }
+#endif
+}
 
-                if (0) {
-                    static const char *ftype_str[] = {
-                        "f32",
-                        "f16",
-                        "q4_0",
-                        "q4_1",
-                    };
-                    fprintf(stderr,
-                            "%24s - [%5d, %5d], type = %6s, split = %d\n",
-                            name.data(), ne[0], ne[1], ftype_str[ftype],
-                            split_type);
+// map anonymous memory for the model context: with huge_pages it is backed by
+// reserved huge pages (MAP_HUGETLB) if there are enough of them and advised to
+// use transparent ones otherwise; buf stays empty where mapping is not
+// supported
+static bool llama_buffer_alloc(llama_buffer &buf, size_t size,
+                               const bool huge_pages) {
+#if defined(__unix__) || (defined(__APPLE__) && defined(__MACH__))
+    const int prot = PROT_READ | PROT_WRITE;
+    const int flags = MAP_PRIVATE | MAP_ANONYMOUS;
+
+    void *addr = MAP_FAILED;
+    size_t page_size = sysconf(_SC_PAGESIZE);
+    bool transparent = false;
+    if (huge_pages) {
+        const size_t huge_size = llama_huge_page_size();
+        size = (size + huge_size - 1) / huge_size * huge_size;
+#if defined(MAP_HUGETLB)
+        addr = mmap(nullptr, size, prot, flags | MAP_HUGETLB, -1, 0);
+        if (addr != MAP_FAILED) {
+            page_size = huge_size;
+        }
+#endif
+#if defined(MADV_HUGEPAGE)
+        if (addr == MAP_FAILED) {
+            // trim a larger mapping to huge page boundaries, so that all of it
+            // can be covered by huge pages
+            char *base =
+                (char *)mmap(nullptr, size + huge_size, prot, flags, -1, 0);
+            if (base != (char *)MAP_FAILED) {
+                const size_t head =
+                    (huge_size - (uintptr_t)base % huge_size) % huge_size;
+                if (head > 0) {
+                    munmap(base, head);
                 }
+                munmap(base + head + size, huge_size - head);
+                addr = base + head;
+                transparent = madvise(addr, size, MADV_HUGEPAGE) == 0;
+            }
+        }
+#endif
+        if (addr != MAP_FAILED && page_size != huge_size && !transparent) {
+            fprintf(stderr,
+                    "%s: huge pages are not available, using pages of %zu "
+                    "kB\n",
+                    __func__, page_size / 1024);
+        }
+    }
+    if (addr == MAP_FAILED) {
+        addr = mmap(nullptr, size, prot, flags, -1, 0);
+    }
+    if (addr == MAP_FAILED) {
+        fprintf(stderr, "%s: failed to map %8.2f MB\n", __func__,
+                size / 1024.0 / 1024.0);
+        return false;
+    }
 
-                size_t bpe = 0;
+    buf.addr = addr;
+    buf.size = size;
+    buf.page_size = page_size;
+    buf.transparent = transparent;
+#else
+    (void)buf;
+    (void)size;
+    (void)huge_pages;
+    fprintf(stderr, "%s: mapping model memory is not supported\n", __func__);
+#endif
+    return true;
+}
 
-                switch (ftype) {
-                case 0:
-                    bpe = ggml_type_size(GGML_TYPE_F32);
-                    break;
-                case 1:
-                    bpe = ggml_type_size(GGML_TYPE_F16);
-                    break;
-                case 2:
-                    bpe = ggml_type_size(GGML_TYPE_Q4_0);
-                    assert(ne[0] % 64 == 0);
-                    break;
-                case 3:
-                    bpe = ggml_type_size(GGML_TYPE_Q4_1);
-                    assert(ne[0] % 64 == 0);
-                    break;
-                default: {
-                    fprintf(stderr, "%s: unknown ftype %d in model file\n",
-                            __func__, ftype);
-                    return false;
-                }
-                };
-
-                if (n_dims == 1 || n_parts == 1) {
-                    if ((nelements * bpe) / ggml_blck_size(tensor->type) !=
-                        ggml_nbytes(tensor)) {
-                        fprintf(stderr,
-                                "%s: tensor '%s' has wrong size in model file: "
-                                "got %zu, expected %zu\n",
-                                __func__, name.data(), ggml_nbytes(tensor),
-                                nelements * bpe);
-                        return false;
-                    }
+// lock the model context in RAM, which faults in all of its pages at once
+static void llama_buffer_lock(llama_buffer &buf) {
+#if defined(__unix__) || (defined(__APPLE__) && defined(__MACH__))
+    if (!buf.addr) {
+        return;
+    }
+    if (mlock(buf.addr, buf.size) == 0) {
+        buf.n_locked = buf.size;
+    } else {
+        fprintf(stderr,
+                "%s: failed to lock %8.2f MB in RAM (%s), see ulimit -l\n",
+                __func__, buf.size / 1024.0 / 1024.0, strerror(errno));
+    }
+#else
+    (void)buf;
+#endif
+}
+
+// bind the rows of the weights of mul_mat to the NUMA nodes whose threads
+// compute them (see ggml_numa_place_rows), before any of them is written
+static void llama_numa_place(llama_model &model) {
+    if (!ggml_numa_init()) {
+        fprintf(stderr, "%s: not a NUMA system, weights are not placed\n",
+                __func__);
+        return;
+    }
+
+    const auto weights = llama_model_weights(model);
+
+    const size_t page_size = model.buffer.page_size;
+
+    size_t n_bytes = 0;
+    for (auto *w : weights) {
+        if (!model.buffer.addr || !ggml_numa_place_rows(w, page_size)) {
+            fprintf(stderr, "%s: failed to place weights on NUMA nodes\n",
+                    __func__);
+            return;
+        }
+        n_bytes += ggml_nbytes(w);
+    }
+
+    fprintf(stderr, "%s: placed %8.2f MB of weights on %d NUMA nodes\n",
+            __func__, n_bytes / 1024.0 / 1024.0, ggml_numa_n_nodes());
+}
+
+// page size and locked bytes achieved for the model context
+static void llama_buffer_report(const llama_buffer &buf) {
+    if (!buf.addr) {
+        return;
+    }
+
+    size_t page_size = buf.page_size;
+    size_t n_huge = 0;
+#if defined(__unix__) || (defined(__APPLE__) && defined(__MACH__))
+    if (buf.transparent) {
+        n_huge = llama_huge_page_bytes(buf.addr, buf.size);
+        if (n_huge > 0) {
+            page_size = llama_huge_page_size();
+        }
+    } else if (buf.page_size > (size_t)sysconf(_SC_PAGESIZE)) {
+        n_huge = buf.size;
+    }
+#endif
+
+    fprintf(stderr,
+            "%s: page size = %zu kB, huge pages = %8.2f MB, locked = %8.2f "
+            "MB of %8.2f MB\n",
+            __func__, page_size / 1024, n_huge / 1024.0 / 1024.0,
+            buf.n_locked / 1024.0 / 1024.0, buf.size / 1024.0 / 1024.0);
+}
+
+bool llama_model_load(const std::string &fname, llama_model &model,
+                      llama_vocab &vocab, const llama_load_params &params) {
+    fprintf(stderr, "%s: loading model from '%s' - please wait ...\n", __func__,
+            fname.c_str());
+
+    const int n_ctx = params.n_ctx;
+    const ggml_type memory_type = params.memory_type;
+
+    // rows of key + value memory per layer
+    const int n_mem_rows =
+        params.kv_pages > 0 ? params.kv_pages * params.kv_page_size : n_ctx;
+
+    int n_parts = params.n_parts;
+
+    std::vector<char> f_buf(1024 * 1024);
+
+    auto fin = std::ifstream(fname, std::ios::binary);
+    fin.rdbuf()->pubsetbuf(f_buf.data(), f_buf.size());
+    if (!fin) {
+        fprintf(stderr, "%s: failed to open '%s'\n", __func__, fname.c_str());
+        return false;
+    }
+
+    uint32_t format_version;
+
+    // verify magic
+    {
+        uint32_t magic;
+        fin.read((char *)&magic, sizeof(magic));
+        if (magic == FILE_MAGIC_UNVERSIONED) {
+            fprintf(stderr,
+                    "%s: invalid model file '%s' (too old, regenerate your "
+                    "model files!)\n",
+                    __func__, fname.c_str());
+            return false;
+        }
+        if (magic != FILE_MAGIC) {
+            fprintf(stderr, "%s: invalid model file '%s' (bad magic)\n",
+                    __func__, fname.c_str());
+            return false;
+        }
+
+        fin.read((char *)&format_version, sizeof(format_version));
+
+        if (format_version != FILE_VERSION &&
+            format_version != FILE_VERSION_INDEXED) {
+            fprintf(stderr,
+                    "%s: invalid model file '%s' (unsupported format version "
+                    "%" PRIu32 ", expected %d or %d)\n",
+                    __func__, fname.c_str(), format_version, FILE_VERSION,
+                    FILE_VERSION_INDEXED);
+            return false;
+        }
+    }
+
+    // an indexed file holds whole tensors
+    if (format_version == FILE_VERSION_INDEXED) {
+        if (n_parts > 1) {
+            fprintf(stderr, "%s: indexed model file '%s' has a single part\n",
+                    __func__, fname.c_str());
+            return false;
+        }
+        n_parts = 1;
+    }
+
+    int n_ff = 0;
+
+    // load hparams
+    {
+        auto &hparams = model.hparams;
+
+        fin.read((char *)&hparams.n_vocab, sizeof(hparams.n_vocab));
+        // fin.read((char *) &hparams.n_ctx,   sizeof(hparams.n_ctx));
+        fin.read((char *)&hparams.n_embd, sizeof(hparams.n_embd));
+        fin.read((char *)&hparams.n_mult, sizeof(hparams.n_mult));
+        fin.read((char *)&hparams.n_head, sizeof(hparams.n_head));
+        fin.read((char *)&hparams.n_layer, sizeof(hparams.n_layer));
+        fin.read((char *)&hparams.n_rot, sizeof(hparams.n_rot));
+        fin.read((char *)&hparams.f16, sizeof(hparams.f16));
+
+        hparams.n_ctx = n_ctx;
+
+        n_ff = ((2 * (4 * hparams.n_embd) / 3 + hparams.n_mult - 1) /
+                hparams.n_mult) *
+               hparams.n_mult;
+
+        if (n_parts < 1) {
+            n_parts = LLAMA_N_PARTS.at(hparams.n_embd);
+        }
+
+        // temp warning to tell the user to use "--n_parts"
+        if (hparams.f16 == 4 && n_parts != 1) {
+            fprintf(stderr,
+                    "%s: GPTQ model detected - are you sure n_parts should be "
+                    "%d? we normally expect it to be 1\n",
+                    __func__, n_parts);
+            fprintf(stderr, "%s: use '--n_parts 1' if necessary\n", __func__);
+        }
+
+        fprintf(stderr, "%s: n_vocab = %d\n", __func__, hparams.n_vocab);
+        fprintf(stderr, "%s: n_ctx   = %d\n", __func__, hparams.n_ctx);
+        fprintf(stderr, "%s: n_embd  = %d\n", __func__, hparams.n_embd);
+        fprintf(stderr, "%s: n_mult  = %d\n", __func__, hparams.n_mult);
+        fprintf(stderr, "%s: n_head  = %d\n", __func__, hparams.n_head);
+        fprintf(stderr, "%s: n_layer = %d\n", __func__, hparams.n_layer);
+        fprintf(stderr, "%s: n_rot   = %d\n", __func__, hparams.n_rot);
+        fprintf(stderr, "%s: f16     = %d\n", __func__, hparams.f16);
+        fprintf(stderr, "%s: n_ff    = %d\n", __func__, n_ff);
+        fprintf(stderr, "%s: n_parts = %d\n", __func__, n_parts);
+
+        // a quantised memory is addressed by head, so a head has to consist
+        // of whole blocks
+        const int n_embd_head = hparams.n_embd / hparams.n_head;
+        if (n_embd_head % ggml_blck_size(memory_type) != 0) {
+            fprintf(stderr,
+                    "%s: memory type %d needs a head size divisible by %d "
+                    "(got %d)\n",
+                    __func__, memory_type, ggml_blck_size(memory_type),
+                    n_embd_head);
+            return false;
+        }
+
+        if (params.kv_pages < 0 ||
+            (params.kv_pages > 0 && params.kv_page_size < 1)) {
+            fprintf(stderr, "%s: invalid paged memory of %d pages of %d\n",
+                    __func__, params.kv_pages, params.kv_page_size);
+            return false;
+        }
+
+        // attention gathers the rows of paged memory into an F32 copy, which
+        // would undo the savings of a quantised memory
+        if (params.kv_pages > 0 && memory_type == GGML_TYPE_Q8_0) {
+            fprintf(stderr,
+                    "%s: paged memory does not support memory type %d\n",
+                    __func__, memory_type);
+            return false;
+        }
+
+        if (params.repack_rows != 0 && params.repack_rows != 4 &&
+            params.repack_rows != 8) {
+            fprintf(stderr, "%s: invalid rows to repack %d (0, 4 or 8)\n",
+                    __func__, params.repack_rows);
+            return false;
+        }
+    }
+
+    // load vocab
+    {
+        std::string word;
+        vocab.id_to_token.resize(model.hparams.n_vocab);
+        std::vector<char> tmp(64);
+
+        for (int i = 0; i < model.hparams.n_vocab; i++) {
+            uint32_t len;
+            fin.read((char *)&len, sizeof(len));
+
+            word.resize(len);
+            if (len > 0) {
+                tmp.resize(len);
+                fin.read(tmp.data(), len);
+                word.assign(tmp.data(), len);
+            } else {
+                word.clear();
+            }
+
+            float score;
+            fin.read((char *)&score, sizeof(score));
+
+            vocab.token_to_id[word] = i;
+
+            auto &tok_score = vocab.id_to_token[i];
+            tok_score.tok = word;
+            tok_score.score = score;
+        }
+    }
+
+    // for the big tensors, we have the option to store the data in 16-bit
+    // floats or quantized in order to save memory and also to speed up the
+    // computation wtype is for per-layer weights, while vtype is for other
+    // weights
+    ggml_type wtype, vtype;
+    switch (model.hparams.f16) {
+    case 0:
+        wtype = vtype = GGML_TYPE_F32;
+        break;
+    case 1:
+        wtype = vtype = GGML_TYPE_F16;
+        break;
+    case 2:
+        wtype = vtype = GGML_TYPE_Q4_0;
+        break;
+    case 3:
+        wtype = vtype = GGML_TYPE_Q4_1;
+        break;
+    case 4:
+        wtype = GGML_TYPE_Q4_1;
+        vtype = GGML_TYPE_F16;
+        break;
+    default: {
+        fprintf(stderr, "%s: invalid model file '%s' (bad f16 value %d)\n",
+                __func__, fname.c_str(), model.hparams.f16);
+        return false;
+    }
+    }
+
+    auto &ctx = model.ctx;
+
+    size_t ctx_size = 0;
+
+    {
+        const auto &hparams = model.hparams;
+
+        const int n_embd = hparams.n_embd;
+        const int n_layer = hparams.n_layer;
+        const int n_vocab = hparams.n_vocab;
+
+        ctx_size += n_embd * n_vocab * ggml_type_sizef(vtype); // tok_embeddings
+
+        ctx_size += n_embd * ggml_type_sizef(GGML_TYPE_F32); // norm
+
+        ctx_size += n_embd * n_vocab * ggml_type_sizef(vtype); // output
+
+        ctx_size += n_layer *
+                    (n_embd * ggml_type_sizef(GGML_TYPE_F32)); // attention_norm
+
+        ctx_size += n_layer * (n_embd * n_embd * ggml_type_sizef(wtype)); // wq
+        ctx_size += n_layer * (n_embd * n_embd * ggml_type_sizef(wtype)); // wk
+        ctx_size += n_layer * (n_embd * n_embd * ggml_type_sizef(wtype)); // wv
+        ctx_size += n_layer * (n_embd * n_embd * ggml_type_sizef(wtype)); // wo
+
+        ctx_size +=
+            n_layer * (n_embd * ggml_type_sizef(GGML_TYPE_F32)); // ffn_norm
+
+        ctx_size += n_layer * (n_ff * n_embd * ggml_type_sizef(wtype)); // w1
+        ctx_size += n_layer * (n_ff * n_embd * ggml_type_sizef(wtype)); // w2
+        ctx_size += n_layer * (n_ff * n_embd * ggml_type_sizef(wtype)); // w3
+
+        ctx_size += n_mem_rows * n_layer * n_embd *
+                    ggml_type_sizef(memory_type); // memory_k
+        ctx_size += n_mem_rows * n_layer * n_embd *
+                    ggml_type_sizef(memory_type); // memory_v
+
+        ctx_size += (5 + 13 * n_layer) * 256; // object overhead
+
+        fprintf(stderr, "%s: ggml ctx size = %6.2f MB\n", __func__,
+                ctx_size / (1024.0 * 1024.0));
+    }
+
+    if (params.huge_pages || params.mlock || params.numa) {
+        if (!llama_buffer_alloc(model.buffer, ctx_size, params.huge_pages)) {
+            return false;
+        }
+    }
+
+    // create the ggml context
+    {
+        struct ggml_init_params init_params = {
+            /*.mem_size   =*/ctx_size,
+            /*.mem_buffer =*/model.buffer.addr,
+        };
+
+        model.ctx = ggml_init(init_params);
+        if (!model.ctx) {
+            fprintf(stderr, "%s: ggml_init() failed\n", __func__);
+            return false;
+        }
+    }
+
+    // prepare memory for the weights
+    {
+        const auto &hparams = model.hparams;
+
+        const int n_embd = hparams.n_embd;
+        const int n_layer = hparams.n_layer;
+        const int n_vocab = hparams.n_vocab;
+
+        model.layers.resize(n_layer);
+
+        model.tok_embeddings = ggml_new_tensor_2d(ctx, vtype, n_embd, n_vocab);
+
+        model.norm = ggml_new_tensor_1d(ctx, GGML_TYPE_F32, n_embd);
+        model.output = ggml_new_tensor_2d(ctx, vtype, n_embd, n_vocab);
+
+        // map by name
+        model.tensors["tok_embeddings.weight"] = model.tok_embeddings;
+
+        model.tensors["norm.weight"] = model.norm;
+        model.tensors["output.weight"] = model.output;
+
+        for (int i = 0; i < n_layer; ++i) {
+            auto &layer = model.layers[i];
+
+            layer.attention_norm =
+                ggml_new_tensor_1d(ctx, GGML_TYPE_F32, n_embd);
+
+            if (params.fuse_qkv) {
+                // wq, wk and wv are stacked so that the projection is a
+                // single matmul over the normalised input
+                layer.wqkv = ggml_new_tensor_2d(ctx, wtype, n_embd, 3 * n_embd);
+                layer.wq = ggml_view_2d(ctx, layer.wqkv, n_embd, n_embd,
+                                        layer.wqkv->nb[1], 0);
+                layer.wk = ggml_view_2d(ctx, layer.wqkv, n_embd, n_embd,
+                                        layer.wqkv->nb[1],
+                                        n_embd * layer.wqkv->nb[1]);
+                layer.wv = ggml_view_2d(ctx, layer.wqkv, n_embd, n_embd,
+                                        layer.wqkv->nb[1],
+                                        2 * n_embd * layer.wqkv->nb[1]);
+            } else {
+                layer.wq = ggml_new_tensor_2d(ctx, wtype, n_embd, n_embd);
+                layer.wk = ggml_new_tensor_2d(ctx, wtype, n_embd, n_embd);
+                layer.wv = ggml_new_tensor_2d(ctx, wtype, n_embd, n_embd);
+            }
+            layer.wo = ggml_new_tensor_2d(ctx, wtype, n_embd, n_embd);
+
+            layer.ffn_norm = ggml_new_tensor_1d(ctx, GGML_TYPE_F32, n_embd);
+
+            if (params.fuse_ffn) {
+                // rows of w1 and w3 are interleaved so that the fused op
+                // streams both gate rows in one pass
+                layer.w13 = ggml_new_tensor_2d(ctx, wtype, n_embd, 2 * n_ff);
+                layer.w1 = ggml_view_2d(ctx, layer.w13, n_embd, n_ff,
+                                        2 * layer.w13->nb[1], 0);
+                layer.w3 = ggml_view_2d(ctx, layer.w13, n_embd, n_ff,
+                                        2 * layer.w13->nb[1],
+                                        layer.w13->nb[1]);
+            } else {
+                layer.w1 = ggml_new_tensor_2d(ctx, wtype, n_embd, n_ff);
+                layer.w3 = ggml_new_tensor_2d(ctx, wtype, n_embd, n_ff);
+            }
+            layer.w2 = ggml_new_tensor_2d(ctx, wtype, n_ff, n_embd);
+
+            // map by name
+            model.tensors["layers." + std::to_string(i) +
+                          ".attention_norm.weight"] = layer.attention_norm;
+
+            model.tensors["layers." + std::to_string(i) +
+                          ".attention.wq.weight"] = layer.wq;
+            model.tensors["layers." + std::to_string(i) +
+                          ".attention.wk.weight"] = layer.wk;
+            model.tensors["layers." + std::to_string(i) +
+                          ".attention.wv.weight"] = layer.wv;
+            model.tensors["layers." + std::to_string(i) +
+                          ".attention.wo.weight"] = layer.wo;
+
+            model.tensors["layers." + std::to_string(i) + ".ffn_norm.weight"] =
+                layer.ffn_norm;
+
+            model.tensors["layers." + std::to_string(i) +
+                          ".feed_forward.w1.weight"] = layer.w1;
+            model.tensors["layers." + std::to_string(i) +
+                          ".feed_forward.w2.weight"] = layer.w2;
+            model.tensors["layers." + std::to_string(i) +
+                          ".feed_forward.w3.weight"] = layer.w3;
+        }
+    }
+
+    // key + value memory
+    {
+        const auto &hparams = model.hparams;
+
+        const int n_embd = hparams.n_embd;
+        const int n_layer = hparams.n_layer;
+
+        const int n_mem = n_layer * n_mem_rows;
+        const int n_elements = n_embd * n_mem;
+
+        model.memory_k = ggml_new_tensor_1d(ctx, memory_type, n_elements);
+        model.memory_v = ggml_new_tensor_1d(ctx, memory_type, n_elements);
+
+        // pages are handed out from the back of the free list
+        model.kv_pages.n_pages = params.kv_pages;
+        model.kv_pages.page_size = params.kv_pages > 0 ? params.kv_page_size : 0;
+        model.kv_pages.free.resize(params.kv_pages);
+        model.kv_pages.refs.assign(params.kv_pages, 0);
+        for (int i = 0; i < params.kv_pages; ++i) {
+            model.kv_pages.free[i] = params.kv_pages - 1 - i;
+        }
+
+        const size_t memory_size =
+            ggml_nbytes(model.memory_k) + ggml_nbytes(model.memory_v);
+
+        fprintf(stderr, "%s: memory_size = %8.2f MB, n_mem = %d\n", __func__,
+                memory_size / 1024.0 / 1024.0, n_mem);
+    }
+
+    if (params.numa) {
+        llama_numa_place(model);
+    }
+    if (params.mlock) {
+        llama_buffer_lock(model.buffer);
+    }
+
+    const size_t file_offset = fin.tellg();
+
+    fin.close();
+
+    auto load_tensors = [&model, fname, file_offset, n_parts, format_version,
+                         params]() {
+        if (format_version == FILE_VERSION_INDEXED) {
+            return llama_model_load_indexed(fname, file_offset, model, params);
+        }
+        return llama_model_load_parts(fname, file_offset, n_parts, model,
+                                      params);
+    };
+
+    // the multi-row kernels are vectorized for AVX2 only
+    int repack_rows = params.repack_rows;
+    if (repack_rows > 0 && !ggml_cpu_has_avx2()) {
+        fprintf(stderr, "%s: weights are not repacked without AVX2\n",
+                __func__);
+        repack_rows = 0;
+    }
+
+    if (!params.async_load) {
+        if (!load_tensors()) {
+            return false;
+        }
+        if (repack_rows > 0) {
+            llama_repack_model(model, repack_rows, params);
+        }
+        // transparent huge pages are known once the weights are written
+        llama_buffer_report(model.buffer);
+        return true;
+    }
+
+    llama_buffer_report(model.buffer);
+
+    llama_load_state_init(model, n_parts, repack_rows);
+    model.loading->thread = std::thread([&model, load_tensors]() {
+        llama_load_finish(*model.loading, load_tensors());
+    });
+
+    fprintf(stderr, "%s: reading %8.2f MB of tensors in the background\n",
+            __func__, model.loading->n_bytes_total / 1024.0 / 1024.0);
+
+    return true;
+}
+
+llama_eval_plan::~llama_eval_plan(void) {
+    Reset();
+    free(buf);
+    free(scratch);
+}
+
+void llama_eval_plan::Reset(void) {
+    if (ctx) {
+        ggml_free(ctx);
+        ctx = nullptr;
+    }
+    model = nullptr;
+    n_tokens = 0;
+    n_kv = 0;
+    n_threads = 0;
+    graph.reset();
+    embd = nullptr;
+    norm = nullptr;
+    logits = nullptr;
+    rows_new = nullptr;
+    rows_kv = nullptr;
+    pos = nullptr;
+    kq_mask = nullptr;
+    layers.clear();
+}
+
+// size in bytes of n consecutive elements of the key or value memory
+static size_t llama_memory_row_size(const struct ggml_tensor *memory, int n) {
+    return ggml_type_size(memory->type) * n / ggml_blck_size(memory->type);
+}
+
+// build the evaluation graph of N tokens attending to n_kv keys and values
+// (at most) in the context of the plan; intermediate results are created as
+// scratch tensors at offsets from origin, which is never dereferenced
+static void llama_build_graph(const llama_model &model, const int N,
+                              const int n_kv, void *origin,
+                              llama_eval_plan &plan) {
+    const auto &hparams = model.hparams;
+
+    const int n_embd = hparams.n_embd;
+    const int n_layer = hparams.n_layer;
+    const int n_ctx = hparams.n_ctx;
+    const int n_head = hparams.n_head;
+    const int n_rot = hparams.n_embd / hparams.n_head;
+
+    // the graph is patched down to the actual past before computation
+    const int n_past = n_kv - N;
+
+    const bool paged = model.kv_pages.n_pages > 0;
+    const int n_mem_rows = model.kv_pages.n_pages * model.kv_pages.page_size;
+
+    const size_t k_row_size = llama_memory_row_size(model.memory_k, n_embd);
+    const size_t v_row_size = llama_memory_row_size(model.memory_v, n_embd);
+
+    struct ggml_context *ctx0 = plan.ctx;
+
+    plan.graph = std::make_unique<ggml_cgraph>();
+    plan.layers.resize(n_layer);
+
+    ggml_cgraph &gf = *plan.graph;
+
+    struct ggml_tensor *embd = ggml_new_tensor_1d(ctx0, GGML_TYPE_I32, N);
+
+    plan.rows_new = nullptr;
+    plan.rows_kv = nullptr;
+    plan.pos = nullptr;
+    plan.kq_mask = nullptr;
+    if (paged) {
+        plan.rows_new = ggml_new_tensor_1d(ctx0, GGML_TYPE_I32, N);
+        plan.rows_kv = ggml_new_tensor_1d(ctx0, GGML_TYPE_I32, n_kv);
+        plan.pos = ggml_new_tensor_1d(ctx0, GGML_TYPE_I32, N);
+        plan.kq_mask = ggml_new_tensor_2d(ctx0, GGML_TYPE_F32, n_kv, N);
+    }
+
+    ggml_set_scratch(ctx0, {0, SIZE_MAX / 2, origin});
+
+    struct ggml_tensor *inpL = ggml_get_rows(ctx0, model.tok_embeddings, embd);
+
+    for (int il = 0; il < n_layer; ++il) {
+        auto &lp = plan.layers[il];
+
+        struct ggml_tensor *inpSA = inpL;
+
+        struct ggml_tensor *cur;
+
+        // norm
+        {
+            cur = ggml_rms_norm(ctx0, inpL);
+
+            // cur = attention_norm*cur
+            cur = ggml_mul(
+                ctx0, ggml_repeat(ctx0, model.layers[il].attention_norm, cur),
+                cur);
+        }
+
+        // self-attention
+        {
+            struct ggml_tensor *Qcur;
+            struct ggml_tensor *Kcur;
+            struct ggml_tensor *Vcur;
+
+            if (model.layers[il].wqkv) {
+                // single projection; Q, K and V are row slices of the result
+                struct ggml_tensor *QKVcur =
+                    ggml_mul_mat(ctx0, model.layers[il].wqkv, cur);
+
+                Qcur = ggml_view_2d(ctx0, QKVcur, n_embd, N, QKVcur->nb[1],
+                                    0 * n_embd * QKVcur->nb[0]);
+                Kcur = ggml_view_2d(ctx0, QKVcur, n_embd, N, QKVcur->nb[1],
+                                    1 * n_embd * QKVcur->nb[0]);
+                Vcur = ggml_view_2d(ctx0, QKVcur, n_embd, N, QKVcur->nb[1],
+                                    2 * n_embd * QKVcur->nb[0]);
+            } else {
+                Qcur = ggml_mul_mat(ctx0, model.layers[il].wq, cur);
+                Kcur = ggml_mul_mat(ctx0, model.layers[il].wk, cur);
+                Vcur = ggml_mul_mat(ctx0, model.layers[il].wv, cur);
+            }
+
+            // keys are stored with the rotary embedding applied, so that the
+            // memory can be read as is (also when it is quantised); tokens in
+            // paged memory have their own positions
+            struct ggml_tensor *K_3d =
+                ggml_cpy(ctx0, Kcur,
+                         ggml_new_tensor_3d(ctx0, GGML_TYPE_F32,
+                                            n_embd / n_head, n_head, N));
+            lp.k_rope = paged ? ggml_rope_pos(ctx0, K_3d, plan.pos, n_rot)
+                              : ggml_rope(ctx0, K_3d, n_past, n_rot, 0);
+
+            // paged memory of the layer, one row per token
+            struct ggml_tensor *k_mem = nullptr;
+            struct ggml_tensor *v_mem = nullptr;
+            if (paged) {
+                k_mem = ggml_view_2d(ctx0, model.memory_k, n_embd, n_mem_rows,
+                                     k_row_size, il * n_mem_rows * k_row_size);
+                v_mem = ggml_view_2d(ctx0, model.memory_v, n_embd, n_mem_rows,
+                                     v_row_size, il * n_mem_rows * v_row_size);
+            }
+
+            // store key and value to memory
+            if (paged) {
+                lp.k_cpy = ggml_set_rows(
+                    ctx0, k_mem, ggml_reshape_2d(ctx0, lp.k_rope, n_embd, N),
+                    plan.rows_new);
+                lp.v_cpy = ggml_set_rows(ctx0, v_mem, Vcur, plan.rows_new);
+
+                ggml_build_forward_expand(&gf, lp.k_cpy);
+                ggml_build_forward_expand(&gf, lp.v_cpy);
+            } else {
+                struct ggml_tensor *k =
+                    ggml_view_1d(ctx0, model.memory_k, N * n_embd,
+                                 k_row_size * (il * n_ctx + n_past));
+                struct ggml_tensor *v =
+                    ggml_view_1d(ctx0, model.memory_v, N * n_embd,
+                                 v_row_size * (il * n_ctx + n_past));
+
+                lp.k_cpy = ggml_cpy(ctx0, lp.k_rope, k);
+                lp.v_cpy = ggml_cpy(ctx0, Vcur, v);
+
+                ggml_build_forward_expand(&gf, lp.k_cpy);
+                ggml_build_forward_expand(&gf, lp.v_cpy);
+            }
+
+            // Q = Qcur.contiguous().view(n_embd/n_head, n_head, N).permute(0,
+            // 2, 1, 3)
+            struct ggml_tensor *Q_3d =
+                ggml_cpy(ctx0, Qcur,
+                         ggml_new_tensor_3d(ctx0, GGML_TYPE_F32,
+                                            n_embd / n_head, n_head, N));
+            lp.q_rope = paged ? ggml_rope_pos(ctx0, Q_3d, plan.pos, n_rot)
+                              : ggml_rope(ctx0, Q_3d, n_past, n_rot, 0);
+
+            struct ggml_tensor *Q = ggml_permute(ctx0, lp.q_rope, 0, 2, 1, 3);
+
+            // K = Kmem.view(n_embd/n_head, n_head, n_past + N).permute(0, 2, 1,
+            // 3)
+            //
+            // paged memory is gathered into an F32 copy of the n_kv rows of the
+            // layer, attention does not read the pages in place yet
+            lp.k_view = paged ? ggml_get_rows(ctx0, k_mem, plan.rows_kv)
+                              : ggml_view_1d(ctx0, model.memory_k,
+                                             (n_past + N) * n_embd,
+                                             il * n_ctx * k_row_size);
+            lp.k_3d = ggml_reshape_3d(ctx0, lp.k_view, n_embd / n_head, n_head,
+                                      n_past + N);
+            lp.k = ggml_permute(ctx0, lp.k_3d, 0, 2, 1, 3);
+
+            // K * Q
+            lp.kq = ggml_mul_mat(ctx0, lp.k, Q);
+
+            // KQ_scaled = KQ / sqrt(n_embd/n_head)
+            lp.kq_scaled = ggml_scale(
+                ctx0, lp.kq,
+                ggml_new_f32(ctx0, 1.0f / sqrt(float(n_embd) / n_head)));
+
+            // KQ_masked = mask_past(KQ_scaled), or the keys of other
+            // sequences and of later positions in paged memory
+            // (the mask of the tokens is broadcast over the heads)
+            if (paged) {
+                lp.kq_masked = ggml_add(ctx0, lp.kq_scaled, plan.kq_mask);
+            } else {
+                lp.kq_masked = ggml_diag_mask_inf(ctx0, lp.kq_scaled, n_past);
+            }
+
+            // KQ = soft_max(KQ_masked)
+            lp.kq_soft_max = ggml_soft_max(ctx0, lp.kq_masked);
+
+            // V_trans = Vmem.view(n_embd/n_head, n_head, n_past + N).permute(1,
+            // 2, 0, 3)
+            //
+            // the transposed view is multiplied in place: each key position
+            // contributes a (possibly quantised) head row of V
+            lp.v_view = paged ? ggml_get_rows(ctx0, v_mem, plan.rows_kv)
+                              : ggml_view_1d(ctx0, model.memory_v,
+                                             (n_past + N) * n_embd,
+                                             il * n_ctx * v_row_size);
+            lp.v_3d = ggml_reshape_3d(ctx0, lp.v_view, n_embd / n_head, n_head,
+                                      n_past + N);
+            lp.v_trans = ggml_permute(ctx0, lp.v_3d, 1, 2, 0, 3);
+
+            // KQV = transpose(V) * KQ_soft_max
+            struct ggml_tensor *KQV =
+                ggml_mul_mat(ctx0, lp.v_trans, lp.kq_soft_max);
+
+            // KQV_merged = KQV.permute(0, 2, 1, 3)
+            struct ggml_tensor *KQV_merged =
+                ggml_permute(ctx0, KQV, 0, 2, 1, 3);
+
+            // cur = KQV_merged.contiguous().view(n_embd, N)
+            cur = ggml_cpy(ctx0, KQV_merged,
+                           ggml_new_tensor_2d(ctx0, GGML_TYPE_F32, n_embd, N));
+
+            // projection (no bias)
+            cur = ggml_mul_mat(ctx0, model.layers[il].wo, cur);
+        }
+
+        struct ggml_tensor *inpFF = ggml_add(ctx0, cur, inpSA);
+
+        // feed-forward network
+        {
+            // norm
+            {
+                cur = ggml_rms_norm(ctx0, inpFF);
+
+                // cur = ffn_norm*cur
+                cur = ggml_mul(
+                    ctx0, ggml_repeat(ctx0, model.layers[il].ffn_norm, cur),
+                    cur);
+            }
+
+            if (model.layers[il].w13) {
+                // cur = silu(w1*cur) * (w3*cur) in one pass
+                cur = ggml_swiglu(ctx0, model.layers[il].w13, cur);
+            } else {
+                struct ggml_tensor *tmp =
+                    ggml_mul_mat(ctx0, model.layers[il].w3, cur);
+
+                cur = ggml_mul_mat(ctx0, model.layers[il].w1, cur);
+
+                // SILU activation
+                cur = ggml_silu(ctx0, cur);
+
+                cur = ggml_mul(ctx0, cur, tmp);
+            }
+
+            cur = ggml_mul_mat(ctx0, model.layers[il].w2, cur);
+        }
+
+        cur = ggml_add(ctx0, cur, inpFF);
+
+        // input for next layer
+        inpL = cur;
+    }
+
+    // norm
+    {
+        inpL = ggml_rms_norm(ctx0, inpL);
+
+        // inpL = norm*inpL
+        inpL = ggml_mul(ctx0, ggml_repeat(ctx0, model.norm, inpL), inpL);
+    }
+
+    plan.norm = inpL;
+
+    // lm_head
+    if (!plan.embeddings) {
+        inpL = ggml_mul_mat(ctx0, model.output, inpL);
+    }
+
+    // logits -> probs
+    // inpL = ggml_soft_max(ctx0, inpL);
+
+    ggml_build_forward_expand(&gf, inpL);
+
+    plan.embd = embd;
+    plan.logits = plan.embeddings ? nullptr : inpL;
+
+    ggml_set_scratch(ctx0, {0, 0, nullptr});
+}
+
+// build the graph of a plan with its intermediate results packed by lifetime
+static bool llama_plan_build(const llama_model &model, const int n_threads,
+                             const int N, const int n_kv,
+                             llama_eval_plan &plan) {
+    plan.Reset();
+
+    // the context holds tensor objects and parameters only (roughly 50 per
+    // layer) and the inputs of paged memory, intermediate results live in the
+    // scratch buffer
+    size_t buf_size = (model.hparams.n_layer + 1) * 64 * 1024;
+    if (model.kv_pages.n_pages > 0) {
+        buf_size += (size_t)(n_kv * (N + 1) + 2 * N) * sizeof(int32_t);
+    }
+
+    if (buf_size > plan.buf_size) {
+        void *buf = realloc(plan.buf, buf_size);
+        if (buf == nullptr) {
+            fprintf(stderr, "%s: failed to allocate %zu bytes\n", __func__,
+                    buf_size);
+            return false;
+        }
+        plan.buf = buf;
+        plan.buf_size = buf_size;
+    }
+
+    struct ggml_init_params params = {
+        /*.mem_size   =*/plan.buf_size,
+        /*.mem_buffer =*/plan.buf,
+    };
+
+    // The intermediate results are built at offsets from plan.buf, which is
+    // never dereferenced through them: ggml_graph_alloc() moves them into the
+    // scratch buffer before the computation.
+    plan.ctx = ggml_init(params);
+    llama_build_graph(model, N, n_kv, plan.buf, plan);
+
+    ggml_cgraph &gf = *plan.graph;
+    gf.n_threads = n_threads;
+    ggml_graph_plan(nullptr, &gf);
+
+    // results share memory according to their lifetimes, the work buffer of
+    // the graph goes after them
+    const size_t work_offs = ggml_graph_alloc(&gf, nullptr);
+    const size_t scratch_size = work_offs + gf.work_size;
+
+    if (scratch_size > plan.scratch_size) {
+        void *buf = realloc(plan.scratch, scratch_size);
+        if (buf == nullptr) {
+            fprintf(stderr, "%s: failed to allocate %zu bytes\n", __func__,
+                    scratch_size);
+            plan.Reset();
+            return false;
+        }
+        plan.scratch = buf;
+        plan.scratch_size = scratch_size;
+    }
+
+    ggml_graph_alloc(&gf, plan.scratch);
+
+    if (gf.work_size > 0) {
+        ggml_set_scratch(plan.ctx, {work_offs, scratch_size, plan.scratch});
+        gf.work = ggml_new_tensor_1d(plan.ctx, GGML_TYPE_I8, gf.work_size);
+        ggml_set_scratch(plan.ctx, {0, 0, nullptr});
+    }
+
+    plan.model = &model;
+    plan.n_tokens = N;
+    plan.n_kv = n_kv;
+    plan.n_threads = n_threads;
+
+    return true;
+}
+
+// set shape of a contiguous tensor
+static void llama_tensor_set_ne(struct ggml_tensor *tensor, int ne0, int ne1,
+                                int ne2) {
+    tensor->ne[0] = ne0;
+    tensor->ne[1] = ne1;
+    tensor->ne[2] = ne2;
+
+    tensor->nb[1] = tensor->nb[0] * (ne0 / ggml_blck_size(tensor->type));
+    tensor->nb[2] = tensor->nb[1] * ne1;
+    tensor->nb[3] = tensor->nb[2] * ne2;
+}
+
+// set shape of a view to the one of its source (see ggml_view_tensor)
+static void llama_tensor_copy_ne(struct ggml_tensor *tensor,
+                                 const struct ggml_tensor *src) {
+    memcpy(tensor->ne, src->ne, sizeof(tensor->ne));
+    memcpy(tensor->nb, src->nb, sizeof(tensor->nb));
+}
+
+// set shape of a permutation of src (see ggml_permute)
+static void llama_tensor_permute_ne(struct ggml_tensor *tensor,
+                                    const struct ggml_tensor *src, int axis0,
+                                    int axis1, int axis2, int axis3) {
+    const int axes[GGML_MAX_DIMS] = {axis0, axis1, axis2, axis3};
+    for (int i = 0; i < GGML_MAX_DIMS; ++i) {
+        tensor->ne[axes[i]] = src->ne[i];
+        tensor->nb[axes[i]] = src->nb[i];
+    }
+}
+
+// patch the graph of a plan for evaluation of its batch attending to n_kv keys
+// and values (n_past + n_tokens in a single context); inputs of paged memory
+// are set by the caller
+static void llama_plan_set_past(const llama_model &model,
+                                llama_eval_plan &plan, const int n_kv) {
+    const auto &hparams = model.hparams;
+
+    const int n_embd = hparams.n_embd;
+    const int n_ctx = hparams.n_ctx;
+    const int n_head = hparams.n_head;
+
+    const int N = plan.n_tokens;
+    const int n_past = n_kv - N;
+
+    const bool paged = plan.rows_kv != nullptr;
+
+    if (paged) {
+        llama_tensor_set_ne(plan.rows_kv, n_kv, 1, 1);
+        llama_tensor_set_ne(plan.kq_mask, n_kv, N, 1);
+    }
+
+    for (size_t il = 0; il < plan.layers.size(); ++il) {
+        auto &lp = plan.layers[il];
+
+        if (!paged) {
+            // a copy is a view of its destination, so both have to be moved
+            char *k_data = (char *)model.memory_k->data +
+                           llama_memory_row_size(model.memory_k, n_embd) *
+                               (il * n_ctx + n_past);
+            char *v_data = (char *)model.memory_v->data +
+                           llama_memory_row_size(model.memory_v, n_embd) *
+                               (il * n_ctx + n_past);
+
+            lp.k_cpy->data = lp.k_cpy->src1->data = k_data;
+            lp.v_cpy->data = lp.v_cpy->src1->data = v_data;
+
+            ((int32_t *)lp.q_rope->src1->data)[0] = n_past;
+            ((int32_t *)lp.k_rope->src1->data)[0] = n_past;
+        }
+
+        if (paged) {
+            llama_tensor_set_ne(lp.k_view, n_embd, n_kv, 1);
+        } else {
+            llama_tensor_set_ne(lp.k_view, n_kv * n_embd, 1, 1);
+        }
+        llama_tensor_set_ne(lp.k_3d, n_embd / n_head, n_head, n_kv);
+        llama_tensor_permute_ne(lp.k, lp.k_3d, 0, 2, 1, 3);
+
+        llama_tensor_set_ne(lp.kq, n_kv, N, n_head);
+        llama_tensor_copy_ne(lp.kq_scaled, lp.kq);
+        llama_tensor_copy_ne(lp.kq_masked, lp.kq);
+        llama_tensor_copy_ne(lp.kq_soft_max, lp.kq);
+        if (!paged) {
+            ((int32_t *)lp.kq_masked->src1->data)[0] = n_past;
+        }
+
+        if (paged) {
+            llama_tensor_set_ne(lp.v_view, n_embd, n_kv, 1);
+        } else {
+            llama_tensor_set_ne(lp.v_view, n_kv * n_embd, 1, 1);
+        }
+        llama_tensor_set_ne(lp.v_3d, n_embd / n_head, n_head, n_kv);
+        llama_tensor_permute_ne(lp.v_trans, lp.v_3d, 1, 2, 0, 3);
+    }
+}
+
+// run the graph of a plan; while tensors of the model are read in the
+// background, the nodes run in segments, each once the weights it uses are
+// ready, so that evaluation follows loading layer by layer
+static bool llama_plan_run(const llama_model &model, llama_eval_plan &plan) {
+    ggml_cgraph &gf = *plan.graph;
+    llama_load_state *state = model.loading.get();
+
+    bool loaded = true;
+    if (state != nullptr) {
+        std::lock_guard<std::mutex> lock(state->mutex);
+        loaded = state->done && !state->failed;
+    }
+
+    if (loaded) {
+        ggml_graph_compute(plan.ctx, &gf);
+        return true;
+    }
+
+    // segment u ends before the first node that uses a weight of a later
+    // unit, so that it only needs the units up to u
+    const int n_units = state->n_pending.size();
+    std::vector<int> ends(n_units + 1, gf.n_nodes);
+    for (int i = 0; i < gf.n_nodes; ++i) {
+        for (const struct ggml_tensor *src :
+             {gf.nodes[i]->src0, gf.nodes[i]->src1}) {
+            auto it = state->units.find(src);
+            if (it != state->units.end()) {
+                ends[it->second] = std::min(ends[it->second], i);
+            }
+        }
+    }
+    for (int u = n_units - 1; u >= 0; --u) {
+        ends[u] = std::min(ends[u], ends[u + 1]);
+    }
+
+    int i0 = 0;
+    for (int u = 0; u < n_units; ++u) {
+        const int i1 = ends[u + 1];
+        if (i1 > i0) {
+            if (!llama_load_wait(model, u)) {
+                return false;
+            }
+            ggml_graph_compute_range(plan.ctx, &gf, i0, i1);
+            i0 = i1;
+        }
+    }
+
+    return true;
+}
+
+// run the patched graph of a plan on input tokens and copy out the logits (or
+// the hidden states of a plan of embeddings)
+static bool llama_plan_compute(const llama_model &model, llama_eval_plan &plan,
+                               const std::vector<llama_vocab::id> &embd_inp,
+                               std::vector<float> &embd_w,
+                               size_t &mem_per_token, bool return_all_logits) {
+    const int N = embd_inp.size();
+    const int n_out =
+        plan.embeddings ? model.hparams.n_embd : model.hparams.n_vocab;
+
+    memcpy(plan.embd->data, embd_inp.data(), N * ggml_element_size(plan.embd));
+
+    // run the computation
+    if (!llama_plan_run(model, plan)) {
+        return false;
+    }
+
+    // if (n_past%100 == 0) {
+    //     ggml_graph_print   (plan.graph.get());
+    //     ggml_graph_dump_dot(plan.graph.get(), NULL, "gpt-2.dot");
+    // }
+
+    struct ggml_tensor *logits = plan.embeddings ? plan.norm : plan.logits;
+
+    if (return_all_logits) {
+        embd_w.resize(n_out * N);
+        memcpy(embd_w.data(), (float *)ggml_get_data(logits),
+               sizeof(float) * n_out * N);
+    } else {
+        // return result for just the last token
+        embd_w.resize(n_out);
+        memcpy(embd_w.data(),
+               (float *)ggml_get_data(logits) + (n_out * (N - 1)),
+               sizeof(float) * n_out);
+    }
+
+    if (mem_per_token == 0) {
+        mem_per_token = (ggml_used_mem(plan.ctx) + plan.scratch_size) / N;
+    }
+    // fprintf(stderr, "used_mem = %zu, scratch = %zu\n",
+    //         ggml_used_mem(plan.ctx), plan.scratch_size);
+
+    return true;
+}
+
+// evaluate the transformer
+//
+//   - model:     the model
+//   - n_threads: number of threads to use
+//   - n_past:    the context size so far
+//   - embd_inp:  the embeddings of the tokens in the context
+//   - embd_w:    the predicted logits for the next token
+//   - plan:      graph to reuse across calls, owned by the caller
+//
+// The GPT-J model requires about 16MB of memory per input token.
+//
+bool llama_eval(const llama_model &model, const int n_threads, const int n_past,
+                const std::vector<llama_vocab::id> &embd_inp,
+                std::vector<float> &embd_w, size_t &mem_per_token,
+                bool return_all_logits, llama_eval_plan *plan) {
+    assert(plan != nullptr);
+
+    const int N = embd_inp.size();
+
+    const int n_ctx = model.hparams.n_ctx;
+
+    if (model.kv_pages.n_pages > 0) {
+        fprintf(stderr, "%s: paged memory is evaluated by sequence\n",
+                __func__);
+        return false;
+    }
+
+    if (N < 1 || n_past < 0 || n_past + N > n_ctx) {
+        fprintf(stderr, "%s: %d tokens after %d do not fit context of %d\n",
+                __func__, N, n_past, n_ctx);
+        return false;
+    }
+
+    if (plan->model != &model || plan->n_tokens != N ||
+        plan->n_threads != n_threads) {
+        if (!llama_plan_build(model, n_threads, N, n_ctx, *plan)) {
+            return false;
+        }
+    }
+
+    llama_plan_set_past(model, *plan, n_past + N);
+    return llama_plan_compute(model, *plan, embd_inp, embd_w, mem_per_token,
+                              return_all_logits);
+}
+
+// evaluate tokens of sequences in paged memory
+//
+//   - seqs:      sequence of each token; a token follows the tokens of its
+//                sequence and earlier tokens of the batch of the same one,
+//                the pages of the sequence have to cover it
+//
+// Keys and values of all sequences of the batch are gathered once (shared
+// pages only once) and every token is masked to the ones of its sequence up to
+// its position. Other arguments are the same as the ones of llama_eval.
+//
+bool llama_eval_seqs(const llama_model &model, const int n_threads,
+                     const std::vector<llama_vocab::id> &embd_inp,
+                     const std::vector<const llama_kv_seq *> &seqs,
+                     std::vector<float> &embd_w, size_t &mem_per_token,
+                     bool return_all_logits, llama_eval_plan *plan) {
+    assert(plan != nullptr);
+
+    const int N = embd_inp.size();
+
+    const int n_ctx = model.hparams.n_ctx;
+    const int page_size = model.kv_pages.page_size;
+
+    if (model.kv_pages.n_pages == 0 || N < 1 || seqs.size() != (size_t)N) {
+        fprintf(stderr, "%s: expected a sequence in paged memory per token\n",
+                __func__);
+        return false;
+    }
+
+    // positions of the tokens and lengths of the sequences after the batch
+    std::vector<const llama_kv_seq *> batch_seqs;
+    std::vector<int32_t> n_seq_tokens;
+    std::vector<int32_t> pos(N);
+    std::vector<int32_t> seq_index(N);
+    for (int i = 0; i < N; ++i) {
+        auto it = std::find(batch_seqs.begin(), batch_seqs.end(), seqs[i]);
+        seq_index[i] = it - batch_seqs.begin();
+        if (it == batch_seqs.end()) {
+            batch_seqs.push_back(seqs[i]);
+            n_seq_tokens.push_back(seqs[i]->n_tokens);
+        }
+        pos[i] = n_seq_tokens[seq_index[i]]++;
+    }
+
+    for (size_t s = 0; s < batch_seqs.size(); ++s) {
+        if (n_seq_tokens[s] > n_ctx ||
+            (size_t)n_seq_tokens[s] >
+                batch_seqs[s]->pages.size() * page_size) {
+            fprintf(stderr, "%s: %d tokens do not fit context of %d or pages\n",
+                    __func__, n_seq_tokens[s], n_ctx);
+            return false;
+        }
+    }
+
+    // rows of all keys and values to attend to; seq_cols[s][q] is the column
+    // of position q of sequence s
+    std::vector<int32_t> rows_kv;
+    std::unordered_map<int32_t, int32_t> row_cols;
+    std::vector<std::vector<int32_t>> seq_cols(batch_seqs.size());
+    for (size_t s = 0; s < batch_seqs.size(); ++s) {
+        const auto &pages = batch_seqs[s]->pages;
+        for (int q = 0; q < n_seq_tokens[s]; ++q) {
+            const int32_t row = pages[q / page_size] * page_size + q % page_size;
+            auto ins = row_cols.emplace(row, (int32_t)rows_kv.size());
+            if (ins.second) {
+                rows_kv.push_back(row);
+            }
+            seq_cols[s].push_back(ins.first->second);
+        }
+    }
+
+    const int n_kv = rows_kv.size();
+
+    if (plan->model != &model || plan->n_tokens != N || plan->n_kv < n_kv ||
+        plan->n_threads != n_threads) {
+        if (!llama_plan_build(model, n_threads, N, std::max(n_ctx, n_kv),
+                              *plan)) {
+            return false;
+        }
+    }
+
+    int32_t *rows_new = (int32_t *)plan->rows_new->data;
+    float *mask = (float *)plan->kq_mask->data;
+    std::fill(mask, mask + n_kv * N, -INFINITY);
+    for (int i = 0; i < N; ++i) {
+        const auto &cols = seq_cols[seq_index[i]];
+        rows_new[i] = rows_kv[cols[pos[i]]];
+        for (int q = 0; q <= pos[i]; ++q) {
+            mask[i * n_kv + cols[q]] = 0.0f;
+        }
+    }
+    memcpy(plan->rows_kv->data, rows_kv.data(), n_kv * sizeof(int32_t));
+    memcpy(plan->pos->data, pos.data(), N * sizeof(int32_t));
+
+    llama_plan_set_past(model, *plan, n_kv);
+    return llama_plan_compute(model, *plan, embd_inp, embd_w, mem_per_token,
+                              return_all_logits);
+}
+
+// negative log-likelihood of token id under the distribution of the logits,
+// i.e. -log(softmax(logits)[id]), by log-sum-exp without copying the logits
+static double llama_token_nll(const float *logits, int n_vocab,
+                              llama_vocab::id id) {
+    float max_logit = logits[0];
+    for (int i = 1; i < n_vocab; ++i) {
+        max_logit = std::max(max_logit, logits[i]);
+    }
+    double sum_exp = 0.0;
+    for (int i = 0; i < n_vocab; ++i) {
+        sum_exp += std::exp(logits[i] - max_logit);
+    }
+    return std::log(sum_exp) + max_logit - logits[id];
+}
+
+// discard n_discard positions after the first n_keep of the n_past positions
+// in memory: the following positions move down and their keys, which are
+// stored with the rotary embedding of their old position applied, are rotated
+// back by n_discard positions
+static void llama_memory_shift(const llama_model &model, int n_keep,
+                               int n_discard, int n_past, int n_threads) {
+    const auto &hparams = model.hparams;
+
+    const int n_embd = hparams.n_embd;
+    const int n_layer = hparams.n_layer;
+    const int n_ctx = hparams.n_ctx;
+    const int n_head = hparams.n_head;
+    const int n_rot = hparams.n_embd / hparams.n_head;
+
+    const int n_move = n_past - n_keep - n_discard;
+    const size_t row_size = llama_memory_row_size(model.memory_k, n_embd);
+
+    // rotations are additive, so one rotation by -n_discard positions suits
+    // all keys (see ggml_compute_forward_rope_f32)
+    std::vector<float> cos_theta(n_rot / 2);
+    std::vector<float> sin_theta(n_rot / 2);
+    for (int i0 = 0; i0 < n_rot; i0 += 2) {
+        const double theta = pow(10000.0, ((double)-i0) / n_rot);
+        cos_theta[i0 / 2] = cos(-n_discard * theta);
+        sin_theta[i0 / 2] = sin(-n_discard * theta);
+    }
+
+    auto shift_layers = [&](int il0, int il1) {
+        std::vector<float> row(n_embd);
+        for (int il = il0; il < il1; ++il) {
+            char *k = (char *)model.memory_k->data + il * n_ctx * row_size;
+            char *v = (char *)model.memory_v->data + il * n_ctx * row_size;
+
+            // positions move down in increasing order, so no row is
+            // overwritten before it is read
+            for (int i = n_keep; i < n_keep + n_move; ++i) {
+                const char *src = k + (i + n_discard) * row_size;
+
+                ggml_row_to_f32(model.memory_k->type, src, row.data(), n_embd);
+                for (int h = 0; h < n_head; ++h) {
+                    float *x = row.data() + h * n_rot;
+                    for (int i0 = 0; i0 < n_rot; i0 += 2) {
+                        const float x0 = x[i0];
+                        const float x1 = x[i0 + 1];
+
+                        x[i0] = x0 * cos_theta[i0 / 2] - x1 * sin_theta[i0 / 2];
+                        x[i0 + 1] = x0 * sin_theta[i0 / 2] + x1 * cos_theta[i0 / 2];
+                    }
+                }
+                ggml_row_from_f32(model.memory_k->type, row.data(),
+                                  k + i * row_size, n_embd);
+            }
+
+            memmove(v + n_keep * row_size, v + (n_keep + n_discard) * row_size,
+                    n_move * row_size);
+        }
+    };
+
+    // layers are independent
+    n_threads = std::max(1, std::min(n_threads, n_layer));
+    std::vector<std::thread> workers;
+    for (int j = 1; j < n_threads; ++j) {
+        workers.emplace_back(shift_layers, j * n_layer / n_threads,
+                             (j + 1) * n_layer / n_threads);
+    }
+    shift_layers(0, n_layer / n_threads);
+    for (auto &worker : workers) {
+        worker.join();
+    }
+}
+
+// session state files: header, tokens and sampler state, followed by the
+// used part of the key + value memory at a page aligned offset so that it can
+// be mapped
+#define LLAMA_STATE_MAGIC 0x6767736e // 'ggsn' in hex
+#define LLAMA_STATE_VERSION 1
+#define LLAMA_STATE_ALIGN 4096
+
+static size_t llama_state_pad(size_t offs) {
+    return (offs + LLAMA_STATE_ALIGN - 1) / LLAMA_STATE_ALIGN * LLAMA_STATE_ALIGN;
+}
+
+bool llama_state_save(const llama_model &model, const std::string &fname,
+                      const std::vector<llama_vocab::id> &tokens,
+                      const std::string &rng) {
+    const auto &hparams = model.hparams;
+
+    const int32_t n_embd = hparams.n_embd;
+    const int32_t n_layer = hparams.n_layer;
+    const int32_t n_ctx = hparams.n_ctx;
+    const int32_t memory_type = model.memory_k->type;
+    const int32_t n_past = tokens.size();
+
+    if (n_past > n_ctx) {
+        fprintf(stderr, "%s: too many tokens for the context: %d > %d\n",
+                __func__, n_past, n_ctx);
+        return false;
+    }
+
+    auto fout = std::ofstream(fname, std::ios::binary);
+    if (!fout) {
+        fprintf(stderr, "%s: failed to open '%s' for writing\n", __func__,
+                fname.c_str());
+        return false;
+    }
+
+    const uint32_t magic = LLAMA_STATE_MAGIC;
+    const uint32_t version = LLAMA_STATE_VERSION;
+    const uint32_t rng_size = rng.size();
+
+    fout.write((const char *)&magic, sizeof(magic));
+    fout.write((const char *)&version, sizeof(version));
+    fout.write((const char *)&n_embd, sizeof(n_embd));
+    fout.write((const char *)&n_layer, sizeof(n_layer));
+    fout.write((const char *)&n_ctx, sizeof(n_ctx));
+    fout.write((const char *)&memory_type, sizeof(memory_type));
+    fout.write((const char *)&n_past, sizeof(n_past));
+    fout.write((const char *)tokens.data(), n_past * sizeof(llama_vocab::id));
+    fout.write((const char *)&rng_size, sizeof(rng_size));
+    fout.write(rng.data(), rng_size);
+
+    const size_t offs = fout.tellp();
+    const std::vector<char> pad(llama_state_pad(offs) - offs, 0);
+    fout.write(pad.data(), pad.size());
+
+    // keys and values of a layer are stored one after the other
+    const size_t row_size = llama_memory_row_size(model.memory_k, n_embd);
+    for (int il = 0; il < n_layer; ++il) {
+        const size_t offs_layer = il * n_ctx * row_size;
+        fout.write((const char *)model.memory_k->data + offs_layer,
+                   n_past * row_size);
+        fout.write((const char *)model.memory_v->data + offs_layer,
+                   n_past * row_size);
+    }
+
+    if (!fout) {
+        fprintf(stderr, "%s: failed to write '%s'\n", __func__, fname.c_str());
+        return false;
+    }
+
+    return true;
+}
+
+// restore a state from the contents of a state file
+static bool llama_state_parse(const llama_model &model, const std::string &fname,
+                              const char *data, size_t size,
+                              std::vector<llama_vocab::id> &tokens,
+                              std::string &rng) {
+    const auto &hparams = model.hparams;
+
+    const int32_t n_ctx = hparams.n_ctx;
+
+    size_t offs = 0;
+    auto read = [&](void *dst, size_t n) {
+        if (offs + n > size) {
+            return false;
+        }
+        memcpy(dst, data + offs, n);
+        offs += n;
+        return true;
+    };
+
+    uint32_t magic = 0;
+    uint32_t version = 0;
+    int32_t n_embd = 0;
+    int32_t n_layer = 0;
+    int32_t n_ctx_saved = 0;
+    int32_t memory_type = 0;
+    int32_t n_past = 0;
+
+    read(&magic, sizeof(magic));
+    read(&version, sizeof(version));
+    if (magic != LLAMA_STATE_MAGIC || version != LLAMA_STATE_VERSION) {
+        fprintf(stderr, "%s: invalid state file '%s' (bad magic or version)\n",
+                __func__, fname.c_str());
+        return false;
+    }
+
+    read(&n_embd, sizeof(n_embd));
+    read(&n_layer, sizeof(n_layer));
+    read(&n_ctx_saved, sizeof(n_ctx_saved));
+    read(&memory_type, sizeof(memory_type));
+    read(&n_past, sizeof(n_past));
+
+    if (n_embd != hparams.n_embd || n_layer != hparams.n_layer ||
+        memory_type != model.memory_k->type) {
+        fprintf(stderr,
+                "%s: state file '%s' does not match the model (n_embd = %d, "
+                "n_layer = %d, memory type = %d)\n",
+                __func__, fname.c_str(), n_embd, n_layer, memory_type);
+        return false;
+    }
+    if (n_past < 0 || n_past > n_ctx) {
+        fprintf(stderr, "%s: state file '%s' does not fit the context: %d > %d\n",
+                __func__, fname.c_str(), n_past, n_ctx);
+        return false;
+    }
+
+    std::vector<llama_vocab::id> tokens_saved(n_past);
+    uint32_t rng_size = 0;
+    if (!read(tokens_saved.data(), n_past * sizeof(llama_vocab::id)) ||
+        !read(&rng_size, sizeof(rng_size)) || offs + rng_size > size) {
+        fprintf(stderr, "%s: state file '%s' is truncated\n", __func__,
+                fname.c_str());
+        return false;
+    }
+    std::string rng_saved(data + offs, rng_size);
+    offs = llama_state_pad(offs + rng_size);
+
+    const size_t row_size = llama_memory_row_size(model.memory_k, n_embd);
+    if (offs + 2 * n_layer * n_past * row_size > size) {
+        fprintf(stderr, "%s: state file '%s' is truncated\n", __func__,
+                fname.c_str());
+        return false;
+    }
+
+    for (int il = 0; il < n_layer; ++il) {
+        const size_t offs_layer = il * n_ctx * row_size;
+        read((char *)model.memory_k->data + offs_layer, n_past * row_size);
+        read((char *)model.memory_v->data + offs_layer, n_past * row_size);
+    }
+
+    tokens = std::move(tokens_saved);
+    rng = std::move(rng_saved);
+
+    return true;
+}
+
+bool llama_state_load(const llama_model &model, const std::string &fname,
+                      std::vector<llama_vocab::id> &tokens, std::string &rng) {
+#if defined(__unix__) || (defined(__APPLE__) && defined(__MACH__))
+    // map the file, the memory is then copied without an intermediate buffer
+    int fd = open(fname.c_str(), O_RDONLY);
+    if (fd == -1) {
+        fprintf(stderr, "%s: failed to open '%s'\n", __func__, fname.c_str());
+        return false;
+    }
+
+    struct stat st;
+    void *addr = MAP_FAILED;
+    if (fstat(fd, &st) == 0 && st.st_size > 0) {
+        addr = mmap(nullptr, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    }
+    close(fd);
+
+    if (addr == MAP_FAILED) {
+        fprintf(stderr, "%s: failed to map '%s'\n", __func__, fname.c_str());
+        return false;
+    }
+
+    const bool ok = llama_state_parse(model, fname, (const char *)addr,
+                                      st.st_size, tokens, rng);
+    munmap(addr, st.st_size);
+    return ok;
+#else
+    auto fin = std::ifstream(fname, std::ios::binary | std::ios::ate);
+    if (!fin) {
+        fprintf(stderr, "%s: failed to open '%s'\n", __func__, fname.c_str());
+        return false;
+    }
+
+    std::vector<char> buf(fin.tellg());
+    fin.seekg(0);
+    fin.read(buf.data(), buf.size());
+
+    return llama_state_parse(model, fname, buf.data(), buf.size(), tokens, rng);
+#endif
+}
+
+// copy keys and values of n positions from pos on between the memory and the
+// buffer of a prefix cache node; the buffer holds keys and values per layer
+static void llama_prefix_copy(const llama_model &model, int pos, int n,
+                              char *buf, bool to_memory) {
+    const auto &hparams = model.hparams;
+
+    const int n_embd = hparams.n_embd;
+    const int n_layer = hparams.n_layer;
+    const int n_ctx = hparams.n_ctx;
+
+    const size_t row_size = llama_memory_row_size(model.memory_k, n_embd);
+    const size_t size = n * row_size;
+
+    for (int il = 0; il < n_layer; ++il) {
+        char *k = (char *)model.memory_k->data + (il * n_ctx + pos) * row_size;
+        char *v = (char *)model.memory_v->data + (il * n_ctx + pos) * row_size;
+        if (to_memory) {
+            memcpy(k, buf, size);
+            memcpy(v, buf + size, size);
+        } else {
+            memcpy(buf, k, size);
+            memcpy(buf + size, v, size);
+        }
+        buf += 2 * size;
+    }
+}
+
+// drop least recently used blocks until the cache fits its capacity
+static void llama_prefix_cache_evict(llama_prefix_cache &cache) {
+    while (cache.stats.size > cache.capacity) {
+        // a node is used whenever one of its descendants is, so it suffices to
+        // look at the leaves
+        llama_prefix_node *lru = nullptr;
+        std::vector<llama_prefix_node *> stack = {&cache.root};
+        while (!stack.empty()) {
+            llama_prefix_node *node = stack.back();
+            stack.pop_back();
+            for (auto &it : node->children) {
+                llama_prefix_node *child = it.second.get();
+                if (!child->children.empty()) {
+                    stack.push_back(child);
+                } else if (!lru || child->last_use < lru->last_use) {
+                    lru = child;
+                }
+            }
+        }
+
+        if (!lru) {
+            break;
+        }
+
+        cache.stats.size -= lru->kv.size();
+        cache.stats.n_blocks--;
+        cache.stats.n_evictions++;
+        lru->parent->children.erase(lru->tokens);
+    }
+}
+
+// restore keys and values of the longest cached prefix of tokens into the
+// memory and return its length, i.e. n_past for evaluation of the rest; at
+// least the last token is left for evaluation to get its logits
+static size_t llama_prefix_cache_restore(
+    const llama_model &model, llama_prefix_cache &cache,
+    const std::vector<llama_vocab::id> &tokens) {
+    const size_t n_block = cache.block_size;
+    const uint64_t now = ++cache.clock;
+
+    llama_prefix_node *node = &cache.root;
+    size_t n_past = 0;
+    while (n_past + n_block < tokens.size()) {
+        std::vector<llama_vocab::id> block(tokens.begin() + n_past,
+                                           tokens.begin() + n_past + n_block);
+        auto it = node->children.find(block);
+        if (it == node->children.end()) {
+            break;
+        }
+
+        node = it->second.get();
+        node->last_use = now;
+
+        llama_prefix_copy(model, n_past, n_block, node->kv.data(), true);
+        n_past += n_block;
+    }
+
+    cache.stats.n_lookups++;
+    cache.stats.n_hits += n_past > 0;
+    cache.stats.n_tokens += tokens.size();
+    cache.stats.n_tokens_reused += n_past;
+
+    return n_past;
+}
+
+// add the complete blocks of tokens, which have to be evaluated into the
+// memory at positions 0, 1, ..., tokens.size() - 1
+static void llama_prefix_cache_store(const llama_model &model,
+                                     llama_prefix_cache &cache,
+                                     const std::vector<llama_vocab::id> &tokens) {
+    const auto &hparams = model.hparams;
+
+    const size_t n_block = cache.block_size;
+    const size_t kv_size = 2 * hparams.n_layer * n_block *
+                           llama_memory_row_size(model.memory_k, hparams.n_embd);
+    const uint64_t now = ++cache.clock;
+
+    llama_prefix_node *node = &cache.root;
+    for (size_t pos = 0; pos + n_block <= tokens.size(); pos += n_block) {
+        std::vector<llama_vocab::id> block(tokens.begin() + pos,
+                                           tokens.begin() + pos + n_block);
+        auto &child = node->children[block];
+        if (!child) {
+            child = std::make_unique<llama_prefix_node>();
+            child->tokens = std::move(block);
+            child->kv.resize(kv_size);
+            child->parent = node;
+
+            llama_prefix_copy(model, pos, n_block, child->kv.data(), false);
+
+            cache.stats.n_blocks++;
+            cache.stats.size += kv_size;
+        }
+
+        node = child.get();
+        node->last_use = now;
+    }
+
+    llama_prefix_cache_evict(cache);
+}
+
+// copy keys and values of a page of paged memory into another one
+static void llama_kv_page_copy(const llama_model &model, int src, int dst) {
+    const int n_embd = model.hparams.n_embd;
+    const int n_layer = model.hparams.n_layer;
+    const int n_pages = model.kv_pages.n_pages;
+    const int page_size = model.kv_pages.page_size;
+
+    const size_t row_size = llama_memory_row_size(model.memory_k, n_embd);
+    const size_t page_bytes = page_size * row_size;
+
+    for (int il = 0; il < n_layer; ++il) {
+        const size_t offs_src = (size_t)(il * n_pages + src) * page_bytes;
+        const size_t offs_dst = (size_t)(il * n_pages + dst) * page_bytes;
+        memcpy((char *)model.memory_k->data + offs_dst,
+               (char *)model.memory_k->data + offs_src, page_bytes);
+        memcpy((char *)model.memory_v->data + offs_dst,
+               (char *)model.memory_v->data + offs_src, page_bytes);
+    }
+}
+
+// make room for n more tokens of a sequence: take missing pages from the free
+// list and replace shared pages that are written to by private copies; nothing
+// changes if there are not enough free pages
+static bool llama_kv_seq_reserve(llama_model &model, llama_kv_seq &seq,
+                                 int n) {
+    auto &kv = model.kv_pages;
+
+    const size_t first = seq.n_tokens / kv.page_size;
+    const size_t last = (seq.n_tokens + n + kv.page_size - 1) / kv.page_size;
+
+    size_t n_needed = 0;
+    for (size_t i = first; i < last; ++i) {
+        if (i >= seq.pages.size() || kv.refs[seq.pages[i]] > 1) {
+            n_needed++;
+        }
+    }
+    if (n_needed > kv.free.size()) {
+        return false;
+    }
+
+    for (size_t i = first; i < last; ++i) {
+        if (i >= seq.pages.size()) {
+            seq.pages.push_back(kv.free.back());
+            kv.free.pop_back();
+            kv.refs[seq.pages.back()] = 1;
+        } else if (kv.refs[seq.pages[i]] > 1) {
+            const int32_t page = kv.free.back();
+            kv.free.pop_back();
+            kv.refs[page] = 1;
+            kv.refs[seq.pages[i]]--;
+            llama_kv_page_copy(model, seq.pages[i], page);
+            seq.pages[i] = page;
+        }
+    }
+    return true;
+}
+
+// drop the pages of a sequence; pages no other sequence refers to are free
+static void llama_kv_seq_clear(llama_model &model, llama_kv_seq &seq) {
+    auto &kv = model.kv_pages;
+    for (auto it = seq.pages.rbegin(); it != seq.pages.rend(); ++it) {
+        if (--kv.refs[*it] == 0) {
+            kv.free.push_back(*it);
+        }
+    }
+    seq.pages.clear();
+    seq.n_tokens = 0;
+}
+
+// sampling distribution of the next token over the whole vocabulary
+static void llama_sampling_dist(const llama_vocab &vocab, const float *logits,
+                                const std::vector<llama_vocab::id> &last_n_tokens,
+                                const llama_sampling_params &sampling,
+                                std::vector<double> &dist) {
+    dist.assign(vocab.id_to_token.size(), 0.0);
+    for (const auto &kv : llama_sample_top_p_top_k_probs(
+             vocab, logits, last_n_tokens, sampling.repeat_penalty,
+             sampling.top_k, sampling.top_p, sampling.temp)) {
+        dist[kv.second] = kv.first;
+    }
+}
+
+static llama_vocab::id llama_sample_dist(const std::vector<double> &dist,
+                                         std::mt19937 &rng) {
+    std::discrete_distribution<> d(dist.begin(), dist.end());
+    return d(rng);
+}
+
+// Decide on draft tokens by rejection sampling (Leviathan et al., 2023). Draft
+// token j is kept with probability min(1, p_j(x_j) / q_j(x_j)), where p_j and
+// q_j are the sampling distributions of target and draft after the preceding
+// tokens. The first rejected token is replaced by a sample of max(0, p_j - q_j)
+// and if all are kept, one more is sampled from p_k. Hence the result is
+// distributed as samples of the target alone. Without distributions (q empty)
+// the draft is deterministic, i.e. q_j is one at x_j.
+//
+//   - logits: rows of target logits for the draft tokens and the one after
+//
+// Returns the amount of kept tokens; next is the token that follows them.
+static size_t llama_speculative_verify(
+    const llama_vocab &vocab, const float *logits,
+    const std::vector<llama_vocab::id> &draft,
+    const std::vector<std::vector<double>> &q,
+    std::vector<llama_vocab::id> last_n_tokens,
+    const llama_sampling_params &sampling, std::mt19937 &rng,
+    llama_vocab::id &next) {
+    const int n_vocab = vocab.id_to_token.size();
+
+    std::uniform_real_distribution<double> uniform(0.0, 1.0);
+    std::vector<double> p;
+
+    for (size_t j = 0; j < draft.size(); ++j) {
+        llama_sampling_dist(vocab, logits + j * n_vocab, last_n_tokens,
+                            sampling, p);
+
+        const llama_vocab::id x = draft[j];
+        const double q_x = q.empty() ? 1.0 : q[j][x];
+        if (uniform(rng) * q_x < p[x]) {
+            last_n_tokens.erase(last_n_tokens.begin());
+            last_n_tokens.push_back(x);
+            continue;
+        }
+
+        // rejection implies p_j(x) < q_j(x), so the residual is not empty
+        for (int i = 0; i < n_vocab; ++i) {
+            const double q_i = q.empty() ? (i == x ? 1.0 : 0.0) : q[j][i];
+            p[i] = std::max(0.0, p[i] - q_i);
+        }
+        next = llama_sample_dist(p, rng);
+        return j;
+    }
+
+    llama_sampling_dist(vocab, logits + draft.size() * n_vocab, last_n_tokens,
+                        sampling, p);
+    next = llama_sample_dist(p, rng);
+    return draft.size();
+}
+
+namespace llama {
+
+std::vector<Tokenizer::ID> Tokenizer::Encode(std::string const &text,
+                                             bool bos) {
+    return llama_tokenize(vocab_, text, bos);
+}
+
+std::shared_ptr<Tokenizer> Tokenizer::Load(std::string const &path) {
+    llama_vocab vocab;
+    if (!llama_vocab_load(path, vocab)) {
+        return nullptr;
+    }
+    return std::make_shared<Tokenizer>(std::move(vocab));
+}
+
+LLaMA::~LLaMA(void) {
+    plan_.Reset();
+    if (model_) {
+        model_->loading.reset(); // joins the reader of tensors
+    }
+    if (model_ && model_->ctx) {
+        ggml_free(model_->ctx);
+        model_->ctx = nullptr;
+    }
+}
+
+bool LLaMA::Apply(std::vector<Tokenizer::ID> const &context,
+                  size_t context_size, std::vector<float> &logits,
+                  size_t &mem_per_token, size_t nothreads,
+                  bool return_all_logits) {
+    return llama_eval(*model_, nothreads, context_size, context, logits,
+                      mem_per_token, return_all_logits, &plan_);
+}
+
+double LLaMA::CalcPerplexity(std::string const &text,
+                             llama_perplexity_params const &params,
+                             size_t nothreads) {
+    // Download:
+    // https://s3.amazonaws.com/research.metamind.io/wikitext/wikitext-2-raw-v1.zip?ref=salesforce-research
+    // Run `./main --perplexity -m models/7B/ggml-model-q4_0.bin -f
+    // wiki.test.raw` Output: `perplexity: 13.5106 [114/114]`
+    const auto &vocab = tokenizer_->GetVocab();
+    const int n_vocab = model_->hparams.n_vocab;
+    const size_t n_ctx = model_->hparams.n_ctx;
+    const bool paged = model_->kv_pages.n_pages > 0;
+
+    const size_t n_window = params.n_window > 0 ? params.n_window : n_ctx;
+    const size_t n_stride = params.n_stride > 0 ? params.n_stride : n_window;
+    if (n_window < 4 || n_window > n_ctx) {
+        fprintf(stderr, "%s: window of %zu tokens does not fit context of %zu\n",
+                __func__, n_window, n_ctx);
+        return NAN;
+    }
+
+    size_t n_batch = std::max<size_t>(1, params.n_batch);
+    if (n_batch > 1 && !paged) {
+        fprintf(stderr, "%s: batching windows requires paged memory\n",
+                __func__);
+        n_batch = 1;
+    }
+
+    // the scores of a layer are n_head matrices of the square of the tokens
+    // of all windows of an evaluation
+    const size_t n_head = model_->hparams.n_head;
+    auto kq_size = [&](size_t n) {
+        const size_t n_tokens = n * (n_window - 1);
+        return n_head * n_tokens * n_tokens * sizeof(float);
+    };
+    if (n_batch > 1 && kq_size(n_batch) > params.max_kq_size) {
+        while (n_batch > 1 && kq_size(n_batch) > params.max_kq_size) {
+            --n_batch;
+        }
+        fprintf(stderr,
+                "%s: %zu windows per evaluation to keep attention scores "
+                "within %zu bytes\n",
+                __func__, n_batch, params.max_kq_size);
+    }
+
+    // Based on https://huggingface.co/docs/transformers/perplexity, every
+    // window scores the tokens which have at least half a window of context
+    // and which the previous window did not score: with the default stride
+    // of a whole window that is the last half of disjoint windows, with a
+    // stride of less than half a window every token after the first window
+    // is scored exactly once.
+    //
+    // We rely on the fact that attention in the forward pass only looks at
+    // previous tokens here, so the logits returned for each token are an
+    // accurate representation of what the model would have predicted at
+    // that point. The last token of a window is only predicted, so it is
+    // not evaluated.
+    const size_t n_eval = n_window - 1;
+    const size_t first = std::max(n_window / 2, n_window - 1 -
+                                  std::min(n_stride, n_window - 1));
+
+    std::vector<llama_vocab::id> tokens = ::llama_tokenize(vocab, text, true);
+    const size_t n_windows =
+        tokens.size() < n_window ? 0 : (tokens.size() - n_window) / n_stride + 1;
+
+    FILE *fnll = nullptr;
+    if (!params.nll_path.empty()) {
+        fnll = fopen(params.nll_path.c_str(), "w");
+        if (!fnll) {
+            fprintf(stderr, "%s: failed to open '%s'\n", __func__,
+                    params.nll_path.c_str());
+            return NAN;
+        }
+    }
+
+    size_t count = 0;
+    double nll = 0.0;
+    size_t mem_per_token = 0;
+    std::vector<float> logits;
+    std::vector<int> seqs;
+    std::vector<Tokenizer::ID> batch;
+    bool ok = true;
+    printf("Calculating perplexity over %zu windows, %zu per evaluation\n",
+           n_windows, n_batch);
+    for (size_t w = 0; ok && w < n_windows; w += n_batch) {
+        const size_t n_batch_windows = std::min(n_batch, n_windows - w);
+        const int64_t t_start_us = ggml_time_us();
+
+        batch.clear();
+        for (size_t b = 0; b < n_batch_windows; ++b) {
+            const auto start = tokens.begin() + (w + b) * n_stride;
+            batch.insert(batch.end(), start, start + n_eval);
+        }
+
+        if (paged) {
+            seqs.clear();
+            for (size_t b = 0; b < n_batch_windows; ++b) {
+                seqs.insert(seqs.end(), n_eval, NewSequence());
+            }
+            ok = ApplySequences(seqs, batch, logits, mem_per_token, nothreads);
+            for (size_t b = 0; b < n_batch_windows; ++b) {
+                FreeSequence(seqs[b * n_eval]);
+            }
+        } else {
+            ok = Apply(batch, 0, logits, mem_per_token, nothreads, true);
+        }
+        if (!ok) {
+            fprintf(stderr, "Failed to predict\n");
+            break;
+        }
+
+        if (w == 0) {
+            const double seconds = (ggml_time_us() - t_start_us) / 1e6;
+            printf("%.2f seconds per pass - ETA %.2f hours\n", seconds,
+                   seconds * ((n_windows + n_batch - 1) / n_batch) / 3600.0);
+        }
+
+        for (size_t b = 0; b < n_batch_windows; ++b) {
+            const size_t start = (w + b) * n_stride;
+            for (size_t j = first; j < n_eval; ++j) {
+                // probability of the next token given the previous ones
+                const size_t i = start + j + 1;
+                const double tok_nll = llama_token_nll(
+                    logits.data() + (b * n_eval + j) * n_vocab, n_vocab,
+                    tokens[i]);
+                if (fnll) {
+                    fprintf(fnll, "%zu\t%d\t%.6f\n", i, tokens[i], tok_nll);
+                }
+                nll += tok_nll;
+                ++count;
+            }
+        }
+        // perplexity is e^(average negative log-likelihood)
+        printf("[%zu]%.4lf,", w + n_batch_windows, std::exp(nll / count));
+        fflush(stdout);
+    }
+    printf("\n");
+
+    if (fnll) {
+        fclose(fnll);
+    }
+    return ok && count > 0 ? std::exp(nll / count) : NAN;
+}
+
+std::vector<llama_score>
+LLaMA::Score(std::vector<Tokenizer::ID> const &context,
+             std::vector<std::vector<Tokenizer::ID>> const &continuations,
+             size_t nothreads) {
+    const int n_vocab = model_->hparams.n_vocab;
+    const size_t n_ctx = model_->hparams.n_ctx;
+    const bool paged = model_->kv_pages.n_pages > 0;
+
+    if (context.empty()) {
+        fprintf(stderr, "%s: empty context\n", __func__);
+        return {};
+    }
+    for (auto const &cont : continuations) {
+        if (context.size() + cont.size() > n_ctx + 1) {
+            fprintf(stderr, "%s: continuation of %zu tokens does not fit context of %zu\n",
+                    __func__, cont.size(), n_ctx);
+            return {};
+        }
+    }
+
+    size_t mem_per_token = 0;
+    std::vector<float> logits;
+    std::vector<float> last_logits; // of the last token of the context
+
+    int root = -1;
+    bool ok;
+    if (paged) {
+        root = NewSequence();
+        ok = ApplySequence(root, context, last_logits, mem_per_token, nothreads);
+    } else {
+        ok = Apply(context, 0, last_logits, mem_per_token, nothreads);
+    }
+
+    // token i of a continuation is predicted by the logits of the last token
+    // of the context (i = 0) or of token i - 1, so the last token of a
+    // continuation is never evaluated
+    std::vector<llama_score> scores(continuations.size());
+    auto score = [&](size_t c, const float *cont_logits) {
+        auto const &cont = continuations[c];
+        auto &s = scores[c];
+        s.logprobs.resize(cont.size());
+        for (size_t i = 0; i < cont.size(); ++i) {
+            const float *l = i == 0 ? last_logits.data()
+                                    : cont_logits + (i - 1) * n_vocab;
+            s.logprobs[i] = -llama_token_nll(l, n_vocab, cont[i]);
+            s.total += s.logprobs[i];
+        }
+    };
+
+    std::vector<int> seqs;
+    std::vector<Tokenizer::ID> batch;
+    std::vector<size_t> batch_conts;
+    const size_t page_size = model_->kv_pages.page_size;
+    for (size_t c = 0; ok && c < continuations.size();) {
+        auto const &cont = continuations[c];
+        if (cont.size() < 2) {
+            score(c++, nullptr);
+            continue;
+        }
+        if (!paged) {
+            batch.assign(cont.begin(), cont.end() - 1);
+            ok = Apply(batch, context.size(), logits, mem_per_token, nothreads,
+                       true);
+            if (ok) {
+                score(c, logits.data());
+            }
+            ++c;
+            continue;
+        }
+
+        // fork the context for as many continuations as the free pages hold;
+        // a fork needs the pages of its tokens and a copy of the partial last
+        // page of the context
+        seqs.clear();
+        batch.clear();
+        batch_conts.clear();
+        size_t n_pages = 0;
+        for (; c < continuations.size(); ++c) {
+            auto const &next = continuations[c];
+            if (next.size() < 2) {
+                score(c, nullptr);
+                continue;
+            }
+            n_pages += (next.size() - 1 + page_size - 1) / page_size + 1;
+            if (!batch_conts.empty() && n_pages > GetFreePages()) {
+                break;
+            }
+            const int seq = ForkSequence(root);
+            seqs.insert(seqs.end(), next.size() - 1, seq);
+            batch.insert(batch.end(), next.begin(), next.end() - 1);
+            batch_conts.push_back(c);
+        }
+        if (batch_conts.empty()) {
+            break;
+        }
+
+        ok = ApplySequences(seqs, batch, logits, mem_per_token, nothreads);
+        size_t offset = 0;
+        for (size_t c : batch_conts) {
+            if (ok) {
+                score(c, logits.data() + offset * n_vocab);
+            }
+            offset += continuations[c].size() - 1;
+            FreeSequence(seqs[offset - 1]);
+        }
+    }
+
+    if (root >= 0) {
+        FreeSequence(root);
+    }
+    if (!ok) {
+        return {};
+    }
+    return scores;
+}
+
+std::vector<float>
+LLaMA::Embed(std::vector<std::vector<Tokenizer::ID>> const &inputs,
+             llama_pooling pooling, size_t nothreads) {
+    const int n_embd = model_->hparams.n_embd;
+    const bool paged = model_->kv_pages.n_pages > 0;
+    const size_t page_size = model_->kv_pages.page_size;
+
+    for (auto const &input : inputs) {
+        if (input.empty()) {
+            fprintf(stderr, "%s: empty input\n", __func__);
+            return {};
+        }
+    }
+
+    embd_plan_.embeddings = true;
+
+    std::vector<float> embeddings(inputs.size() * n_embd, 0.0f);
+    auto pool = [&](size_t i, const float *states) {
+        const size_t n = inputs[i].size();
+        float *embd = embeddings.data() + i * n_embd;
+        if (pooling == LLAMA_POOLING_LAST) {
+            std::copy(states + (n - 1) * n_embd, states + n * n_embd, embd);
+            return;
+        }
+        for (size_t t = 0; t < n; ++t) {
+            for (int j = 0; j < n_embd; ++j) {
+                embd[j] += states[t * n_embd + j];
+            }
+        }
+        for (int j = 0; j < n_embd; ++j) {
+            embd[j] /= n;
+        }
+    };
+
+    size_t mem_per_token = 0;
+    std::vector<float> states;
+    std::vector<int> seqs;
+    std::vector<Tokenizer::ID> batch;
+    std::vector<size_t> batch_inputs;
+    bool ok = true;
+    for (size_t i = 0; ok && i < inputs.size();) {
+        if (!paged) {
+            ok = llama_eval(*model_, nothreads, 0, inputs[i], states,
+                            mem_per_token, true, &embd_plan_);
+            if (ok) {
+                pool(i, states.data());
+            }
+            ++i;
+            continue;
+        }
+
+        // as many inputs as the free pages hold are sequences of a batch
+        seqs.clear();
+        batch.clear();
+        batch_inputs.clear();
+        size_t n_pages = 0;
+        for (; i < inputs.size(); ++i) {
+            n_pages += (inputs[i].size() + page_size - 1) / page_size;
+            if (!batch_inputs.empty() && n_pages > GetFreePages()) {
+                break;
+            }
+            seqs.insert(seqs.end(), inputs[i].size(), NewSequence());
+            batch.insert(batch.end(), inputs[i].begin(), inputs[i].end());
+            batch_inputs.push_back(i);
+        }
+
+        ok = EvalSequences(seqs, batch, states, mem_per_token, nothreads,
+                           embd_plan_);
+        size_t offset = 0;
+        for (size_t b : batch_inputs) {
+            if (ok) {
+                pool(b, states.data() + offset * n_embd);
+            }
+            offset += inputs[b].size();
+            FreeSequence(seqs[offset - 1]);
+        }
+    }
+
+    if (!ok) {
+        return {};
+    }
+    return embeddings;
+}
+
+size_t LLaMA::EstimateMemPerToken(size_t nothreads) {
+    size_t mem_per_token = 0;
+    std::vector<float> logits;
+    if (model_->kv_pages.n_pages > 0) {
+        int seq = NewSequence();
+        ApplySequence(seq, {0, 1, 2, 3}, logits, mem_per_token, nothreads);
+        FreeSequence(seq);
+    } else {
+        Apply({0, 1, 2, 3}, 0, logits, mem_per_token, nothreads);
+    }
+    return mem_per_token;
+}
+
+std::vector<float> LLaMA::Eval(std::vector<Tokenizer::ID> const &context,
+                                size_t context_size, size_t mem_per_token,
+                                size_t nothreads, bool return_all_logits) {
+    std::vector<float> logits;
+    bool ok = Apply(context, context_size, logits, mem_per_token, nothreads,
+                    return_all_logits);
+    return ok ? logits : std::vector<float>{};
+}
+
+bool LLaMA::SaveState(std::string const &path,
+                      std::vector<Tokenizer::ID> const &tokens,
+                      std::mt19937 const *rng) const {
+    if (model_->kv_pages.n_pages > 0) {
+        fprintf(stderr, "%s: not supported with paged memory\n", __func__);
+        return false;
+    }
+    std::ostringstream rng_state;
+    if (rng) {
+        rng_state << *rng;
+    }
+    return llama_state_save(*model_, path, tokens, rng_state.str());
+}
+
+bool LLaMA::LoadState(std::string const &path,
+                      std::vector<Tokenizer::ID> &tokens, std::mt19937 *rng) {
+    if (model_->kv_pages.n_pages > 0) {
+        fprintf(stderr, "%s: not supported with paged memory\n", __func__);
+        return false;
+    }
+    std::string rng_state;
+    if (!llama_state_load(*model_, path, tokens, rng_state)) {
+        return false;
+    }
+    if (rng && !rng_state.empty()) {
+        std::istringstream(rng_state) >> *rng;
+    }
+    return true;
+}
+
+void LLaMA::SetPrefixCache(size_t capacity, size_t block_size) {
+    if (capacity > 0 && model_->kv_pages.n_pages > 0) {
+        fprintf(stderr, "%s: not supported with paged memory\n", __func__);
+        capacity = 0;
+    }
+    if (capacity == 0 || block_size == 0) {
+        prefix_cache_.reset();
+        return;
+    }
+    if (!prefix_cache_ || prefix_cache_->block_size != (int)block_size) {
+        prefix_cache_ = std::make_unique<llama_prefix_cache>();
+        prefix_cache_->block_size = block_size;
+    }
+    prefix_cache_->capacity = capacity;
+    llama_prefix_cache_evict(*prefix_cache_);
+}
+
+size_t LLaMA::RestorePrefix(std::vector<Tokenizer::ID> const &tokens) {
+    if (!prefix_cache_) {
+        return 0;
+    }
+    return llama_prefix_cache_restore(*model_, *prefix_cache_, tokens);
+}
 
-                    if (part_id == 0) {
-                        fin.read(reinterpret_cast<char *>(tensor->data),
-                                 ggml_nbytes(tensor));
-                    } else {
-                        fin.seekg(ggml_nbytes(tensor), std::ios::cur);
-                    }
+void LLaMA::StorePrefix(std::vector<Tokenizer::ID> const &tokens) {
+    if (prefix_cache_) {
+        llama_prefix_cache_store(*model_, *prefix_cache_, tokens);
+    }
+}
 
-                    total_size += ggml_nbytes(tensor);
-                } else {
-                    if ((nelements * bpe) / ggml_blck_size(tensor->type) !=
-                        ggml_nbytes(tensor) / n_parts) {
-                        fprintf(stderr,
-                                "%s: tensor '%s' has wrong size in model file: "
-                                "got %zu, expected %zu\n",
-                                __func__, name.data(),
-                                ggml_nbytes(tensor) / n_parts, nelements * bpe);
-                        return false;
-                    }
+llama_prefix_cache_stats LLaMA::GetPrefixCacheStats(void) const {
+    return prefix_cache_ ? prefix_cache_->stats : llama_prefix_cache_stats{};
+}
 
-                    if (split_type == 0) {
-                        const int np0 = ne[0];
+size_t LLaMA::GetWeightSize(void) const {
+    size_t n_bytes = 0;
+    for (const auto *w : llama_model_weights(*model_)) {
+        n_bytes += ggml_nbytes(w);
+    }
+    return n_bytes;
+}
 
-                        const size_t row_size =
-                            (tensor->ne[0] / ggml_blck_size(tensor->type)) *
-                            ggml_type_size(tensor->type);
-                        assert(row_size == tensor->nb[1]);
-
-                        for (int i1 = 0; i1 < ne[1]; ++i1) {
-                            const size_t offset_row = i1 * row_size;
-                            const size_t offset =
-                                offset_row + ((part_id * np0) /
-                                              ggml_blck_size(tensor->type)) *
-                                                 ggml_type_size(tensor->type);
-                            fin.read(reinterpret_cast<char *>(tensor->data) +
-                                         offset,
-                                     row_size / n_parts);
-                        }
-                    } else {
-                        const int np1 = ne[1];
-
-                        const size_t row_size =
-                            (tensor->ne[0] / ggml_blck_size(tensor->type)) *
-                            ggml_type_size(tensor->type);
+llama_load_progress LLaMA::GetLoadProgress(void) const {
+    llama_load_progress progress;
+    progress.n_layers = model_->hparams.n_layer;
 
-                        for (int i1 = 0; i1 < ne[1]; ++i1) {
-                            const size_t offset_row =
-                                (i1 + part_id * np1) * row_size;
-                            fin.read(reinterpret_cast<char *>(tensor->data) +
-                                         offset_row,
-                                     row_size);
-                        }
-                    }
+    llama_load_state *state = model_->loading.get();
+    if (state == nullptr) {
+        for (const auto &it : model_->tensors) {
+            progress.n_bytes_total += ggml_nbytes(it.second);
+        }
+        progress.n_bytes = progress.n_bytes_total;
+        progress.n_layers_ready = progress.n_layers;
+        progress.done = true;
+        return progress;
+    }
 
-                    total_size += ggml_nbytes(tensor) / n_parts;
-                }
+    std::lock_guard<std::mutex> lock(state->mutex);
+    progress.n_bytes = state->n_bytes;
+    progress.n_bytes_total = state->n_bytes_total;
+    progress.n_layers_ready =
+        std::max(0, std::min(state->n_ready - 1, progress.n_layers));
+    progress.done = state->done;
+    progress.failed = state->failed;
+    return progress;
+}
 
-                // fprintf(stderr, "%42s - [%5d, %5d], type = %6s, %6.2f MB\n",
-                // name.data(), ne[0], ne[1], ftype == 0 ? "float" : "f16",
-                // ggml_nbytes(tensor)/1024.0/1024.0);
-                if (++n_tensors % 8 == 0) {
-                    fprintf(stderr, ".");
-                    fflush(stderr);
-                }
-            }
+bool LLaMA::WaitLoaded(void) {
+    return llama_load_wait(*model_, model_->hparams.n_layer + 1);
+}
 
-            fprintf(stderr, " done\n");
+size_t LLaMA::ShiftContext(size_t n_keep, size_t n_discard,
+                           size_t context_size, size_t nothreads) {
+    if (model_->kv_pages.n_pages > 0) {
+        fprintf(stderr, "%s: not supported with paged memory\n", __func__);
+        return context_size;
+    }
+    n_keep = std::min(n_keep, context_size);
+    n_discard = std::min(n_discard, context_size - n_keep);
+    llama_memory_shift(*model_, n_keep, n_discard, context_size, nothreads);
+    return context_size - n_discard;
+}
 
-            fprintf(stderr, "%s: model size = %8.2f MB / num tensors = %d\n",
-                    __func__, total_size / 1024.0 / 1024.0, n_tensors);
-        }
+int LLaMA::NewSequence(void) {
+    int seq = next_sequence_++;
+    sequences_[seq] = llama_kv_seq{};
+    return seq;
+}
 
-        fin.close();
+int LLaMA::ForkSequence(int seq) {
+    auto it = sequences_.find(seq);
+    if (it == sequences_.end()) {
+        return -1;
     }
+    for (int32_t page : it->second.pages) {
+        model_->kv_pages.refs[page]++;
+    }
+    int fork = next_sequence_++;
+    sequences_[fork] = it->second;
+    return fork;
+}
 
-    return true;
+void LLaMA::FreeSequence(int seq) {
+    auto it = sequences_.find(seq);
+    if (it == sequences_.end()) {
+        return;
+    }
+    llama_kv_seq_clear(*model_, it->second);
+    sequences_.erase(it);
 }
 
-// evaluate the transformer
-//
-//   - model:     the model
-//   - n_threads: number of threads to use
-//   - n_past:    the context size so far
-//   - embd_inp:  the embeddings of the tokens in the context
-//   - embd_w:    the predicted logits for the next token
-//
-// The GPT-J model requires about 16MB of memory per input token.
-//
-bool llama_eval(const llama_model &model, const int n_threads, const int n_past,
-                const std::vector<llama_vocab::id> &embd_inp,
-                std::vector<float> &embd_w, size_t &mem_per_token,
-                bool return_all_logits = false) {
-    const int N = embd_inp.size();
+bool LLaMA::ApplySequence(int seq, std::vector<Tokenizer::ID> const &tokens,
+                          std::vector<float> &logits, size_t &mem_per_token,
+                          size_t nothreads, bool return_all_logits) {
+    std::vector<int> seqs(tokens.size(), seq);
+    if (!ApplySequences(seqs, tokens, logits, mem_per_token, nothreads)) {
+        return false;
+    }
+    if (!return_all_logits) {
+        const int n_vocab = model_->hparams.n_vocab;
+        logits.erase(logits.begin(), logits.end() - n_vocab);
+    }
+    return true;
+}
 
-    const auto &hparams = model.hparams;
+bool LLaMA::ApplySequences(std::vector<int> const &seqs,
+                           std::vector<Tokenizer::ID> const &tokens,
+                           std::vector<float> &logits, size_t &mem_per_token,
+                           size_t nothreads) {
+    return EvalSequences(seqs, tokens, logits, mem_per_token, nothreads,
+                         plan_);
+}
 
-    const int n_embd = hparams.n_embd;
-    const int n_layer = hparams.n_layer;
-    const int n_ctx = hparams.n_ctx;
-    const int n_head = hparams.n_head;
-    const int n_vocab = hparams.n_vocab;
-    const int n_rot = hparams.n_embd / hparams.n_head;
+bool LLaMA::EvalSequences(std::vector<int> const &seqs,
+                          std::vector<Tokenizer::ID> const &tokens,
+                          std::vector<float> &output, size_t &mem_per_token,
+                          size_t nothreads, llama_eval_plan &plan) {
+    if (model_->kv_pages.n_pages == 0 || seqs.size() != tokens.size()) {
+        fprintf(stderr, "%s: expected a sequence in paged memory per token\n",
+                __func__);
+        return false;
+    }
 
-    // TODO: check if this size scales with n_ctx linearly and remove constant.
-    // somehow I feel it wasn't the case static size_t buf_size =
-    // hparams.n_ctx*1024*1024;
-    static size_t buf_size = 512u * 1024 * 1024;
-    static void *buf = malloc(buf_size);
-
-    if (mem_per_token > 0 && mem_per_token * N > buf_size) {
-        const size_t buf_size_new =
-            1.3 *
-            (mem_per_token * N); // add 30% to account for ggml object overhead
-        // fprintf(stderr, "\n%s: reallocating buffer from %zu to %zu bytes\n",
-        // __func__, buf_size, buf_size_new);
-
-        // reallocate
-        buf_size = buf_size_new;
-        buf = realloc(buf, buf_size);
-        if (buf == nullptr) {
-            fprintf(stderr, "%s: failed to allocate %zu bytes\n", __func__,
-                    buf_size);
+    std::vector<const llama_kv_seq *> kv_seqs(seqs.size());
+    std::map<int, int> n_new;
+    for (size_t i = 0; i < seqs.size(); ++i) {
+        auto it = sequences_.find(seqs[i]);
+        if (it == sequences_.end()) {
+            fprintf(stderr, "%s: no sequence %d\n", __func__, seqs[i]);
             return false;
         }
+        kv_seqs[i] = &it->second;
+        n_new[seqs[i]]++;
     }
 
-    struct ggml_init_params params = {
-        /*.mem_size   =*/buf_size,
-        /*.mem_buffer =*/buf,
-    };
+    for (auto const &[seq, n] : n_new) {
+        if (!llama_kv_seq_reserve(*model_, sequences_[seq], n)) {
+            fprintf(stderr, "%s: out of pages for sequence %d (%zu free)\n",
+                    __func__, seq, model_->kv_pages.free.size());
+            return false;
+        }
+    }
 
-    struct ggml_context *ctx0 = ggml_init(params);
-    ggml_cgraph gf = {};
-    gf.n_threads = n_threads;
+    if (!llama_eval_seqs(*model_, nothreads, tokens, kv_seqs, output,
+                         mem_per_token, true, &plan)) {
+        return false;
+    }
 
-    struct ggml_tensor *embd = ggml_new_tensor_1d(ctx0, GGML_TYPE_I32, N);
-    memcpy(embd->data, embd_inp.data(), N * ggml_element_size(embd));
+    for (auto const &[seq, n] : n_new) {
+        sequences_[seq].n_tokens += n;
+    }
+    return true;
+}
 
-    struct ggml_tensor *inpL = ggml_get_rows(ctx0, model.tok_embeddings, embd);
+std::vector<std::vector<Tokenizer::ID>>
+LLaMA::SampleParallel(std::vector<Tokenizer::ID> const &prompt, size_t n,
+                      size_t n_predict, llama_sampling_params const &sampling,
+                      std::mt19937 &rng, size_t nothreads) {
+    std::vector<std::vector<Tokenizer::ID>> completions(n);
+    if (n == 0 || prompt.empty()) {
+        return completions;
+    }
 
-    for (int il = 0; il < n_layer; ++il) {
-        struct ggml_tensor *inpSA = inpL;
+    const int n_vocab = model_->hparams.n_vocab;
 
-        struct ggml_tensor *cur;
+    size_t mem_per_token = 0;
+    std::vector<float> logits;
 
-        // norm
-        {
-            cur = ggml_rms_norm(ctx0, inpL);
+    int root = NewSequence();
+    if (!ApplySequence(root, prompt, logits, mem_per_token, nothreads)) {
+        FreeSequence(root);
+        return completions;
+    }
 
-            // cur = attention_norm*cur
-            cur = ggml_mul(
-                ctx0, ggml_repeat(ctx0, model.layers[il].attention_norm, cur),
-                cur);
-        }
+    // every branch starts from the prompt and its logits
+    std::vector<Tokenizer::ID> last_n_tokens(sampling.repeat_last_n, 0);
+    for (auto id : prompt) {
+        last_n_tokens.erase(last_n_tokens.begin());
+        last_n_tokens.push_back(id);
+    }
 
-        // self-attention
-        {
-            struct ggml_tensor *Qcur =
-                ggml_mul_mat(ctx0, model.layers[il].wq, cur);
-            struct ggml_tensor *Kcur =
-                ggml_mul_mat(ctx0, model.layers[il].wk, cur);
-            struct ggml_tensor *Vcur =
-                ggml_mul_mat(ctx0, model.layers[il].wv, cur);
+    std::vector<int> seqs(n, root);
+    std::vector<std::vector<Tokenizer::ID>> last_n(n, last_n_tokens);
+    std::vector<size_t> logits_index(n, 0);
+    for (size_t i = 1; i < n; ++i) {
+        seqs[i] = ForkSequence(root);
+    }
 
-            // store key and value to memory
-            if (N >= 1) {
-                struct ggml_tensor *k =
-                    ggml_view_1d(ctx0, model.memory_k, N * n_embd,
-                                 (ggml_element_size(model.memory_k) * n_embd) *
-                                     (il * n_ctx + n_past));
-                struct ggml_tensor *v =
-                    ggml_view_1d(ctx0, model.memory_v, N * n_embd,
-                                 (ggml_element_size(model.memory_v) * n_embd) *
-                                     (il * n_ctx + n_past));
+    std::vector<size_t> active(n);
+    for (size_t i = 0; i < n; ++i) {
+        active[i] = i;
+    }
 
-                ggml_build_forward_expand(&gf, ggml_cpy(ctx0, Kcur, k));
-                ggml_build_forward_expand(&gf, ggml_cpy(ctx0, Vcur, v));
+    for (size_t step = 0; step < n_predict && !active.empty(); ++step) {
+        std::vector<size_t> next_active;
+        std::vector<int> batch_seqs;
+        std::vector<Tokenizer::ID> batch_tokens;
+
+        for (size_t i : active) {
+            auto id = SampleNextToken(
+                *tokenizer_, logits.data() + logits_index[i] * n_vocab,
+                last_n[i], sampling.repeat_penalty, sampling.top_k,
+                sampling.top_p, sampling.temp, rng);
+            last_n[i].erase(last_n[i].begin());
+            last_n[i].push_back(id);
+
+            if (id == EOS_TOKEN_ID) {
+                continue;
             }
+            completions[i].push_back(id);
 
-            // Q = Qcur.contiguous().view(n_embd/n_head, n_head, N).permute(0,
-            // 2, 1, 3)
-            struct ggml_tensor *Q = ggml_permute(
-                ctx0,
-                ggml_rope(
-                    ctx0,
-                    ggml_cpy(ctx0, Qcur,
-                             ggml_new_tensor_3d(ctx0, GGML_TYPE_F32,
-                                                n_embd / n_head, n_head, N)),
-                    n_past, n_rot, 0),
-                0, 2, 1, 3);
-
-            // K = Kmem.view(n_embd/n_head, n_head, n_past + N).permute(0, 2, 1,
-            // 3)
-            struct ggml_tensor *K = ggml_permute(
-                ctx0,
-                ggml_rope(
-                    ctx0,
-                    ggml_reshape_3d(
-                        ctx0,
-                        ggml_view_1d(
-                            ctx0, model.memory_k, (n_past + N) * n_embd,
-                            il * n_ctx * ggml_element_size(model.memory_k) *
-                                n_embd),
-                        n_embd / n_head, n_head, n_past + N),
-                    n_past, n_rot, 1),
-                0, 2, 1, 3);
-
-            // K * Q
-            struct ggml_tensor *KQ = ggml_mul_mat(ctx0, K, Q);
-
-            // KQ_scaled = KQ / sqrt(n_embd/n_head)
-            struct ggml_tensor *KQ_scaled = ggml_scale(
-                ctx0, KQ,
-                ggml_new_f32(ctx0, 1.0f / sqrt(float(n_embd) / n_head)));
+            logits_index[i] = batch_seqs.size();
+            next_active.push_back(i);
+            batch_seqs.push_back(seqs[i]);
+            batch_tokens.push_back(id);
+        }
 
-            // KQ_masked = mask_past(KQ_scaled)
-            struct ggml_tensor *KQ_masked =
-                ggml_diag_mask_inf(ctx0, KQ_scaled, n_past);
+        active = std::move(next_active);
+        if (active.empty() || step + 1 == n_predict) {
+            break;
+        }
 
-            // KQ = soft_max(KQ_masked)
-            struct ggml_tensor *KQ_soft_max = ggml_soft_max(ctx0, KQ_masked);
+        // all branches advance in a single forward pass
+        if (!ApplySequences(batch_seqs, batch_tokens, logits, mem_per_token,
+                            nothreads)) {
+            break;
+        }
+    }
 
-            // V_trans = Vmem.view(n_embd/n_head, n_head, n_past + N).permute(1,
-            // 2, 0, 3).contiguous()
-            struct ggml_tensor *V_trans = ggml_permute(
-                ctx0,
-                ggml_reshape_3d(
-                    ctx0,
-                    ggml_view_1d(ctx0, model.memory_v, (n_past + N) * n_embd,
-                                 il * n_ctx *
-                                     ggml_element_size(model.memory_v) *
-                                     n_embd),
-                    n_embd / n_head, n_head, n_past + N),
-                1, 2, 0, 3);
+    for (int seq : seqs) {
+        FreeSequence(seq);
+    }
+    return completions;
+}
 
-            // KQV = transpose(V) * KQ_soft_max
-            struct ggml_tensor *KQV = ggml_mul_mat(ctx0, V_trans, KQ_soft_max);
+std::vector<Tokenizer::ID>
+LLaMA::BeamSearch(std::vector<Tokenizer::ID> const &prompt, size_t n_beams,
+                  size_t n_predict, size_t nothreads) {
+    if (n_beams == 0 || prompt.empty()) {
+        return {};
+    }
 
-            // KQV_merged = KQV.permute(0, 2, 1, 3)
-            struct ggml_tensor *KQV_merged =
-                ggml_permute(ctx0, KQV, 0, 2, 1, 3);
+    const int n_vocab = model_->hparams.n_vocab;
 
-            // cur = KQV_merged.contiguous().view(n_embd, N)
-            cur = ggml_cpy(ctx0, KQV_merged,
-                           ggml_new_tensor_2d(ctx0, GGML_TYPE_F32, n_embd, N));
+    size_t mem_per_token = 0;
+    std::vector<float> logits;
 
-            // projection (no bias)
-            cur = ggml_mul_mat(ctx0, model.layers[il].wo, cur);
-        }
+    struct Beam {
+        int seq;
+        std::vector<Tokenizer::ID> tokens;
+        double score; // log-probability of tokens
+        bool done;
+    };
 
-        struct ggml_tensor *inpFF = ggml_add(ctx0, cur, inpSA);
+    int root = NewSequence();
+    if (!ApplySequence(root, prompt, logits, mem_per_token, nothreads)) {
+        FreeSequence(root);
+        return {};
+    }
 
-        // feed-forward network
-        {
-            // norm
-            {
-                cur = ggml_rms_norm(ctx0, inpFF);
+    // logits of the unfinished beams are in the order of the beams
+    std::vector<Beam> beams = {{root, {}, 0.0, false}};
 
-                // cur = ffn_norm*cur
-                cur = ggml_mul(
-                    ctx0, ggml_repeat(ctx0, model.layers[il].ffn_norm, cur),
-                    cur);
+    for (size_t step = 0; step < n_predict; ++step) {
+        // candidates are the best continuations of each beam and the beams
+        // which are done
+        struct Candidate {
+            double score;
+            size_t beam;
+            Tokenizer::ID id; // -1 for a beam which is done
+        };
+        std::vector<Candidate> candidates;
+
+        std::vector<int> top(n_vocab);
+        size_t k = 0;
+        for (size_t b = 0; b < beams.size(); ++b) {
+            if (beams[b].done) {
+                candidates.push_back({beams[b].score, b, -1});
+                continue;
             }
 
-            struct ggml_tensor *tmp =
-                ggml_mul_mat(ctx0, model.layers[il].w3, cur);
-
-            cur = ggml_mul_mat(ctx0, model.layers[il].w1, cur);
+            const float *l = logits.data() + (k++) * n_vocab;
+            const float max_l = *std::max_element(l, l + n_vocab);
+            double sum = 0.0;
+            for (int i = 0; i < n_vocab; ++i) {
+                sum += exp(l[i] - max_l);
+            }
+            const double log_z = max_l + log(sum);
 
-            // SILU activation
-            cur = ggml_silu(ctx0, cur);
+            const size_t n_top = std::min<size_t>(n_beams, n_vocab);
+            for (int i = 0; i < n_vocab; ++i) {
+                top[i] = i;
+            }
+            std::partial_sort(
+                top.begin(), top.begin() + n_top, top.end(),
+                [l](int a, int b) { return l[a] > l[b]; });
+            for (size_t i = 0; i < n_top; ++i) {
+                candidates.push_back(
+                    {beams[b].score + l[top[i]] - log_z, b, top[i]});
+            }
+        }
 
-            cur = ggml_mul(ctx0, cur, tmp);
+        const size_t n_next = std::min(n_beams, candidates.size());
+        std::partial_sort(candidates.begin(), candidates.begin() + n_next,
+                          candidates.end(),
+                          [](Candidate const &a, Candidate const &b) {
+                              return a.score > b.score;
+                          });
+
+        // the first continuation of a beam takes over its sequence, further
+        // ones fork it; beams without continuation are dropped
+        std::vector<Beam> next;
+        std::vector<bool> used(beams.size(), false);
+        for (size_t i = 0; i < n_next; ++i) {
+            const auto &c = candidates[i];
+            Beam beam = beams[c.beam];
+            if (c.id >= 0) {
+                if (used[c.beam]) {
+                    beam.seq = ForkSequence(beam.seq);
+                }
+                beam.tokens.push_back(c.id);
+                beam.score = c.score;
+                beam.done = c.id == EOS_TOKEN_ID;
+            }
+            used[c.beam] = true;
+            next.push_back(std::move(beam));
+        }
+        for (size_t b = 0; b < beams.size(); ++b) {
+            if (!used[b]) {
+                FreeSequence(beams[b].seq);
+            }
+        }
+        beams = std::move(next);
+
+        std::vector<int> batch_seqs;
+        std::vector<Tokenizer::ID> batch_tokens;
+        for (auto const &beam : beams) {
+            if (!beam.done) {
+                batch_seqs.push_back(beam.seq);
+                batch_tokens.push_back(beam.tokens.back());
+            }
+        }
+        if (batch_seqs.empty() || step + 1 == n_predict) {
+            break;
+        }
 
-            cur = ggml_mul_mat(ctx0, model.layers[il].w2, cur);
+        // all beams advance in a single forward pass
+        if (!ApplySequences(batch_seqs, batch_tokens, logits, mem_per_token,
+                            nothreads)) {
+            break;
         }
+    }
 
-        cur = ggml_add(ctx0, cur, inpFF);
+    // beams are ordered by score
+    std::vector<Tokenizer::ID> best = beams.front().tokens;
+    if (!best.empty() && best.back() == EOS_TOKEN_ID) {
+        best.pop_back();
+    }
+    for (auto const &beam : beams) {
+        FreeSequence(beam.seq);
+    }
+    return best;
+}
 
-        // input for next layer
-        inpL = cur;
+std::vector<Tokenizer::ID> LLaMA::GenerateSpeculative(
+    LLaMA &draft, std::vector<Tokenizer::ID> const &prompt, size_t n_predict,
+    size_t n_draft, llama_sampling_params const &sampling, std::mt19937 &rng,
+    size_t nothreads) {
+    std::vector<Tokenizer::ID> output;
+    if (prompt.empty() || n_predict == 0) {
+        return output;
+    }
+    if (draft.model_->hparams.n_vocab != model_->hparams.n_vocab) {
+        fprintf(stderr, "%s: vocabularies of target and draft differ\n",
+                __func__);
+        return output;
     }
 
-    // norm
-    {
-        inpL = ggml_rms_norm(ctx0, inpL);
+    const auto &vocab = tokenizer_->GetVocab();
+    const int n_vocab = model_->hparams.n_vocab;
+    const size_t n_ctx =
+        std::min(model_->hparams.n_ctx, draft.model_->hparams.n_ctx);
 
-        // inpL = norm*inpL
-        inpL = ggml_mul(ctx0, ggml_repeat(ctx0, model.norm, inpL), inpL);
+    std::vector<Tokenizer::ID> tokens = prompt;
+    std::vector<Tokenizer::ID> last_n_tokens(sampling.repeat_last_n, 0);
+    for (auto id : prompt) {
+        last_n_tokens.erase(last_n_tokens.begin());
+        last_n_tokens.push_back(id);
     }
 
-    // lm_head
-    { inpL = ggml_mul_mat(ctx0, model.output, inpL); }
-
-    // logits -> probs
-    // inpL = ggml_soft_max(ctx0, inpL);
+    // amount of leading tokens with keys and values in memory of each model
+    size_t n_eval = 0;
+    size_t n_eval_draft = 0;
 
-    // run the computation
-    ggml_build_forward_expand(&gf, inpL);
-    ggml_graph_compute(ctx0, &gf);
+    size_t mem_per_token = 0;
+    size_t mem_per_token_draft = 0;
+    std::vector<float> logits;
+    std::vector<float> logits_draft;
+
+    std::vector<Tokenizer::ID> proposed;
+    std::vector<std::vector<double>> q;
+
+    bool done = false;
+    while (!done && output.size() < n_predict && tokens.size() <= n_ctx) {
+        // verification yields one token more than proposed
+        const size_t k = std::min({n_draft, n_predict - output.size() - 1,
+                                   n_ctx - tokens.size()});
+
+        proposed.clear();
+        q.resize(k);
+        auto last_n_draft = last_n_tokens;
+        for (size_t j = 0; j < k; ++j) {
+            // after the prompt tokens are fed one by one, so that the draft
+            // reuses the plan for a single token
+            std::vector<Tokenizer::ID> inp;
+            for (size_t i = n_eval_draft; i < tokens.size() + j; ++i) {
+                inp.push_back(i < tokens.size() ? tokens[i]
+                                                : proposed[i - tokens.size()]);
+            }
+            for (size_t i = 0; i < inp.size();) {
+                const size_t n = n_eval_draft == 0 ? inp.size() : 1;
+                std::vector<Tokenizer::ID> batch(inp.begin() + i,
+                                                 inp.begin() + i + n);
+                if (!draft.Apply(batch, n_eval_draft, logits_draft,
+                                 mem_per_token_draft, nothreads)) {
+                    return output;
+                }
+                n_eval_draft += n;
+                i += n;
+            }
 
-    // if (n_past%100 == 0) {
-    //     ggml_graph_print   (&gf);
-    //     ggml_graph_dump_dot(&gf, NULL, "gpt-2.dot");
-    // }
+            llama_sampling_dist(vocab, logits_draft.data(), last_n_draft,
+                                sampling, q[j]);
+            const auto x = llama_sample_dist(q[j], rng);
+            proposed.push_back(x);
+            last_n_draft.erase(last_n_draft.begin());
+            last_n_draft.push_back(x);
+        }
 
-    // embd_w.resize(n_vocab*N);
-    // memcpy(embd_w.data(), ggml_get_data(inpL), sizeof(float)*n_vocab*N);
+        // the target evaluates its pending tokens and all proposals at once
+        std::vector<Tokenizer::ID> inp(tokens.begin() + n_eval, tokens.end());
+        inp.insert(inp.end(), proposed.begin(), proposed.end());
+        if (!Apply(inp, n_eval, logits, mem_per_token, nothreads, true)) {
+            break;
+        }
 
-    if (return_all_logits) {
-        embd_w.resize(n_vocab * N);
-        memcpy(embd_w.data(), (float *)ggml_get_data(inpL),
-               sizeof(float) * n_vocab * N);
-    } else {
-        // return result for just the last token
-        embd_w.resize(n_vocab);
-        memcpy(embd_w.data(),
-               (float *)ggml_get_data(inpL) + (n_vocab * (N - 1)),
-               sizeof(float) * n_vocab);
+        Tokenizer::ID next;
+        const size_t n_accepted = llama_speculative_verify(
+            vocab, logits.data() + (inp.size() - 1 - k) * n_vocab, proposed,
+            q, last_n_tokens, sampling, rng, next);
+
+        speculative_stats_.n_rounds++;
+        speculative_stats_.n_drafted += k;
+        speculative_stats_.n_accepted += n_accepted;
+        speculative_stats_.n_generated += n_accepted + 1;
+
+        // keys and values after the kept tokens are overwritten later
+        n_eval = tokens.size() + n_accepted;
+        n_eval_draft = std::min(n_eval_draft, n_eval);
+
+        proposed.resize(n_accepted);
+        proposed.push_back(next);
+        for (auto id : proposed) {
+            if (id == EOS_TOKEN_ID) {
+                done = true;
+                break;
+            }
+            tokens.push_back(id);
+            output.push_back(id);
+            last_n_tokens.erase(last_n_tokens.begin());
+            last_n_tokens.push_back(id);
+        }
     }
 
-    if (mem_per_token == 0) {
-        mem_per_token = ggml_used_mem(ctx0) / N;
+    if (output.size() > n_predict) {
+        output.resize(n_predict);
     }
-    // fprintf(stderr, "used_mem = %zu\n", ggml_used_mem(ctx0));
+    return output;
+}
 
-    ggml_free(ctx0);
+std::vector<Tokenizer::ID> LLaMA::GenerateLookup(
+    std::vector<Tokenizer::ID> const &prompt, size_t n_predict, size_t n_gram,
+    size_t n_draft, llama_sampling_params const &sampling, std::mt19937 &rng,
+    size_t nothreads) {
+    std::vector<Tokenizer::ID> output;
+    if (prompt.empty() || n_predict == 0) {
+        return output;
+    }
 
-    return true;
-}
+    const auto &vocab = tokenizer_->GetVocab();
+    const int n_vocab = model_->hparams.n_vocab;
+    const size_t n_ctx = model_->hparams.n_ctx;
 
-std::vector<double> softmax(const std::vector<float> &logits) {
-    std::vector<double> probs(logits.size());
-    float max_logit = logits[0];
-    for (float v : logits)
-        max_logit = std::max(max_logit, v);
-    double sum_exp = 0.0;
-    for (size_t i = 0; i < logits.size(); i++) {
-        // Subtract the maximum logit value from the current logit value for
-        // numerical stability
-        float logit = logits[i] - max_logit;
-        double exp_logit = std::exp(logit);
-        sum_exp += exp_logit;
-        probs[i] = exp_logit;
-    }
-    for (size_t i = 0; i < probs.size(); i++)
-        probs[i] /= sum_exp;
-    return probs;
-}
-
-void perplexity(const llama_vocab &vocab, const llama_model &model,
-                const std::string &prompt, size_t n_ctx, size_t mem_per_token,
-                size_t n_threads) {
-    // Download:
-    // https://s3.amazonaws.com/research.metamind.io/wikitext/wikitext-2-raw-v1.zip?ref=salesforce-research
-    // Run `./main --perplexity -m models/7B/ggml-model-q4_0.bin -f
-    // wiki.test.raw` Output: `perplexity: 13.5106 [114/114]`
-    std::vector<llama_vocab::id> tokens = ::llama_tokenize(vocab, prompt, true);
+    std::vector<Tokenizer::ID> tokens = prompt;
+    std::vector<Tokenizer::ID> last_n_tokens(sampling.repeat_last_n, 0);
+    for (auto id : prompt) {
+        last_n_tokens.erase(last_n_tokens.begin());
+        last_n_tokens.push_back(id);
+    }
 
-    int count = 0;
-    double nll = 0.0;
-    int seq_count = tokens.size() / n_ctx;
-    printf("Calculating perplexity over %d chunks\n", seq_count);
-    for (int i = 0; i < seq_count; ++i) {
-        int start = i * n_ctx;
-        int end = start + n_ctx - 1;
-        std::vector<llama_vocab::id> embd(tokens.begin() + start,
-                                          tokens.begin() + end);
-        std::vector<float> logits;
-        auto start_t = std::chrono::high_resolution_clock::now();
-        if (!llama_eval(model, n_threads, 0, embd, logits, mem_per_token,
-                        true)) {
-            fprintf(stderr, "Failed to predict\n");
-            return;
+    size_t n_eval = 0; // leading tokens with keys and values in memory
+    size_t mem_per_token = 0;
+    std::vector<float> logits;
+    std::vector<Tokenizer::ID> proposed;
+
+    bool done = false;
+    while (!done && output.size() < n_predict && tokens.size() <= n_ctx) {
+        const size_t k = std::min({n_draft, n_predict - output.size() - 1,
+                                   n_ctx - tokens.size()});
+
+        // propose what followed the latest earlier occurrence of the longest
+        // matching n-gram at the end of the tokens
+        proposed.clear();
+        for (size_t n = std::min(n_gram, tokens.size() - 1);
+             n > 0 && k > 0 && proposed.empty(); --n) {
+            const auto suffix = tokens.end() - n;
+            for (size_t i = tokens.size() - n; i-- > 0;) {
+                if (std::equal(suffix, tokens.end(), tokens.begin() + i)) {
+                    const size_t end = std::min(i + n + k, tokens.size());
+                    proposed.assign(tokens.begin() + i + n,
+                                    tokens.begin() + end);
+                    break;
+                }
+            }
         }
-        auto end_t = std::chrono::high_resolution_clock::now();
-        if (i == 0) {
-            double seconds =
-                std::chrono::duration<double>(end_t - start_t).count();
-            printf("%.2f seconds per pass - ETA %.2f hours\n", seconds,
-                   (seconds * seq_count) / (60.0 * 60.0));
-        }
-        // We get the logits for all the tokens in the context window
-        // (n_ctx) from llama_eval above.  Now, based on
-        // https://huggingface.co/docs/transformers/perplexity, calculate the
-        // perplexity over the last half the window (so the model always has
-        // some context to predict the token).
-        //
-        // We rely on the fact that attention in the forward pass only looks at
-        // previous tokens here, so the logits returned for each token are an
-        // accurate representation of what the model would have predicted at
-        // that point.
-        //
-        // Example, we have a context window of 512, we will compute perplexity
-        // for each of the last 256 tokens.  Then, we split the input up into
-        // context window size chunks to process the entire prompt.
-        for (size_t j = n_ctx / 2; j < n_ctx - 1; ++j) {
-            // Calculate probability of next token, given the previous ones.
-            int n_vocab = model.hparams.n_vocab;
-            std::vector<float> tok_logits(logits.begin() + j * n_vocab,
-                                          logits.begin() + (j + 1) * n_vocab);
-            double prob = softmax(tok_logits)[tokens[start + j + 1]];
-            nll += -std::log(prob);
-            ++count;
+
+        std::vector<Tokenizer::ID> inp(tokens.begin() + n_eval, tokens.end());
+        inp.insert(inp.end(), proposed.begin(), proposed.end());
+        if (!Apply(inp, n_eval, logits, mem_per_token, nothreads, true)) {
+            break;
         }
-        // perplexity is e^(average negative log-likelihood)
-        printf("[%d]%.4lf,", i + 1, std::exp(nll / count));
-        fflush(stdout);
-    }
-    printf("\n");
-}
 
-namespace llama {
+        Tokenizer::ID next;
+        const size_t n_accepted = llama_speculative_verify(
+            vocab, logits.data() + (inp.size() - 1 - proposed.size()) * n_vocab,
+            proposed, {}, last_n_tokens, sampling, rng, next);
 
-std::vector<Tokenizer::ID> Tokenizer::Encode(std::string const &text,
-                                             bool bos) {
-    return llama_tokenize(vocab_, text, bos);
-}
+        speculative_stats_.n_rounds++;
+        speculative_stats_.n_drafted += proposed.size();
+        speculative_stats_.n_accepted += n_accepted;
+        speculative_stats_.n_generated += n_accepted + 1;
 
-std::shared_ptr<Tokenizer> Tokenizer::Load(std::string const &path) {
-    llama_vocab vocab;
-    if (!llama_vocab_load(path, vocab)) {
-        return nullptr;
-    }
-    return std::make_shared<Tokenizer>(std::move(vocab));
-}
+        n_eval = tokens.size() + n_accepted;
 
-LLaMA::~LLaMA(void) {
-    if (model_ && model_->ctx) {
-        ggml_free(model_->ctx);
-        model_->ctx = nullptr;
+        proposed.resize(n_accepted);
+        proposed.push_back(next);
+        for (auto id : proposed) {
+            if (id == EOS_TOKEN_ID) {
+                done = true;
+                break;
+            }
+            tokens.push_back(id);
+            output.push_back(id);
+            last_n_tokens.erase(last_n_tokens.begin());
+            last_n_tokens.push_back(id);
+        }
     }
-}
-
-bool LLaMA::Apply(std::vector<Tokenizer::ID> const &context,
-                  size_t context_size, std::vector<float> &logits,
-                  size_t &mem_per_token, size_t nothreads,
-                  bool return_all_logits) {
-    return llama_eval(*model_, nothreads, context_size, context, logits,
-                      mem_per_token, return_all_logits);
-}
 
-void LLaMA::CalcPerplexity(std::string const &text, size_t context_size,
-                           size_t mem_per_token, size_t nothreads) {
-    perplexity(tokenizer_->GetVocab(), *model_, text, context_size,
-               mem_per_token, nothreads);
-}
-
-size_t LLaMA::EstimateMemPerToken(size_t nothreads) {
-    size_t mem_per_token = 0;
-    std::vector<float> logits;
-    Apply({0, 1, 2, 3}, 0, logits, mem_per_token, nothreads);
-    return mem_per_token;
+    if (output.size() > n_predict) {
+        output.resize(n_predict);
+    }
+    return output;
 }
 
-std::vector<float> LLaMA::Eval(std::vector<Tokenizer::ID> const &context,
-                                size_t context_size, size_t mem_per_token,
-                                size_t nothreads, bool return_all_logits) {
-    std::vector<float> logits;
-    bool ok = Apply(context, context_size, logits, mem_per_token, nothreads,
-                    return_all_logits);
-    return ok ? logits : std::vector<float>{};
+size_t LLaMA::GetSequenceSize(int seq) const {
+    auto it = sequences_.find(seq);
+    return it == sequences_.end() ? 0 : it->second.n_tokens;
 }
 
 std::shared_ptr<LLaMA> LLaMA::Load(std::string const &path, size_t context_size,
                                    DType dtype) {
+    llama_load_params params;
+    params.n_ctx = context_size;
+    params.memory_type = dtype;
+    return Load(path, params);
+}
+
+std::shared_ptr<LLaMA> LLaMA::Load(std::string const &path,
+                                   llama_load_params const &params) {
     auto model = std::make_unique<llama_model>();
     auto vocab = llama_vocab{};
-    if (!llama_model_load(path, *model, vocab, context_size, -1, dtype)) {
+    if (!llama_model_load(path, *model, vocab, params)) {
         return nullptr;
     }
     auto tokenizer = std::make_shared<Tokenizer>(std::move(vocab));
@@ -2,8 +2,12 @@
 
 #include <llama/cc/ggml.h>
 #include <llama/cc/utils.h>
+#include <condition_variable>
+#include <map>
 #include <memory>
+#include <mutex>
 #include <string>
+#include <thread>
 #include <unordered_map>
 #include <vector>
 
@@ -19,6 +23,31 @@ struct llama_hparams {
     int32_t f16 = 1;
 };
 
+// Options of model loading.
+struct llama_load_params {
+    int32_t n_ctx = 512;   // context size
+    int32_t n_parts = -1;  // amount of model parts (-1 = determine from model dimensions)
+
+    ggml_type memory_type = GGML_TYPE_F16; // type of key + value memory (F32, F16 or Q8_0)
+
+    bool fuse_qkv = true;  // pack wq, wk and wv for a single projection
+    bool fuse_ffn = true;  // pack w1 and w3 for the fused SwiGLU op
+
+    int32_t kv_pages = 0;      // pages of key + value memory (0 = single context, see llama_kv_pages)
+    int32_t kv_page_size = 16; // tokens per page
+
+    int32_t n_load_threads = 0; // threads reading parts or tensors (0 = hardware threads)
+
+    bool async_load = false; // read tensors in the background (see llama_load_state)
+
+    bool huge_pages = false; // back weights and key + value memory with huge pages
+    bool mlock = false;      // lock weights and key + value memory in RAM
+
+    bool numa = false; // place rows of weights on the NUMA nodes whose threads compute them
+
+    int32_t repack_rows = 0; // interleave Q4_0 weights by 4 or 8 rows for multi-row kernels (0 = off); pays off for decoding, not for batches
+};
+
 struct llama_layer {
     // normalization
     struct ggml_tensor *attention_norm;
@@ -29,6 +58,9 @@ struct llama_layer {
     struct ggml_tensor *wv;
     struct ggml_tensor *wo;
 
+    // wq, wk and wv stacked by rows; wq, wk and wv are views into it if present
+    struct ggml_tensor *wqkv;
+
     // normalization
     struct ggml_tensor *ffn_norm;
 
@@ -36,6 +68,91 @@ struct llama_layer {
     struct ggml_tensor *w1;
     struct ggml_tensor *w2;
     struct ggml_tensor *w3;
+
+    // w1 and w3 with interleaved rows (see ggml_swiglu); w1 and w3 are views
+    // into it if present
+    struct ggml_tensor *w13;
+};
+
+// Key + value memory shared by many sequences in pages of page_size tokens. A
+// page holds its tokens for all layers: slot s of page p in layer il is row
+// (il * n_pages + p) * page_size + s of memory_k and memory_v. Sequences take
+// pages from the free list as they grow, so memory is bound by the tokens in
+// flight rather than by a full context per sequence. A forked sequence shares
+// the pages of its origin; a shared page is copied before it is written to.
+//
+// Attention does not read the pages in place: each layer gathers the n_kv rows
+// a step attends to into an F32 copy of the keys and one of the values (2 *
+// n_kv * n_embd floats of scratch memory per layer). Paged memory of type Q8_0
+// is refused, as the copy would undo its savings.
+struct llama_kv_pages {
+    int32_t page_size = 0;
+    int32_t n_pages = 0;       // zero if memory is a single context
+    std::vector<int32_t> free; // unused pages
+    std::vector<int32_t> refs; // sequences per page
+};
+
+// Page table of a sequence: position i is slot i % page_size of page
+// pages[i / page_size].
+struct llama_kv_seq {
+    std::vector<int32_t> pages;
+    int32_t n_tokens = 0; // positions with keys and values in memory
+};
+
+// Tensors of a model which are read in the background: loading returns once
+// they are allocated and evaluation waits for the weights of each layer before
+// running it, so that the first prompt is evaluated while the last layers are
+// still read. Units of weights are the embeddings, the layers and the output
+// (norm and lm_head) in the order of evaluation; a unit is ready once all its
+// tensors (or their slices in every part) are read.
+struct llama_load_state {
+    std::unordered_map<const struct ggml_tensor *, int> units; // of weights
+
+    std::mutex mutex;
+    std::condition_variable cond;
+    std::vector<int> n_pending; // tensor slices to read per unit (-1 once ready)
+    int n_ready = 0;            // leading units which are ready
+    size_t n_bytes = 0;         // bytes read so far
+    size_t n_bytes_total = 0;
+    bool done = false;
+    bool failed = false;
+
+    // weights of each unit which are repacked once it is read (see
+    // llama_load_params::repack_rows)
+    int repack_rows = 0;
+    std::vector<std::vector<struct ggml_tensor *>> weights;
+
+    std::thread thread; // reads the tensors
+
+    ~llama_load_state(void) {
+        if (thread.joinable()) {
+            thread.join();
+        }
+    }
+};
+
+struct llama_load_progress {
+    size_t n_bytes = 0;         // bytes of tensors read
+    size_t n_bytes_total = 0;   // bytes of all tensors
+    int32_t n_layers_ready = 0; // leading layers which can be evaluated
+    int32_t n_layers = 0;
+    bool done = false;   // all tensors are read (or loading failed)
+    bool failed = false; // evaluation fails
+};
+
+// Memory of the weights and key + value memory if it is mapped by the model
+// rather than allocated by ggml (see llama_load_params::huge_pages and mlock).
+struct llama_buffer {
+    void *addr = nullptr;
+    size_t size = 0;
+    size_t page_size = 0;     // huge page size if backed by MAP_HUGETLB
+    bool transparent = false; // advised to use transparent huge pages
+    size_t n_locked = 0;      // bytes locked in RAM
+
+    llama_buffer(void) = default;
+    llama_buffer(const llama_buffer &) = delete;
+    llama_buffer &operator=(const llama_buffer &) = delete;
+    ~llama_buffer(void);
 };
 
 // Forward declaration for llama_model.
@@ -53,9 +170,176 @@ struct llama_model {
     struct ggml_tensor *memory_k;
     struct ggml_tensor *memory_v;
 
+    // pages of key + value memory if it is paged
+    llama_kv_pages kv_pages;
+
     //
     struct ggml_context *ctx;
     std::unordered_map<std::string, struct ggml_tensor *> tensors;
+
+    // memory of ctx unless ggml allocates it
+    llama_buffer buffer;
+
+    // null unless tensors are read in the background
+    std::unique_ptr<llama_load_state> loading;
+};
+
+// Tensors of a layer graph whose data, shape or parameters depend on n_past.
+struct llama_layer_plan {
+    // copies of new keys and values into memory (data depends on n_past; rows
+    // of the paged memory are given by llama_eval_plan::rows_new instead)
+    struct ggml_tensor *k_cpy;
+    struct ggml_tensor *v_cpy;
+
+    // rotary embedding of queries and new keys (n_past parameter)
+    struct ggml_tensor *q_rope;
+    struct ggml_tensor *k_rope;
+
+    // keys: view (get_rows of paged memory) -> reshape -> permute
+    struct ggml_tensor *k_view;
+    struct ggml_tensor *k_3d;
+    struct ggml_tensor *k;
+
+    // attention scores: mul_mat -> scale -> mask -> soft_max; paged memory
+    // is masked by adding llama_eval_plan::kq_mask, broadcast over the heads
+    struct ggml_tensor *kq;
+    struct ggml_tensor *kq_scaled;
+    struct ggml_tensor *kq_masked;
+    struct ggml_tensor *kq_soft_max;
+
+    // values: view (get_rows of paged memory) -> reshape -> permute
+    struct ggml_tensor *v_view;
+    struct ggml_tensor *v_3d;
+    struct ggml_tensor *v_trans;
+};
+
+// Evaluation graph that is built once for a batch size and replayed for
+// subsequent calls. The graph is built for the longest possible past (n_ctx -
+// n_tokens) so that its buffers fit any step; before each replay only the
+// input tokens and the tensors in llama_layer_plan are patched for the actual
+// n_past, hence neither graph construction nor planning of the computation
+// happens per token. With paged memory the tokens of a batch may belong to
+// different sequences, the graph then attends to the rows of all of them
+// (at least n_ctx) under a mask.
+struct llama_eval_plan {
+    const llama_model *model = nullptr; // model the graph was built for
+    int n_tokens = 0;                   // batch size the graph was built for
+    int n_kv = 0;                       // keys and values it attends to at most
+    int n_threads = 0;
+
+    size_t buf_size = 0; // tensor objects
+    void *buf = nullptr;
+
+    size_t scratch_size = 0; // intermediate results and work buffer
+    void *scratch = nullptr;
+
+    struct ggml_context *ctx = nullptr;
+    std::unique_ptr<struct ggml_cgraph> graph;
+
+    struct ggml_tensor *embd = nullptr;   // input tokens
+    struct ggml_tensor *norm = nullptr;   // output of the final norm
+    struct ggml_tensor *logits = nullptr; // output of lm_head
+
+    // the graph ends with the final norm, evaluation returns hidden states of
+    // n_embd instead of logits; kept across builds
+    bool embeddings = false;
+
+    // rows of paged memory for new keys and values and of all keys and values
+    // to attend to, positions of the tokens and the mask of keys each token
+    // attends to (0 or -inf); null if memory is not paged
+    struct ggml_tensor *rows_new = nullptr;
+    struct ggml_tensor *rows_kv = nullptr;
+    struct ggml_tensor *pos = nullptr;
+    struct ggml_tensor *kq_mask = nullptr;
+    std::vector<llama_layer_plan> layers;
+
+    llama_eval_plan(void) = default;
+    llama_eval_plan(llama_eval_plan const &) = delete;
+    llama_eval_plan &operator=(llama_eval_plan const &) = delete;
+    ~llama_eval_plan(void);
+
+    // Drop the graph; the buffer is kept for the next build.
+    void Reset(void);
+};
+
+// Node of the prefix cache: a block of tokens that follows the blocks of its
+// ancestors together with the keys and values of the block for all layers.
+struct llama_prefix_node {
+    std::vector<llama_vocab::id> tokens;
+    std::vector<char> kv;
+
+    llama_prefix_node *parent = nullptr;
+    std::map<std::vector<llama_vocab::id>, std::unique_ptr<llama_prefix_node>>
+        children;
+
+    uint64_t last_use = 0;
+};
+
+struct llama_prefix_cache_stats {
+    size_t n_lookups = 0;       // calls to restore a prefix
+    size_t n_hits = 0;          // lookups that restored at least one block
+    size_t n_tokens = 0;        // tokens looked up
+    size_t n_tokens_reused = 0; // tokens restored instead of evaluated
+    size_t n_blocks = 0;        // blocks in the cache
+    size_t n_evictions = 0;     // blocks dropped to stay within capacity
+    size_t size = 0;            // bytes of keys and values in the cache
+};
+
+// Keys and values of evaluated token sequences shared between requests. The
+// sequences form a radix tree over blocks of block_size tokens, so that
+// prompts starting with the same blocks (e.g. a system prompt) share the
+// nodes. Keys and values only depend on the preceding tokens and the
+// position, hence a cached prefix can be copied back into the memory instead
+// of being evaluated. Least recently used leaves are dropped if the cache
+// grows beyond its capacity.
+struct llama_prefix_cache {
+    size_t capacity = 0; // bytes
+    int block_size = 0;  // tokens
+
+    llama_prefix_node root;
+    uint64_t clock = 0;
+
+    llama_prefix_cache_stats stats;
+};
+
+struct llama_speculative_stats {
+    size_t n_rounds = 0;    // draft and verification steps
+    size_t n_drafted = 0;   // tokens proposed by the draft
+    size_t n_accepted = 0;  // proposed tokens kept by the target
+    size_t n_generated = 0; // tokens generated (kept ones and one per round)
+};
+
+// Parameters of sampling the next token (see llama::SampleNextToken).
+struct llama_sampling_params {
+    int32_t top_k = 40;
+    float top_p = 0.95f;
+    float temp = 0.80f;
+    float repeat_penalty = 1.10f;
+    int32_t repeat_last_n = 64; // last n tokens to penalize
+};
+
+// Pooling of the hidden states of the tokens of an input to its embedding.
+enum llama_pooling {
+    LLAMA_POOLING_MEAN = 0, // mean over all tokens
+    LLAMA_POOLING_LAST = 1, // last token
+};
+
+// Log-probabilities of the tokens of a continuation (see llama::LLaMA::Score).
+struct llama_score {
+    std::vector<float> logprobs; // log P(token | context, previous tokens)
+    double total = 0.0;          // sum of logprobs
+};
+
+// Parameters of perplexity evaluation (see llama::LLaMA::CalcPerplexity).
+struct llama_perplexity_params {
+    size_t n_window = 0; // tokens per window (0 = context size)
+    size_t n_stride = 0; // tokens between starts of windows (0 = window)
+    size_t n_batch = 1;  // windows per evaluation (> 1 needs paged memory)
+    // bytes of the attention scores of a layer, which grow with the square of
+    // the tokens of an evaluation (windows attend to all of them and mask the
+    // others out); n_batch is lowered to stay within
+    size_t max_kq_size = 256u << 20;
+    std::string nll_path = ""; // file to write the nll of scored tokens to
 };
 
 namespace llama {
@@ -96,6 +380,18 @@ class LLaMA {
 private:
     std::unique_ptr<llama_model> model_;
     std::shared_ptr<Tokenizer> tokenizer_;
+    llama_eval_plan plan_;
+    llama_eval_plan embd_plan_;
+    std::unique_ptr<llama_prefix_cache> prefix_cache_;
+    std::map<int, llama_kv_seq> sequences_;
+    int next_sequence_ = 0;
+    llama_speculative_stats speculative_stats_;
+
+    // ApplySequences with the graph of a plan
+    bool EvalSequences(std::vector<int> const &seqs,
+                       std::vector<Tokenizer::ID> const &tokens,
+                       std::vector<float> &output, size_t &mem_per_token,
+                       size_t nothreads, llama_eval_plan &plan);
 
 public:
     LLaMA(std::unique_ptr<llama_model> &&model,
@@ -120,8 +416,63 @@ public:
                std::vector<float> &logits, size_t &mem_per_token,
                size_t nothreads = 1, bool return_all_logits = false);
 
-    void CalcPerplexity(std::string const &text, size_t context_size,
-                        size_t mem_per_token, size_t nothreads = 1);
+    /**
+     * Calculate the perplexity of a text over windows of tokens. Every window
+     * scores the tokens with at least half a window of context which the
+     * previous window did not score. With paged memory several windows are
+     * evaluated at once as separate sequences. Otherwise each window is
+     * evaluated from position 0 of the memory: the keys and values of a
+     * context evaluated before are overwritten and have to be evaluated (or
+     * restored with LoadState) again.
+     *
+     * @param[in] text      Text to score.
+     * @param[in] params    Windows, stride, batching and nll dump.
+     * @param[in] nothreads Number of threads to use.
+     * @return Perplexity, NaN on failure.
+     */
+    double CalcPerplexity(std::string const &text,
+                          llama_perplexity_params const &params = {},
+                          size_t nothreads = 1);
+
+    /**
+     * Score continuations of a shared context, e.g. to rank candidate
+     * answers. The context is evaluated once. With paged memory the
+     * continuations are forks of it evaluated together in as few batches as
+     * the free pages allow, otherwise one after the other following the
+     * context in memory. Log-probabilities are computed from the logits in
+     * place; only the ones of the continuation tokens are returned.
+     *
+     * Without paged memory the context is evaluated from position 0, which
+     * overwrites the keys and values of whatever the caller evaluated before
+     * (the n_past it tracks is no longer valid afterwards).
+     *
+     * @param[in] context       Context tokens (not empty).
+     * @param[in] continuations Continuations to score.
+     * @param[in] nothreads     Number of threads to use.
+     * @return Score of each continuation; empty on failure.
+     */
+    std::vector<llama_score>
+    Score(std::vector<Tokenizer::ID> const &context,
+          std::vector<std::vector<Tokenizer::ID>> const &continuations,
+          size_t nothreads = 1);
+
+    /**
+     * Compute embeddings of inputs: hidden states after the final norm,
+     * pooled over the tokens of each input. The output projection is not
+     * evaluated. With paged memory the inputs are evaluated together in as
+     * few batches as the free pages allow, otherwise one after the other
+     * from position 0 of the memory, replacing the keys and values of a
+     * context evaluated before.
+     *
+     * @param[in] inputs    Tokens of each input (not empty).
+     * @param[in] pooling   Pooling of the hidden states of an input.
+     * @param[in] nothreads Number of threads to use.
+     * @return Embeddings of the inputs, n_embd values each, one after the
+     *         other; empty on failure.
+     */
+    std::vector<float>
+    Embed(std::vector<std::vector<Tokenizer::ID>> const &inputs,
+          llama_pooling pooling = LLAMA_POOLING_MEAN, size_t nothreads = 1);
 
     size_t EstimateMemPerToken(size_t nothreads = 1);
 
@@ -130,6 +481,255 @@ public:
                             size_t nothreads = 1,
                             bool return_all_logits = false);
 
+    /**
+     * Save session state: keys and values of the first tokens.size()
+     * positions of the memory, the tokens themselves and optionally the state
+     * of a sampler.
+     *
+     * @param[in] path   Path to state file.
+     * @param[in] tokens Tokens evaluated so far (i.e. n_past = tokens.size()).
+     * @param[in] rng    Random number generator of sampling (optional).
+     * @return Status of successfull saving.
+     */
+    bool SaveState(std::string const &path,
+                   std::vector<Tokenizer::ID> const &tokens,
+                   std::mt19937 const *rng = nullptr) const;
+
+    /**
+     * Restore session state saved with SaveState. Evaluation can continue
+     * with context_size = tokens.size().
+     *
+     * @param[in] path    Path to state file.
+     * @param[out] tokens Tokens which keys and values are restored.
+     * @param[out] rng    Random number generator of sampling (optional,
+     *                    unchanged if the state has no generator).
+     * @return Status of successfull loading.
+     */
+    bool LoadState(std::string const &path, std::vector<Tokenizer::ID> &tokens,
+                   std::mt19937 *rng = nullptr);
+
+    /**
+     * Make room in a full context: drop n_discard tokens that follow the
+     * first n_keep tokens. Keys and values of the later tokens move down in
+     * memory and keys are re-rotated to their new positions, so nothing has
+     * to be evaluated again.
+     *
+     * @param[in] n_keep       Amount of leading tokens to keep (e.g. prompt).
+     * @param[in] n_discard    Amount of tokens to drop after them.
+     * @param[in] context_size Size of past context.
+     * @param[in] nothreads    Number of threads to use.
+     * @return Context size after the shift.
+     */
+    size_t ShiftContext(size_t n_keep, size_t n_discard, size_t context_size,
+                        size_t nothreads = 1);
+
+    /**
+     * Enable the prefix cache which shares keys and values of common prompt
+     * prefixes between sequences. A capacity of zero disables it.
+     *
+     * @param[in] capacity   Bytes of keys and values to keep at most.
+     * @param[in] block_size Granularity of prefixes in tokens.
+     */
+    void SetPrefixCache(size_t capacity, size_t block_size = 64);
+
+    /**
+     * Restore keys and values of the longest cached prefix of a new sequence
+     * into memory. The last token is never restored, so that there is always
+     * a suffix to evaluate for logits.
+     *
+     * @param[in] tokens Tokens of the sequence.
+     * @return Amount of restored tokens, i.e. context size for evaluation of
+     *         the remaining tokens.
+     */
+    size_t RestorePrefix(std::vector<Tokenizer::ID> const &tokens);
+
+    /**
+     * Add a sequence which has been evaluated from the start to the prefix
+     * cache.
+     *
+     * @param[in] tokens Tokens which keys and values are in memory.
+     */
+    void StorePrefix(std::vector<Tokenizer::ID> const &tokens);
+
+    llama_prefix_cache_stats GetPrefixCacheStats(void) const;
+
+    /**
+     * Progress of reading tensors in the background (see
+     * llama_load_params::async_load); loading is done at once otherwise.
+     */
+    llama_load_progress GetLoadProgress(void) const;
+
+    /**
+     * Wait until all tensors are read in the background.
+     *
+     * @return False if loading failed.
+     */
+    bool WaitLoaded(void);
+
+    /**
+     * @return Bytes of weight matrices (of layers and output) which are
+     *         streamed from memory by every evaluation of the model.
+     */
+    size_t GetWeightSize(void) const;
+
+    /**
+     * Start an empty sequence in paged key + value memory (see
+     * llama_load_params::kv_pages). Pages are taken from the free list as
+     * tokens are applied to the sequence.
+     *
+     * @return Identifier of the sequence.
+     */
+    int NewSequence(void);
+
+    /**
+     * Fork a sequence in paged memory. The fork shares the pages of the
+     * sequence until either of them writes to a shared page, hence forking
+     * costs neither memory nor a copy of keys and values.
+     *
+     * @param[in] seq Identifier of the sequence.
+     * @return Identifier of the new sequence or -1 if there is none to fork.
+     */
+    int ForkSequence(int seq);
+
+    /**
+     * Drop a sequence and return its pages to the free list.
+     *
+     * @param[in] seq Identifier of the sequence.
+     */
+    void FreeSequence(int seq);
+
+    /**
+     * Apply model to tokens following the ones of a sequence in paged memory
+     * and calculate logits of the next token.
+     *
+     * @param[in] seq               Identifier of the sequence.
+     * @param[in] tokens            New tokens of the sequence.
+     * @param[out] logits           Logits of the next predicted token.
+     * @param[in,out] mem_per_token Memory estimation needed for inference.
+     * @param[in] nothreads         Number of threads to use.
+     * @param[in] return_all_logits Return all logits.
+     * @return Status of successfull computations; fails if the sequence
+     *         would exceed the context or there are not enough free pages.
+     */
+    bool ApplySequence(int seq, std::vector<Tokenizer::ID> const &tokens,
+                       std::vector<float> &logits, size_t &mem_per_token,
+                       size_t nothreads = 1, bool return_all_logits = false);
+
+    /**
+     * Apply model to one batch of tokens of several sequences in paged
+     * memory, e.g. the next token of each branch of a parallel sampling.
+     * Each token follows the tokens of its sequence.
+     *
+     * @param[in] seqs              Sequence of each token.
+     * @param[in] tokens            New tokens.
+     * @param[out] logits           Logits of the next token after each token.
+     * @param[in,out] mem_per_token Memory estimation needed for inference.
+     * @param[in] nothreads         Number of threads to use.
+     * @return Status of successfull computations.
+     */
+    bool ApplySequences(std::vector<int> const &seqs,
+                        std::vector<Tokenizer::ID> const &tokens,
+                        std::vector<float> &logits, size_t &mem_per_token,
+                        size_t nothreads = 1);
+
+    /**
+     * Sample n completions of a prompt. The prompt is evaluated once and
+     * shared by the completions, which are extended in a single batch per
+     * token. Requires paged memory.
+     *
+     * @param[in] prompt    Prompt tokens.
+     * @param[in] n         Amount of completions.
+     * @param[in] n_predict Maximal amount of tokens of a completion.
+     * @param[in] sampling  Sampling parameters.
+     * @param[in,out] rng   Random number generator.
+     * @param[in] nothreads Number of threads to use.
+     * @return Tokens of the completions (without end of sequence).
+     */
+    std::vector<std::vector<Tokenizer::ID>>
+    SampleParallel(std::vector<Tokenizer::ID> const &prompt, size_t n,
+                   size_t n_predict, llama_sampling_params const &sampling,
+                   std::mt19937 &rng, size_t nothreads = 1);
+
+    /**
+     * Find the completion of a prompt with the highest log-probability by
+     * beam search. Beams share pages of their common prefix and are
+     * extended in a single batch per token. Requires paged memory.
+     *
+     * @param[in] prompt    Prompt tokens.
+     * @param[in] n_beams   Amount of beams.
+     * @param[in] n_predict Maximal amount of tokens of the completion.
+     * @param[in] nothreads Number of threads to use.
+     * @return Tokens of the completion (without end of sequence).
+     */
+    std::vector<Tokenizer::ID> BeamSearch(std::vector<Tokenizer::ID> const &prompt,
+                                          size_t n_beams, size_t n_predict,
+                                          size_t nothreads = 1);
+
+    /**
+     * Sample a completion of a prompt by speculative decoding: a cheaper
+     * draft model proposes n_draft tokens which this model verifies in a
+     * single evaluation. Draft tokens are kept by rejection sampling, so the
+     * completion is distributed as if it was sampled from this model alone.
+     * Both models need the same vocabulary and a single context.
+     *
+     * @param[in] draft     Draft model (e.g. a smaller or quantized one).
+     * @param[in] prompt    Prompt tokens.
+     * @param[in] n_predict Maximal amount of tokens of the completion.
+     * @param[in] n_draft   Amount of tokens proposed per step.
+     * @param[in] sampling  Sampling parameters.
+     * @param[in,out] rng   Random number generator.
+     * @param[in] nothreads Number of threads to use.
+     * @return Tokens of the completion (without end of sequence).
+     */
+    std::vector<Tokenizer::ID>
+    GenerateSpeculative(LLaMA &draft, std::vector<Tokenizer::ID> const &prompt,
+                        size_t n_predict, size_t n_draft,
+                        llama_sampling_params const &sampling,
+                        std::mt19937 &rng, size_t nothreads = 1);
+
+    /**
+     * Sample a completion of a prompt by speculative decoding without a draft
+     * model: the continuation of the latest earlier occurrence of the last
+     * n-gram in prompt and output is proposed and verified in a single
+     * evaluation (as in GenerateSpeculative). Pays off when the output copies
+     * spans of the prompt, e.g. in summarisation or code editing.
+     *
+     * @param[in] prompt    Prompt tokens.
+     * @param[in] n_predict Maximal amount of tokens of the completion.
+     * @param[in] n_gram    Longest n-gram to look up (shorter ones are tried
+     *                      if there is no match).
+     * @param[in] n_draft   Maximal amount of tokens proposed per step.
+     * @param[in] sampling  Sampling parameters.
+     * @param[in,out] rng   Random number generator.
+     * @param[in] nothreads Number of threads to use.
+     * @return Tokens of the completion (without end of sequence).
+     */
+    std::vector<Tokenizer::ID>
+    GenerateLookup(std::vector<Tokenizer::ID> const &prompt, size_t n_predict,
+                   size_t n_gram, size_t n_draft,
+                   llama_sampling_params const &sampling, std::mt19937 &rng,
+                   size_t nothreads = 1);
+
+    /**
+     * @return Counters of speculative decoding with this model as target;
+     *         n_accepted / n_drafted is the acceptance rate.
+     */
+    llama_speculative_stats GetSpeculativeStats(void) const {
+        return speculative_stats_;
+    }
+
+    /**
+     * @return Amount of tokens of a sequence.
+     */
+    size_t GetSequenceSize(int seq) const;
+
+    /**
+     * @return Amount of unused pages of paged memory.
+     */
+    size_t GetFreePages(void) const {
+        return model_->kv_pages.free.size();
+    }
+
     llama_hparams GetHParams(void) const {
         return model_->hparams;
     }
@@ -140,7 +740,10 @@ public:
 
     static std::shared_ptr<LLaMA> Load(std::string const &path,
                                        size_t context_size,
-                                       DType dtype = ggml_type::GGML_TYPE_F32);
+                                       DType dtype = ggml_type::GGML_TYPE_F16);
+
+    static std::shared_ptr<LLaMA> Load(std::string const &path,
+                                       llama_load_params const &params);
 };
 
 /**
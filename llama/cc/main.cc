@@ -83,26 +83,6 @@ void sigint_handler(int signo) {
 }
 #endif
 
-const char * llama_print_system_info(void) {
-    static std::string s;
-
-    s  = "";
-    s += "AVX = "       + std::to_string(ggml_cpu_has_avx())       + " | ";
-    s += "AVX2 = "      + std::to_string(ggml_cpu_has_avx2())      + " | ";
-    s += "AVX512 = "    + std::to_string(ggml_cpu_has_avx512())    + " | ";
-    s += "FMA = "       + std::to_string(ggml_cpu_has_fma())       + " | ";
-    s += "NEON = "      + std::to_string(ggml_cpu_has_neon())      + " | ";
-    s += "ARM_FMA = "   + std::to_string(ggml_cpu_has_arm_fma())   + " | ";
-    s += "F16C = "      + std::to_string(ggml_cpu_has_f16c())      + " | ";
-    s += "FP16_VA = "   + std::to_string(ggml_cpu_has_fp16_va())   + " | ";
-    s += "WASM_SIMD = " + std::to_string(ggml_cpu_has_wasm_simd()) + " | ";
-    s += "BLAS = "      + std::to_string(ggml_cpu_has_blas())      + " | ";
-    s += "SSE3 = "      + std::to_string(ggml_cpu_has_sse3())      + " | ";
-    s += "VSX = "       + std::to_string(ggml_cpu_has_vsx())       + " | ";
-
-    return s.c_str();
-}
-
 int main(int argc, char ** argv) {
     ggml_time_init();
     const int64_t t_main_start_us = ggml_time_us();
@@ -144,8 +124,32 @@ int main(int argc, char ** argv) {
     // load the model
     {
         const int64_t t_start_us = ggml_time_us();
-        auto memory_type = params.memory_f16 ? GGML_TYPE_F16 : GGML_TYPE_F32;
-        model = llama::LLaMA::Load(params.model, params.n_ctx, memory_type);
+        ggml_type memory_type;
+        if (params.memory_type == "f32") {
+            memory_type = GGML_TYPE_F32;
+        } else if (params.memory_type == "f16") {
+            memory_type = GGML_TYPE_F16;
+        } else if (params.memory_type == "q8_0") {
+            memory_type = GGML_TYPE_Q8_0;
+        } else {
+            fprintf(stderr, "%s: unknown memory type '%s'\n", __func__, params.memory_type.c_str());
+            return 1;
+        }
+        llama_load_params load_params;
+        load_params.n_ctx = params.n_ctx;
+        load_params.n_parts = params.n_parts;
+        load_params.memory_type = memory_type;
+        load_params.async_load = params.async_load;
+        load_params.huge_pages = params.huge_pages;
+        load_params.mlock = params.mlock;
+        load_params.numa = params.numa;
+        load_params.repack_rows = params.repack_rows;
+        if (params.perplexity && params.ppl_batch > 1) {
+            // windows evaluated together are sequences of paged memory
+            load_params.kv_pages = params.ppl_batch *
+                ((params.n_ctx + load_params.kv_page_size - 1) / load_params.kv_page_size);
+        }
+        model = llama::LLaMA::Load(params.model, load_params);
         if (!model) {
             fprintf(stderr, "%s: failed to load model from '%s'\n", __func__, params.model.c_str());
             return 1;
@@ -165,14 +169,18 @@ int main(int argc, char ** argv) {
     std::vector<float> logits;
 
     // determine the required inference memory per token:
-    size_t mem_per_token = 0;
-    model->Apply({0, 1, 2, 3}, 0, logits, mem_per_token, params.n_threads);
-
     if (params.perplexity) {
-        model->CalcPerplexity(params.prompt, mem_per_token, params.n_ctx, params.n_threads);
-        exit(0);
+        llama_perplexity_params ppl_params;
+        ppl_params.n_stride = params.ppl_stride;
+        ppl_params.n_batch = params.ppl_batch;
+        ppl_params.nll_path = params.ppl_nll;
+        const double ppl = model->CalcPerplexity(params.prompt, ppl_params, params.n_threads);
+        exit(std::isnan(ppl) ? 1 : 0);
     }
 
+    size_t mem_per_token = 0;
+    model->Apply({0, 1, 2, 3}, 0, logits, mem_per_token, params.n_threads);
+
     int n_past = 0;
 
     int64_t t_sample_us  = 0;
@@ -183,7 +191,11 @@ int main(int argc, char ** argv) {
     // tokenize the prompt
     std::vector<llama_vocab::id> embd_inp = tokenizer->Encode(params.prompt, true);
 
-    params.n_predict = std::min(params.n_predict, model->GetHParams().n_ctx - (int) embd_inp.size());
+    const int n_ctx = model->GetHParams().n_ctx;
+
+    if (params.n_keep < 0 || params.n_keep > (int) embd_inp.size()) {
+        params.n_keep = (int) embd_inp.size();
+    }
 
     // prefix & suffix for instruct mode
     const std::vector<llama_vocab::id> inp_pfx = tokenizer->Encode("\n\n### Instruction:\n\n", true);
@@ -235,6 +247,58 @@ int main(int argc, char ** argv) {
     std::vector<llama_vocab::id> last_n_tokens(last_n_size);
     std::fill(last_n_tokens.begin(), last_n_tokens.end(), 0);
 
+    // speculative decoding generates the whole completion at once
+    if (!params.draft_model.empty() || params.lookup_ngram > 0) {
+        if (params.interactive) {
+            fprintf(stderr, "%s: speculative decoding is not interactive\n", __func__);
+            return 1;
+        }
+
+        std::shared_ptr<llama::LLaMA> draft;
+        if (!params.draft_model.empty()) {
+            llama_load_params draft_params;
+            draft_params.n_ctx = params.n_ctx;
+            draft = llama::LLaMA::Load(params.draft_model, draft_params);
+            if (!draft) {
+                fprintf(stderr, "%s: failed to load draft model from '%s'\n", __func__, params.draft_model.c_str());
+                return 1;
+            }
+        }
+
+        llama_sampling_params sampling;
+        sampling.top_k = params.top_k;
+        sampling.top_p = params.top_p;
+        sampling.temp = params.temp;
+        sampling.repeat_penalty = params.repeat_penalty;
+        sampling.repeat_last_n = params.repeat_last_n;
+
+        const int64_t t_start_predict_us = ggml_time_us();
+        const auto output = draft
+            ? model->GenerateSpeculative(
+                *draft, embd_inp, params.n_predict, params.n_draft, sampling, rng, params.n_threads)
+            : model->GenerateLookup(
+                embd_inp, params.n_predict, params.lookup_ngram, params.n_draft, sampling, rng, params.n_threads);
+        t_predict_us = ggml_time_us() - t_start_predict_us;
+
+        for (auto id : embd_inp) {
+            printf("%s", tokenizer->Decode(id).c_str());
+        }
+        for (auto id : output) {
+            printf("%s", tokenizer->Decode(id).c_str());
+        }
+        fflush(stdout);
+
+        const auto stats = model->GetSpeculativeStats();
+        fprintf(stderr, "\n\n");
+        fprintf(stderr, "%s: drafted = %zu, accepted = %zu (%.1f%%), %.2f tokens per target evaluation\n", __func__,
+                stats.n_drafted, stats.n_accepted, 100.0 * stats.n_accepted / std::max<size_t>(1, stats.n_drafted),
+                (double) stats.n_generated / std::max<size_t>(1, stats.n_rounds));
+        fprintf(stderr, "%s:     load time = %8.2f ms\n", __func__, t_load_us/1000.0f);
+        fprintf(stderr, "%s:  predict time = %8.2f ms / %.2f ms per token\n", __func__,
+                t_predict_us/1000.0f, t_predict_us/1000.0f/std::max<size_t>(1, output.size()));
+        return 0;
+    }
+
     if (params.interactive) {
         fprintf(stderr, "== Running in interactive mode. ==\n"
 #if defined (__unix__) || (defined (__APPLE__) && defined (__MACH__)) || defined (_WIN32)
@@ -263,9 +327,57 @@ int main(int argc, char ** argv) {
     // the first thing we will do is to output the prompt, so set color accordingly
     set_console_state(CONSOLE_STATE_PROMPT);
 
+    // restore the longest prefix of the prompt from the session file; the last
+    // prompt token is evaluated in any case to get its logits
+    bool session_saved = params.session.empty();
+    {
+        std::vector<llama_vocab::id> session_tokens;
+        std::mt19937 session_rng;
+        if (!session_saved && model->LoadState(params.session, session_tokens, &session_rng)) {
+            size_t n_match = 0;
+            while (n_match < session_tokens.size() && n_match + 1 < embd_inp.size() &&
+                   session_tokens[n_match] == embd_inp[n_match]) {
+                n_match++;
+            }
+
+            // the same prompt again (all but its last token are restored):
+            // continue sampling where the session stopped, there is nothing
+            // new to save; a prompt extending the session is saved anew
+            if (session_tokens == embd_inp) {
+                rng = session_rng;
+                session_saved = true;
+            }
+
+            for (size_t i = 0; i < n_match; i++) {
+                last_n_tokens.erase(last_n_tokens.begin());
+                last_n_tokens.push_back(embd_inp[i]);
+                printf("%s", tokenizer->Decode(embd_inp[i]).c_str());
+            }
+            fflush(stdout);
+
+            n_past = n_match;
+            input_consumed = n_match;
+
+            fprintf(stderr, "%s: restored %zu of %zu prompt tokens from session '%s'\n",
+                    __func__, n_match, embd_inp.size(), params.session.c_str());
+        }
+    }
+
     while (remaining_tokens > 0 || params.interactive) {
         // predict
         if (embd.size() > 0) {
+            // out of context: drop half of the tokens after the first n_keep
+            // and keep going with the remaining ones without evaluating them again
+            if (n_past + (int) embd.size() > n_ctx) {
+                const int n_discard = (n_past - params.n_keep)/2;
+                if (n_discard < 1 || n_past - n_discard + (int) embd.size() > n_ctx) {
+                    fprintf(stderr, "%s: context of %d tokens is too small to continue\n", __func__, n_ctx);
+                    return 1;
+                }
+
+                n_past = model->ShiftContext(params.n_keep, n_discard, n_past, params.n_threads);
+            }
+
             const int64_t t_start_us = ggml_time_us();
 
             if (!model->Apply(embd, n_past, logits, mem_per_token, params.n_threads)) {
@@ -280,6 +392,15 @@ int main(int argc, char ** argv) {
         embd.clear();
 
         if ((int) embd_inp.size() <= input_consumed) {
+            // the prompt is evaluated, keep it for the next run
+            if (!session_saved) {
+                std::vector<llama_vocab::id> session_tokens(embd_inp.begin(), embd_inp.begin() + n_past);
+                if (!model->SaveState(params.session, session_tokens, &rng)) {
+                    fprintf(stderr, "%s: failed to save session '%s'\n", __func__, params.session.c_str());
+                }
+                session_saved = true;
+            }
+
             // out of user input, sample next token
             const float top_k = params.top_k;
             const float top_p = params.top_p;
@@ -0,0 +1,32 @@
+#include <cstdio>
+#include <cstring>
+#include <string>
+
+#include <llama/cc/conversion.h>
+#include <llama/cc/ggml.h>
+
+int main(int argc, char ** argv) {
+    ggml_time_init();
+    const bool indexed = argc == 4 && strcmp(argv[3], "--indexed") == 0;
+    if (argc != 3 && !indexed) {
+        fprintf(stderr, "usage: %s model.bin model-merged.bin [--indexed]\n", argv[0]);
+        fprintf(stderr, "  merges model.bin, model.bin.1, ... into a single part\n");
+        fprintf(stderr, "  --indexed  write the indexed format with aligned tensors\n");
+        return 1;
+    }
+
+    const std::string fname_inp = argv[1];
+    const std::string fname_out = argv[2];
+
+    const int64_t t_start_us = ggml_time_us();
+
+    if (!llama::MergeModel(fname_inp, fname_out, indexed)) {
+        fprintf(stderr, "%s: failed to merge model from '%s'\n", __func__, fname_inp.c_str());
+        return 1;
+    }
+
+    printf("\n");
+    printf("%s: merge time = %8.2f ms\n", __func__, (ggml_time_us() - t_start_us)/1000.0f);
+
+    return 0;
+}
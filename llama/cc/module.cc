@@ -1,5 +1,8 @@
+#include <llama/cc/checkpoint.h>
+#include <llama/cc/conversion.h>
 #include <llama/cc/llama.h>
 #include <llama/cc/quantization.h>
+#include <pybind11/numpy.h>
 #include <pybind11/pybind11.h>
 #include <pybind11/stl.h>
 
@@ -27,6 +30,14 @@ PYBIND11_MODULE(_llama, m) {
         .value("I32", ggml_type::GGML_TYPE_I32)
         .value("F16", ggml_type::GGML_TYPE_F16)
         .value("F32", ggml_type::GGML_TYPE_F32)
+        .value("Q8_0", ggml_type::GGML_TYPE_Q8_0)
+        .value("Q4_0_R4", ggml_type::GGML_TYPE_Q4_0_R4)
+        .value("Q4_0_R8", ggml_type::GGML_TYPE_Q4_0_R8)
+        .export_values();
+
+    py::enum_<llama_pooling>(m, "Pooling")
+        .value("MEAN", llama_pooling::LLAMA_POOLING_MEAN)
+        .value("LAST", llama_pooling::LLAMA_POOLING_LAST)
         .export_values();
 
     py::class_<llama::Tokenizer>(m, "Tokenizer")
@@ -34,12 +45,209 @@ PYBIND11_MODULE(_llama, m) {
         .def("encode", &llama::Tokenizer::Encode)
         .def_static("load", &llama::Tokenizer::Load);
 
+    py::class_<llama_load_params>(m, "LoadParams")
+        .def(py::init<>())
+        .def_readwrite("n_ctx", &llama_load_params::n_ctx)
+        .def_readwrite("n_parts", &llama_load_params::n_parts)
+        .def_readwrite("memory_type", &llama_load_params::memory_type)
+        .def_readwrite("fuse_qkv", &llama_load_params::fuse_qkv)
+        .def_readwrite("fuse_ffn", &llama_load_params::fuse_ffn)
+        .def_readwrite("kv_pages", &llama_load_params::kv_pages)
+        .def_readwrite("kv_page_size", &llama_load_params::kv_page_size)
+        .def_readwrite("n_load_threads", &llama_load_params::n_load_threads)
+        .def_readwrite("async_load", &llama_load_params::async_load)
+        .def_readwrite("huge_pages", &llama_load_params::huge_pages)
+        .def_readwrite("mlock", &llama_load_params::mlock)
+        .def_readwrite("numa", &llama_load_params::numa)
+        .def_readwrite("repack_rows", &llama_load_params::repack_rows);
+
+    py::class_<llama_load_progress>(m, "LoadProgress")
+        .def_readonly("n_bytes", &llama_load_progress::n_bytes)
+        .def_readonly("n_bytes_total", &llama_load_progress::n_bytes_total)
+        .def_readonly("n_layers_ready", &llama_load_progress::n_layers_ready)
+        .def_readonly("n_layers", &llama_load_progress::n_layers)
+        .def_readonly("done", &llama_load_progress::done)
+        .def_readonly("failed", &llama_load_progress::failed);
+
+    py::class_<llama_sampling_params>(m, "SamplingParams")
+        .def(py::init<>())
+        .def_readwrite("top_k", &llama_sampling_params::top_k)
+        .def_readwrite("top_p", &llama_sampling_params::top_p)
+        .def_readwrite("temp", &llama_sampling_params::temp)
+        .def_readwrite("repeat_penalty", &llama_sampling_params::repeat_penalty)
+        .def_readwrite("repeat_last_n", &llama_sampling_params::repeat_last_n);
+
+    py::class_<llama_score>(m, "Score")
+        .def_readonly("logprobs", &llama_score::logprobs)
+        .def_readonly("total", &llama_score::total);
+
+    py::class_<llama_perplexity_params>(m, "PerplexityParams")
+        .def(py::init<>())
+        .def_readwrite("n_window", &llama_perplexity_params::n_window)
+        .def_readwrite("n_stride", &llama_perplexity_params::n_stride)
+        .def_readwrite("n_batch", &llama_perplexity_params::n_batch)
+        .def_readwrite("max_kq_size", &llama_perplexity_params::max_kq_size)
+        .def_readwrite("nll_path", &llama_perplexity_params::nll_path);
+
+    py::class_<llama_speculative_stats>(m, "SpeculativeStats")
+        .def_readonly("n_rounds", &llama_speculative_stats::n_rounds)
+        .def_readonly("n_drafted", &llama_speculative_stats::n_drafted)
+        .def_readonly("n_accepted", &llama_speculative_stats::n_accepted)
+        .def_readonly("n_generated", &llama_speculative_stats::n_generated);
+
+    py::class_<llama_prefix_cache_stats>(m, "PrefixCacheStats")
+        .def_readonly("n_lookups", &llama_prefix_cache_stats::n_lookups)
+        .def_readonly("n_hits", &llama_prefix_cache_stats::n_hits)
+        .def_readonly("n_tokens", &llama_prefix_cache_stats::n_tokens)
+        .def_readonly("n_tokens_reused",
+                      &llama_prefix_cache_stats::n_tokens_reused)
+        .def_readonly("n_blocks", &llama_prefix_cache_stats::n_blocks)
+        .def_readonly("n_evictions", &llama_prefix_cache_stats::n_evictions)
+        .def_readonly("size", &llama_prefix_cache_stats::size);
+
     py::class_<llama::LLaMA>(m, "LLaMA")
-        .def("calc_perplexity", &llama::LLaMA::CalcPerplexity)
+        .def("calc_perplexity", &llama::LLaMA::CalcPerplexity, py::arg("text"),
+             py::arg("params") = llama_perplexity_params{},
+             py::arg("nothreads") = 1)
+        .def("score", &llama::LLaMA::Score, py::arg("context"),
+             py::arg("continuations"), py::arg("nothreads") = 1)
+        .def(
+            "embed",
+            [](llama::LLaMA &self,
+               std::vector<std::vector<llama::Tokenizer::ID>> const &inputs,
+               llama_pooling pooling, size_t nothreads) {
+                auto embd = std::make_unique<std::vector<float>>(
+                    self.Embed(inputs, pooling, nothreads));
+                if (embd->empty() && !inputs.empty()) {
+                    throw std::runtime_error("failed to compute embeddings");
+                }
+                // the array owns the embeddings without copying them
+                const size_t n_embd =
+                    inputs.empty() ? 0 : embd->size() / inputs.size();
+                float *data = embd->data();
+                py::capsule owner(embd.release(), [](void *ptr) {
+                    delete static_cast<std::vector<float> *>(ptr);
+                });
+                return py::array_t<float>(
+                    {inputs.size(), n_embd},
+                    {n_embd * sizeof(float), sizeof(float)}, data, owner);
+            },
+            py::arg("inputs"), py::arg("pooling") = LLAMA_POOLING_MEAN,
+            py::arg("nothreads") = 1)
         .def("estimate_mem_per_token", &llama::LLaMA::EstimateMemPerToken)
         .def("eval", &llama::LLaMA::Eval)
         .def("get_tokenizer", &llama::LLaMA::GetTokenizer)
-        .def_static("load", &llama::LLaMA::Load);
+        .def("set_prefix_cache", &llama::LLaMA::SetPrefixCache,
+             py::arg("capacity"), py::arg("block_size") = 64)
+        .def("restore_prefix", &llama::LLaMA::RestorePrefix)
+        .def("store_prefix", &llama::LLaMA::StorePrefix)
+        .def("prefix_cache_stats", &llama::LLaMA::GetPrefixCacheStats)
+        .def("load_progress", &llama::LLaMA::GetLoadProgress)
+        .def("wait_loaded", &llama::LLaMA::WaitLoaded,
+             py::call_guard<py::gil_scoped_release>())
+        .def("weight_size", &llama::LLaMA::GetWeightSize)
+        .def(
+            "save_state",
+            [](llama::LLaMA const &self, std::string const &path,
+               std::vector<llama::Tokenizer::ID> const &tokens) {
+                return self.SaveState(path, tokens);
+            },
+            py::arg("path"), py::arg("tokens"))
+        .def(
+            "load_state",
+            [](llama::LLaMA &self, std::string const &path) -> py::object {
+                std::vector<llama::Tokenizer::ID> tokens;
+                if (!self.LoadState(path, tokens)) {
+                    return py::none();
+                }
+                return py::cast(tokens);
+            },
+            py::arg("path"))
+        .def("new_sequence", &llama::LLaMA::NewSequence)
+        .def("fork_sequence", &llama::LLaMA::ForkSequence)
+        .def("free_sequence", &llama::LLaMA::FreeSequence)
+        .def(
+            "eval_sequence",
+            [](llama::LLaMA &self, int seq,
+               std::vector<llama::Tokenizer::ID> const &tokens,
+               size_t nothreads, bool return_all_logits) {
+                std::vector<float> logits;
+                size_t mem_per_token = 0;
+                bool ok = self.ApplySequence(seq, tokens, logits, mem_per_token,
+                                             nothreads, return_all_logits);
+                return ok ? logits : std::vector<float>{};
+            },
+            py::arg("seq"), py::arg("tokens"), py::arg("nothreads") = 1,
+            py::arg("return_all_logits") = false)
+        .def(
+            "eval_sequences",
+            [](llama::LLaMA &self, std::vector<int> const &seqs,
+               std::vector<llama::Tokenizer::ID> const &tokens,
+               size_t nothreads) {
+                std::vector<float> logits;
+                size_t mem_per_token = 0;
+                bool ok = self.ApplySequences(seqs, tokens, logits,
+                                              mem_per_token, nothreads);
+                return ok ? logits : std::vector<float>{};
+            },
+            py::arg("seqs"), py::arg("tokens"), py::arg("nothreads") = 1)
+        .def(
+            "sample_parallel",
+            [](llama::LLaMA &self,
+               std::vector<llama::Tokenizer::ID> const &prompt, size_t n,
+               size_t n_predict, llama_sampling_params const &sampling,
+               uint32_t seed, size_t nothreads) {
+                std::mt19937 rng(seed);
+                return self.SampleParallel(prompt, n, n_predict, sampling, rng,
+                                           nothreads);
+            },
+            py::arg("prompt"), py::arg("n"), py::arg("n_predict"),
+            py::arg("sampling") = llama_sampling_params{},
+            py::arg("seed") = 0, py::arg("nothreads") = 1)
+        .def("beam_search", &llama::LLaMA::BeamSearch, py::arg("prompt"),
+             py::arg("n_beams"), py::arg("n_predict"), py::arg("nothreads") = 1)
+        .def(
+            "generate_speculative",
+            [](llama::LLaMA &self, llama::LLaMA &draft,
+               std::vector<llama::Tokenizer::ID> const &prompt,
+               size_t n_predict, size_t n_draft,
+               llama_sampling_params const &sampling, uint32_t seed,
+               size_t nothreads) {
+                std::mt19937 rng(seed);
+                return self.GenerateSpeculative(draft, prompt, n_predict,
+                                                n_draft, sampling, rng,
+                                                nothreads);
+            },
+            py::arg("draft"), py::arg("prompt"), py::arg("n_predict"),
+            py::arg("n_draft") = 4,
+            py::arg("sampling") = llama_sampling_params{},
+            py::arg("seed") = 0, py::arg("nothreads") = 1)
+        .def(
+            "generate_lookup",
+            [](llama::LLaMA &self,
+               std::vector<llama::Tokenizer::ID> const &prompt,
+               size_t n_predict, size_t n_gram, size_t n_draft,
+               llama_sampling_params const &sampling, uint32_t seed,
+               size_t nothreads) {
+                std::mt19937 rng(seed);
+                return self.GenerateLookup(prompt, n_predict, n_gram, n_draft,
+                                           sampling, rng, nothreads);
+            },
+            py::arg("prompt"), py::arg("n_predict"), py::arg("n_gram") = 3,
+            py::arg("n_draft") = 4,
+            py::arg("sampling") = llama_sampling_params{},
+            py::arg("seed") = 0, py::arg("nothreads") = 1)
+        .def("speculative_stats", &llama::LLaMA::GetSpeculativeStats)
+        .def("sequence_size", &llama::LLaMA::GetSequenceSize)
+        .def("free_pages", &llama::LLaMA::GetFreePages)
+        .def_static("load",
+                    static_cast<std::shared_ptr<llama::LLaMA> (*)(
+                        std::string const &, size_t, llama::DType)>(
+                        &llama::LLaMA::Load))
+        .def_static("load",
+                    static_cast<std::shared_ptr<llama::LLaMA> (*)(
+                        std::string const &, llama_load_params const &)>(
+                        &llama::LLaMA::Load));
 
     m.def("sample_next_token", &llama::SampleNextToken);
 
@@ -51,4 +259,32 @@ PYBIND11_MODULE(_llama, m) {
         ":param dst: Path to quantized checkpoint.\n"
         ":param dtype: FP-type code: GGML_TYPE_Q4_0 (2), GGML_TYPE_Q4_1 (3).\n",
         py::arg("src"), py::arg("dst"), py::arg("dtype"));
+
+    m.def(
+        "convert_checkpoint", &llama::ConvertCheckpoint,
+        "Convert PyTorch checkpoint to GGLM format in a single pass.\n"
+        "\n"
+        ":param model_dir: Directory with params.json and consolidated.XX.pth;\n"
+        "    tokenizer.model is expected in its parent directory.\n"
+        ":param dtype: Type of 2-d tensors: F32, F16, Q4_0 or Q4_1.\n"
+        ":param nothreads: Number of conversion threads (all cores if 0).\n",
+        py::arg("model_dir"), py::arg("dtype") = GGML_TYPE_F16,
+        py::arg("nothreads") = 0);
+
+    m.def(
+        "convert_model", &llama::ConvertModel,
+        "Convert single-part checkpoint in GGLM format to indexed one.\n"
+        "\n"
+        ":param src: Path to original checkpoint.\n"
+        ":param dst: Path to indexed checkpoint with aligned tensors.\n",
+        py::arg("src"), py::arg("dst"));
+
+    m.def(
+        "merge_model", &llama::MergeModel,
+        "Merge parts src, src.1, ... of checkpoint in GGLM format into one.\n"
+        "\n"
+        ":param src: Path to first part of original checkpoint.\n"
+        ":param dst: Path to single-part checkpoint.\n"
+        ":param indexed: Write indexed checkpoint with aligned tensors.\n",
+        py::arg("src"), py::arg("dst"), py::arg("indexed") = false);
 }
@@ -1,4 +1,5 @@
 #include "utils.h"
+#include "ggml.h"
 
 #include <cassert>
 #include <cstring>
@@ -50,8 +51,20 @@ bool gpt_params_parse(int argc, char ** argv, gpt_params & params) {
             params.top_k = std::stoi(argv[++i]);
         } else if (arg == "-c" || arg == "--ctx_size") {
             params.n_ctx = std::stoi(argv[++i]);
+        } else if (arg == "--keep") {
+            params.n_keep = std::stoi(argv[++i]);
         } else if (arg == "--memory_f16") {
-            params.memory_f16 = true;
+            params.memory_type = "f16";
+        } else if (arg == "--session") {
+            params.session = argv[++i];
+        } else if (arg == "--draft_model") {
+            params.draft_model = argv[++i];
+        } else if (arg == "--n_draft") {
+            params.n_draft = std::stoi(argv[++i]);
+        } else if (arg == "--lookup_ngram") {
+            params.lookup_ngram = std::stoi(argv[++i]);
+        } else if (arg == "--memory_type") {
+            params.memory_type = argv[++i];
         } else if (arg == "--top_p") {
             params.top_p = std::stof(argv[++i]);
         } else if (arg == "--temp") {
@@ -74,10 +87,26 @@ bool gpt_params_parse(int argc, char ** argv, gpt_params & params) {
             params.antiprompt.push_back(argv[++i]);
         } else if (arg == "--perplexity") {
             params.perplexity = true;
+        } else if (arg == "--ppl_stride") {
+            params.ppl_stride = std::stoi(argv[++i]);
+        } else if (arg == "--ppl_batch") {
+            params.ppl_batch = std::stoi(argv[++i]);
+        } else if (arg == "--ppl_nll") {
+            params.ppl_nll = argv[++i];
         } else if (arg == "--ignore-eos") {
             params.ignore_eos = true;
         } else if (arg == "--n_parts") {
             params.n_parts = std::stoi(argv[++i]);
+        } else if (arg == "--async_load") {
+            params.async_load = true;
+        } else if (arg == "--huge_pages") {
+            params.huge_pages = true;
+        } else if (arg == "--mlock") {
+            params.mlock = true;
+        } else if (arg == "--numa") {
+            params.numa = true;
+        } else if (arg == "--repack") {
+            params.repack_rows = std::stoi(argv[++i]);
         } else if (arg == "-h" || arg == "--help") {
             gpt_print_usage(argc, argv, params);
             exit(0);
@@ -117,12 +146,28 @@ void gpt_print_usage(int /*argc*/, char ** argv, const gpt_params & params) {
     fprintf(stderr, "  --repeat_last_n N     last n tokens to consider for penalize (default: %d)\n", params.repeat_last_n);
     fprintf(stderr, "  --repeat_penalty N    penalize repeat sequence of tokens (default: %.1f)\n", params.repeat_penalty);
     fprintf(stderr, "  -c N, --ctx_size N    size of the prompt context (default: %d)\n", params.n_ctx);
+    fprintf(stderr, "  --keep N              prompt tokens to keep when the context is full, -1 = all (default: %d)\n", params.n_keep);
     fprintf(stderr, "  --ignore-eos          ignore end of stream token and continue generating\n");
-    fprintf(stderr, "  --memory_f16          use f16 instead of f32 for memory key+value\n");
+    fprintf(stderr, "  --session FNAME       file to cache the evaluated prompt in across runs\n");
+    fprintf(stderr, "  --draft_model FNAME   draft model for speculative decoding (default: none)\n");
+    fprintf(stderr, "  --n_draft N           tokens proposed per speculative step (default: %d)\n", params.n_draft);
+    fprintf(stderr, "  --lookup_ngram N      speculate by looking up n-grams of prompt and output (default: 0 = off)\n");
+    fprintf(stderr, "  --memory_type T       type of memory key+value: f32, f16 or q8_0 (default: %s)\n", params.memory_type.c_str());
+    fprintf(stderr, "  --memory_f16          same as --memory_type f16\n");
     fprintf(stderr, "  --temp N              temperature (default: %.1f)\n", params.temp);
     fprintf(stderr, "  --n_parts N           number of model parts (default: -1 = determine from dimensions)\n");
+    fprintf(stderr, "  --async_load          read weights in the background, evaluation waits for each layer\n");
+    fprintf(stderr, "  --huge_pages          back weights and key + value memory with huge pages\n");
+    fprintf(stderr, "  --mlock               lock weights and key + value memory in RAM\n");
+    fprintf(stderr, "  --numa                pin threads to NUMA nodes and place weight rows on the nodes using them\n");
+    fprintf(stderr, "  --repack N            interleave q4_0 weights by 4 or 8 rows for multi-row kernels (default: 0 = off);\n");
+    fprintf(stderr, "                        targets matvec (decoding one token), batches of prompt tokens can be slower\n");
     fprintf(stderr, "  -b N, --batch_size N  batch size for prompt processing (default: %d)\n", params.n_batch);
     fprintf(stderr, "  --perplexity          compute perplexity over the prompt\n");
+    fprintf(stderr, "  --ppl_stride N        tokens between perplexity windows (default: context size)\n");
+    fprintf(stderr, "  --ppl_batch N         perplexity windows per evaluation (default: %d); the attention\n", params.ppl_batch);
+    fprintf(stderr, "                        scores take N^2 times the memory, N is lowered to keep them within 256 MiB\n");
+    fprintf(stderr, "  --ppl_nll FNAME       write the negative log-likelihood of each scored token\n");
     fprintf(stderr, "  -m FNAME, --model FNAME\n");
     fprintf(stderr, "                        model path (default: %s)\n", params.model.c_str());
     fprintf(stderr, "\n");
@@ -147,6 +192,26 @@ std::string gpt_random_prompt(std::mt19937 & rng) {
     return "The";
 }
 
+const char * llama_print_system_info(void) {
+    static std::string s;
+
+    s  = "";
+    s += "AVX = "       + std::to_string(ggml_cpu_has_avx())       + " | ";
+    s += "AVX2 = "      + std::to_string(ggml_cpu_has_avx2())      + " | ";
+    s += "AVX512 = "    + std::to_string(ggml_cpu_has_avx512())    + " | ";
+    s += "FMA = "       + std::to_string(ggml_cpu_has_fma())       + " | ";
+    s += "NEON = "      + std::to_string(ggml_cpu_has_neon())      + " | ";
+    s += "ARM_FMA = "   + std::to_string(ggml_cpu_has_arm_fma())   + " | ";
+    s += "F16C = "      + std::to_string(ggml_cpu_has_f16c())      + " | ";
+    s += "FP16_VA = "   + std::to_string(ggml_cpu_has_fp16_va())   + " | ";
+    s += "WASM_SIMD = " + std::to_string(ggml_cpu_has_wasm_simd()) + " | ";
+    s += "BLAS = "      + std::to_string(ggml_cpu_has_blas())      + " | ";
+    s += "SSE3 = "      + std::to_string(ggml_cpu_has_sse3())      + " | ";
+    s += "VSX = "       + std::to_string(ggml_cpu_has_vsx())       + " | ";
+
+    return s.c_str();
+}
+
 void replace(std::string & str, const std::string & needle, const std::string & replacement) {
     size_t pos = 0;
     while ((pos = str.find(needle, pos)) != std::string::npos) {
@@ -155,6 +220,37 @@ void replace(std::string & str, const std::string & needle, const std::string &
     }
 }
 
+int llama_tensor_split_type(const std::string & name) {
+    // split_type = 0:
+    // regex:
+    //   - tok_embeddings.*
+    //   - layers.*.attention.wo.weight
+    //   - layers.*.feed_forward.w2.weight
+
+    // split_type = 1:
+    // regex:
+    //   - output.*
+    //   - layers.*.attention.wq.weight
+    //   - layers.*.attention.wk.weight
+    //   - layers.*.attention.wv.weight
+    //   - layers.*.feed_forward.w1.weight
+    //   - layers.*.feed_forward.w3.weight
+    if (name.find("tok_embeddings") != std::string::npos) {
+        return 0;
+    } else if (name.find("layers") != std::string::npos) {
+        if (name.find("attention.wo.weight") != std::string::npos) {
+            return 0;
+        } else if (name.find("feed_forward.w2.weight") != std::string::npos) {
+            return 0;
+        } else {
+            return 1;
+        }
+    } else if (name.find("output") != std::string::npos) {
+        return 1;
+    }
+    return 0;
+}
+
 std::unordered_map<std::string, int32_t> json_parse(const std::string & fname) {
     std::unordered_map<std::string, int32_t> result;
 
@@ -449,15 +545,14 @@ void sample_top_k(std::vector<std::pair<double, llama_vocab::id>> & logits_id, i
     logits_id.resize(top_k);
 }
 
-llama_vocab::id llama_sample_top_p_top_k(
+std::vector<std::pair<double, llama_vocab::id>> llama_sample_top_p_top_k_probs(
         const llama_vocab & vocab,
         const float * logits,
-        std::vector<llama_vocab::id> & last_n_tokens,
+        const std::vector<llama_vocab::id> & last_n_tokens,
         double repeat_penalty,
         int top_k,
         double top_p,
-        double temp,
-        std::mt19937 & rng) {
+        double temp) {
     int n_logits = vocab.id_to_token.size();
 
     std::vector<std::pair<double, llama_vocab::id>> logits_id;
@@ -528,10 +623,35 @@ llama_vocab::id llama_sample_top_p_top_k(
     //printf("\n\n");
     //exit(0);
 
+    for (int i = 0; i < (int) probs.size(); i++) {
+        logits_id[i].first = probs[i];
+    }
+
+    return logits_id;
+}
+
+llama_vocab::id llama_sample_top_p_top_k(
+        const llama_vocab & vocab,
+        const float * logits,
+        std::vector<llama_vocab::id> & last_n_tokens,
+        double repeat_penalty,
+        int top_k,
+        double top_p,
+        double temp,
+        std::mt19937 & rng) {
+    const auto probs_id = llama_sample_top_p_top_k_probs(
+            vocab, logits, last_n_tokens, repeat_penalty, top_k, top_p, temp);
+
+    std::vector<double> probs;
+    probs.reserve(probs_id.size());
+    for (const auto & kv : probs_id) {
+        probs.push_back(kv.first);
+    }
+
     std::discrete_distribution<> dist(probs.begin(), probs.end());
     int idx = dist(rng);
 
-    return logits_id[idx].second;
+    return probs_id[idx].second;
 }
 
 
@@ -19,6 +19,7 @@ struct gpt_params {
     int32_t repeat_last_n = 64;  // last n tokens to penalize
     int32_t n_parts       = -1;  // amount of model parts (-1 = determine from model dimensions)
     int32_t n_ctx         = 512; //context size
+    int32_t n_keep        = 0;   // prompt tokens to keep when the context is full (-1 = all)
 
     // sampling parameters
     int32_t top_k = 40;
@@ -30,17 +31,30 @@ struct gpt_params {
 
     std::string model  = "models/lamma-7B/ggml-model.bin"; // model path
     std::string prompt = "";
+    std::string session = ""; // file to restore the evaluated prompt from and save it to
+    std::string draft_model = ""; // draft model path for speculative decoding
+    int32_t n_draft = 4; // tokens proposed per speculative decoding step
+    int32_t lookup_ngram = 0; // n-gram size for prompt lookup decoding (0 = off)
 
     std::vector<std::string> antiprompt; // string upon seeing which more user input is prompted
 
-    bool memory_f16        = false; // use f16 instead of f32 for memory kv
+    std::string memory_type = "f16"; // type of memory kv: f32, f16 or q8_0
+
     bool random_prompt     = false; // do not randomize prompt if none provided
     bool use_color         = false; // use color to distinguish generations and inputs
     bool interactive       = false; // interactive mode
     bool interactive_start = false; // reverse prompt immediately
     bool instruct          = false; // instruction mode (used for Alpaca models)
     bool ignore_eos        = false; // do not stop generating after eos
+    bool async_load        = false; // read weights in the background while evaluating the prompt
+    bool huge_pages        = false; // back weights and key + value memory with huge pages
+    bool mlock             = false; // lock weights and key + value memory in RAM
+    bool numa              = false; // pin threads to NUMA nodes and place weights on them
+    int32_t repack_rows    = 0;     // interleave Q4_0 weights by 4 or 8 rows (0 = off)
     bool perplexity        = false; // compute perplexity over the prompt
+    int32_t ppl_stride     = 0;     // tokens between perplexity windows (0 = context size)
+    int32_t ppl_batch      = 1;     // perplexity windows per evaluation
+    std::string ppl_nll    = "";    // file to write the nll of each scored token to
 };
 
 bool gpt_params_parse(int argc, char ** argv, gpt_params & params);
@@ -49,13 +63,22 @@ void gpt_print_usage(int argc, char ** argv, const gpt_params & params);
 
 std::string gpt_random_prompt(std::mt19937 & rng);
 
+// features of the CPU ggml was built for
+const char * llama_print_system_info(void);
+
 //
 // Model file parsing
 //
 
 #define FILE_MAGIC_UNVERSIONED 0x67676d6c // pre-versioned files
 #define FILE_MAGIC 0x67676d66 // 'ggmf' in hex
-#define FILE_VERSION 1
+#define FILE_VERSION 1 // sequence of tensor records, possibly split into parts
+#define FILE_VERSION_INDEXED 2 // single file with tensor directory
+#define FILE_ALIGNMENT 32 // of tensor data in indexed files
+
+// how a 2-d tensor of a model is split into parts by its name:
+// 0 = by columns (every part holds a slice of each row), 1 = by rows
+int llama_tensor_split_type(const std::string & name);
 
 //
 // Vocab utils
@@ -101,6 +124,17 @@ llama_vocab::id llama_sample_top_p_top_k(
         double temp,
         std::mt19937 & rng);
 
+// probabilities of the tokens llama_sample_top_p_top_k samples from, in
+// descending order; all other tokens have probability zero
+std::vector<std::pair<double, llama_vocab::id>> llama_sample_top_p_top_k_probs(
+        const llama_vocab & vocab,
+        const float * logits,
+        const std::vector<llama_vocab::id> & last_n_tokens,
+        double repeat_penalty,
+        int top_k,
+        double top_p,
+        double temp);
+
 // filer to top K tokens from list of logits
 void sample_top_k(std::vector<std::pair<double, llama_vocab::id>> & logits_id, int top_k);
 
@@ -17,9 +17,14 @@ LOG_LEVELS = {
 }
 
 
-def convert(fp_type: int, model_dir: Path):
-    from .io import convert
-    convert(model_dir, fp_type)
+def convert(fp_type: str, threads: int, model_dir: Path):
+    from .conversion import convert
+    convert(model_dir, fp_type, threads)
+
+
+def merge(model_path: Path, output: Path, indexed: bool):
+    from .conversion import merge
+    merge(model_path, output, indexed)
 
 
 def help_():
@@ -91,12 +96,19 @@ subparsers = parser.add_subparsers()
 
 parser_convert = subparsers.add_parser('convert', help='convert model from pth to gglm format')  # noqa: E501
 parser_convert.set_defaults(func=convert)
-parser_convert.add_argument('--fp-type', choices=('fp16', 'fp32'), default='fp16', help='target floating point type')  # noqa: E501
+parser_convert.add_argument('--fp-type', choices=('fp16', 'fp32', 'q4_0', 'q4_1'), default='fp16', help='target type of weights')  # noqa: E501
+parser_convert.add_argument('-t', '--threads', type=int, default=0, help='number of conversion threads (default: all cores)')  # noqa: E501
 parser_convert.add_argument('model_dir', type=Path, default=Path('.'), help='model directory')  # noqa: E501
 
 parser_help = subparsers.add_parser('help', add_help=False, help='show this message and exit')  # noqa: E501
 parser_help.set_defaults(func=help_)
 
+parser_merge = subparsers.add_parser('merge', help='merge checkpoint parts into single file')  # noqa: E501
+parser_merge.set_defaults(func=merge)
+parser_merge.add_argument('-o', '--output', type=Path, default=None, help='merged checkpoint (default: <model_path> with -merged suffix)')  # noqa: E501
+parser_merge.add_argument('--indexed', action='store_true', help='write indexed format with aligned tensors')  # noqa: E501
+parser_merge.add_argument('model_path', type=Path, help='first part of checkpoint')  # noqa: E501
+
 parser_pull = subparsers.add_parser('pull', help='download model')  # noqa: E501
 parser_pull.set_defaults(func=pull)
 parser_pull.add_argument('-m', '--model-dir', type=Path, default=Path('.'), help='download directory ')  # noqa: E501
@@ -0,0 +1,54 @@
+import logging
+from os import PathLike
+from pathlib import Path
+from typing import Optional
+
+from ._llama import GGMLType, convert_checkpoint, merge_model
+
+GGML_TYPES = {
+    'fp16': GGMLType.F16,
+    'fp32': GGMLType.F32,
+    'q4_0': GGMLType.Q4_0,
+    'q4_1': GGMLType.Q4_1,
+}
+
+
+def convert(model_dir: PathLike, fp_type: str = 'fp16', nothreads: int = 0):
+    """Convert PyTorch checkpoint located at :model_dir: to gglm format in a
+    single pass without torch: tensors are streamed from checkpoint archives,
+    converted (or quantized) in parallel and written to
+    `ggml-model-<type>.bin` next to them.
+
+    Args:
+        model_dir: Directory where model is located.
+        fp_type: Target type of weights (fp16, fp32, q4_0 or q4_1).
+        nothreads: Number of conversion threads (all cores by default).
+    """
+    if fp_type not in GGML_TYPES:
+        raise ValueError(f'Param fp_type should be one of {list(GGML_TYPES)}.')
+
+    logging.info('convert model checkpoint in %s to %s', model_dir, fp_type)
+    if not convert_checkpoint(str(model_dir), GGML_TYPES[fp_type], nothreads):
+        raise RuntimeError(f'Failed to convert model checkpoint {model_dir}.')
+
+
+def merge(model_path: PathLike,
+          output_path: Optional[PathLike] = None,
+          indexed: bool = False):
+    """Merge parts :model_path:, :model_path:.1, ... of a checkpoint into a
+    single file so that loading it needs no reassembly of split tensors.
+
+    Args:
+        model_path: First part of checkpoint.
+        output_path: Merged checkpoint (`-merged` is added to the name of the
+            first part by default).
+        indexed: Write indexed format with aligned tensors.
+    """
+    model_path = Path(model_path)
+    if output_path is None:
+        output_path = model_path.with_name(
+            f'{model_path.stem}-merged{model_path.suffix}')
+
+    logging.info('merge model checkpoint %s to %s', model_path, output_path)
+    if not merge_model(str(model_path), str(output_path), indexed):
+        raise RuntimeError(f'Failed to merge model checkpoint {model_path}.')
@@ -0,0 +1,232 @@
+# Write the checkpoint of llama/cc/checkpoint_test.cc: a tiny LLaMA state dict
+# in the format of torch.save (a zip archive of a pickle and its storages),
+# without torch. The archive uses zip64 records and 64-byte aligned storages
+# like the writer of torch, weights are bf16 and norms f32.
+#
+# Usage: python3 make_fixture.py  (writes tokenizer.model and 1L/ next to it)
+import collections
+import io
+import json
+import os
+import pickle
+import struct
+import sys
+import types
+import zlib
+
+DIM, MULTIPLE_OF, N_HEADS, N_LAYERS = 32, 32, 2, 1
+N_FF = ((2 * (4 * DIM) // 3 + MULTIPLE_OF - 1) // MULTIPLE_OF) * MULTIPLE_OF
+
+# pieces of the tokenizer: (piece, score, type)
+PIECES = [
+    (b'<unk>', 0.0, 2),
+    (b'<s>', 0.0, 3),
+    (b'<0x0A>', 0.0, 6),
+    (b'\xe2\x96\x81a', -1.5, 1),
+    (b'b', -2.25, 1),
+]
+
+# pickled like torch, the module and name of the classes and functions is all
+# that matters
+torch = types.ModuleType('torch')
+torch_utils = types.ModuleType('torch._utils')
+sys.modules['torch'] = torch
+sys.modules['torch._utils'] = torch_utils
+for name in ('FloatStorage', 'BFloat16Storage'):
+    setattr(torch, name, type(name, (), {'__module__': 'torch'}))
+
+
+def _rebuild_tensor_v2(*args):
+    pass
+
+
+def _rebuild_parameter(*args):
+    pass
+
+
+for f in (_rebuild_tensor_v2, _rebuild_parameter):
+    f.__module__ = 'torch._utils'
+    setattr(torch_utils, f.__name__, f)
+
+
+class Storage:
+
+    def __init__(self, key, cls, data):
+        self.key, self.cls, self.data = key, cls, data
+
+
+class Tensor:
+
+    def __init__(self, storage, offset, shape):
+        self.storage, self.offset, self.shape = storage, offset, shape
+
+    def __reduce__(self):
+        stride, n = [], 1
+        for d in reversed(self.shape):
+            stride.insert(0, n)
+            n *= d
+        return (_rebuild_tensor_v2,
+                (self.storage, self.offset, tuple(self.shape), tuple(stride),
+                 False, collections.OrderedDict()))
+
+
+class Parameter:
+
+    def __init__(self, tensor):
+        self.tensor = tensor
+
+    def __reduce__(self):
+        return (_rebuild_parameter,
+                (self.tensor, True, collections.OrderedDict()))
+
+
+class Pickler(pickle.Pickler):
+
+    def persistent_id(self, obj):
+        if isinstance(obj, Storage):
+            size = len(obj.data) // (4 if obj.cls is torch.FloatStorage else 2)
+            return ('storage', obj.cls, obj.key, 'cpu', size)
+        return None
+
+
+def value(t, i):
+    """Element i of tensor t, exact in bf16 and f16."""
+    return ((i * 7 + t) % 31 - 15) / 16.0
+
+
+def tensors():
+    yield 'tok_embeddings.weight', [len(PIECES), DIM]
+    yield 'norm.weight', [DIM]
+    yield 'output.weight', [len(PIECES), DIM]
+    for il in range(N_LAYERS):
+        for name in ('wq', 'wk', 'wv', 'wo'):
+            yield f'layers.{il}.attention.{name}.weight', [DIM, DIM]
+        yield f'layers.{il}.feed_forward.w1.weight', [N_FF, DIM]
+        yield f'layers.{il}.feed_forward.w2.weight', [DIM, N_FF]
+        yield f'layers.{il}.feed_forward.w3.weight', [N_FF, DIM]
+        yield f'layers.{il}.attention_norm.weight', [DIM]
+        yield f'layers.{il}.ffn_norm.weight', [DIM]
+
+
+def state_dict():
+    sd = collections.OrderedDict()
+    storages = []
+    for t, (name, shape) in enumerate(tensors()):
+        n = 1
+        for d in shape:
+            n *= d
+        values = [value(t, i) for i in range(n)]
+        if len(shape) == 1:
+            cls, data = torch.FloatStorage, struct.pack(f'<{n}f', *values)
+            elsize = 4
+        else:
+            cls, elsize = torch.BFloat16Storage, 2
+            data = b''.join(struct.pack('<f', v)[2:] for v in values)
+        # every other tensor starts at an offset into its storage
+        offset = 3 if t % 2 else 0
+        storage = Storage(str(t), cls, b'\0' * offset * elsize + data)
+        storages.append(storage)
+        tensor = Tensor(storage, offset, shape)
+        if name == 'norm.weight':
+            tensor.shape = [1] + shape  # squeezed by the converter
+        sd[name] = Parameter(tensor) if name.startswith('layers.') else tensor
+    freqs = Storage(str(len(storages)), torch.FloatStorage,
+                    struct.pack('<4f', 1, 2, 3, 4))
+    storages.append(freqs)
+    sd['rope.freqs'] = Tensor(freqs, 0, [4])
+    return sd, storages
+
+
+def write_zip(fname, files):
+    """Stored entries with zip64 sizes and offsets as torch writes them."""
+    out = io.BytesIO()
+    directory = []
+    for name, data in files:
+        name = name.encode()
+        crc = zlib.crc32(data)
+        offset = out.tell()
+        extra = struct.pack('<HHQQ', 0x0001, 16, len(data), len(data))
+        # pad the data to 64 bytes with an unknown extra field
+        pad = -(offset + 30 + len(name) + len(extra) + 4) % 64
+        extra += struct.pack('<HH', 0x4246, pad) + b'Z' * pad
+        out.write(
+            struct.pack('<IHHHHHIIIHH', 0x04034b50, 45, 0, 0, 0, 0, crc,
+                        0xFFFFFFFF, 0xFFFFFFFF, len(name), len(extra)))
+        out.write(name + extra + data)
+        directory.append((name, crc, len(data), offset))
+
+    cd_offset = out.tell()
+    for name, crc, size, offset in directory:
+        extra = struct.pack('<HHQQQ', 0x0001, 24, size, size, offset)
+        out.write(
+            struct.pack('<IHHHHHHIIIHHHHHII', 0x02014b50, 45, 45, 0, 0, 0, 0,
+                        crc, 0xFFFFFFFF, 0xFFFFFFFF, len(name), len(extra), 0,
+                        0, 0, 0, 0xFFFFFFFF))
+        out.write(name + extra)
+    cd_size = out.tell() - cd_offset
+
+    eocd64 = out.tell()
+    out.write(
+        struct.pack('<IQHHIIQQQQ', 0x06064b50, 44, 45, 45, 0, 0,
+                    len(directory), len(directory), cd_size, cd_offset))
+    out.write(struct.pack('<IIQI', 0x07064b50, 0, eocd64, 1))
+    out.write(
+        struct.pack('<IHHHHIIH', 0x06054b50, 0xFFFF, 0xFFFF, 0xFFFF, 0xFFFF,
+                    0xFFFFFFFF, 0xFFFFFFFF, 0))
+
+    with open(fname, 'wb') as fout:
+        fout.write(out.getvalue())
+
+
+def varint(v):
+    out = b''
+    while v > 0x7f:
+        out += bytes([v & 0x7f | 0x80])
+        v >>= 7
+    return out + bytes([v])
+
+
+def field(num, wire_type, payload):
+    if wire_type == 2:
+        payload = varint(len(payload)) + payload
+    return varint(num << 3 | wire_type) + payload
+
+
+def main():
+    root = os.path.dirname(os.path.abspath(__file__))
+    model_dir = os.path.join(root, '1L')
+    os.makedirs(model_dir, exist_ok=True)
+
+    sd, storages = state_dict()
+    pkl = io.BytesIO()
+    Pickler(pkl, protocol=2).dump(sd)
+    write_zip(os.path.join(model_dir, 'consolidated.00.pth'),
+              [('consolidated/data.pkl', pkl.getvalue())] +
+              [('consolidated/data/' + s.key, s.data) for s in storages] +
+              [('consolidated/version', b'3\n')])
+
+    with open(os.path.join(model_dir, 'params.json'), 'w') as fout:
+        json.dump(
+            {
+                'dim': DIM,
+                'multiple_of': MULTIPLE_OF,
+                'n_heads': N_HEADS,
+                'n_layers': N_LAYERS,
+                'norm_eps': 1e-06,
+                'vocab_size': -1,
+            }, fout)
+
+    # sentencepiece ModelProto: pieces = 1 {piece = 1, score = 2, type = 3}
+    model = b''
+    for piece, score, kind in PIECES:
+        model += field(
+            1, 2,
+            field(1, 2, piece) + field(2, 5, struct.pack('<f', score)) +
+            (field(3, 0, varint(kind)) if kind != 1 else b''))
+    model += field(2, 2, field(1, 2, b'fixture'))  # trainer_spec, skipped
+    with open(os.path.join(root, 'tokenizer.model'), 'wb') as fout:
+        fout.write(model)
+
+
+if __name__ == '__main__':
+    main()